@@ -0,0 +1,98 @@
+/*
+
+Copyright (c) 2007, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include <algorithm>
+
+#include "libtorrent/bandwidth_manager.hpp"
+#include "libtorrent/peer_connection.hpp"
+
+namespace libtorrent
+{
+	void bandwidth_manager::refill(resource_request& r, size_type& carry
+		, size_type microseconds)
+	{
+		assert(microseconds >= 0);
+		assert(carry >= 0 && carry < 1000000);
+		if (r.given == resource_request::inf)
+		{
+			r.used = 0;
+			carry = 0;
+			return;
+		}
+
+		// at least one byte, or slow rates would never
+		// save up enough to send anything
+		int max_left = (std::max)(1, int(size_type(r.given) * max_burst / 1000));
+		if (r.given - r.used >= max_left) return;
+
+		// anything past max_burst would be capped anyway, and
+		// this keeps the product from overflowing
+		if (microseconds > max_burst * 1000) microseconds = max_burst * 1000;
+		size_type amount = size_type(r.given) * microseconds + carry;
+		carry = amount % 1000000;
+		r.used -= int(amount / 1000000);
+		if (r.given - r.used > max_left)
+		{
+			r.used = r.given - max_left;
+			carry = 0;
+		}
+	}
+
+	void bandwidth_manager::reset(resource_request& r, size_type& carry)
+	{
+		carry = 0;
+		if (r.given == resource_request::inf)
+		{
+			r.used = 0;
+			return;
+		}
+		r.used = r.given - int(size_type(r.given) * refill_interval / 1000);
+	}
+
+	void bandwidth_manager::wait_for_quota(
+		boost::intrusive_ptr<peer_connection> const& p, channel_t channel)
+	{
+		assert(p);
+		m_queue.push_back(std::make_pair(p, channel));
+	}
+
+	void bandwidth_manager::wake_up()
+	{
+		// connections that are still out of quota queue
+		// up again, at the back
+		queue_t q;
+		q.swap(m_queue);
+		for (queue_t::iterator i = q.begin(), end(q.end()); i != end; ++i)
+			i->first->on_bandwidth(i->second);
+	}
+}
+
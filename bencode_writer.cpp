@@ -0,0 +1,182 @@
+/*
+
+Copyright (c) 2007, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include <algorithm>
+
+#include "libtorrent/bencode_writer.hpp"
+#include "libtorrent/bencode.hpp"
+
+namespace libtorrent
+{
+
+	bencode_writer::bencode_writer(std::vector<char>& buf)
+		: m_buf(buf)
+	{}
+
+	void bencode_writer::start_value()
+	{
+		if (m_stack.empty()) return;
+		container& c = m_stack.back();
+		if (!c.dict) return;
+		// a dictionary value without a key
+		assert(c.has_key);
+		c.has_key = false;
+	}
+
+	void bencode_writer::begin_dict()
+	{
+		start_value();
+		m_buf.push_back('d');
+		container c;
+		c.dict = true;
+		c.has_key = false;
+		c.last_key = -1;
+		c.last_key_len = 0;
+		m_stack.push_back(c);
+	}
+
+	void bencode_writer::begin_list()
+	{
+		start_value();
+		m_buf.push_back('l');
+		container c;
+		c.dict = false;
+		c.has_key = false;
+		c.last_key = -1;
+		c.last_key_len = 0;
+		m_stack.push_back(c);
+	}
+
+	void bencode_writer::end()
+	{
+		assert(!m_stack.empty());
+		// a dictionary key without a value
+		assert(!m_stack.back().has_key);
+		m_stack.pop_back();
+		m_buf.push_back('e');
+	}
+
+	void bencode_writer::key(char const* k, int len)
+	{
+		assert(!m_stack.empty());
+		container& c = m_stack.back();
+		assert(c.dict);
+		assert(!c.has_key);
+
+#ifndef NDEBUG
+		// the keys have to be strictly increasing, compared
+		// as strings of unsigned bytes
+		if (c.last_key >= 0)
+		{
+			int cmp = std::memcmp(&m_buf[c.last_key], k
+				, (std::min)(c.last_key_len, len));
+			assert(cmp < 0 || (cmp == 0 && c.last_key_len < len));
+		}
+#endif
+
+		write_length(len);
+		c.last_key = int(m_buf.size());
+		c.last_key_len = len;
+		write(k, len);
+		c.has_key = true;
+	}
+
+	void bencode_writer::integer(entry::integer_type val)
+	{
+		start_value();
+		char buf[21];
+		m_buf.push_back('i');
+		char const* str = detail::integer_to_str(buf, 21, val);
+		write(str, int(buf + 20 - str));
+		m_buf.push_back('e');
+	}
+
+	void bencode_writer::write_length(int len)
+	{
+		assert(len >= 0);
+		char buf[21];
+		char const* str = detail::integer_to_str(buf, 21, len);
+		write(str, int(buf + 20 - str));
+		m_buf.push_back(':');
+	}
+
+	void bencode_writer::string(char const* str, int len)
+	{
+		start_value();
+		write_length(len);
+		write(str, len);
+	}
+
+	char* bencode_writer::string_buffer(int len)
+	{
+		start_value();
+		write_length(len);
+		m_buf.resize(m_buf.size() + len);
+		return len == 0 ? 0 : &m_buf[m_buf.size() - len];
+	}
+
+	void bencode_writer::value(entry const& e)
+	{
+		switch (e.type())
+		{
+		case entry::int_t:
+			integer(e.integer());
+			break;
+		case entry::string_t:
+			string(e.string());
+			break;
+		case entry::list_t:
+			begin_list();
+			for (entry::list_type::const_iterator i = e.list().begin();
+				i != e.list().end(); ++i)
+				value(*i);
+			end();
+			break;
+		case entry::dictionary_t:
+			begin_dict();
+			for (entry::dictionary_type::const_iterator i = e.dict().begin();
+				i != e.dict().end(); ++i)
+			{
+				if (i->second.type() == entry::undefined_t) continue;
+				key(i->first);
+				value(i->second);
+			}
+			end();
+			break;
+		default:
+			// do nothing
+			break;
+		}
+	}
+
+}
+
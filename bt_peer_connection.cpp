@@ -41,6 +41,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/identify_client.hpp"
 #include "libtorrent/entry.hpp"
 #include "libtorrent/bencode.hpp"
+#include "libtorrent/lazy_entry.hpp"
+#include "libtorrent/bencode_writer.hpp"
 #include "libtorrent/alert_types.hpp"
 #include "libtorrent/invariant_check.hpp"
 #include "libtorrent/io.hpp"
@@ -652,11 +654,12 @@ namespace libtorrent
 		assert(msg.length() <= 1 * 1024);
 		if (!supports_extension(extended_chat_message)) return;
 
-		entry e(entry::dictionary_t);
-		e["msg"] = msg;
-
 		std::vector<char> message;
-		bencode(std::back_inserter(message), e);
+		bencode_writer w(message);
+		w.begin_dict();
+		w.key("msg");
+		w.string(msg);
+		w.end();
 
 		buffer::interval i = allocate_send_buffer(message.size() + 6);
 
@@ -680,58 +683,55 @@ namespace libtorrent
 
 		buffer::const_interval recv_buffer = receive_buffer();
 	
-		entry root = bdecode(recv_buffer.begin + 2, recv_buffer.end);
+		lazy_entry root;
+		lazy_bdecode(recv_buffer.begin + 2, recv_buffer.end, root);
 
 #ifdef TORRENT_VERBOSE_LOGGING
 		std::stringstream ext;
-		root.print(ext);
+		root.to_entry().print(ext);
 		(*m_logger) << "<== EXTENDED HANDSHAKE: \n" << ext.str();
 #endif
 
-		if (entry* msgs = root.find_key("m"))
+		lazy_entry msgs = root.find_key("m");
+		if (msgs.type() == entry::dictionary_t)
 		{
-			if (msgs->type() == entry::dictionary_t)
+			// this must be the initial handshake message
+			// lets see if any of our extensions are supported
+			// if not, we will signal no extensions support to the upper layer
+			for (int i = 1; i < num_supported_extensions; ++i)
 			{
-				// this must be the initial handshake message
-				// lets see if any of our extensions are supported
-				// if not, we will signal no extensions support to the upper layer
-				for (int i = 1; i < num_supported_extensions; ++i)
+				lazy_entry f = msgs.find_key(extension_names[i]);
+				if (f.type() != entry::undefined_t)
 				{
-					if (entry* f = msgs->find_key(extension_names[i]))
-					{
-						m_extension_messages[i] = (int)f->integer();
-					}
-					else
-					{
-						m_extension_messages[i] = 0;
-					}
+					m_extension_messages[i] = (int)f.integer();
+				}
+				else
+				{
+					m_extension_messages[i] = 0;
 				}
 			}
 		}
 
 		// there is supposed to be a remote listen port
-		if (entry* listen_port = root.find_key("p"))
+		lazy_entry listen_port = root.find_key("p");
+		if (listen_port.type() == entry::int_t)
 		{
-			if (listen_port->type() == entry::int_t)
-			{
-				tcp::endpoint adr(remote().address()
-					, (unsigned short)listen_port->integer());
-				t->get_policy().peer_from_tracker(adr, pid());
-			}
+			tcp::endpoint adr(remote().address()
+				, (unsigned short)listen_port.integer());
+			t->get_policy().peer_from_tracker(adr, pid());
 		}
 		// there should be a version too
 		// but where do we put that info?
 		
-		if (entry* client_info = root.find_key("v"))
-		{
-			if (client_info->type() == entry::string_t)
-				m_client_version = client_info->string();
-		}
+		lazy_entry client_info = root.find_key("v");
+		if (client_info.type() == entry::string_t)
+			m_client_version = client_info.string();
 
-		if (entry* reqq = root.find_key("reqq"))
+		lazy_entry reqq = root.find_key("reqq");
+		if (reqq.type() != entry::undefined_t)
 		{
-			if (reqq->type() == entry::int_t)
-				m_max_out_request_queue = reqq->integer();
+			if (reqq.type() == entry::int_t)
+				m_max_out_request_queue = reqq.integer();
 			if (m_max_out_request_queue < 1)
 				m_max_out_request_queue = 1;
 		}
@@ -760,8 +760,9 @@ namespace libtorrent
 			assert(t);
 		
 			buffer::const_interval recv_buffer = receive_buffer();
-			entry d = bdecode(recv_buffer.begin + 2, recv_buffer.end);
-			const std::string& str = d["msg"].string();
+			lazy_entry d;
+			lazy_bdecode(recv_buffer.begin + 2, recv_buffer.end, d);
+			std::string str = d["msg"].string();
 
 			if (t->alerts().should_post(alert::critical))
 			{
@@ -1110,28 +1111,38 @@ namespace libtorrent
 #endif
 		assert(m_supports_extensions);
 
-		entry handshake(entry::dictionary_t);
-		entry extension_list(entry::dictionary_t);
+		// the keys are written in sorted order
+		std::vector<char> msg;
+		bencode_writer w(msg);
+		w.begin_dict();
+
+		char remote_address[16];
+		char* out = remote_address;
+		detail::write_address(remote().address(), out);
+		w.key("ip");
+		w.string(remote_address, int(out - remote_address));
 
+		// extension_names are sorted
+		w.key("m");
+		w.begin_dict();
 		for (int i = 1; i < num_supported_extensions; ++i)
 		{
 			// if this specific extension is disabled
 			// just don't add it to the supported set
 			if (!m_ses.extension_enabled(i)) continue;
-			extension_list[extension_names[i]] = i;
+			w.key(extension_names[i]);
+			w.integer(i);
 		}
+		w.end();
 
-		handshake["m"] = extension_list;
-		handshake["p"] = m_ses.listen_port();
-		handshake["v"] = m_ses.settings().user_agent;
-		std::string remote_address;
-		std::back_insert_iterator<std::string> out(remote_address);
-		detail::write_address(remote().address(), out);
-		handshake["ip"] = remote_address;
-		handshake["reqq"] = m_ses.settings().max_allowed_in_request_queue;
+		w.key("p");
+		w.integer(m_ses.listen_port());
+		w.key("reqq");
+		w.integer(m_ses.settings().max_allowed_in_request_queue);
+		w.key("v");
+		w.string(m_ses.settings().user_agent);
 
-		std::vector<char> msg;
-		bencode(std::back_inserter(msg), handshake);
+		w.end();
 
 		// make room for message
 		buffer::interval i = allocate_send_buffer(6 + msg.size());
@@ -1148,7 +1159,9 @@ namespace libtorrent
 
 #ifdef TORRENT_VERBOSE_LOGGING
 		std::stringstream ext;
-		handshake.print(ext);
+		lazy_entry handshake;
+		lazy_bdecode(&msg[0], &msg[0] + msg.size(), handshake);
+		handshake.to_entry().print(ext);
 		(*m_logger) << "==> EXTENDED HANDSHAKE: \n" << ext.str();
 #endif
 
@@ -1206,26 +1219,70 @@ namespace libtorrent
 	{
 		INVARIANT_CHECK;
 
-		const int packet_size = 4 + 5 + 4 + r.length;
-
 		boost::shared_ptr<torrent> t = associated_torrent().lock();
 		assert(t);
 
-		buffer::interval i = allocate_send_buffer(packet_size);
+		// the piece message is written to the send buffer
+		// once the disk io thread has read the block
+		m_reading_bytes += r.length;
+		m_reading_requests.push_back(r);
+		t->async_read(r, bind(&bt_peer_connection::on_disk_read_complete
+			, boost::intrusive_ptr<bt_peer_connection>(this), _1, _2, r));
+	}
+
+	// this is called with the session locked
+	void bt_peer_connection::on_disk_read_complete(int ret
+		, disk_io_job const& j, peer_request r) try
+	{
+		INVARIANT_CHECK;
+
+		m_reading_bytes -= r.length;
+		assert(m_reading_bytes >= 0);
+
+		if (is_disconnecting()) return;
+
+		// the request may have been cancelled, or the peer
+		// choked, while the block was being read
+		std::deque<peer_request>::iterator k = std::find(
+			m_reading_requests.begin(), m_reading_requests.end(), r);
+		if (k == m_reading_requests.end()) return;
+		m_reading_requests.erase(k);
+		if (is_choked()) return;
+
+		if (ret != r.length)
+		{
+			boost::shared_ptr<torrent> t = associated_torrent().lock();
+			if (t && t->alerts().should_post(alert::fatal))
+			{
+				t->alerts().post_alert(file_error_alert(t->get_handle()
+					, ret < 0 ? j.str : "failed to read block from disk"));
+			}
+			throw std::runtime_error("failed to read piece from disk");
+		}
+
+		const int packet_size = 4 + 5 + 4 + r.length;
+
+		buffer::interval i = allocate_send_buffer(packet_size - r.length);
 		
 		detail::write_int32(packet_size-4, i.begin);
 		detail::write_uint8(msg_piece, i.begin);
 		detail::write_int32(r.piece, i.begin);
 		detail::write_int32(r.start, i.begin);
 
-		t->filesystem().read(
-			i.begin, r.piece, r.start, r.length);
+		assert(i.begin == i.end);
 
-		assert(i.begin + r.length == i.end);
+		// the payload is sent straight out of the buffer the
+		// disk thread returned, which may be a cached piece
+		append_send_buffer(j.buffer, j.buffer.get() + j.buffer_offset, r.length);
 
 		m_payloads.push_back(range(send_buffer_size() - r.length, r.length));
+		fill_send_buffer();
 		setup_send();
 	}
+	catch (std::exception& e)
+	{
+		m_ses.connection_failed(get_socket(), remote(), e.what());
+	}
 
 	// --------------------------
 	// RECEIVE DATA
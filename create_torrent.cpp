@@ -0,0 +1,165 @@
+/*
+
+Copyright (c) 2007, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#ifdef _MSC_VER
+#pragma warning(push, 1)
+#endif
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/ref.hpp>
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+#include "libtorrent/create_torrent.hpp"
+#include "libtorrent/storage.hpp"
+#include "libtorrent/hasher.hpp"
+#include "libtorrent/file.hpp"
+
+namespace libtorrent
+{
+	namespace
+	{
+		// the number of pieces a thread claims at a time. They
+		// are hashed together, which lets the multi-buffer
+		// sha-1 backends hash several of them at once
+		enum { pieces_per_batch = 8 };
+
+		struct piece_hasher
+		{
+			piece_hasher(torrent_info& t, storage& st
+				, boost::function<void(int, int)> const& f)
+				: m_info(t)
+				, m_storage(st)
+				, m_progress(f)
+				, m_next_piece(0)
+				, m_pieces_done(0)
+				, m_abort(false)
+			{}
+
+			void operator()()
+			{
+				int const piece_size = static_cast<int>(m_info.piece_length());
+				std::vector<char> buf(piece_size * pieces_per_batch);
+				char const* bufs[pieces_per_batch];
+				sha1_hash hashes[pieces_per_batch];
+
+				for (;;)
+				{
+					boost::mutex::scoped_lock l(m_mutex);
+					if (m_abort || m_next_piece >= m_info.num_pieces()) return;
+					int first = m_next_piece;
+					int num = (std::min)(int(pieces_per_batch)
+						, m_info.num_pieces() - first);
+					m_next_piece += num;
+					l.unlock();
+
+					try
+					{
+						// the last piece may be smaller than the others,
+						// it's hashed on its own
+						int full = num;
+						if (first + num == m_info.num_pieces()
+							&& m_info.piece_size(first + num - 1) != piece_size)
+							--full;
+
+						for (int i = 0; i < num; ++i)
+						{
+							bufs[i] = &buf[i * piece_size];
+							m_storage.read(&buf[i * piece_size], first + i, 0
+								, static_cast<int>(m_info.piece_size(first + i)));
+						}
+						hash_buffers(bufs, full, piece_size, hashes);
+						if (full < num)
+						{
+							hasher h(bufs[full]
+								, static_cast<int>(m_info.piece_size(first + full)));
+							hashes[full] = h.final();
+						}
+					}
+					catch (std::exception& e)
+					{
+						l.lock();
+						if (!m_abort) m_error = e.what();
+						m_abort = true;
+						return;
+					}
+
+					l.lock();
+					for (int i = 0; i < num; ++i)
+						m_info.set_hash(first + i, hashes[i]);
+					m_pieces_done += num;
+					int done = m_pieces_done;
+					l.unlock();
+
+					if (m_progress) m_progress(done, m_info.num_pieces());
+				}
+			}
+
+			torrent_info& m_info;
+			storage& m_storage;
+			boost::function<void(int, int)> m_progress;
+
+			boost::mutex m_mutex;
+			int m_next_piece;
+			int m_pieces_done;
+			bool m_abort;
+			std::string m_error;
+		};
+	}
+
+	void set_piece_hashes(torrent_info& t, boost::filesystem::path const& p
+		, int num_threads, boost::function<void(int, int)> const& progress)
+	{
+		if (num_threads < 1) num_threads = 1;
+
+		// all threads share one storage, since a file may only
+		// be opened by one storage at a time
+		storage st(t, p);
+		piece_hasher ph(t, st, progress);
+
+		boost::thread_group threads;
+		for (int i = 1; i < num_threads; ++i)
+			threads.create_thread(boost::ref(ph));
+		ph();
+		threads.join_all();
+
+		if (!ph.m_error.empty()) throw file_error(ph.m_error);
+	}
+}
+
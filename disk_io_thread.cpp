@@ -0,0 +1,627 @@
+/*
+
+Copyright (c) 2007, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#ifdef _MSC_VER
+#pragma warning(push, 1)
+#endif
+
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/next_prior.hpp>
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+#include "libtorrent/disk_io_thread.hpp"
+#include "libtorrent/storage.hpp"
+#include "libtorrent/hasher.hpp"
+
+namespace libtorrent
+{
+
+	// offset is the number of bytes of the piece that have been
+	// hashed, the blocks are hashed as long as they arrive in order
+	struct disk_io_thread::partial_hash
+	{
+		partial_hash(): offset(0) {}
+		int offset;
+		hasher h;
+	};
+
+	disk_io_thread::disk_io_thread(demuxer& ios)
+		: m_read_cache_usage(0)
+		, m_write_cache_usage(0)
+		, m_abort(false)
+		, m_in_progress(0)
+		, m_flush_tickets(0)
+		, m_total_jobs(0)
+		, m_total_latency(0)
+		, m_max_latency(0)
+		, m_cache_size(0)
+		, m_cache_hits(0)
+		, m_cache_misses(0)
+		, m_write_cache_size(0)
+		, m_blocks_written(0)
+		, m_writes(0)
+		, m_forced_flushes(0)
+		, m_hashed_from_memory(0)
+		, m_hashed_from_disk(0)
+		, m_ios(ios)
+		, m_disk_io_thread(boost::ref(*this))
+	{}
+
+	disk_io_thread::~disk_io_thread()
+	{
+		stop();
+	}
+
+	void disk_io_thread::stop()
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		if (m_abort) return;
+		m_abort = true;
+		m_signal.notify_all();
+		l.unlock();
+
+		m_disk_io_thread.join();
+	}
+
+	void disk_io_thread::add_job(disk_io_job const& j, handler_t const& f)
+	{
+		assert(j.storage);
+		boost::mutex::scoped_lock l(m_mutex);
+		// once the thread has been stopped, there's no one
+		// left to execute the job. This may happen when a
+		// completion handler queues a new job while the
+		// session is shutting down
+		if (m_abort) return;
+
+		m_jobs.push_back(std::make_pair(j, f));
+		m_jobs.back().first.start_time
+			= boost::posix_time::microsec_clock::universal_time();
+		m_signal.notify_all();
+	}
+
+	void disk_io_thread::flush(boost::shared_ptr<piece_manager> const& s
+		, handler_t const& f)
+	{
+		assert(s);
+		boost::mutex::scoped_lock l(m_mutex);
+		if (m_abort) return;
+
+		disk_io_job j;
+		j.action = disk_io_job::flush;
+		j.storage = s;
+		j.piece = ++m_flush_tickets;
+		j.start_time = boost::posix_time::microsec_clock::universal_time();
+
+		// the jobs of different storages don't depend on each
+		// other, only the order of the jobs of one storage matters
+		job_queue jobs;
+		for (job_queue::iterator i = m_jobs.begin()
+			, end(m_jobs.end()); i != end; ++i)
+		{
+			if (i->first.storage == s) jobs.push_back(*i);
+		}
+		jobs.push_back(std::make_pair(j, f));
+		for (job_queue::iterator i = m_jobs.begin()
+			, end(m_jobs.end()); i != end; ++i)
+		{
+			if (i->first.storage != s) jobs.push_back(*i);
+		}
+		m_jobs.swap(jobs);
+		m_pending_flushes.insert(j.piece);
+		m_signal.notify_all();
+
+		// the queue is drained even if the thread is stopped
+		// in the meantime, so the job will complete
+		while (m_pending_flushes.count(j.piece)) m_flushed.wait(l);
+	}
+
+	void disk_io_thread::set_cache_size(int read_cache, int write_cache)
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		assert(read_cache >= 0);
+		assert(write_cache >= 0);
+		m_cache_size = read_cache;
+		m_write_cache_size = write_cache;
+	}
+
+	disk_io_status disk_io_thread::status() const
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		disk_io_status ret;
+		ret.queue_depth = int(m_jobs.size()) + m_in_progress;
+		ret.total_jobs = m_total_jobs;
+		ret.average_latency = m_total_jobs == 0 ? 0
+			: int(m_total_latency / m_total_jobs);
+		ret.max_latency = m_max_latency;
+		ret.cache_hits = m_cache_hits;
+		ret.cache_misses = m_cache_misses;
+		ret.read_cache_size = m_read_cache_usage;
+		ret.write_cache_size = m_write_cache_usage;
+		ret.blocks_written = m_blocks_written;
+		ret.writes = m_writes;
+		ret.forced_flushes = m_forced_flushes;
+		ret.hashed_from_memory = m_hashed_from_memory;
+		ret.hashed_from_disk = m_hashed_from_disk;
+		return ret;
+	}
+
+	disk_io_thread::cache_t::iterator disk_io_thread::find_cached_piece(
+		piece_manager* s, int piece)
+	{
+		for (cache_t::iterator i = m_read_cache.begin()
+			, end(m_read_cache.end()); i != end; ++i)
+		{
+			if (i->storage == s && i->piece == piece) return i;
+		}
+		return m_read_cache.end();
+	}
+
+	// evicts the cached pieces belonging to the given storage.
+	// If piece is -1, all its pieces are evicted
+	void disk_io_thread::evict_cached_pieces(piece_manager* s, int piece)
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		for (cache_t::iterator i = m_read_cache.begin();
+			i != m_read_cache.end();)
+		{
+			if (i->storage != s || (piece != -1 && i->piece != piece))
+			{
+				++i;
+				continue;
+			}
+			m_read_cache_usage -= i->size;
+			m_read_cache.erase(i++);
+		}
+		assert(m_read_cache_usage >= 0);
+	}
+
+	// evicts the least recently used pieces until
+	// the cache uses no more than limit bytes
+	void disk_io_thread::prune_read_cache(int limit)
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		while (!m_read_cache.empty() && m_read_cache_usage > limit)
+		{
+			m_read_cache_usage -= m_read_cache.back().size;
+			m_read_cache.pop_back();
+		}
+		assert(m_read_cache_usage >= 0);
+	}
+
+	// serves a read job from the read cache. On a miss, the
+	// whole piece is read, since peers tend to request all
+	// the blocks of a piece
+	int disk_io_thread::read_cached(disk_io_job& j)
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		int cache_size = m_cache_size;
+		l.unlock();
+
+		int piece_size = j.storage->piece_size(j.piece);
+		assert(j.offset + j.buffer_size <= piece_size);
+
+		cache_t::iterator p = find_cached_piece(j.storage.get(), j.piece);
+		if (p != m_read_cache.end())
+		{
+			m_read_cache.splice(m_read_cache.begin(), m_read_cache, p);
+			l.lock();
+			++m_cache_hits;
+			l.unlock();
+		}
+		else
+		{
+			l.lock();
+			++m_cache_misses;
+			l.unlock();
+
+			// pieces that don't fit in the cache are
+			// not worth evicting everything else for
+			if (piece_size > cache_size)
+			{
+				prune_read_cache(cache_size);
+				j.buffer.reset(new char[j.buffer_size]);
+				return int(j.storage->read(j.buffer.get()
+					, j.piece, j.offset, j.buffer_size));
+			}
+
+			cached_piece cp;
+			cp.storage = j.storage.get();
+			cp.piece = j.piece;
+			cp.size = piece_size;
+			cp.buf.reset(new char[piece_size]);
+			if (j.storage->read(cp.buf.get(), j.piece, 0, piece_size)
+				!= piece_size)
+			{
+				j.buffer.reset(new char[j.buffer_size]);
+				return int(j.storage->read(j.buffer.get()
+					, j.piece, j.offset, j.buffer_size));
+			}
+
+			prune_read_cache(cache_size - piece_size);
+			m_read_cache.push_front(cp);
+			p = m_read_cache.begin();
+			l.lock();
+			m_read_cache_usage += piece_size;
+			l.unlock();
+		}
+
+		// the cached piece is never written to, so it's safe
+		// to hand out a reference to it. It stays alive until
+		// the block has been sent, even if it's evicted
+		j.buffer = p->buf;
+		j.buffer_offset = j.offset;
+		return j.buffer_size;
+	}
+
+	disk_io_thread::write_cache_t::iterator disk_io_thread::find_cached_write(
+		piece_manager* s, int piece)
+	{
+		for (write_cache_t::iterator i = m_write_cache.begin()
+			, end(m_write_cache.end()); i != end; ++i)
+		{
+			if (i->storage == s && i->piece == piece) return i;
+		}
+		return m_write_cache.end();
+	}
+
+	// writes the blocks of the cached piece to the storage, merging
+	// adjacent blocks into a single write, and removes the piece
+	// from the cache. forced is true if the piece isn't complete.
+	void disk_io_thread::flush_cached_write(write_cache_t::iterator i
+		, bool forced)
+	{
+		// the piece is removed from the cache before it's written,
+		// so that a failing write doesn't leave it behind
+		cached_write p = *i;
+		m_write_cache.erase(i);
+
+		int writes = 0;
+		std::vector<file::iovec_t> vec;
+		for (std::vector<cached_block>::iterator b = p.blocks.begin()
+			, end(p.blocks.end()); b != end;)
+		{
+			int start = b->offset;
+			int stop = start;
+			vec.clear();
+			for (; b != end && b->offset == stop; ++b)
+			{
+				file::iovec_t v;
+				v.buf = b->buf.get();
+				v.size = b->size;
+				vec.push_back(v);
+				stop += b->size;
+			}
+			p.storage->writev(&vec[0], int(vec.size()), p.piece, start);
+			++writes;
+		}
+
+		boost::mutex::scoped_lock l(m_mutex);
+		m_write_cache_usage -= p.size;
+		assert(m_write_cache_usage >= 0);
+		m_writes += writes;
+		if (forced) ++m_forced_flushes;
+	}
+
+	// flushes the cached pieces of the given storage. If piece is -1
+	// all of its pieces are flushed, if s is 0, every piece is
+	void disk_io_thread::flush_cached_writes(piece_manager* s, int piece)
+	{
+		for (write_cache_t::iterator i = m_write_cache.begin();
+			i != m_write_cache.end();)
+		{
+			if ((s != 0 && i->storage != s) || (piece != -1 && i->piece != piece))
+			{
+				++i;
+				continue;
+			}
+			flush_cached_write(i++, true);
+		}
+	}
+
+	// flushes the least recently written pieces until the
+	// cache uses no more than limit bytes
+	void disk_io_thread::prune_write_cache(int limit)
+	{
+		for (;;)
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+			if (m_write_cache.empty() || m_write_cache_usage <= limit) return;
+			l.unlock();
+			flush_cached_write(boost::prior(m_write_cache.end()), true);
+		}
+	}
+
+	// hashes the part of the buffer (which starts at offset in
+	// the piece) that follows what has been hashed already
+	void disk_io_thread::advance_hash(partial_hash& ph, char const* buf
+		, int offset, int size)
+	{
+		if (offset > ph.offset || offset + size <= ph.offset) return;
+		int skip = ph.offset - offset;
+		ph.h.update(buf + skip, size - skip);
+		ph.offset += size - skip;
+
+		boost::mutex::scoped_lock l(m_mutex);
+		m_hashed_from_memory += size - skip;
+	}
+
+	void disk_io_thread::erase_partial_hashes(piece_manager* s)
+	{
+		hash_map_t::iterator i = m_partial_hashes.lower_bound(
+			std::make_pair(s, 0));
+		while (i != m_partial_hashes.end() && i->first.first == s)
+			m_partial_hashes.erase(i++);
+	}
+
+	// hashes the cached blocks of the piece that follow
+	// what has been hashed already, as long as there's no gap
+	void disk_io_thread::advance_hash(partial_hash& ph, cached_write const& p)
+	{
+		for (std::vector<cached_block>::const_iterator i = p.blocks.begin()
+			, end(p.blocks.end()); i != end; ++i)
+		{
+			if (i->offset > ph.offset) break;
+			advance_hash(ph, i->buf.get(), i->offset, i->size);
+		}
+	}
+
+	// copies the block into the write cache. Pieces that can't
+	// fit in the cache are written straight to the storage.
+	// If the block is the next one to be hashed, it is hashed
+	// along with the cached blocks following it
+	void disk_io_thread::write_cached(disk_io_job& j)
+	{
+		char const* data = j.buffer.get() + j.buffer_offset;
+
+		boost::mutex::scoped_lock l(m_mutex);
+		int cache_size = m_write_cache_size;
+		++m_blocks_written;
+		l.unlock();
+
+		int piece_size = j.storage->piece_size(j.piece);
+		assert(j.offset + j.buffer_size <= piece_size);
+
+		boost::shared_ptr<partial_hash>& php
+			= m_partial_hashes[std::make_pair(j.storage.get(), j.piece)];
+		if (!php) php.reset(new partial_hash);
+		partial_hash& ph = *php;
+
+		if (piece_size > cache_size
+			&& find_cached_write(j.storage.get(), j.piece) == m_write_cache.end())
+		{
+			prune_write_cache(cache_size);
+			j.storage->write(data, j.piece, j.offset, j.buffer_size);
+			advance_hash(ph, data, j.offset, j.buffer_size);
+			l.lock();
+			++m_writes;
+			return;
+		}
+
+		// the block is copied, since the buffer it refers
+		// to may be a peer's receive buffer, which is larger
+		cached_block b;
+		b.offset = j.offset;
+		b.size = j.buffer_size;
+		b.buf.reset(new char[j.buffer_size]);
+		std::memcpy(b.buf.get(), data, j.buffer_size);
+
+		// this may flush the piece itself
+		prune_write_cache(cache_size - j.buffer_size);
+
+		write_cache_t::iterator p = find_cached_write(j.storage.get(), j.piece);
+		if (p == m_write_cache.end())
+		{
+			cached_write cw;
+			cw.storage = j.storage.get();
+			cw.piece = j.piece;
+			cw.size = 0;
+			m_write_cache.push_front(cw);
+			p = m_write_cache.begin();
+		}
+		else
+		{
+			m_write_cache.splice(m_write_cache.begin(), m_write_cache, p);
+		}
+
+		// a block that is written twice replaces the cached copy
+		std::vector<cached_block>::iterator i = p->blocks.begin();
+		while (i != p->blocks.end() && i->offset < b.offset) ++i;
+		int added = b.size;
+		if (i != p->blocks.end() && i->offset == b.offset)
+		{
+			added -= i->size;
+			*i = b;
+		}
+		else
+		{
+			p->blocks.insert(i, b);
+		}
+		p->size += added;
+		l.lock();
+		m_write_cache_usage += added;
+		l.unlock();
+
+		// this block may fill the gap in front of blocks
+		// that arrived out of order
+		if (j.offset == ph.offset) advance_hash(ph, *p);
+	}
+
+	// finishes the hash of the piece. The part that hasn't been
+	// hashed yet is taken from the write cache if all of it is
+	// there, otherwise the cached blocks are flushed and it is
+	// read back from the storage. Either way, the piece has been
+	// written once this returns.
+	int disk_io_thread::hash_piece(disk_io_job& j)
+	{
+		assert(j.buffer_size > 0);
+
+		partial_hash ph;
+		hash_map_t::iterator hi = m_partial_hashes.find(
+			std::make_pair(j.storage.get(), j.piece));
+		if (hi != m_partial_hashes.end())
+		{
+			ph = *hi->second;
+			m_partial_hashes.erase(hi);
+		}
+
+		write_cache_t::iterator p = find_cached_write(j.storage.get(), j.piece);
+		if (p != m_write_cache.end())
+		{
+			advance_hash(ph, *p);
+			flush_cached_write(p, false);
+		}
+
+		if (ph.offset < j.buffer_size)
+		{
+			int size = j.buffer_size - ph.offset;
+			std::vector<char> buf(size);
+			j.storage->read(&buf[0], j.piece, ph.offset, size);
+			ph.h.update(&buf[0], size);
+
+			boost::mutex::scoped_lock l(m_mutex);
+			m_hashed_from_disk += size;
+		}
+
+		sha1_hash digest = ph.h.final();
+		j.str.assign((char const*)digest.begin(), sha1_hash::size);
+		return 0;
+	}
+
+	int disk_io_thread::perform_job(disk_io_job& j)
+	{
+		switch (j.action)
+		{
+			case disk_io_job::read:
+				// the piece has to be on disk before it's read
+				flush_cached_writes(j.storage.get(), j.piece);
+				return read_cached(j);
+			case disk_io_job::write:
+				// the piece is being downloaded, any cached copy
+				// of it is stale
+				evict_cached_pieces(j.storage.get(), j.piece);
+				write_cached(j);
+				return j.buffer_size;
+			case disk_io_job::hash:
+				return hash_piece(j);
+			case disk_io_job::move_storage:
+			{
+				flush_cached_writes(j.storage.get());
+				bool ret = j.storage->move_storage(j.save_path);
+				if (!ret) j.str = "failed to move storage to "
+					+ j.save_path.native_file_string();
+				j.save_path = j.storage->save_path();
+				return ret ? 0 : -1;
+			}
+			case disk_io_job::release_files:
+				// the storage may be destructed once its files
+				// are released, it must not be left in the caches
+				evict_cached_pieces(j.storage.get());
+				flush_cached_writes(j.storage.get());
+				erase_partial_hashes(j.storage.get());
+				j.storage->release_files();
+				return 0;
+			case disk_io_job::flush:
+				flush_cached_writes(j.storage.get());
+				return 0;
+		}
+		assert(false);
+		return -1;
+	}
+
+	void disk_io_thread::operator()()
+	{
+		using namespace boost::posix_time;
+
+		for (;;)
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+			while (m_jobs.empty() && !m_abort)
+				m_signal.wait(l);
+			// the queue is drained before the thread exits
+			if (m_jobs.empty() && m_abort)
+			{
+				l.unlock();
+				// all storages should have released their files
+				// by now, which flushes their pieces
+				assert(m_write_cache.empty());
+				try { flush_cached_writes(0); } catch (std::exception&) {}
+				return;
+			}
+
+			std::pair<disk_io_job, handler_t> j = m_jobs.front();
+			m_jobs.pop_front();
+			++m_in_progress;
+			l.unlock();
+
+			int ret;
+			try
+			{
+				ret = perform_job(j.first);
+				if (ret < 0 && j.first.str.empty())
+					j.first.str = "disk operation failed";
+			}
+			catch (std::exception& e)
+			{
+				ret = -1;
+				j.first.str = e.what();
+			}
+
+			int latency = int((microsec_clock::universal_time()
+				- j.first.start_time).total_milliseconds());
+
+			if (j.second) m_ios.post(boost::bind(j.second, ret, j.first));
+
+			l.lock();
+			// flush() is woken up whether the flush succeeded
+			// or not, a failure is reported through the handler
+			if (j.first.action == disk_io_job::flush)
+			{
+				m_pending_flushes.erase(j.first.piece);
+				m_flushed.notify_all();
+			}
+			--m_in_progress;
+			++m_total_jobs;
+			m_total_latency += latency;
+			if (latency > m_max_latency) m_max_latency = latency;
+		}
+	}
+
+}
+
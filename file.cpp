@@ -55,6 +55,12 @@ typedef int mode_t;
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) \
+	|| defined(__OpenBSD__)
+#define TORRENT_USE_PREADV 1
+#endif
 
 #include <boost/static_assert.hpp>
 // make sure the _FILE_OFFSET_BITS define worked
@@ -66,6 +72,7 @@ BOOST_STATIC_ASSERT(sizeof(lseek(0, 0, 0)) >= 8);
 #include <boost/filesystem/operations.hpp>
 #include "libtorrent/file.hpp"
 #include <sstream>
+#include <algorithm>
 
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -254,6 +261,108 @@ namespace libtorrent
 			return ret;
 		}
 
+		size_type read_at(char* buf, size_type offset, size_type num_bytes)
+		{
+			assert(m_open_mode & mode_in);
+			assert(m_fd != -1);
+
+#ifdef _WIN32
+			seek(offset, 1);
+			return read(buf, num_bytes);
+#else
+			size_type ret = ::pread(m_fd, buf, num_bytes, offset);
+			if (ret == -1)
+			{
+				std::stringstream msg;
+				msg << "read failed: " << strerror(errno);
+				throw file_error(msg.str());
+			}
+			return ret;
+#endif
+		}
+
+		size_type write_at(const char* buf, size_type offset, size_type num_bytes)
+		{
+			assert(m_open_mode & mode_out);
+			assert(m_fd != -1);
+
+#ifdef _WIN32
+			seek(offset, 1);
+			return write(buf, num_bytes);
+#else
+			size_type ret = ::pwrite(m_fd, buf, num_bytes, offset);
+			if (ret == -1)
+			{
+				std::stringstream msg;
+				msg << "write failed: " << strerror(errno);
+				throw file_error(msg.str());
+			}
+			return ret;
+#endif
+		}
+
+		size_type readv_at(file::iovec_t const* bufs, int num_bufs, size_type offset)
+		{
+			assert(m_open_mode & mode_in);
+			assert(m_fd != -1);
+			return transfer_vec(bufs, num_bufs, offset, false);
+		}
+
+		size_type writev_at(file::iovec_t const* bufs, int num_bufs, size_type offset)
+		{
+			assert(m_open_mode & mode_out);
+			assert(m_fd != -1);
+			return transfer_vec(bufs, num_bufs, offset, true);
+		}
+
+		// issues the vectored operation in batches of at most
+		// max_batch buffers. It stops at the first short transfer,
+		// since that means we hit the end of the file
+		size_type transfer_vec(file::iovec_t const* bufs, int num_bufs
+			, size_type offset, bool write_op)
+		{
+			size_type total = 0;
+#if defined(TORRENT_USE_PREADV)
+			enum { max_batch = 16 };
+			::iovec vec[max_batch];
+			while (num_bufs > 0)
+			{
+				int n = (std::min)(int(max_batch), num_bufs);
+				size_type batch_size = 0;
+				for (int i = 0; i < n; ++i)
+				{
+					vec[i].iov_base = bufs[i].buf;
+					vec[i].iov_len = bufs[i].size;
+					batch_size += bufs[i].size;
+				}
+				size_type ret = write_op
+					? ::pwritev(m_fd, vec, n, offset + total)
+					: ::preadv(m_fd, vec, n, offset + total);
+				if (ret == -1)
+				{
+					std::stringstream msg;
+					msg << (write_op ? "write" : "read") << " failed: "
+						<< strerror(errno);
+					throw file_error(msg.str());
+				}
+				total += ret;
+				if (ret != batch_size) break;
+				bufs += n;
+				num_bufs -= n;
+			}
+#else
+			for (int i = 0; i < num_bufs; ++i)
+			{
+				size_type ret = write_op
+					? write_at(bufs[i].buf, offset + total, bufs[i].size)
+					: read_at(bufs[i].buf, offset + total, bufs[i].size);
+				total += ret;
+				if (ret != bufs[i].size) break;
+			}
+#endif
+			return total;
+		}
+
 		size_type tell()
 		{
 			assert(m_open_mode);
@@ -310,4 +419,24 @@ namespace libtorrent
 		return m_impl->tell();
 	}
 
+	size_type file::read_at(char* buf, size_type offset, size_type num_bytes)
+	{
+		return m_impl->read_at(buf, offset, num_bytes);
+	}
+
+	size_type file::write_at(const char* buf, size_type offset, size_type num_bytes)
+	{
+		return m_impl->write_at(buf, offset, num_bytes);
+	}
+
+	size_type file::readv_at(file::iovec_t const* bufs, int num_bufs, size_type offset)
+	{
+		return m_impl->readv_at(bufs, num_bufs, offset);
+	}
+
+	size_type file::writev_at(file::iovec_t const* bufs, int num_bufs, size_type offset)
+	{
+		return m_impl->writev_at(bufs, num_bufs, offset);
+	}
+
 }
@@ -0,0 +1,202 @@
+/*
+
+Copyright (c) 2007, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+// Checks the positional and vectored reads and writes of
+// libtorrent::file, and compares reading a file block by block
+// with seek+read, read_at() and readv_at(). The file is in the
+// page cache, so the times are mostly the cost of the system
+// calls. Build and run it with testfile.
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <string>
+#include <fstream>
+
+#include <boost/filesystem/operations.hpp>
+
+#include "libtorrent/file.hpp"
+
+using namespace libtorrent;
+
+namespace
+{
+	int failures = 0;
+
+	void check(bool ok, char const* what)
+	{
+		if (ok) return;
+		std::printf("FAILED: %s\n", what);
+		++failures;
+	}
+
+	double seconds(std::clock_t start)
+	{
+		return double(std::clock() - start) / CLOCKS_PER_SEC;
+	}
+
+	// the number of read system calls the process has made,
+	// or -1 if the platform doesn't tell
+	long read_syscalls()
+	{
+		std::ifstream io("/proc/self/io");
+		std::string key;
+		long value;
+		while (io >> key >> value)
+			if (key == "syscr:") return value;
+		return -1;
+	}
+
+	enum { block_size = 16 * 1024, blocks_per_call = 16 };
+
+	void test_vectored(boost::filesystem::path const& p)
+	{
+		std::vector<char> data(3 * block_size + 100);
+		for (int i = 0; i < int(data.size()); ++i)
+			data[i] = char(i * 7 + i / 251);
+
+		// the buffers have different sizes, to make sure
+		// they are filled in order
+		int sizes[] = { 100, block_size, 2 * block_size };
+		file::iovec_t vec[3];
+		int pos = 0;
+		for (int i = 0; i < 3; ++i)
+		{
+			vec[i].buf = &data[pos];
+			vec[i].size = sizes[i];
+			pos += sizes[i];
+		}
+
+		{
+			file f(p, file::in | file::out);
+			check(f.writev_at(vec, 3, 1000) == size_type(data.size())
+				, "writev_at returns the number of bytes written");
+		}
+
+		file f(p, file::in);
+		std::vector<char> buf(data.size());
+		check(f.read_at(&buf[0], 1000, buf.size()) == size_type(buf.size())
+			, "read_at reads what writev_at wrote");
+		check(buf == data, "writev_at writes the buffers in order");
+
+		std::vector<char> out(data.size());
+		pos = 0;
+		for (int i = 0; i < 3; ++i)
+		{
+			vec[i].buf = &out[pos];
+			pos += sizes[i];
+		}
+		check(f.readv_at(vec, 3, 1000) == size_type(out.size())
+			, "readv_at returns the number of bytes read");
+		check(out == data, "readv_at fills the buffers in order");
+
+		// the file ends in the middle of the second buffer
+		check(f.readv_at(vec, 3, 1000 + 200) == size_type(out.size() - 200)
+			, "readv_at stops at the end of the file");
+	}
+
+	void bench(char const* name, boost::filesystem::path const& p
+		, int num_blocks, int method)
+	{
+		file f(p, file::in);
+		std::vector<char> buf(block_size * blocks_per_call);
+		file::iovec_t vec[blocks_per_call];
+		for (int i = 0; i < blocks_per_call; ++i)
+		{
+			vec[i].buf = &buf[i * block_size];
+			vec[i].size = block_size;
+		}
+
+		long calls = read_syscalls();
+		int seeks = 0;
+		size_type total = 0;
+		std::clock_t start = std::clock();
+		for (int i = 0; i < num_blocks;)
+		{
+			size_type offset = size_type(i) * block_size;
+			if (method == 0)
+			{
+				f.seek(offset);
+				++seeks;
+				total += f.read(&buf[0], block_size);
+				++i;
+			}
+			else if (method == 1)
+			{
+				total += f.read_at(&buf[0], offset, block_size);
+				++i;
+			}
+			else
+			{
+				total += f.readv_at(vec, blocks_per_call, offset);
+				i += blocks_per_call;
+			}
+		}
+		double t = seconds(start);
+		check(total == size_type(num_blocks) * block_size, name);
+
+		long syscalls = calls < 0 ? -1 : read_syscalls() - calls + seeks;
+		std::printf("%-16s %8ld syscalls %8.2f GB/s\n", name, syscalls
+			, t == 0 ? 0. : total / t / 1000000000.);
+	}
+}
+
+int main()
+{
+	boost::filesystem::path p = boost::filesystem::complete("file_test.tmp");
+
+	test_vectored(p);
+
+	enum { num_blocks = 4096 };
+	{
+		std::vector<char> block(block_size, 'x');
+		file f(p, file::out);
+		for (int i = 0; i < num_blocks; ++i)
+			f.write_at(&block[0], size_type(i) * block_size, block_size);
+	}
+
+	std::printf("reading %d blocks of %d bytes\n", int(num_blocks), int(block_size));
+	bench("seek + read", p, num_blocks, 0);
+	bench("read_at", p, num_blocks, 1);
+	bench("readv_at x16", p, num_blocks, 2);
+
+	boost::filesystem::remove(p);
+
+	if (failures > 0)
+	{
+		std::printf("%d tests FAILED\n", failures);
+		return 1;
+	}
+	std::printf("all tests passed\n");
+	return 0;
+}
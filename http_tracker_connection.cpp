@@ -698,7 +698,9 @@ namespace libtorrent
 		// handle tracker response
 		try
 		{
-			entry e = bdecode(m_buffer.begin(), m_buffer.end());
+			lazy_entry e;
+			char const* buf = m_buffer.empty() ? 0 : &m_buffer[0];
+			lazy_bdecode(buf, buf + m_buffer.size(), e);
 			parse(e);
 		}
 		catch (std::exception& e)
@@ -716,17 +718,17 @@ namespace libtorrent
 		#endif
 	}
 
-	peer_entry http_tracker_connection::extract_peer_info(const entry& info)
+	peer_entry http_tracker_connection::extract_peer_info(lazy_entry const& info)
 	{
 		peer_entry ret;
 
 		// extract peer id (if any)
-		entry const* i = info.find_key("peer id");
-		if (i != 0)
+		lazy_entry i = info.find_key("peer id");
+		if (i.type() != entry::undefined_t)
 		{
-			if (i->string().length() != 20)
+			if (i.string_length() != 20)
 				throw std::runtime_error("invalid response from tracker");
-			std::copy(i->string().begin(), i->string().end(), ret.pid.begin());
+			std::copy(i.string_ptr(), i.string_ptr() + 20, ret.pid.begin());
 		}
 		else
 		{
@@ -736,18 +738,20 @@ namespace libtorrent
 
 		// extract ip
 		i = info.find_key("ip");
-		if (i == 0) throw std::runtime_error("invalid response from tracker");
-		ret.ip = i->string();
+		if (i.type() == entry::undefined_t)
+			throw std::runtime_error("invalid response from tracker");
+		ret.ip = i.string();
 
 		// extract port
 		i = info.find_key("port");
-		if (i == 0) throw std::runtime_error("invalid response from tracker");
-		ret.port = (unsigned short)i->integer();
+		if (i.type() == entry::undefined_t)
+			throw std::runtime_error("invalid response from tracker");
+		ret.port = (unsigned short)i.integer();
 
 		return ret;
 	}
 
-	void http_tracker_connection::parse(entry const& e)
+	void http_tracker_connection::parse(lazy_entry const& e)
 	{
 		if (!has_requester()) return;
 
@@ -756,7 +760,7 @@ namespace libtorrent
 			// parse the response
 			try
 			{
-				entry const& failure = e["failure reason"];
+				lazy_entry failure = e["failure reason"];
 
 				fail(m_code, failure.string().c_str());
 				return;
@@ -765,7 +769,7 @@ namespace libtorrent
 
 			try
 			{
-				entry const& warning = e["warning message"];
+				lazy_entry warning = e["warning message"];
 				if (has_requester())
 					requester().tracker_warning(warning.string());
 			}
@@ -778,7 +782,7 @@ namespace libtorrent
 				std::string ih;
 				std::copy(tracker_req().info_hash.begin(), tracker_req().info_hash.end()
 					, std::back_inserter(ih));
-				entry scrape_data = e["files"][ih];
+				lazy_entry scrape_data = e["files"][ih];
 				int complete = scrape_data["complete"].integer();
 				int incomplete = scrape_data["incomplete"].integer();
 				requester().tracker_response(tracker_request(), peer_list, 0, complete
@@ -788,13 +792,13 @@ namespace libtorrent
 
 			int interval = (int)e["interval"].integer();
 
-			if (e["peers"].type() == entry::string_t)
+			lazy_entry peers = e["peers"];
+			if (peers.type() == entry::string_t)
 			{
-				std::string const& peers = e["peers"].string();
-				for (std::string::const_iterator i = peers.begin();
-					i != peers.end();)
+				char const* end = peers.string_ptr() + peers.string_length();
+				for (char const* i = peers.string_ptr(); i != end;)
 				{
-					if (std::distance(i, peers.end()) < 6) break;
+					if (std::distance(i, end) < 6) break;
 
 					peer_entry p;
 					p.pid.clear();
@@ -810,10 +814,10 @@ namespace libtorrent
 			}
 			else
 			{
-				entry::list_type const& l = e["peers"].list();
-				for(entry::list_type::const_iterator i = l.begin(); i != l.end(); ++i)
+				int size = peers.list_size();
+				for (int i = 0; i < size; ++i)
 				{
-					peer_entry p = extract_peer_info(*i);
+					peer_entry p = extract_peer_info(peers.list_at(i));
 					peer_list.push_back(p);
 				}
 			}
@@ -239,6 +239,21 @@ namespace libtorrent
 		torrent_handle handle;
 	};
 
+	struct TORRENT_EXPORT storage_moved_alert: alert
+	{
+		storage_moved_alert(
+			const torrent_handle& h
+			, const std::string& path)
+			: alert(alert::warning, path)
+			, handle(h)
+		{}
+
+		virtual std::auto_ptr<alert> clone() const
+		{ return std::auto_ptr<alert>(new storage_moved_alert(*this)); }
+
+		torrent_handle handle;
+	};
+
 	struct TORRENT_EXPORT metadata_failed_alert: alert
 	{
 		metadata_failed_alert(
@@ -75,6 +75,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/session_status.hpp"
 #include "libtorrent/session.hpp"
 #include "libtorrent/stat.hpp"
+#include "libtorrent/disk_io_thread.hpp"
+#include "libtorrent/bandwidth_manager.hpp"
+#include "libtorrent/timer_wheel.hpp"
 
 namespace libtorrent
 {
@@ -88,7 +91,7 @@ namespace libtorrent
 		struct piece_checker_data
 		{
 			piece_checker_data()
-				: processing(false), progress(0.f), abort(false) {}
+				: processing(false), claimed(false), progress(0.f), abort(false) {}
 
 			boost::shared_ptr<torrent> torrent_ptr;
 			boost::filesystem::path save_path;
@@ -101,7 +104,7 @@ namespace libtorrent
 				, std::string& error);
 
 			std::vector<int> piece_map;
-			std::vector<piece_picker::downloading_piece> unfinished_pieces;
+			std::vector<piece_picker::unfinished_piece> unfinished_pieces;
 			std::vector<tcp::endpoint> peers;
 			entry resume_data;
 
@@ -111,6 +114,13 @@ namespace libtorrent
 			// to be set.
 			bool processing;
 
+			// this is true while one of the checker threads is
+			// working on this torrent, either parsing its resume
+			// data or checking its files. Just like with processing,
+			// a claimed torrent cannot be removed from the queue,
+			// it has to be aborted.
+			bool claimed;
+
 			// is filled in by storage::initialize_pieces()
 			// and represents the progress. It should be a
 			// value in the range [0, 1]
@@ -124,7 +134,13 @@ namespace libtorrent
 
 		struct checker_impl: boost::noncopyable
 		{
-			checker_impl(session_impl& s): m_ses(s), m_abort(false) {}
+			checker_impl(session_impl& s)
+				: m_ses(s)
+				, m_abort(false)
+				, m_max_threads(1)
+				, m_num_threads(0)
+				, m_next_thread(0)
+			{}
 			void operator()();
 			piece_checker_data* find_torrent(const sha1_hash& info_hash);
 			void remove_torrent(sha1_hash const& info_hash);
@@ -146,6 +162,17 @@ namespace libtorrent
 			std::deque<boost::shared_ptr<piece_checker_data> > m_processing;
 
 			bool m_abort;
+
+			// the number of checker threads that may pick up
+			// new torrents to check
+			int m_max_threads;
+
+			// the number of checker threads that are running
+			int m_num_threads;
+
+			// used to hand out an index to each checker thread
+			// as it starts
+			int m_next_thread;
 		};
 
 		// this is the link between the main thread and the
@@ -192,6 +219,32 @@ namespace libtorrent
 			void process_connection_queue();
 
 			void close_connection(boost::intrusive_ptr<peer_connection> const& p);
+
+			// makes second_tick() check the torrent for a tracker
+			// request once torrent::seconds_to_next_announce()
+			// has passed. Has to be called whenever the torrent's
+			// next announce is moved closer
+			void schedule_announce(torrent& t);
+
+			// the demuxer to create the sockets of the torrent's
+			// outgoing connections on. All of a torrent's outgoing
+			// connections end up on the same network thread
+			demuxer& peer_demuxer(sha1_hash const& ih);
+			// the demuxer for the next incoming connection. The
+			// torrent isn't known until the handshake, so these
+			// are spread round-robin
+			demuxer& incoming_demuxer();
+
+			// torrent_handle::status() for torrents in the session
+			// reads the snapshot published here, which only needs
+			// m_status_mutex, not m_mutex. Returns false if there
+			// is no snapshot for the torrent yet
+			bool published_status(sha1_hash const& ih, torrent_status& st);
+			// stores a snapshot computed under m_mutex
+			void publish_status(sha1_hash const& ih, torrent_status const& st);
+			// drops the snapshot, because the torrent has changed
+			// or has been removed from the session
+			void invalidate_status(sha1_hash const& ih);
 			void connection_completed(boost::intrusive_ptr<peer_connection> const& p);
 			void connection_failed(boost::shared_ptr<stream_socket> const& s
 				, tcp::endpoint const& a, char const* message);
@@ -223,7 +276,8 @@ namespace libtorrent
 				, boost::filesystem::path const& save_path
 				, entry const& resume_data
 				, bool compact_mode
-				, int block_size);
+				, int block_size
+				, storage_constructor_type sc);
 
 			torrent_handle add_torrent(
 				char const* tracker_url
@@ -231,7 +285,8 @@ namespace libtorrent
 				, boost::filesystem::path const& save_path
 				, entry const& resume_data
 				, bool compact_mode
-				, int block_size);
+				, int block_size
+				, storage_constructor_type sc);
 
 			void remove_torrent(torrent_handle const& h);
 
@@ -264,11 +319,37 @@ namespace libtorrent
 			
 //		private:
 
+			// when settings().network_threads is greater than one,
+			// the sockets of the peer connections are spread over
+			// m_selector and these demuxers, each one run by its
+			// own thread from m_peer_threads. They have to outlive
+			// every socket created on them, including the ones held
+			// by handlers queued on m_selector (like the pending
+			// accept), which is why they are declared before it.
+			// The work objects keep the threads running while there
+			// are no sockets, they are released at shutdown
+			std::vector<boost::shared_ptr<demuxer> > m_peer_demuxers;
+			std::vector<boost::shared_ptr<demuxer::work> > m_peer_demuxer_work;
+
 			// this is where all active sockets are stored.
 			// the selector can sleep while there's no activity on
 			// them
 			demuxer m_selector;
 
+			boost::thread_group m_peer_threads;
+			int m_next_incoming_demuxer;
+			demuxer& network_demuxer(int index);
+			void run_peer_demuxer(demuxer& d);
+
+			// all reads, writes and hashing of pieces are
+			// done by this thread, to keep the network
+			// thread from blocking on the disk
+			disk_io_thread m_disk_thread;
+
+			// the connections that ran out of bandwidth
+			// quota, bandwidth_tick() wakes them up
+			bandwidth_manager m_bandwidth_manager;
+
 			tracker_manager m_tracker_manager;
 			torrent_map m_torrents;
 
@@ -347,12 +428,54 @@ namespace libtorrent
 			void second_tick(asio::error const& e);
 			boost::posix_time::ptime m_last_tick;
 
+			// second_tick() only looks at the connections and
+			// torrents whose timers have expired. Connections are
+			// checked for timeouts and keep-alives, torrents for
+			// tracker requests. Connections and torrents that have
+			// been removed are ignored when their timers expire.
+			timer_wheel<boost::shared_ptr<stream_socket> > m_connection_timers;
+			timer_wheel<sha1_hash> m_announce_timers;
+
+			// the time the last second_tick() took, the longest
+			// one so far, and the number of timers that expired
+			// in the last tick
+			boost::posix_time::time_duration m_last_tick_duration;
+			boost::posix_time::time_duration m_max_tick_duration;
+			int m_last_tick_timers;
+
+			// refreshes the status snapshots that have been
+			// read since the last tick and drops the others.
+			// Called by second_tick()
+			void refresh_status();
+
+			// the status snapshots of the torrents whose status
+			// is being polled. The network thread refreshes them
+			// every second, so polling the status of many torrents
+			// doesn't contend with the network thread for m_mutex
+			struct status_snapshot
+			{
+				torrent_status status;
+				// set when the snapshot is read. Snapshots
+				// that haven't been read since the last tick
+				// are dropped instead of refreshed
+				bool requested;
+			};
+			typedef std::map<sha1_hash, status_snapshot> status_map;
+			status_map m_status;
+			boost::mutex m_status_mutex;
+
+			// wakes up the connections waiting for
+			// bandwidth quota
+			void bandwidth_tick(asio::error const& e);
+
 #ifndef TORRENT_DISABLE_DHT
 			boost::scoped_ptr<dht::dht_tracker> m_dht;
 			dht_settings m_dht_settings;
 #endif
 			// the timer used to fire the second_tick
 			deadline_timer m_timer;
+			// the timer used to fire the bandwidth_tick
+			deadline_timer m_bandwidth_timer;
 #ifndef NDEBUG
 			void check_invariant(const char *place = 0);
 #endif
@@ -370,9 +493,9 @@ namespace libtorrent
 			// the main working thread
 			boost::scoped_ptr<boost::thread> m_thread;
 
-			// the thread that calls initialize_pieces()
+			// the threads that call initialize_pieces()
 			// on all torrents before they start downloading
-			boost::scoped_ptr<boost::thread> m_checker_thread;
+			boost::thread_group m_checker_threads;
 		};
 	}
 }
@@ -0,0 +1,114 @@
+/*
+
+Copyright (c) 2007, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_BANDWIDTH_MANAGER_HPP_INCLUDED
+#define TORRENT_BANDWIDTH_MANAGER_HPP_INCLUDED
+
+#include <deque>
+#include <utility>
+
+#ifdef _MSC_VER
+#pragma warning(push, 1)
+#endif
+
+#include <boost/intrusive_ptr.hpp>
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+#include "libtorrent/resource_request.hpp"
+#include "libtorrent/size_type.hpp"
+#include "libtorrent/config.hpp"
+
+namespace libtorrent
+{
+	class peer_connection;
+
+	// allocate_resources() decides once a second how many bytes
+	// per second every connection may send and receive, sharing
+	// the session's limits between the torrents and the torrents'
+	// between their peers. The bandwidth manager hands that quota
+	// out to the connections continuously instead of all of it at
+	// the start of each second. Each connection tops up its own
+	// quota with what it has earned since the last time, whenever
+	// it's about to send or receive. Connections that run out of
+	// quota wait in a queue and are woken up in order, every
+	// refill_interval, to try again.
+	class bandwidth_manager
+	{
+	public:
+		enum channel_t { upload_channel, download_channel };
+
+		// the time between waking up the queued
+		// connections, in milliseconds
+		enum { refill_interval = 100 };
+
+		// the most unused quota a connection can save up,
+		// in milliseconds worth of its rate
+		enum { max_burst = 200 };
+
+		// adds microseconds worth of r.given to what's left of r,
+		// up to max_burst worth. carry is the fraction of a byte
+		// (in millionths) the previous refill couldn't hand out,
+		// it's added to this one so slow rates don't round to 0
+		static void refill(resource_request& r, size_type& carry
+			, size_type microseconds);
+
+		// starts over once allocate_resources() has set a new
+		// r.given. r gets refill_interval worth to start with
+		static void reset(resource_request& r, size_type& carry);
+
+		// queues p until its quota has been refilled. A
+		// connection is queued at most once per channel
+		void wait_for_quota(boost::intrusive_ptr<peer_connection> const& p
+			, channel_t channel);
+
+		// wakes up the connections in the queue, in the order
+		// they started waiting. They refill their own quota
+		void wake_up();
+
+		int queue_size() const { return int(m_queue.size()); }
+
+		// drops the queue, when the session is shutting down
+		void clear() { m_queue.clear(); }
+
+	private:
+
+		typedef std::deque<std::pair<boost::intrusive_ptr<peer_connection>
+			, channel_t> > queue_t;
+		queue_t m_queue;
+	};
+}
+
+#endif // TORRENT_BANDWIDTH_MANAGER_HPP_INCLUDED
+
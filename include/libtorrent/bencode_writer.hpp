@@ -0,0 +1,116 @@
+/*
+
+Copyright (c) 2007, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_BENCODE_WRITER_HPP_INCLUDED
+#define TORRENT_BENCODE_WRITER_HPP_INCLUDED
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cassert>
+
+#include "libtorrent/entry.hpp"
+#include "libtorrent/config.hpp"
+
+namespace libtorrent
+{
+	// writes bencoded data straight into a buffer, without
+	// building an entry tree first. Dictionaries and lists are
+	// opened with begin_dict() and begin_list() and closed with
+	// end(). In a dictionary, every value is preceded by a call
+	// to key(). The keys have to be written in sorted order and
+	// without duplicates, as bencoding requires, which is
+	// asserted.
+	//
+	// the output is appended to the buffer. Reserving room in it
+	// up front saves the reallocations.
+	class TORRENT_EXPORT bencode_writer
+	{
+	public:
+
+		explicit bencode_writer(std::vector<char>& buf);
+
+		void begin_dict();
+		void begin_list();
+		// closes the innermost dictionary or list
+		void end();
+
+		void key(char const* k, int len);
+		void key(char const* k) { key(k, int(std::strlen(k))); }
+		void key(std::string const& k) { key(k.c_str(), int(k.size())); }
+
+		void integer(entry::integer_type val);
+
+		void string(char const* str, int len);
+		void string(char const* str) { string(str, int(std::strlen(str))); }
+		void string(std::string const& str) { string(str.c_str(), int(str.size())); }
+
+		// writes the header of a string of len bytes and returns
+		// where its bytes go. The pointer is only valid until the
+		// next call to the writer
+		char* string_buffer(int len);
+
+		// writes a whole entry tree. Undefined entries are left
+		// out, and so are the keys they are stored under
+		void value(entry const& e);
+
+		// true when every dictionary and list has been closed
+		bool done() const { return m_stack.empty(); }
+
+	private:
+
+		void write(char const* str, int len)
+		{ m_buf.insert(m_buf.end(), str, str + len); }
+		void write_length(int len);
+
+		// called before every value. Keeps track of the keys and
+		// values alternating in dictionaries
+		void start_value();
+
+		struct container
+		{
+			bool dict;
+			// true when a key has been written and its value
+			// is next
+			bool has_key;
+			// where the bytes of the last key are in the
+			// buffer, -1 if there is none yet
+			int last_key;
+			int last_key_len;
+		};
+
+		std::vector<char>& m_buf;
+		std::vector<container> m_stack;
+	};
+}
+
+#endif // TORRENT_BENCODE_WRITER_HPP_INCLUDED
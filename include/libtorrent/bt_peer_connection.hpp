@@ -176,6 +176,9 @@ namespace libtorrent
 
 	private:
 
+		void on_disk_read_complete(int ret, disk_io_job const& j
+			, peer_request r);
+
 		bool dispatch_message(int received);
 		// returns the block currently being
 		// downloaded. And the progress of that
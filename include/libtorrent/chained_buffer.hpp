@@ -0,0 +1,186 @@
+/*
+
+Copyright (c) 2007, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_CHAINED_BUFFER_HPP_INCLUDED
+#define TORRENT_CHAINED_BUFFER_HPP_INCLUDED
+
+#include <deque>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <cassert>
+
+#ifdef _MSC_VER
+#pragma warning(push, 1)
+#endif
+
+#include <boost/shared_array.hpp>
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+#include "libtorrent/socket.hpp"
+
+namespace libtorrent
+{
+	// a queue of ref-counted chunks of memory that is sent with
+	// scatter/gather writes. Buffers owned by someone else (like
+	// a block in the disk cache) are appended without copying
+	// them, small messages are copied into the free space at the
+	// end of the last chunk. Memory is never moved once it has
+	// been appended, so it's safe to append more data while a
+	// write of the front of the queue is in progress.
+	class chained_buffer
+	{
+	public:
+		chained_buffer(): m_bytes(0) {}
+
+		// appends size bytes starting at start. buf is the buffer
+		// start points into, the reference to it is what keeps the
+		// memory alive until it has been sent
+		void append_buffer(boost::shared_array<char> const& buf
+			, char* start, int size)
+		{
+			assert(size > 0);
+			chunk c;
+			c.buf = buf;
+			c.start = start;
+			c.size = size;
+			// no room to append to, the buffer isn't ours
+			c.capacity = size;
+			m_chunks.push_back(c);
+			m_bytes += size;
+		}
+
+		// returns a pointer to size bytes of uninitialized memory
+		// at the end of the queue
+		char* allocate_appendix(int size)
+		{
+			assert(size >= 0);
+			if (m_chunks.empty()
+				|| m_chunks.back().capacity - m_chunks.back().size < size)
+			{
+				chunk c;
+				c.capacity = (std::max)(size, int(min_chunk_size));
+				c.buf.reset(new char[c.capacity]);
+				c.start = c.buf.get();
+				c.size = 0;
+				m_chunks.push_back(c);
+			}
+			chunk& c = m_chunks.back();
+			char* ret = c.start + c.size;
+			c.size += size;
+			m_bytes += size;
+			return ret;
+		}
+
+		void append(char const* begin, char const* end)
+		{
+			assert(end >= begin);
+			int size = int(end - begin);
+			if (size == 0) return;
+			std::memcpy(allocate_appendix(size), begin, size);
+		}
+
+		// removes bytes that have been sent from the front
+		void pop_front(int bytes)
+		{
+			assert(bytes >= 0);
+			assert(bytes <= m_bytes);
+			m_bytes -= bytes;
+			while (bytes > 0)
+			{
+				chunk& c = m_chunks.front();
+				if (c.size > bytes)
+				{
+					c.start += bytes;
+					c.size -= bytes;
+					c.capacity -= bytes;
+					return;
+				}
+				bytes -= c.size;
+				m_chunks.pop_front();
+			}
+		}
+
+		int size() const { return m_bytes; }
+		bool empty() const { return m_bytes == 0; }
+
+		// returns the buffers making up the first to_send bytes
+		// of the queue. The returned vector is valid until the
+		// next call to build_iovec()
+		std::vector<asio::const_buffer> const& build_iovec(int to_send)
+		{
+			assert(to_send <= m_bytes);
+			m_iovec.clear();
+			for (std::deque<chunk>::iterator i = m_chunks.begin();
+				to_send > 0; ++i)
+			{
+				assert(i != m_chunks.end());
+				if (i->size == 0) continue;
+				int len = (std::min)(i->size, to_send);
+				m_iovec.push_back(asio::const_buffer(i->start, len));
+				to_send -= len;
+			}
+			return m_iovec;
+		}
+
+	private:
+
+		// messages are small, this is the smallest chunk
+		// that's allocated to copy them into
+		enum { min_chunk_size = 512 };
+
+		struct chunk
+		{
+			boost::shared_array<char> buf;
+			// the first byte that hasn't been sent yet
+			char* start;
+			// the number of bytes that haven't been sent
+			int size;
+			// the number of bytes that fit from start
+			int capacity;
+		};
+
+		std::deque<chunk> m_chunks;
+
+		// the total number of bytes in the queue
+		int m_bytes;
+
+		// reused by build_iovec()
+		std::vector<asio::const_buffer> m_iovec;
+	};
+}
+
+#endif // TORRENT_CHAINED_BUFFER_HPP_INCLUDED
+
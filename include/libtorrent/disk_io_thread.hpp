@@ -0,0 +1,324 @@
+/*
+
+Copyright (c) 2007, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_DISK_IO_THREAD_HPP_INCLUDED
+#define TORRENT_DISK_IO_THREAD_HPP_INCLUDED
+
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+
+#ifdef _MSC_VER
+#pragma warning(push, 1)
+#endif
+
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/shared_array.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+#include "libtorrent/socket.hpp"
+#include "libtorrent/size_type.hpp"
+#include "libtorrent/config.hpp"
+
+namespace libtorrent
+{
+	class piece_manager;
+
+	struct disk_io_job
+	{
+		disk_io_job()
+			: action(read)
+			, buffer_size(0)
+			, buffer_offset(0)
+			, piece(0)
+			, offset(0)
+		{}
+
+		enum action_t
+		{
+			read
+			, write
+			, hash
+			, move_storage
+			, release_files
+			, flush
+		};
+
+		action_t action;
+
+		// the data to write, or the buffer a read job
+		// returns. For hash jobs buffer_size is the size
+		// of the piece to hash
+		boost::shared_array<char> buffer;
+		int buffer_size;
+		// where in buffer the data starts. Blocks served
+		// from the read cache refer to the cached piece
+		// instead of being copied out of it, and blocks
+		// to write may refer to a peer's receive buffer
+		int buffer_offset;
+		boost::shared_ptr<piece_manager> storage;
+		int piece;
+		int offset;
+
+		// the new save path of a move_storage job
+		boost::filesystem::path save_path;
+
+		// the 20 byte sha-1 digest of a hash job, or
+		// the error message if the job failed
+		std::string str;
+
+		// the time the job was added to the queue
+		boost::posix_time::ptime start_time;
+	};
+
+	struct TORRENT_EXPORT disk_io_status
+	{
+		// the number of jobs that are queued or
+		// currently being executed
+		int queue_depth;
+
+		// the number of jobs that have completed
+		size_type total_jobs;
+
+		// the average time (in milliseconds) from the point
+		// a job was queued until it completed, and the
+		// worst one seen
+		int average_latency;
+		int max_latency;
+
+		// the number of blocks that were read from the cache
+		// and the number of blocks that had to go to disk
+		size_type cache_hits;
+		size_type cache_misses;
+
+		// the number of bytes in the read cache
+		int read_cache_size;
+
+		// the number of bytes held by the write cache
+		int write_cache_size;
+
+		// the number of blocks that have been written and
+		// the number of writes that were issued to the storage
+		// after they had been coalesced
+		size_type blocks_written;
+		size_type writes;
+
+		// the number of pieces that were flushed before they
+		// were complete, because the write cache was full or
+		// the files were released
+		size_type forced_flushes;
+
+		// the number of bytes that were hashed from memory
+		// as they were downloaded, and the number of bytes
+		// that had to be read back from disk to be hashed
+		size_type hashed_from_memory;
+		size_type hashed_from_disk;
+	};
+
+	// the disk io thread runs all storage operations on
+	// behalf of the network thread. Jobs are executed
+	// in the order they are added, which guarantees that
+	// a piece is written before it is hashed. The handler
+	// of each job is posted to the demuxer once the job
+	// has completed.
+	class TORRENT_EXPORT disk_io_thread : boost::noncopyable
+	{
+	public:
+
+		// the int passed to the handler is the return value
+		// of the operation. A negative value means the job
+		// failed and str in the job holds the error message
+		typedef boost::function<void(int, disk_io_job const&)> handler_t;
+
+		disk_io_thread(demuxer& ios);
+		~disk_io_thread();
+
+		void add_job(disk_io_job const& j, handler_t const& f);
+
+		// blocks until the jobs queued for the storage so far
+		// have completed and its cached blocks have been written
+		// to disk. The storage's jobs are moved to the front of
+		// the queue, so this doesn't wait for the jobs of other
+		// storages. It must not be called with the session mutex
+		// held, or the network would stall while waiting. f is
+		// posted like the handler of any other job
+		void flush(boost::shared_ptr<piece_manager> const& s
+			, handler_t const& f);
+
+		// sets the maximum number of bytes the read
+		// and the write cache may use
+		void set_cache_size(int read_cache, int write_cache);
+
+		// executes the jobs that are left in the queue,
+		// posts their handlers and then waits for the
+		// thread to terminate
+		void stop();
+
+		disk_io_status status() const;
+
+		void operator()();
+
+	private:
+
+		int perform_job(disk_io_job& j);
+
+		struct cached_piece
+		{
+			// the storage is only used as a key. All its
+			// pieces are evicted when its files are released
+			piece_manager* storage;
+			int piece;
+			int size;
+			boost::shared_array<char> buf;
+		};
+
+		// the read cache, ordered by when the pieces were
+		// used. The most recently used piece is at the front
+		typedef std::list<cached_piece> cache_t;
+
+		int read_cached(disk_io_job& j);
+		cache_t::iterator find_cached_piece(piece_manager* s, int piece);
+		void evict_cached_pieces(piece_manager* s, int piece = -1);
+		void prune_read_cache(int limit);
+
+		struct cached_block
+		{
+			int offset;
+			int size;
+			boost::shared_array<char> buf;
+		};
+
+		// a piece that is being downloaded. Its blocks are
+		// kept until the piece is hashed, or until the cache
+		// is full. Each run of adjacent blocks is then written
+		// with a single writev()
+		struct cached_write
+		{
+			piece_manager* storage;
+			int piece;
+			// the number of bytes in the cached blocks
+			int size;
+			// the blocks, ordered by their offset
+			std::vector<cached_block> blocks;
+		};
+
+		// the write cache, the most recently written
+		// piece is at the front
+		typedef std::list<cached_write> write_cache_t;
+
+		void write_cached(disk_io_job& j);
+		int hash_piece(disk_io_job& j);
+
+		// the hash state of a piece that is being downloaded.
+		// It's defined in disk_io_thread.cpp, to keep hasher.hpp
+		// out of this header
+		struct partial_hash;
+
+		typedef std::map<std::pair<piece_manager*, int>
+			, boost::shared_ptr<partial_hash> > hash_map_t;
+
+		void advance_hash(partial_hash& ph, char const* buf, int offset, int size);
+		void advance_hash(partial_hash& ph, cached_write const& p);
+		void erase_partial_hashes(piece_manager* s);
+		write_cache_t::iterator find_cached_write(piece_manager* s, int piece);
+		void flush_cached_write(write_cache_t::iterator i, bool forced);
+		void flush_cached_writes(piece_manager* s, int piece = -1);
+		void prune_write_cache(int limit);
+
+		// the lists are only accessed by the disk io thread,
+		// the counters are protected by m_mutex
+		cache_t m_read_cache;
+		int m_read_cache_usage;
+		write_cache_t m_write_cache;
+		int m_write_cache_usage;
+		hash_map_t m_partial_hashes;
+
+		mutable boost::mutex m_mutex;
+		boost::condition m_signal;
+		bool m_abort;
+
+		typedef std::deque<std::pair<disk_io_job, handler_t> > job_queue;
+		job_queue m_jobs;
+
+		// the number of jobs that have been picked up
+		// by the thread but not completed yet
+		int m_in_progress;
+
+		// flush() waits until the ticket of its flush job
+		// has been removed from m_pending_flushes
+		int m_flush_tickets;
+		std::set<int> m_pending_flushes;
+		boost::condition m_flushed;
+
+		size_type m_total_jobs;
+		// the sum of the latencies of all completed
+		// jobs, in milliseconds
+		size_type m_total_latency;
+		int m_max_latency;
+
+		// the limit of the read cache, in bytes
+		int m_cache_size;
+		size_type m_cache_hits;
+		size_type m_cache_misses;
+
+		// the limit of the write cache, in bytes
+		int m_write_cache_size;
+		size_type m_blocks_written;
+		size_type m_writes;
+		size_type m_forced_flushes;
+		size_type m_hashed_from_memory;
+		size_type m_hashed_from_disk;
+
+		demuxer& m_ios;
+
+		// this must be the last member, since the thread
+		// uses all the others as soon as it's started
+		boost::thread m_disk_io_thread;
+	};
+
+}
+
+#endif // TORRENT_DISK_IO_THREAD_HPP_INCLUDED
+
@@ -104,6 +104,13 @@ namespace libtorrent
 		static const open_mode in;
 		static const open_mode out;
 
+		// describes one buffer in a vectored read or write
+		struct iovec_t
+		{
+			char* buf;
+			int size;
+		};
+
 		file();
 		file(boost::filesystem::path const& p, open_mode m);
 		~file();
@@ -117,6 +124,19 @@ namespace libtorrent
 		size_type seek(size_type pos, seek_mode m = begin);
 		size_type tell();
 
+		// positional reads and writes. These don't use or
+		// move the file position, so they don't need a seek
+		// first and can be issued from several threads at once.
+		// They return the number of bytes transferred, which
+		// is less than requested if the end of the file is hit
+		size_type read_at(char* buf, size_type offset, size_type num_bytes);
+		size_type write_at(const char* buf, size_type offset, size_type num_bytes);
+
+		// the vectored versions fill (or drain) the buffers
+		// in order, as if they were one contiguous buffer
+		size_type readv_at(iovec_t const* bufs, int num_bufs, size_type offset);
+		size_type writev_at(iovec_t const* bufs, int num_bufs, size_type offset);
+
 	private:
 
 		struct impl;
@@ -34,6 +34,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_HASHER_HPP_INCLUDED
 
 #include <cassert>
+#include <vector>
+#include <algorithm>
 #include <boost/cstdint.hpp>
 
 #include "libtorrent/peer_id.hpp"
@@ -50,6 +52,9 @@ struct TORRENT_EXPORT SHA1_CTX
 TORRENT_EXPORT void SHA1Init(SHA1_CTX* context);
 TORRENT_EXPORT void SHA1Update(SHA1_CTX* context, boost::uint8_t const* data, boost::uint32_t len);
 TORRENT_EXPORT void SHA1Final(SHA1_CTX* context, boost::uint8_t* digest);
+TORRENT_EXPORT void SHA1Multi(boost::uint8_t const* const* data, int num
+	, boost::uint32_t len, boost::uint8_t* digests);
+TORRENT_EXPORT char const* SHA1Backend();
 
 extern "C"
 {
@@ -113,6 +118,24 @@ namespace libtorrent
 		SHA1_CTX m_context;
 
 	};
+
+	// hashes num buffers of size bytes each. Where the CPU
+	// supports it, several of them are hashed at once.
+	inline void hash_buffers(char const* const* bufs, int num, int size
+		, sha1_hash* digests)
+	{
+		assert(num >= 0);
+		assert(size >= 0);
+		if (num == 0) return;
+		std::vector<unsigned char> d(num * sha1_hash::size);
+		SHA1Multi(reinterpret_cast<unsigned char const* const*>(bufs)
+			, num, size, &d[0]);
+		for (int i = 0; i < num; ++i)
+		{
+			std::copy(d.begin() + i * sha1_hash::size
+				, d.begin() + (i + 1) * sha1_hash::size, digests[i].begin());
+		}
+	}
 }
 
 #endif // TORRENT_HASHER_HPP_INCLUDED
@@ -53,6 +53,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "libtorrent/socket.hpp"
 #include "libtorrent/entry.hpp"
+#include "libtorrent/lazy_entry.hpp"
 #include "libtorrent/session_settings.hpp"
 #include "libtorrent/peer_id.hpp"
 #include "libtorrent/peer.hpp"
@@ -140,8 +141,8 @@ namespace libtorrent
 
 		virtual void on_timeout();
 
-		void parse(const entry& e);
-		peer_entry extract_peer_info(const entry& e);
+		void parse(lazy_entry const& e);
+		peer_entry extract_peer_info(lazy_entry const& e);
 
 		tracker_manager& m_man;
 		enum { read_status, read_header, read_body } m_state;
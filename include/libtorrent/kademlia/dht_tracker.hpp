@@ -52,6 +52,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/kademlia/packet_iterator.hpp"
 #include "libtorrent/session_settings.hpp"
 #include "libtorrent/session_status.hpp"
+#include "libtorrent/lazy_entry.hpp"
 
 namespace libtorrent { namespace dht
 {
@@ -105,6 +106,10 @@ namespace libtorrent { namespace dht
 		int m_buffer;
 		std::vector<char> m_in_buf[2];
 		udp::endpoint m_remote_endpoint[2];
+		// incoming packets are parsed into this. It keeps its
+		// token vector between packets, so parsing them doesn't
+		// allocate once it has grown to fit
+		lazy_entry m_in_msg;
 		std::vector<char> m_send_buf;
 
 		boost::posix_time::ptime m_last_refresh;
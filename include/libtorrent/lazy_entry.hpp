@@ -0,0 +1,239 @@
+/*
+
+Copyright (c) 2007, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_LAZY_ENTRY_HPP_INCLUDED
+#define TORRENT_LAZY_ENTRY_HPP_INCLUDED
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <cassert>
+
+#include "libtorrent/entry.hpp"
+#include "libtorrent/config.hpp"
+
+/*
+ * This file declares the lazy_entry class and the lazy_bdecode()
+ * function. lazy_bdecode() parses a bencoded buffer without
+ * copying it. Instead of building a tree of entry objects, it
+ * records one token per item, holding its offset into the
+ * buffer, in a single vector. The lazy_entry objects handed out
+ * by the accessors are just an index into that vector.
+ *
+ * The buffer has to outlive the root lazy_entry, and the root
+ * has to outlive every lazy_entry taken from it. Parsing into a
+ * root that has been used before reuses its token vector, so
+ * once it has grown to fit, parsing doesn't allocate at all.
+ *
+ * The accessors have the same names and semantics as the ones
+ * on entry. They throw type_error if the item has another type.
+ *
+ */
+
+namespace libtorrent
+{
+	namespace detail
+	{
+		struct lazy_token
+		{
+			// the offset of the item's first byte in the buffer
+			int offset;
+			// the number of tokens to the next item at the same
+			// level. For lists and dictionaries this includes
+			// their items and the end token
+			int next;
+			// strings: the length of the "<length>:" prefix
+			// lists and dictionaries: the number of items in
+			// them, keys and values both count in dictionaries
+			int header;
+			// entry::data_type, or end_t
+			int type;
+
+			enum { end_t = entry::undefined_t + 1 };
+		};
+	}
+
+	class lazy_entry;
+
+	// parses the bencoded buffer [start, end) into ret. Throws
+	// invalid_encoding if it isn't correctly bencoded. Anything
+	// following the first item is ignored.
+	TORRENT_EXPORT void lazy_bdecode(char const* start, char const* end
+		, lazy_entry& ret);
+
+	class TORRENT_EXPORT lazy_entry
+	{
+	friend void lazy_bdecode(char const* start, char const* end
+		, lazy_entry& ret);
+	public:
+
+		typedef entry::data_type data_type;
+
+		lazy_entry();
+		lazy_entry(lazy_entry const& e);
+		lazy_entry& operator=(lazy_entry const& e);
+
+		// undefined_t for default constructed entries and the
+		// ones returned by find_key() when the key is missing
+		data_type type() const;
+
+		entry::integer_type integer() const;
+
+		// strings are not null terminated, they point into the
+		// buffer that was parsed
+		char const* string_ptr() const;
+		int string_length() const;
+		std::string string() const;
+		bool string_equal(char const* str) const;
+
+		int list_size() const;
+		lazy_entry list_at(int i) const;
+
+		// the number of key-value pairs
+		int dict_size() const;
+		std::pair<lazy_entry, lazy_entry> dict_at(int i) const;
+		// throws type_error if the key is missing
+		lazy_entry operator[](char const* key) const;
+		lazy_entry operator[](std::string const& key) const;
+		// returns an undefined entry if the key is missing
+		lazy_entry find_key(char const* key) const;
+		lazy_entry find_key(std::string const& key) const;
+
+		// the bencoded item this entry was parsed from
+		std::pair<char const*, int> data_section() const;
+
+		// builds a copy of this item as an entry tree
+		entry to_entry() const;
+
+	private:
+
+		lazy_entry(std::vector<detail::lazy_token> const* root
+			, char const* buffer, int token);
+
+		detail::lazy_token const& token(int i) const
+		{
+			assert(m_root);
+			assert(i >= 0 && i < int(m_root->size()));
+			return (*m_root)[i];
+		}
+
+		void check_type(data_type t) const
+		{
+			if (type() != t) throw type_error("invalid type requested from entry");
+		}
+
+		// the token of the i:th item in this list or dictionary
+		int child_token(int i) const;
+
+		// keys may contain null characters, hence the length
+		lazy_entry find_key(char const* key, int len) const;
+		lazy_entry lookup(char const* key, int len) const;
+
+		// the tokens of the whole buffer. Points to m_tokens
+		// in the root entry
+		std::vector<detail::lazy_token> const* m_root;
+		char const* m_buffer;
+		int m_token;
+
+		// child_token() walks from the last child it returned
+		// when it can, to make iterating over the items linear
+		mutable int m_last_index;
+		mutable int m_last_token;
+
+		// only used by the root entry
+		std::vector<detail::lazy_token> m_tokens;
+	};
+
+	inline lazy_entry::lazy_entry()
+		: m_root(0)
+		, m_buffer(0)
+		, m_token(0)
+		, m_last_index(-1)
+		, m_last_token(-1)
+	{}
+
+	inline lazy_entry::lazy_entry(std::vector<detail::lazy_token> const* root
+		, char const* buffer, int token)
+		: m_root(root)
+		, m_buffer(buffer)
+		, m_token(token)
+		, m_last_index(-1)
+		, m_last_token(-1)
+	{}
+
+	inline lazy_entry::data_type lazy_entry::type() const
+	{
+		if (m_root == 0) return entry::undefined_t;
+		return data_type(token(m_token).type);
+	}
+
+	inline char const* lazy_entry::string_ptr() const
+	{
+		check_type(entry::string_t);
+		detail::lazy_token const& t = token(m_token);
+		return m_buffer + t.offset + t.header;
+	}
+
+	inline int lazy_entry::string_length() const
+	{
+		check_type(entry::string_t);
+		// there is always a token following a string, it
+		// starts where the string ends
+		detail::lazy_token const& t = token(m_token);
+		return token(m_token + 1).offset - t.offset - t.header;
+	}
+
+	inline std::string lazy_entry::string() const
+	{
+		return std::string(string_ptr(), string_length());
+	}
+
+	inline int lazy_entry::list_size() const
+	{
+		check_type(entry::list_t);
+		return token(m_token).header;
+	}
+
+	inline int lazy_entry::dict_size() const
+	{
+		check_type(entry::dictionary_t);
+		return token(m_token).header / 2;
+	}
+
+	inline std::ostream& operator<<(std::ostream& os, lazy_entry const& e)
+	{
+		e.to_entry().print(os, 0);
+		return os;
+	}
+}
+
+#endif // TORRENT_LAZY_ENTRY_HPP_INCLUDED
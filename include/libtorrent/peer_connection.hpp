@@ -59,6 +59,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 #include "libtorrent/buffer.hpp"
+#include "libtorrent/chained_buffer.hpp"
+#include "libtorrent/bandwidth_manager.hpp"
 #include "libtorrent/socket.hpp"
 #include "libtorrent/peer_id.hpp"
 #include "libtorrent/storage.hpp"
@@ -143,6 +145,11 @@ namespace libtorrent
 		// will send a keep-alive message to the peer
 		void keep_alive();
 
+		// the number of seconds until has_timed_out() or
+		// keep_alive() may have something to do. The session
+		// doesn't look at the connection again before then
+		int seconds_to_next_timeout() const;
+
 		peer_id const& pid() const { return m_peer_id; }
 		void set_pid(const peer_id& pid) { m_peer_id = pid; }
 		bool has_piece(int i) const;
@@ -204,9 +211,13 @@ namespace libtorrent
 		
 		// This is called for every peer right after the upload
 		// bandwidth has been distributed among them
-		// It will reset the used bandwidth to 0.
+		// It will start handing out the new quota.
 		void reset_upload_quota();
 
+		// called by the bandwidth manager when the quota on
+		// channel has been refilled, if we were waiting for it
+		void on_bandwidth(bandwidth_manager::channel_t channel);
+
 		// free upload.
 		size_type total_free_upload() const;
 		void add_free_upload(size_type free_upload);
@@ -312,17 +323,17 @@ namespace libtorrent
 
 		void send_buffer(char const* begin, char const* end);
 		buffer::interval allocate_send_buffer(int size);
+		// queues size bytes at start to be sent, without copying
+		// them. buf keeps the memory alive until it's been sent
+		void append_send_buffer(boost::shared_array<char> const& buf
+			, char* start, int size);
 		int send_buffer_size() const
-		{
-			return (int)m_send_buffer[0].size()
-				+ (int)m_send_buffer[1].size()
-				- m_write_pos;
-		}
+		{ return m_send_buffer.size(); }
 
 		buffer::const_interval receive_buffer() const
 		{
-			return buffer::const_interval(&m_recv_buffer[0]
-				, &m_recv_buffer[0] + m_recv_pos);
+			char const* start = m_recv_buffer.get() + m_recv_start;
+			return buffer::const_interval(start, start + m_recv_pos);
 		}
 
 		void cut_receive_buffer(int size, int packet_size);
@@ -339,6 +350,14 @@ namespace libtorrent
 		void setup_send();
 		void setup_receive();
 
+		// tops up the upload and download quota with
+		// what has been earned since the last refill
+		void refill_quota();
+
+		// makes room in the receive buffer for the rest of
+		// the current packet before the next read
+		void prepare_recv_buffer();
+
 		void attach_to_torrent(sha1_hash const& ih);
 
 		bool verify_piece(peer_request const& p) const;
@@ -370,12 +389,23 @@ namespace libtorrent
 		// web seeds also has a limit on the queue size.
 		int m_max_out_request_queue;
 
-		void set_timeout(int s) { m_timeout = s; }
+		// the number of bytes of piece data that have been
+		// requested from the disk io thread, but haven't
+		// made it into the send buffer yet
+		int m_reading_bytes;
 
-	private:
+		// the requests that are being read by the disk io
+		// thread. A request is removed when the peer cancels
+		// it or is choked, and its block is then dropped
+		// instead of sent once the read completes
+		std::deque<peer_request> m_reading_requests;
+
+		void set_timeout(int s) { m_timeout = s; }
 
 		void fill_send_buffer();
 
+	private:
+
 		// the timeout in seconds
 		int m_timeout;
 
@@ -383,29 +413,28 @@ namespace libtorrent
 		// piece packet from this peer
 		boost::posix_time::ptime m_last_piece;
 
+		// the receive buffer reads ahead of the current packet,
+		// and messages are parsed in place. m_recv_start is
+		// where the current packet starts, m_recv_pos is the
+		// number of bytes of it that have been handed to
+		// on_receive() and m_recv_end is the end of the data
+		// that has been read. Pieces are passed on to the disk
+		// thread by reference to this buffer, so it's replaced
+		// rather than overwritten while it's still referenced.
 		int m_packet_size;
 		int m_recv_pos;
-		std::vector<char> m_recv_buffer;
-
-		// this is the buffer where data that is
-		// to be sent is stored until it gets
-		// consumed by send(). Since asio requires
-		// the memory buffer that is given to async.
-		// operations to remain valid until the operation
-		// finishes, there has to be two buffers. While
-		// waiting for a async_write operation on one
-		// buffer, the other is used to write data to
-		// be queued up.
-		std::vector<char> m_send_buffer[2];
-		// the current send buffer is the one to write to.
-		// (m_current_send_buffer + 1) % 2 is the
-		// buffer we're currently waiting for.
-		int m_current_send_buffer;
-		
-		// if the sending buffer doesn't finish in one send
-		// operation, this is the position within that buffer
-		// where the next operation should continue
-		int m_write_pos;
+		int m_recv_start;
+		int m_recv_end;
+		boost::shared_array<char> m_recv_buffer;
+		int m_recv_buffer_size;
+
+		// this is where data that is to be sent is
+		// queued until it gets consumed by send().
+		// Memory that has been queued stays where it
+		// is until it has been sent, so more data can
+		// be queued while an async_write_some is
+		// waiting on the front of the queue.
+		chained_buffer m_send_buffer;
 
 		// timeouts
 		boost::posix_time::ptime m_last_receive;
@@ -543,6 +572,18 @@ namespace libtorrent
 		int m_last_write_size;
 		bool m_reading;
 		int m_last_read_size;		
+
+		// true while we're in the bandwidth manager's queue,
+		// waiting for more upload or download quota
+		bool m_ul_quota_waiting;
+		bool m_dl_quota_waiting;
+
+		// the last time the quota was refilled, and the
+		// fractions of a byte that were left over then
+		boost::posix_time::ptime m_last_refill;
+		size_type m_ul_refill_carry;
+		size_type m_dl_refill_carry;
+
 		// reference counter for intrusive_ptr
 		mutable boost::detail::atomic_count m_refs;
 
@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <algorithm>
 #include <vector>
+#include <map>
 #include <bitset>
 #include <cassert>
 
@@ -42,6 +43,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 #include <boost/optional.hpp>
+#include <boost/cstdint.hpp>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
@@ -90,24 +92,42 @@ namespace libtorrent
 
 		struct block_info
 		{
-			block_info(): num_downloads(0) {}
+			block_info(): peer(no_peer), num_downloads(0), state(state_none) {}
 			// the peer this block was requested or
-			// downloaded from
-			tcp::endpoint peer;
+			// downloaded from. This is an index into the
+			// picker's peer table, see peer_endpoint()
+			boost::uint16_t peer;
 			// the number of times this block has been downloaded
-			int num_downloads;
+			unsigned num_downloads:14;
+			// one of the states below
+			unsigned state:2;
+
+			enum { state_none, state_requested, state_finished };
+			enum { no_peer = 0xffff };
 		};
 
 		struct downloading_piece
+		{
+			downloading_piece(): index(-1), info(0), requested(0), finished(0) {}
+			int index;
+			// info about each block in the piece. It has
+			// blocks_in_piece() entries and points into the
+			// picker's block pool, so it's only valid as long
+			// as the piece is being downloaded
+			block_info* info;
+			// the number of blocks in the requested state
+			boost::uint16_t requested;
+			// the number of blocks in the finished state
+			boost::uint16_t finished;
+		};
+
+		// a partially downloaded piece, as restored from
+		// the fast resume data
+		struct unfinished_piece
 		{
 			int index;
-			// each bit represents a block in the piece
-			// set to one if the block has been requested
-			std::bitset<max_blocks_per_piece> requested_blocks;
 			// the bit is set to one if the block has been acquired
 			std::bitset<max_blocks_per_piece> finished_blocks;
-			// info about each block
-			block_info info[max_blocks_per_piece];
 		};
 
 		piece_picker(int blocks_per_piece
@@ -121,7 +141,7 @@ namespace libtorrent
 		// and which we don't have.
 		void files_checked(
 			const std::vector<bool>& pieces
-			, const std::vector<downloading_piece>& unfinished);
+			, const std::vector<unfinished_piece>& unfinished);
 
 		// increases the peer count for the given piece
 		// (is used when a HAVE or BITFIELD message is received)
@@ -131,21 +151,46 @@ namespace libtorrent
 		// (used when a peer disconnects)
 		void dec_refcount(int index);
 
+		// increases or decreases the peer count for every
+		// piece that's set in the bitmask. Used when a BITFIELD
+		// message is received and when a peer disconnects
+		void inc_refcount(std::vector<bool> const& bitmask);
+		void dec_refcount(std::vector<bool> const& bitmask);
+
+		// increases or decreases the peer count for all
+		// pieces. Used when a seed connects or disconnects
+		void inc_refcount_all();
+		void dec_refcount_all();
+
 		// This indicates that we just received this piece
 		// it means that the refcounter will indicate that
 		// we are not interested in this piece anymore
 		// (i.e. we don't have to maintain a refcount)
 		void we_have(int index);
 
+		// sets the priority of a piece. Priority 0 means the piece
+		// is filtered and won't be downloaded, 1 is the normal priority
+		// and 7 the highest. Pieces with a higher priority are always
+		// picked before pieces with a lower one, within the same priority
+		// the rarest pieces are picked first.
+		void set_piece_priority(int index, int prio);
+
+		// returns the priority for the piece at 'index'
+		int piece_priority(int index) const;
+
+		// fills the vector with the priority of every piece
+		void piece_priorities(std::vector<int>& pieces) const;
+
 		// This will mark a piece as unfiltered, and if it was
 		// previously marked as filtered, it will be considered
 		// interesting again and be placed in the piece list available
-		// for downloading.
+		// for downloading. It's the same as setting the priority to 1.
 		void mark_as_unfiltered(int index);
 
 		// This will mark a piece as filtered. The piece will be
 		// removed from the list of pieces avalable for downloading
-		// and hence, will not be downloaded.
+		// and hence, will not be downloaded. It's the same as setting
+		// the priority to 0.
 		void mark_as_filtered(int index);
 
 		// returns true if the pieces at 'index' is marked as filtered
@@ -168,7 +213,7 @@ namespace libtorrent
 		void pick_pieces(const std::vector<bool>& pieces
 			, std::vector<piece_block>& interesting_blocks
 			, int num_pieces, bool prefer_whole_pieces
-			, tcp::endpoint peer) const;
+			, tcp::endpoint peer);
 
 		// returns true if any client is currently downloading this
 		// piece-block, or if it's queued for downloading by some client
@@ -204,6 +249,16 @@ namespace libtorrent
 
 		boost::optional<tcp::endpoint> get_downloader(piece_block block) const;
 
+		// returns the endpoint of the peer the block_info
+		// refers to, or a default endpoint if there is none
+		tcp::endpoint peer_endpoint(int peer) const
+		{
+			if (peer == block_info::no_peer) return tcp::endpoint();
+			assert(peer >= 0 && peer < (int)m_peers.size());
+			assert(m_peers[peer].refcount > 0);
+			return m_peers[peer].endpoint;
+		}
+
 		// the number of filtered pieces we don't have
 		int num_filtered() const { return m_num_filtered; }
 
@@ -215,10 +270,12 @@ namespace libtorrent
 #endif
 
 		// functor that compares indices on downloading_pieces
+		// and unfinished_pieces
 		struct has_index
 		{
 			has_index(int i): index(i) { assert(i >= 0); }
-			bool operator()(const downloading_piece& p) const
+			template <class Piece>
+			bool operator()(const Piece& p) const
 			{ return p.index == index; }
 			int index;
 		};
@@ -236,34 +293,64 @@ namespace libtorrent
 			piece_pos(int peer_count_, int index_)
 				: peer_count(peer_count_)
 				, downloading(0)
-				, filtered(0)
+				, piece_priority(1)
 				, index(index_)
 			{
 				assert(peer_count_ >= 0);
 				assert(index_ >= 0);
 			}
 
-			// selects which vector to look in
-			unsigned peer_count : 11;
+			// the number of peers that has this piece
+			// (availability)
+			unsigned peer_count : 10;
 			// is 1 if the piece is marked as being downloaded
 			unsigned downloading : 1;
-			// is 1 if the piece is filtered (not to be downloaded)
-			unsigned filtered : 1;
-			// index in to the piece_info vector
-			unsigned index : 19;
-
-			enum { we_have_index = 0x3ffff };
-			
+			// is 0 if the piece is filtered (not to be downloaded)
+			// 1 is normal priority (default)
+			// 7 is maximum priority
+			unsigned piece_priority : 3;
+			// index in to the m_pieces vector
+			unsigned index : 18;
+
+			enum
+			{
+				// index is set to this to indicate that we have the
+				// piece. There is no entry for the piece in the
+				// m_pieces vector
+				we_have_index = 0x3ffff,
+				// the priority value that means the piece is filtered
+				filter_priority = 0,
+				// the max number the peer count can hold
+				max_peer_count = 0x3ff,
+				// the number of piece priority levels, including the
+				// filtered level
+				priority_levels = 8
+			};
+
+			bool have() const { return index == we_have_index; }
+			bool filtered() const { return piece_priority == filter_priority; }
+
+			// returns the bucket in m_pieces this piece belongs in, or
+			// -1 if it shouldn't be in m_pieces at all (we have it or
+			// it's filtered). Bucket 0 contains the pieces no peer has.
+			// The rest are laid out by piece priority, availability
+			// (capped at limit) and whether the piece is being downloaded,
+			// so that a change in peer count or download state moves a
+			// piece at most two buckets.
 			int priority(int limit) const
 			{
-				return peer_count >= (unsigned)limit ? limit : peer_count;
+				if (have() || filtered()) return -1;
+				if (peer_count == 0) return 0;
+				int availability = (std::min)(int(peer_count), limit);
+				return 1 + ((piece_priority - 1) * limit
+					+ availability - 1) * 2 + downloading;
 			}
-			
+
 			bool ordered(int limit) const
 			{
 				return peer_count >= (unsigned)limit;
 			}
-			
+
 			bool operator!=(piece_pos p) const
 			{ return index != p.index || peer_count != p.peer_count; }
 
@@ -272,48 +359,86 @@ namespace libtorrent
 
 		};
 
+		// peer_count saturates at max_peer_count, the peers beyond
+		// that are counted in m_peer_count_overflow. These return
+		// true if peer_count changed, and the piece may have to
+		// move to another bucket
+		bool inc_peer_count(int index);
+		bool dec_peer_count(int index);
 
 		void add(int index);
-		void move(bool downloading, bool filtered, int vec_index, int elem_index);
-		void remove(bool downloading, bool filtered, int vec_index, int elem_index);
-		std::vector<std::vector<int> >& pick_piece_info_vector(bool downloading
-			, bool filtered);
-
-		std::vector<std::vector<int> > const& pick_piece_info_vector(
-			bool downloading, bool filtered) const;
-
-		int add_interesting_blocks_free(const std::vector<int>& piece_list
+		void remove(int priority, int elem_index);
+		void update(int priority, int elem_index);
+		void move_to_bucket(int priority, int elem_index);
+		void rebuild_buckets();
+
+		// moves the entry at 'from' in m_pieces to 'to'. If the bucket
+		// is ordered the entries in between are shifted one step,
+		// otherwise the two entries swap places
+		void relocate(int bucket, int from, int to);
+		bool is_ordered(int bucket) const;
+		int bucket_begin(int bucket) const
+		{ return bucket == 0 ? 0 : m_priority_boundaries[bucket - 1]; }
+
+		int add_interesting_blocks_free(int bucket
 				, const std::vector<bool>& pieces
 				, std::vector<piece_block>& interesting_blocks
 				, int num_blocks, bool prefer_whole_pieces) const;
 
-		int add_interesting_blocks_partial(const std::vector<int>& piece_list
+		int add_interesting_blocks_partial(int bucket
 				, const std::vector<bool>& pieces
 				, std::vector<piece_block>& interesting_blocks
 				, std::vector<piece_block>& backup_blocks
 				, int num_blocks, bool prefer_whole_pieces
-				, tcp::endpoint peer) const;
-
-
-		// this vector contains all pieces we don't have.
-		// in the first entry (index 0) is a vector of all pieces
-		// that no peer have, the vector at index 1 contains
-		// all pieces that exactly one peer have, index 2 contains
-		// all pieces exactly two peers have and so on.
-		std::vector<std::vector<int> > m_piece_info;
-
-		// this vector has the same structure as m_piece_info
-		// but only contains pieces we are currently downloading
-		// they have higher priority than pieces we aren't downloading
-		// during piece picking
-		std::vector<std::vector<int> > m_downloading_piece_info;
+				, int peer) const;
+
+		bool exclusively_requested_from(downloading_piece const& p
+			, int peer) const;
+
+		// allocates block_info entries for a new downloading piece
+		// and adds it to m_downloads
+		downloading_piece& add_download_piece(int index);
+		void erase_download_piece(std::vector<downloading_piece>::iterator i);
+
+		// returns the index in the peer table of the given peer,
+		// adding it if it's not there. -1 is returned by find_peer()
+		// if the peer isn't in the table
+		int find_peer(tcp::endpoint const& peer) const;
+		void set_block_peer(block_info& b, tcp::endpoint const& peer);
+		void release_peer(int peer);
+
+		// this vector contains all pieces we don't have and that
+		// aren't filtered, grouped by the bucket returned by
+		// piece_pos::priority(). Within a bucket the pieces are in
+		// random order, except for the buckets of pieces with at least
+		// m_sequenced_download_threshold peers, which are kept sorted
+		// by piece index. Keeping all pieces in one flat vector means
+		// moving a piece to a neighbouring bucket is a single swap.
+		std::vector<int> m_pieces;
+
+		// the end of each bucket in m_pieces. Bucket i is the range
+		// [m_priority_boundaries[i-1], m_priority_boundaries[i]).
+		// It only grows as large as the highest bucket that has been
+		// used.
+		std::vector<int> m_priority_boundaries;
+
+		// this is set when the peer counts of many pieces have changed
+		// at once. m_pieces and m_priority_boundaries are then out of
+		// date and are rebuilt the next time pieces are picked, instead
+		// of moving every piece individually
+		bool m_dirty;
+
+		// the number of peers that have a piece in excess of
+		// piece_pos::max_peer_count, for the (rare) pieces whose
+		// peer_count has saturated
+		std::map<int, int> m_peer_count_overflow;
 
 		// this maps indices to number of peers that has this piece and
-		// index into the m_piece_info vectors.
+		// index into the m_pieces vector.
 		// piece_pos::we_have_index means that we have the piece, so it
-		// doesn't exist in the piece_info buckets
-		// pieces with the filtered flag set doesn't have entries in
-		// the m_piece_info buckets either
+		// doesn't exist in the m_pieces vector
+		// pieces that are filtered doesn't have entries in
+		// m_pieces either
 		std::vector<piece_pos> m_piece_map;
 
 		// each piece that's currently being downloaded
@@ -322,6 +447,32 @@ namespace libtorrent
 		// is being downloaded
 		std::vector<downloading_piece> m_downloads;
 
+		// the block_info entries for the pieces in m_downloads.
+		// It's divided into slots of m_blocks_per_piece entries,
+		// one slot per downloading piece
+		std::vector<block_info> m_block_info;
+
+		// the slots in m_block_info that aren't used
+		// by any downloading piece
+		std::vector<int> m_free_block_slots;
+
+		struct peer_entry
+		{
+			tcp::endpoint endpoint;
+			// the number of blocks that refer to this peer
+			int refcount;
+		};
+
+		// the peers that blocks in m_block_info refer to, so
+		// that block_info doesn't need to hold an endpoint
+		std::vector<peer_entry> m_peers;
+
+		// the entries in m_peers that aren't used
+		std::vector<int> m_free_peers;
+
+		// maps endpoints to their index in m_peers
+		std::map<tcp::endpoint, int> m_peer_index;
+
 		int m_blocks_per_piece;
 		int m_blocks_in_last_piece;
 
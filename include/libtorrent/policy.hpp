@@ -35,6 +35,8 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <algorithm>
 #include <vector>
+#include <map>
+#include <set>
 
 #ifdef _MSC_VER
 #pragma warning(push, 1)
@@ -178,35 +180,94 @@ namespace libtorrent
 		{
 			return m_num_unchoked;
 		}
+
+		// the time the choking part of the last
+		// pulse() took
+		boost::posix_time::time_duration last_choke_round() const
+		{
+			return m_last_choke_round;
+		}
 		
-		typedef std::vector<peer>::iterator iterator;
+		// the peers are indexed by their address. There is
+		// at most one entry per address
+		typedef std::map<address, peer> peers_t;
+
+		typedef peers_t::iterator iterator;
 		iterator begin_peer() { return m_peers.begin(); }
 		iterator end_peer() { return m_peers.end(); }
 
 	private:
 
+		// returns the entry for the peer the connection is
+		// connected to, or m_peers.end() if there is none
+		iterator find_connection(peer_connection const& c);
+
+		// the connect candidate set is ordered by the peer's
+		// connected time. The entry has to be removed from the
+		// set before any of the fields is_connect_candidate()
+		// or the ordering depends on is changed, and be updated
+		// afterwards
+		bool is_connect_candidate(peer const& p) const
+		{
+			return p.connection == 0
+				&& !p.banned
+				&& p.type == peer::connectable;
+		}
+		void erase_connect_candidate(peer& p)
+		{ m_connect_candidates.erase(&p); }
+		void update_connect_candidate(peer& p)
+		{ if (is_connect_candidate(p)) m_connect_candidates.insert(&p); }
+
+		// adds or removes the peer from m_connected
+		void add_connected(peer& p);
+		void remove_connected(peer& p);
+
+		// removes the peers that have been disconnected
+		// for too long
+		void erase_old_peers();
+
 		bool unchoke_one_peer();
 		void choke_one_peer();
-		peer* find_choke_candidate();
 		peer* find_unchoke_candidate();
 
 		// the seed prefix means that the
 		// function is used while seeding.
 		bool seed_unchoke_one_peer();
 		void seed_choke_one_peer();
-		peer* find_seed_choke_candidate();
 		peer* find_seed_unchoke_candidate();
 
 		bool connect_peer(peer *);
 		bool connect_one_peer();
 		bool disconnect_one_peer();
-		peer* find_disconnect_candidate();
 		peer* find_connect_candidate();
 
+		// these fill in the connected peers that are candidates
+		// for the respective action. The num first entries are
+		// the best candidates, in order, the rest is unsorted.
+		// Ranking k peers out of n is O(n log k).
+		void choke_candidates(std::vector<peer*>& peers, int num);
+		void unchoke_candidates(std::vector<peer*>& peers, int num);
+		void seed_choke_candidates(std::vector<peer*>& peers, int num);
+		void seed_unchoke_candidates(std::vector<peer*>& peers, int num);
+		void disconnect_candidates(std::vector<peer*>& peers, int num);
+
+		// (un)chokes or disconnects up to num peers, from
+		// a single ranking of the peers. Returns the number
+		// of peers that were (un)choked or disconnected
+		int choke_peers(int num);
+		int unchoke_peers(int num);
+		int seed_choke_peers(int num);
+		int seed_unchoke_peers(int num);
+		int disconnect_peers(int num);
+
 		// a functor that identifies peers that have disconnected and that
 		// are too old for still being saved.
 		struct old_disconnected_peer
 		{
+			old_disconnected_peer()
+				: now(boost::posix_time::second_clock::universal_time())
+			{}
+
 			bool operator()(const peer& p)
 			{
 				using namespace boost::posix_time;
@@ -216,12 +277,36 @@ namespace libtorrent
 				// this timeout has to be customizable!
 				return p.connection == 0
 					&& p.connected != not_tried_yet
-					&& second_clock::universal_time() - p.connected > minutes(30);
+					&& now - p.connected > minutes(30);
+			}
+
+			boost::posix_time::ptime now;
+		};
+
+		// orders peers by the time they were last connected or
+		// disconnected, the oldest first
+		struct connect_order
+		{
+			bool operator()(peer const* lhs, peer const* rhs) const
+			{
+				if (lhs->connected != rhs->connected)
+					return lhs->connected < rhs->connected;
+				return lhs < rhs;
 			}
 		};
 
+		peers_t m_peers;
+
+		// the peers we can connect to, i.e. the ones that
+		// aren't connected, banned and have a known listen
+		// port. The first entry is the one that was connected
+		// the longest time ago.
+		std::set<peer*, connect_order> m_connect_candidates;
 
-		std::vector<peer> m_peers;
+		// the peers that have a connection. This is the set
+		// the choker works on, which is a lot smaller than
+		// m_peers
+		std::vector<peer*> m_connected;
 
 		torrent* m_torrent;
 
@@ -237,6 +322,13 @@ namespace libtorrent
 		// we disconnect one peer every minute in hope of
 		// establishing a connection with a better peer
 		boost::posix_time::ptime m_last_optimistic_disconnect;
+
+		// the last time old disconnected peers were removed
+		// from m_peers
+		boost::posix_time::ptime m_last_peer_sweep;
+
+		// the time the choking part of the last pulse took
+		boost::posix_time::time_duration m_last_choke_round;
 	};
 
 }
@@ -59,6 +59,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/session_status.hpp"
 #include "libtorrent/version.hpp"
 #include "libtorrent/fingerprint.hpp"
+#include "libtorrent/storage.hpp"
 
 
 #if !defined(NDEBUG) && defined(_MSC_VER)
@@ -138,7 +139,8 @@ namespace libtorrent
 			, boost::filesystem::path const& save_path
 			, entry const& resume_data = entry()
 			, bool compact_mode = true
-			, int block_size = 16 * 1024);
+			, int block_size = 16 * 1024
+			, storage_constructor_type sc = default_storage_constructor);
 
 		// TODO: deprecated, this is for backwards compatibility only
 		torrent_handle add_torrent(
@@ -146,10 +148,11 @@ namespace libtorrent
 			, boost::filesystem::path const& save_path
 			, entry const& resume_data = entry()
 			, bool compact_mode = true
-			, int block_size = 16 * 1024)
+			, int block_size = 16 * 1024
+			, storage_constructor_type sc = default_storage_constructor)
 		{
 			return add_torrent(torrent_info(e), save_path, resume_data
-				, compact_mode, block_size);
+				, compact_mode, block_size, sc);
 		}
 
 		torrent_handle add_torrent(
@@ -158,7 +161,8 @@ namespace libtorrent
 			, boost::filesystem::path const& save_path
 			, entry const& resume_data = entry()
 			, bool compact_mode = true
-			, int block_size = 16 * 1024);
+			, int block_size = 16 * 1024
+			, storage_constructor_type sc = default_storage_constructor);
 
 		session_proxy abort() { return session_proxy(m_impl); }
 
@@ -56,6 +56,11 @@ namespace libtorrent
 			, peer_timeout(120)
 			, urlseed_timeout(20)
 			, urlseed_pipeline_size(5)
+			, file_checks_threads(1)
+			, hashing_threads(1)
+			, read_cache_size(4 * 1024 * 1024)
+			, write_cache_size(8 * 1024 * 1024)
+			, network_threads(1)
 		{}
 
 		std::string proxy_ip;
@@ -130,6 +135,43 @@ namespace libtorrent
 		
 		// controls the pipelining size of url-seeds
 		int urlseed_pipeline_size;
+
+		// the number of torrents that may have their files
+		// checked at the same time. Each of them is checked
+		// by a separate thread.
+		int file_checks_threads;
+
+		// the number of threads that hash pieces while a
+		// torrent's files are being checked. When this is
+		// greater than one, pieces are read ahead and hashed
+		// while the following ones are being read.
+		int hashing_threads;
+
+		// the maximum number of bytes the disk io thread may
+		// use to cache pieces read from disk. When a block is
+		// requested, the whole piece it belongs to is read and
+		// kept in the cache, since peers are likely to request
+		// the rest of it too. 0 disables the read cache.
+		int read_cache_size;
+
+		// the maximum number of bytes the disk io thread may
+		// use to hold the blocks of pieces that are being
+		// downloaded. A piece is written in one go when it
+		// is complete and hashed from memory. If the cache
+		// is full, the least recently written piece is
+		// flushed to disk. 0 disables the write cache.
+		int write_cache_size;
+
+		// the number of threads that run the sockets of the
+		// peer connections. With more than one, new connections
+		// are spread over the threads, outgoing ones by the
+		// torrent they belong to. This only spreads the socket
+		// system calls and the completion dispatch. Every message
+		// handler locks the session mutex, so parsing messages,
+		// picking pieces and choking still run on one core at a
+		// time. Threads are started on demand and never stopped,
+		// lowering this only affects new connections.
+		int network_threads;
 	};
 	
 #ifndef TORRENT_DISABLE_DHT
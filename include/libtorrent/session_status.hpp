@@ -55,6 +55,51 @@ namespace libtorrent
 
 		int num_peers;
 
+		// the number of jobs queued for, or being executed
+		// by, the disk io thread
+		int disk_queue_depth;
+		// the average and the worst time (in milliseconds)
+		// from the point a disk job was queued until it
+		// completed
+		int disk_average_latency;
+		int disk_max_latency;
+		size_type disk_total_jobs;
+
+		// the number of blocks that were served from
+		// the read cache, and the number of blocks that
+		// had to be read from disk. read_cache_size is
+		// the number of bytes currently in the cache
+		size_type read_cache_hits;
+		size_type read_cache_misses;
+		int read_cache_size;
+
+		// the number of bytes held by the write cache, the
+		// number of blocks that have been downloaded and the
+		// number of writes they were coalesced into
+		int write_cache_size;
+		size_type blocks_written;
+		size_type disk_writes;
+
+		// the number of pieces that had to be flushed before
+		// they were complete, because the write cache was full
+		// or the torrent was paused
+		size_type forced_write_flushes;
+
+		// the number of downloaded bytes that were hashed
+		// from memory as they arrived, and the number that
+		// had to be read back from disk to be hashed (the
+		// blocks that arrived out of order)
+		size_type bytes_hashed_from_memory;
+		size_type bytes_hashed_from_disk;
+
+		// the time, in microseconds, the last one second
+		// tick of the session took and the longest tick so
+		// far. tick_expired_timers is the number of connection
+		// and tracker timers that expired in the last tick
+		int tick_duration;
+		int max_tick_duration;
+		int tick_expired_timers;
+
 #ifndef TORRENT_DISABLE_DHT
 		int m_dht_nodes;
 		int m_dht_node_cache;
@@ -51,6 +51,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 
 #include "libtorrent/torrent_info.hpp"
+#include "libtorrent/file.hpp"
 #include "libtorrent/config.hpp"
 
 namespace libtorrent
@@ -86,7 +87,61 @@ namespace libtorrent
 		std::string m_msg;
 	};
 
-	class TORRENT_EXPORT storage
+	// moves the files of the torrent from old_save_path to
+	// new_save_path (which is created if it doesn't exist).
+	// Returns false if it fails. The caller is expected to
+	// have closed all the files first
+	TORRENT_EXPORT bool move_torrent_files(
+		torrent_info const& t
+		, boost::filesystem::path const& old_save_path
+		, boost::filesystem::path const& new_save_path);
+
+	// the interface the piece_manager uses to read and write
+	// the slots of a torrent. Slots are piece sized chunks of
+	// the torrent's files, the piece_manager keeps track of
+	// which piece is stored in which slot. Implementations
+	// must allow reads and writes to different slots from
+	// several threads at once
+	struct TORRENT_EXPORT storage_interface
+	{
+		// may throw file_error if storage for slot does not exist
+		virtual size_type read(char* buf, int slot, int offset, int size) = 0;
+
+		// may throw file_error if storage for slot hasn't been allocated
+		virtual void write(const char* buf, int slot, int offset, int size) = 0;
+
+		// writes the buffers to the slot as if they were one
+		// contiguous buffer. The default implementation calls
+		// write() once per buffer
+		virtual void writev(file::iovec_t const* bufs, int num_bufs
+			, int slot, int offset);
+
+		virtual bool move_storage(boost::filesystem::path save_path) = 0;
+
+		// this will close all open files that are opened for
+		// writing. This is called when a torrent has finished
+		// downloading.
+		virtual void release_files() = 0;
+
+		virtual ~storage_interface() {}
+	};
+
+	typedef storage_interface* (*storage_constructor_type)(
+		torrent_info const&, boost::filesystem::path const&);
+
+	// the default storage, reads and writes the files
+	// through a pool of open files
+	TORRENT_EXPORT storage_interface* default_storage_constructor(
+		torrent_info const& ti, boost::filesystem::path const& path);
+
+	// memory maps windows of the files instead of reading and
+	// writing them, see mapped_storage.cpp. On platforms without
+	// mmap() or posix_fallocate() this is the same as
+	// default_storage_constructor
+	TORRENT_EXPORT storage_interface* mapped_storage_constructor(
+		torrent_info const& ti, boost::filesystem::path const& path);
+
+	class TORRENT_EXPORT storage : public storage_interface
 	{
 	public:
 		storage(
@@ -95,17 +150,11 @@ namespace libtorrent
 
 		void swap(storage&);
 
-		// may throw file_error if storage for slot does not exist
 		size_type read(char* buf, int slot, int offset, int size);
-
-		// may throw file_error if storage for slot hasn't been allocated
 		void write(const char* buf, int slot, int offset, int size);
-
+		void writev(file::iovec_t const* bufs, int num_bufs
+			, int slot, int offset);
 		bool move_storage(boost::filesystem::path save_path);
-
-		// this will close all open files that are opened for
-		// writing. This is called when a torrent has finished
-		// downloading.
 		void release_files();
 
 #ifndef NDEBUG
@@ -125,14 +174,17 @@ namespace libtorrent
 
 		piece_manager(
 			const torrent_info& info
-			, const boost::filesystem::path& path);
+			, const boost::filesystem::path& path
+			, storage_constructor_type sc = default_storage_constructor);
 
 		~piece_manager();
 
 		bool check_fastresume(aux::piece_checker_data& d
 			, std::vector<bool>& pieces, int& num_pieces, bool compact_mode);
+		// hash_threads is the number of threads that may
+		// hash pieces concurrently while checking
 		std::pair<bool, float> check_files(std::vector<bool>& pieces
-			, int& num_pieces);
+			, int& num_pieces, int hash_threads = 1);
 
 		void release_files();
 
@@ -145,6 +197,7 @@ namespace libtorrent
 			, int block_size
 			, const std::bitset<256>& bitmask);
 		int slot_for_piece(int piece_index) const;
+		int piece_size(int piece_index) const;
 
 		size_type read(
 			char* buf
@@ -158,6 +211,12 @@ namespace libtorrent
 			, int offset
 			, int size);
 
+		void writev(
+			file::iovec_t const* bufs
+			, int num_bufs
+			, int piece_index
+			, int offset);
+
 		boost::filesystem::path const& save_path() const;
 		bool move_storage(boost::filesystem::path const&);
 
@@ -0,0 +1,205 @@
+/*
+
+Copyright (c) 2007, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_TIMER_WHEEL_HPP_INCLUDED
+#define TORRENT_TIMER_WHEEL_HPP_INCLUDED
+
+#include <vector>
+#include <map>
+#include <utility>
+#include <algorithm>
+#include <cassert>
+
+#ifdef _MSC_VER
+#pragma warning(push, 1)
+#endif
+
+#include <boost/cstdint.hpp>
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+#include "libtorrent/config.hpp"
+
+namespace libtorrent
+{
+	// a two level hierarchical timer wheel. Keys are scheduled a
+	// number of ticks into the future and tick() hands them back
+	// once that many ticks have passed. The first level has one
+	// slot per tick, the second level one slot per revolution of
+	// the first level. Every revolution, the timers in the next
+	// second level slot are moved down into the first level.
+	// A tick only touches the timers that are due, and the ones
+	// that are moved down.
+	//
+	// every key has at most one entry in the slots. Scheduling a
+	// key that already has a timer replaces it, and cancel()
+	// removes it, so the wheel doesn't hold on to keys that
+	// refer to objects that are gone.
+	template <class Key>
+	class timer_wheel
+	{
+	public:
+
+		enum
+		{
+			level0_slots = 256,
+			level1_slots = 64,
+			// the longest delay a timer can have. Longer delays
+			// are cut down to this
+			max_delay = level0_slots * (level1_slots - 1)
+		};
+
+		timer_wheel()
+			: m_tick(0)
+			, m_level0(level0_slots)
+			, m_level1(level1_slots)
+		{}
+
+		// makes the key expire after the given number of ticks.
+		// Any timer the key already had is replaced
+		void schedule(Key const& k, int ticks)
+		{
+			if (ticks < 1) ticks = 1;
+			if (ticks > max_delay) ticks = max_delay;
+			boost::int64_t due = m_tick + ticks;
+			typename std::map<Key, boost::int64_t>::iterator i = m_due.find(k);
+			if (i != m_due.end())
+			{
+				remove(entry(k, i->second));
+				i->second = due;
+			}
+			else
+			{
+				m_due.insert(std::make_pair(k, due));
+			}
+			insert(entry(k, due));
+		}
+
+		// removes the timer of the key, if it has one
+		void cancel(Key const& k)
+		{
+			typename std::map<Key, boost::int64_t>::iterator i = m_due.find(k);
+			if (i == m_due.end()) return;
+			remove(entry(k, i->second));
+			m_due.erase(i);
+		}
+
+		// the number of keys that have a timer
+		int size() const { return int(m_due.size()); }
+
+		// advances the wheel one tick and appends the keys
+		// whose timers expired to ret
+		void tick(std::vector<Key>& ret)
+		{
+			++m_tick;
+			int slot = int(m_tick % level0_slots);
+			if (slot == 0) cascade();
+
+			std::vector<entry>& s = m_level0[slot];
+			for (typename std::vector<entry>::iterator i = s.begin()
+				, end(s.end()); i != end; ++i)
+			{
+				typename std::map<Key, boost::int64_t>::iterator j
+					= m_due.find(i->first);
+				assert(j != m_due.end() && j->second == i->second);
+				assert(i->second == m_tick);
+				ret.push_back(i->first);
+				m_due.erase(j);
+			}
+			s.clear();
+		}
+
+	private:
+
+		typedef std::pair<Key, boost::int64_t> entry;
+
+		// the slot an entry that is due at the given tick is in
+		std::vector<entry>& slot(boost::int64_t due)
+		{
+			boost::int64_t revolution = due / level0_slots;
+			if (revolution == m_tick / level0_slots)
+				return m_level0[int(due % level0_slots)];
+			else
+				return m_level1[int(revolution % level1_slots)];
+		}
+
+		void insert(entry const& e)
+		{
+			assert(e.second > m_tick);
+			assert(e.second - m_tick <= max_delay);
+			slot(e.second).push_back(e);
+		}
+
+		void remove(entry const& e)
+		{
+			std::vector<entry>& s = slot(e.second);
+			typename std::vector<entry>::iterator i
+				= std::find(s.begin(), s.end(), e);
+			assert(i != s.end());
+			// the order within a slot doesn't matter
+			*i = s.back();
+			s.pop_back();
+		}
+
+		// called when the first level starts a new revolution.
+		// Moves the timers that are due in this revolution down
+		// into the first level
+		void cascade()
+		{
+			std::vector<entry> s;
+			s.swap(m_level1[int((m_tick / level0_slots) % level1_slots)]);
+			for (typename std::vector<entry>::iterator i = s.begin()
+				, end(s.end()); i != end; ++i)
+			{
+				assert(m_due.find(i->first) != m_due.end()
+					&& m_due.find(i->first)->second == i->second);
+				assert(i->second / level0_slots == m_tick / level0_slots);
+				m_level0[int(i->second % level0_slots)].push_back(*i);
+			}
+		}
+
+		// the number of ticks since the wheel was created
+		boost::int64_t m_tick;
+
+		// the tick each key is due, which tells which
+		// slot its entry is in
+		std::map<Key, boost::int64_t> m_due;
+
+		std::vector<std::vector<entry> > m_level0;
+		std::vector<std::vector<entry> > m_level1;
+	};
+}
+
+#endif // TORRENT_TIMER_WHEEL_HPP_INCLUDED
+
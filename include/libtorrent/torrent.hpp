@@ -49,6 +49,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/tuple/tuple.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
@@ -66,6 +67,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/piece_picker.hpp"
 #include "libtorrent/config.hpp"
 #include "libtorrent/escape_string.hpp"
+#include "libtorrent/disk_io_thread.hpp"
+#include "libtorrent/peer_request.hpp"
+#include "libtorrent/storage.hpp"
 
 namespace libtorrent
 {
@@ -101,6 +105,7 @@ namespace libtorrent
 			, tcp::endpoint const& net_interface
 			, bool compact_mode
 			, int block_size
+			, storage_constructor_type sc
 			, session_settings const& s);
 
 		// used with metadata-less torrents
@@ -114,6 +119,7 @@ namespace libtorrent
 			, tcp::endpoint const& net_interface
 			, bool compact_mode
 			, int block_size
+			, storage_constructor_type sc
 			, session_settings const& s);
 
 		~torrent();
@@ -152,7 +158,7 @@ namespace libtorrent
 	
 		bool check_fastresume(aux::piece_checker_data&);
 		std::pair<bool, float> check_files();
-		void files_checked(std::vector<piece_picker::downloading_piece> const&
+		void files_checked(std::vector<piece_picker::unfinished_piece> const&
 			unfinished_pieces);
 
 		stat statistics() const { return m_stat; }
@@ -164,6 +170,17 @@ namespace libtorrent
 		void resume();
 		bool is_paused() const { return m_paused; }
 
+		// true when the pieces or the finished blocks have
+		// changed since the resume data was last written
+		bool need_save_resume_data() const { return m_need_save_resume_data; }
+		void resume_data_saved() { m_need_save_resume_data = false; }
+
+		void set_piece_priority(int index, int priority);
+		int piece_priority(int index) const;
+
+		void prioritize_pieces(std::vector<int> const& pieces);
+		void piece_priorities(std::vector<int>&) const;
+
 		void filter_piece(int index, bool filter);
 		void filter_pieces(std::vector<bool> const& bitmask);
 		bool is_piece_filtered(int index) const;
@@ -264,6 +281,10 @@ namespace libtorrent
 		// tracker request
 		bool should_request();
 
+		// the number of seconds until should_request() may
+		// return true. The session checks the torrent again then
+		int seconds_to_next_announce() const;
+
 		// forcefully sets next_announce to the current time
 		void force_tracker_request();
 		void force_tracker_request(boost::posix_time::ptime);
@@ -300,6 +321,22 @@ namespace libtorrent
 			m_picker->inc_refcount(index);
 		}
 
+		// when we get a bitfield message, this is called with the
+		// pieces the peer has gained
+		void peer_has(std::vector<bool> const& bitmask)
+		{
+			assert(m_picker.get());
+			assert(bitmask.size() == m_have_pieces.size());
+			m_picker->inc_refcount(bitmask);
+		}
+
+		// when a seed connects
+		void peer_has_all()
+		{
+			assert(m_picker.get());
+			m_picker->inc_refcount_all();
+		}
+
 		// when peer disconnects, this is called for every piece it had
 		void peer_lost(int index)
 		{
@@ -308,6 +345,22 @@ namespace libtorrent
 			m_picker->dec_refcount(index);
 		}
 
+		// when a peer disconnects, this is called with all
+		// the pieces it had
+		void peer_lost(std::vector<bool> const& bitmask)
+		{
+			assert(m_picker.get());
+			assert(bitmask.size() == m_have_pieces.size());
+			m_picker->dec_refcount(bitmask);
+		}
+
+		// when a seed disconnects
+		void peer_lost_all()
+		{
+			assert(m_picker.get());
+			m_picker->dec_refcount_all();
+		}
+
 		int block_size() const { assert(m_block_size > 0); return m_block_size; }
 
 		// this will tell all peers that we just got his piece
@@ -333,11 +386,35 @@ namespace libtorrent
 		// completed() is called immediately after it.
 		void finished();
 
-		bool verify_piece(int piece_index);
-
-		// this is called from the peer_connection
-		// each time a piece has failed the hash
-		// test
+		// these queue jobs on the disk io thread. The
+		// handler of a read is called with the session
+		// locked, once the data is in the job's buffer.
+		void async_read(peer_request const& r
+			, disk_io_thread::handler_t const& handler);
+		void async_write(peer_request const& p, char const* data);
+		// writes the block at offset in buf without copying it.
+		// buf must not be modified until the write completes
+		void async_write(peer_request const& p
+			, boost::shared_array<char> const& buf, int offset);
+		void async_release_files();
+
+		// blocks until every block handed to the disk io thread
+		// so far is on disk. Used before the resume data is
+		// written, since it checksums the blocks on disk. Must
+		// be called without the session mutex held
+		void flush_disk_writes();
+
+		// hashes the piece on the disk io thread and then
+		// calls piece_finished() with the result
+		void async_verify_piece(int piece_index);
+
+		// this is called once a downloaded piece has been
+		// hashed. It will announce the piece if it passed
+		// the hash check and call piece_failed() otherwise
+		void piece_finished(int index, bool passed_hash_check);
+
+		// this is called each time a piece has failed
+		// the hash test
 		void piece_failed(int index);
 		void received_redundant_data(int num_bytes)
 		{ assert(num_bytes > 0); m_total_redundant_bytes += num_bytes; }
@@ -437,6 +514,14 @@ namespace libtorrent
 		void try_next_tracker();
 		int prioritize_tracker(int tracker_index);
 
+		// completion handlers for the disk io jobs
+		void on_disk_read_complete(int ret, disk_io_job const& j
+			, disk_io_thread::handler_t handler);
+		void on_disk_write_complete(int ret, disk_io_job const& j);
+		void on_piece_verified(int ret, disk_io_job const& j);
+		void on_files_released(int ret, disk_io_job const& j);
+		void on_storage_moved(int ret, disk_io_job const& j);
+
 		torrent_info m_torrent_file;
 
 		// is set to true when the torrent has
@@ -449,6 +534,9 @@ namespace libtorrent
 		// paused to the time should_request() is called
 		bool m_just_paused;
 
+		// see need_save_resume_data()
+		bool m_need_save_resume_data;
+
 		tracker_request::event_t m_event;
 
 		void parse_response(const entry& e, std::vector<peer_entry>& peer_list);
@@ -460,8 +548,9 @@ namespace libtorrent
 
 		// if this pointer is 0, the torrent is in
 		// a state where the metadata hasn't been
-		// received yet.
-		boost::scoped_ptr<piece_manager> m_storage;
+		// received yet. The disk io jobs that are in
+		// flight keep a reference to the storage.
+		boost::shared_ptr<piece_manager> m_storage;
 
 		// the time of next tracker request
 		boost::posix_time::ptime m_next_request;
@@ -602,6 +691,10 @@ namespace libtorrent
 		// when creating the torrent
 		const int m_default_block_size;
 
+		// creates the storage of the torrent once it
+		// has metadata
+		storage_constructor_type m_storage_constructor;
+
 		// this is set to false as long as the connections
 		// of this torrent hasn't been initialized. If we
 		// have metadata from the start, connections are
@@ -628,18 +721,6 @@ namespace libtorrent
 		return m_next_request;
 	}
 
-	inline void torrent::force_tracker_request()
-	{
-		using boost::posix_time::second_clock;
-		m_next_request = second_clock::universal_time();
-	}
-
-	inline void torrent::force_tracker_request(boost::posix_time::ptime t)
-	{
-		namespace time = boost::posix_time;
-		m_next_request = t;
-	}
-
 	inline void torrent::set_tracker_login(
 		std::string const& name
 		, std::string const& pw)
@@ -98,6 +98,7 @@ namespace libtorrent
 			, num_seeds(0)
 			, distributed_copies(0.f)
 			, block_size(0)
+			, choke_round_duration(0)
 		{}
 
 		enum state_t
@@ -199,6 +200,10 @@ namespace libtorrent
 		// the number of bytes each piece request asks for
 		// and each bit in the download queue bitfield represents
 		int block_size;
+
+		// the time, in microseconds, the last round of choking
+		// and unchoking the peers of this torrent took
+		int choke_round_duration;
 	};
 
 	struct TORRENT_EXPORT partial_piece_info
@@ -244,6 +249,16 @@ namespace libtorrent
 		void pause() const;
 		void resume() const;
 
+		// sets the priority of pieces. 0 means the piece won't be
+		// downloaded (same as filtered), 1 is the normal priority
+		// and 7 the highest. Pieces with higher priority are always
+		// picked before pieces with lower priority.
+		void piece_priority(int index, int priority) const;
+		int piece_priority(int index) const;
+
+		void prioritize_pieces(std::vector<int> const& pieces) const;
+		std::vector<int> piece_priorities() const;
+
 		// marks the piece with the given index as filtered
 		// it will not be downloaded
 		void filter_piece(int index, bool filter) const;
@@ -260,6 +275,17 @@ namespace libtorrent
 		void use_interface(const char* net_interface) const;
 
 		entry write_resume_data() const;
+		// bencodes the resume data straight into buf, appending
+		// to it. Leaves buf as it is if there is no resume data
+		void write_resume_data(std::vector<char>& buf) const;
+		// like write_resume_data(), but only writes the resume data
+		// if the torrent has finished or verified any blocks since
+		// its resume data was last written. Returns true if it
+		// wrote anything. Calling this periodically for every
+		// torrent only costs anything for the torrents that are
+		// downloading, and keeps the loss small if the client
+		// crashes
+		bool write_resume_checkpoint(std::vector<char>& buf) const;
 
 		// kind of similar to get_torrent_info() but this
 		// is lower level, returning the exact info-part of
@@ -307,7 +333,10 @@ namespace libtorrent
 		void set_tracker_login(std::string const& name
 			, std::string const& password) const;
 
-		// post condition: save_path() == save_path if true is returned
+		// the files are moved by the disk io thread. Once they
+		// have been moved, save_path() is updated and a
+		// storage_moved_alert is posted. If the move fails, a
+		// file_error_alert is posted instead.
 		bool move_storage(boost::filesystem::path const& save_path) const;
 
 		const sha1_hash& info_hash() const
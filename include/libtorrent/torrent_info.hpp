@@ -92,6 +92,8 @@ namespace libtorrent
 		virtual const char* what() const throw() { return "invalid torrent file"; }
 	};
 
+	class bencode_writer;
+
 	class TORRENT_EXPORT torrent_info
 	{
 	public:
@@ -103,6 +105,11 @@ namespace libtorrent
 
 		entry create_torrent() const;
 		entry create_info_metadata() const;
+		// bencode the torrent file and the info section straight
+		// into buf, appending to it. create_torrent() leaves buf
+		// as it is if there are no trackers, nodes or files
+		void create_torrent(std::vector<char>& buf) const;
+		void write_info_section(bencode_writer& w) const;
 		void set_comment(char const* str);
 		void set_creator(char const* str);
 		void set_piece_size(int size);
@@ -125,6 +132,11 @@ namespace libtorrent
 		reverse_file_iterator rbegin_files() const { return m_files.rbegin(); }
 		reverse_file_iterator rend_files() const { return m_files.rend(); }
 
+		// returns the file that contains the byte at the given
+		// offset into the torrent. This is a binary search over
+		// the file offsets, so it's O(log n) in the number of files
+		file_iterator file_at_offset(size_type offset) const;
+
 		int num_files() const
 		{ assert(m_piece_length > 0); return (int)m_files.size(); }
 		const file_entry& file_at(int index) const
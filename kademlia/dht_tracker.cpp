@@ -49,6 +49,8 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "libtorrent/socket.hpp"
 #include "libtorrent/bencode.hpp"
+#include "libtorrent/bencode_writer.hpp"
+#include "libtorrent/lazy_entry.hpp"
 #include "libtorrent/io.hpp"
 #include "libtorrent/version.hpp"
 
@@ -122,6 +124,22 @@ namespace
 		}
 	}
 
+	template <class EndpointType>
+	void read_endpoint_list(libtorrent::lazy_entry const& n, std::vector<EndpointType>& epl)
+	{
+		using namespace libtorrent;
+		int size = n.list_size();
+		for (int i = 0; i < size; ++i)
+		{
+			lazy_entry p = n.list_at(i);
+			char const* in = p.string_ptr();
+			if (p.string_length() == 6)
+				epl.push_back(read_v4_endpoint<EndpointType>(in));
+			else if (p.string_length() == 18)
+				epl.push_back(read_v6_endpoint<EndpointType>(in));
+		}
+	}
+
 }
 
 namespace libtorrent { namespace dht
@@ -367,12 +385,14 @@ namespace libtorrent { namespace dht
 		try
 		{
 			using libtorrent::entry;
-			using libtorrent::bdecode;
+			using libtorrent::lazy_entry;
+			using libtorrent::lazy_bdecode;
 			
 			assert(bytes_transferred > 0);
 
-			entry e = bdecode(m_in_buf[current_buffer].begin()
-				, m_in_buf[current_buffer].end());
+			char const* buf = &m_in_buf[current_buffer][0];
+			lazy_bdecode(buf, buf + bytes_transferred, m_in_msg);
+			lazy_entry const& e = m_in_msg;
 
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 			TORRENT_LOG(dht_tracker) << microsec_clock::universal_time()
@@ -388,10 +408,10 @@ namespace libtorrent { namespace dht
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 			try
 			{
-				entry const* ver = e.find_key("v");
-				if (!ver) throw std::exception();
+				lazy_entry ver = e.find_key("v");
+				if (ver.type() == entry::undefined_t) throw std::exception();
 
-				std::string const& client = ver->string();
+				std::string client = ver.string();
 				if (client.size() > 1 && std::equal(client.begin(), client.begin() + 2, "UT"))
 				{
 					++m_ut_message_input;
@@ -423,9 +443,9 @@ namespace libtorrent { namespace dht
 			};
 #endif
 
-			std::string const& msg_type = e["y"].string();
+			lazy_entry msg_type = e["y"];
 
-			if (msg_type == "r")
+			if (msg_type.string_equal("r"))
 			{
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 				TORRENT_LOG(dht_tracker) << "   reply: transaction: "
@@ -433,12 +453,13 @@ namespace libtorrent { namespace dht
 #endif
 
 				m.reply = true;
-				entry const& r = e["r"];
-				std::string const& id = r["id"].string();
-				if (id.size() != 20) throw std::runtime_error("invalid size of id");
-				std::copy(id.begin(), id.end(), m.id.begin());
+				lazy_entry r = e["r"];
+				lazy_entry id = r["id"];
+				if (id.string_length() != 20) throw std::runtime_error("invalid size of id");
+				std::copy(id.string_ptr(), id.string_ptr() + 20, m.id.begin());
 
-				if (entry const* n = r.find_key("values"))				
+				lazy_entry n = r.find_key("values");
+				if (n.type() != entry::undefined_t)
 				{
 					m.peers.clear();
 					read_endpoint_list<tcp::endpoint>(n, m.peers);
@@ -448,11 +469,11 @@ namespace libtorrent { namespace dht
 				}
 
 				m.nodes.clear();
-				if (entry const* n = r.find_key("nodes"))				
+				n = r.find_key("nodes");
+				if (n.type() != entry::undefined_t)
 				{
-					std::string const& nodes = n->string();
-					std::string::const_iterator i = nodes.begin();
-					std::string::const_iterator end = nodes.end();
+					char const* i = n.string_ptr();
+					char const* end = i + n.string_length();
 
 					while (std::distance(i, end) >= 26)
 					{
@@ -467,23 +488,24 @@ namespace libtorrent { namespace dht
 #endif
 				}
 
-				if (entry const* n = r.find_key("nodes2"))				
+				n = r.find_key("nodes2");
+				if (n.type() != entry::undefined_t)
 				{
-					entry::list_type const& contacts = n->list();
-					for (entry::list_type::const_iterator i = contacts.begin()
-						, end(contacts.end()); i != end; ++i)
+					int size = n.list_size();
+					for (int i = 0; i < size; ++i)
 					{
-						std::string const& p = i->string();
-						if (p.size() < 6 + 20) continue;
-						std::string::const_iterator in = p.begin();
+						lazy_entry p = n.list_at(i);
+						int len = p.string_length();
+						if (len < 6 + 20) continue;
+						char const* in = p.string_ptr();
 
 						node_id id;
 						std::copy(in, in + 20, id.begin());
 						in += 20;
-						if (p.size() == 6 + 20)
+						if (len == 6 + 20)
 							m.nodes.push_back(libtorrent::dht::node_entry(
 								id, read_v4_endpoint<udp::endpoint>(in)));
-						else if (p.size() == 18 + 20)
+						else if (len == 18 + 20)
 							m.nodes.push_back(libtorrent::dht::node_entry(
 								id, read_v6_endpoint<udp::endpoint>(in)));
 					}
@@ -492,31 +514,31 @@ namespace libtorrent { namespace dht
 #endif
 				}
 
-				entry const* token = r.find_key("token");
-				if (token) m.write_token = *token;
+				lazy_entry token = r.find_key("token");
+				if (token.type() != entry::undefined_t) m.write_token = token.to_entry();
 			}
-			else if (msg_type == "q")
+			else if (msg_type.string_equal("q"))
 			{
 				m.reply = false;
-				entry const& a = e["a"];
-				std::string const& id = a["id"].string();
-				if (id.size() != 20) throw std::runtime_error("invalid size of id");
-				std::copy(id.begin(), id.end(), m.id.begin());
+				lazy_entry a = e["a"];
+				lazy_entry id = a["id"];
+				if (id.string_length() != 20) throw std::runtime_error("invalid size of id");
+				std::copy(id.string_ptr(), id.string_ptr() + 20, m.id.begin());
 
-				std::string request_kind(e["q"].string());
+				lazy_entry request_kind = e["q"];
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
-				TORRENT_LOG(dht_tracker) << "   query: " << request_kind;
+				TORRENT_LOG(dht_tracker) << "   query: " << request_kind.string();
 #endif
 
-				if (request_kind == "ping")
+				if (request_kind.string_equal("ping"))
 				{
 					m.message_id = libtorrent::dht::messages::ping;
 				}
-				else if (request_kind == "find_node")
+				else if (request_kind.string_equal("find_node"))
 				{
-					std::string const& target = a["target"].string();
-					if (target.size() != 20) throw std::runtime_error("invalid size of target id");
-					std::copy(target.begin(), target.end(), m.info_hash.begin());
+					lazy_entry target = a["target"];
+					if (target.string_length() != 20) throw std::runtime_error("invalid size of target id");
+					std::copy(target.string_ptr(), target.string_ptr() + 20, m.info_hash.begin());
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 					TORRENT_LOG(dht_tracker) << "   target: "
 						<< boost::lexical_cast<std::string>(m.info_hash);
@@ -524,28 +546,28 @@ namespace libtorrent { namespace dht
 
 					m.message_id = libtorrent::dht::messages::find_node;
 				}
-				else if (request_kind == "get_peers")
+				else if (request_kind.string_equal("get_peers"))
 				{
-					std::string const& info_hash = a["info_hash"].string();
-					if (info_hash.size() != 20) throw std::runtime_error("invalid size of info-hash");
-					std::copy(info_hash.begin(), info_hash.end(), m.info_hash.begin());
+					lazy_entry info_hash = a["info_hash"];
+					if (info_hash.string_length() != 20) throw std::runtime_error("invalid size of info-hash");
+					std::copy(info_hash.string_ptr(), info_hash.string_ptr() + 20, m.info_hash.begin());
 					m.message_id = libtorrent::dht::messages::get_peers;
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 					TORRENT_LOG(dht_tracker) << "   info_hash: "
 						<< boost::lexical_cast<std::string>(m.info_hash);
 #endif
 				}
-				else if (request_kind == "announce_peer")
+				else if (request_kind.string_equal("announce_peer"))
 				{
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 					++m_announces;
 #endif
-					std::string const& info_hash = a["info_hash"].string();
-					if (info_hash.size() != 20)
+					lazy_entry info_hash = a["info_hash"];
+					if (info_hash.string_length() != 20)
 						throw std::runtime_error("invalid size of info-hash");
-					std::copy(info_hash.begin(), info_hash.end(), m.info_hash.begin());
+					std::copy(info_hash.string_ptr(), info_hash.string_ptr() + 20, m.info_hash.begin());
 					m.port = a["port"].integer();
-					m.write_token = a["token"];
+					m.write_token = a["token"].to_entry();
 					m.message_id = libtorrent::dht::messages::announce_peer;
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 					TORRENT_LOG(dht_tracker) << "   info_hash: "
@@ -560,17 +582,17 @@ namespace libtorrent { namespace dht
 				{
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 					TORRENT_LOG(dht_tracker) << "  *** UNSUPPORTED REQUEST *** : "
-						<< request_kind;
+						<< request_kind.string();
 #endif
-					throw std::runtime_error("unsupported request: " + request_kind);
+					throw std::runtime_error("unsupported request: " + request_kind.string());
 				}
 			}
-			else if (msg_type == "e")
+			else if (msg_type.string_equal("e"))
 			{
-				entry::list_type const& list = e["e"].list();
+				lazy_entry list = e["e"];
 				m.message_id = messages::error;
-				m.error_msg = list.back().string();
-				m.error_code = list.front().integer();
+				m.error_msg = list.list_at(list.list_size() - 1).string();
+				m.error_code = list.list_at(0).integer();
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 				TORRENT_LOG(dht_tracker) << "   error: " << m.error_code << " "
 					<< m.error_msg;
@@ -580,9 +602,9 @@ namespace libtorrent { namespace dht
 			{
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 				TORRENT_LOG(dht_tracker) << "  *** UNSUPPORTED MESSAGE TYPE *** : "
-					<< msg_type;
+					<< msg_type.string();
 #endif
-				throw std::runtime_error("unsupported message type: " + msg_type);
+				throw std::runtime_error("unsupported message type: " + msg_type.string());
 			}
 
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
@@ -686,31 +708,31 @@ namespace libtorrent { namespace dht
 
 	void dht_tracker::send_packet(msg const& m)
 	{
-		using libtorrent::bencode;
+		using libtorrent::bencode_writer;
 		using libtorrent::entry;
-		entry e(entry::dictionary_t);
-		e["t"] = m.transaction_id;
-		std::string version_str("LT  ");
-		std::string::iterator i = version_str.begin() + 2;
-		detail::write_uint8(LIBTORRENT_VERSION_MAJOR, i);
-		detail::write_uint8(LIBTORRENT_VERSION_MINOR, i);
-		e["v"] = version_str;
 
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 		TORRENT_LOG(dht_tracker) << microsec_clock::universal_time()
 			<< " SENDING [" << m.addr << "]:";
 		TORRENT_LOG(dht_tracker) << "   transaction: " << m.transaction_id;
-//		e.print(std::cerr);
 #endif
 
+		// the message is bencoded straight into the send buffer,
+		// the keys are written in sorted order
+		m_send_buf.clear();
+		bencode_writer w(m_send_buf);
+		w.begin_dict();
+
+		char const* msg_type;
 		if (m.message_id == messages::error)
 		{
 			assert(m.reply);
-			e["y"] = "e";
-			entry error_list(entry::list_t);
-			error_list.list().push_back(entry(m.error_code));
-			error_list.list().push_back(entry(m.error_msg));
-			e["e"] = error_list;
+			msg_type = "e";
+			w.key("e");
+			w.begin_list();
+			w.integer(m.error_code);
+			w.string(m.error_msg);
+			w.end();
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 		TORRENT_LOG(dht_tracker) << "   error: " << m.error_code << " "
 			<< m.error_msg;
@@ -718,116 +740,96 @@ namespace libtorrent { namespace dht
 		}
 		else if (m.reply)
 		{
-			e["y"] = "r";
-			e["r"] = entry(entry::dictionary_t);
-			entry& r = e["r"];
-			r["id"] = std::string(m.id.begin(), m.id.end());
+			msg_type = "r";
+			w.key("r");
+			w.begin_dict();
+			w.key("id");
+			w.string((char const*)m.id.begin(), node_id::size);
 
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 			TORRENT_LOG(dht_tracker) << "   reply: "
 				<< messages::ids[m.message_id];
 #endif
 
-			if (m.write_token.type() != entry::undefined_t)
-				r["token"] = m.write_token;
+			// find_node replies carry nodes, and so do get_peers
+			// replies when there are no peers to return
+			bool write_nodes = m.message_id == messages::find_node
+				|| (m.message_id == messages::get_peers && m.peers.empty());
 
-			switch (m.message_id)
+			if (write_nodes)
 			{
-				case messages::ping:
-					break;
-				case messages::find_node:
+				int num_v4 = 0;
+				for (msg::nodes_t::const_iterator i = m.nodes.begin()
+					, end(m.nodes.end()); i != end; ++i)
 				{
-					bool ipv6_nodes = false;
-					r["nodes"] = entry(entry::string_t);
-					entry& n = r["nodes"];
-					std::back_insert_iterator<std::string> out(n.string());
+					if (i->addr.address().is_v4()) ++num_v4;
+				}
+
+				w.key("nodes");
+				char* out = w.string_buffer(num_v4 * 26);
+				for (msg::nodes_t::const_iterator i = m.nodes.begin()
+					, end(m.nodes.end()); i != end; ++i)
+				{
+					if (!i->addr.address().is_v4()) continue;
+					out = std::copy(i->id.begin(), i->id.end(), out);
+					write_endpoint(i->addr, out);
+				}
+
+				if (m.message_id == messages::find_node
+					&& num_v4 < int(m.nodes.size()))
+				{
+					w.key("nodes2");
+					w.begin_list();
 					for (msg::nodes_t::const_iterator i = m.nodes.begin()
 						, end(m.nodes.end()); i != end; ++i)
 					{
-						if (!i->addr.address().is_v4())
-						{
-							ipv6_nodes = true;
-							continue;
-						}
-						std::copy(i->id.begin(), i->id.end(), out);
+						char node[20 + 18];
+						char* out = std::copy(i->id.begin(), i->id.end(), node);
 						write_endpoint(i->addr, out);
+						w.string(node, int(out - node));
 					}
-
-					if (ipv6_nodes)
-					{
-						r["nodes2"] = entry(entry::list_t);
-						entry& p = r["nodes2"];
-						std::string endpoint;
-						endpoint.resize(6);
-						for (msg::nodes_t::const_iterator i = m.nodes.begin()
-							, end(m.nodes.end()); i != end; ++i)
-						{
-							std::string::iterator out = endpoint.begin();
-							std::copy(i->id.begin(), i->id.end(), out);
-							write_endpoint(i->addr, out);
-							p.list().push_back(entry(endpoint));
-						}
-					}
-#ifdef TORRENT_DHT_VERBOSE_LOGGING
-					TORRENT_LOG(dht_tracker) << "   nodes: " << m.nodes.size();
-#endif
-					break;
+					w.end();
 				}
-				case messages::get_peers:
-				{
-					if (m.peers.empty())
-					{
-						r["nodes"] = entry(entry::string_t);
-						entry& n = r["nodes"];
-						std::back_insert_iterator<std::string> out(n.string());
-						for (msg::nodes_t::const_iterator i = m.nodes.begin()
-							, end(m.nodes.end()); i != end; ++i)
-						{
-							if (!i->addr.address().is_v4()) continue;
-							std::copy(i->id.begin(), i->id.end(), out);
-							write_endpoint(i->addr, out);
-						}
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
-						TORRENT_LOG(dht_tracker) << "   nodes: " << m.nodes.size();
+				TORRENT_LOG(dht_tracker) << "   nodes: " << m.nodes.size();
 #endif
-					}
-					else
-					{
-						r["values"] = entry(entry::list_t);
-						entry& p = r["values"];
-						std::string endpoint;
-						endpoint.resize(6);
-						for (msg::peers_t::const_iterator i = m.peers.begin()
-							, end(m.peers.end()); i != end; ++i)
-						{
-							std::string::iterator out = endpoint.begin();
-							write_endpoint(*i, out);
-							p.list().push_back(entry(endpoint));
-						}
+			}
+
+			if (m.write_token.type() != entry::undefined_t)
+			{
+				w.key("token");
+				w.value(m.write_token);
+			}
+
+			if (m.message_id == messages::get_peers && !m.peers.empty())
+			{
+				w.key("values");
+				w.begin_list();
+				for (msg::peers_t::const_iterator i = m.peers.begin()
+					, end(m.peers.end()); i != end; ++i)
+				{
+					char endpoint[18];
+					char* out = endpoint;
+					write_endpoint(*i, out);
+					w.string(endpoint, int(out - endpoint));
+				}
+				w.end();
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
-						TORRENT_LOG(dht_tracker) << "   peers: " << m.peers.size();
+				TORRENT_LOG(dht_tracker) << "   peers: " << m.peers.size();
 #endif
-					}
-					break;
-				}
-
-				case messages::announce_peer:
-					break;
-				break;
 			}
+
+			w.end();
 		}
 		else
 		{
-			e["y"] = "q";
-			e["a"] = entry(entry::dictionary_t);
-			entry& a = e["a"];
-			a["id"] = std::string(m.id.begin(), m.id.end());
+			msg_type = "q";
+			w.key("a");
+			w.begin_dict();
+			w.key("id");
+			w.string((char const*)m.id.begin(), node_id::size);
 
-			if (m.write_token.type() != entry::undefined_t)
-				a["token"] = m.write_token;
 			assert(m.message_id <= messages::error);
-			e["q"] = messages::ids[m.message_id];
-
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 			TORRENT_LOG(dht_tracker) << "   query: "
 				<< messages::ids[m.message_id];
@@ -837,7 +839,8 @@ namespace libtorrent { namespace dht
 			{
 				case messages::find_node:
 				{
-					a["target"] = std::string(m.info_hash.begin(), m.info_hash.end());
+					w.key("target");
+					w.string((char const*)m.info_hash.begin(), sha1_hash::size);
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 					TORRENT_LOG(dht_tracker) << "   target: "
 						<< boost::lexical_cast<std::string>(m.info_hash);
@@ -846,7 +849,8 @@ namespace libtorrent { namespace dht
 				}
 				case messages::get_peers:
 				{
-					a["info_hash"] = std::string(m.info_hash.begin(), m.info_hash.end());
+					w.key("info_hash");
+					w.string((char const*)m.info_hash.begin(), sha1_hash::size);
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 					TORRENT_LOG(dht_tracker) << "   info_hash: "
 						<< boost::lexical_cast<std::string>(m.info_hash);
@@ -854,9 +858,10 @@ namespace libtorrent { namespace dht
 					break;	
 				}
 				case messages::announce_peer:
-					a["port"] = m_settings.service_port;
-					a["info_hash"] = boost::lexical_cast<std::string>(m.info_hash);
-					a["token"] = m.write_token;
+					w.key("info_hash");
+					w.string(boost::lexical_cast<std::string>(m.info_hash));
+					w.key("port");
+					w.integer(m_settings.service_port);
 #ifdef TORRENT_DHT_VERBOSE_LOGGING
 					TORRENT_LOG(dht_tracker) << "   port: "
 						<< m_settings.service_port
@@ -866,10 +871,33 @@ namespace libtorrent { namespace dht
 				default: break;
 			}
 
+			if (m.write_token.type() != entry::undefined_t)
+			{
+				w.key("token");
+				w.value(m.write_token);
+			}
+			w.end();
+
+			w.key("q");
+			w.string(messages::ids[m.message_id]);
 		}
 
-		m_send_buf.clear();
-		bencode(std::back_inserter(m_send_buf), e);
+		w.key("t");
+		w.string(m.transaction_id);
+
+		char version[4] = { 'L', 'T', 0, 0 };
+		char* v = version + 2;
+		detail::write_uint8(LIBTORRENT_VERSION_MAJOR, v);
+		detail::write_uint8(LIBTORRENT_VERSION_MINOR, v);
+		w.key("v");
+		w.string(version, 4);
+
+		w.key("y");
+		w.string(msg_type);
+
+		w.end();
+		assert(w.done());
+
 		m_socket.send_to(asio::buffer(&m_send_buf[0]
 			, (int)m_send_buf.size()), m.addr);
 
@@ -885,6 +913,9 @@ namespace libtorrent { namespace dht
 		{
 			m_queries_out_bytes += m_send_buf.size();
 		}
+		libtorrent::lazy_entry e;
+		libtorrent::lazy_bdecode(&m_send_buf[0]
+			, &m_send_buf[0] + m_send_buf.size(), e);
 		TORRENT_LOG(dht_tracker) << e;
 #endif
 
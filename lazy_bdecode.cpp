@@ -0,0 +1,343 @@
+/*
+
+Copyright (c) 2007, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include <cstring>
+#include <cctype>
+#include <limits>
+
+#include "libtorrent/lazy_entry.hpp"
+#include "libtorrent/bencode.hpp"
+
+namespace
+{
+	using libtorrent::detail::lazy_token;
+
+	enum
+	{
+		// lists and dictionaries nested deeper than this are
+		// rejected. Nothing we parse comes close, and it keeps
+		// the stack of open containers off the heap
+		max_depth = 100
+	};
+
+	void push_token(std::vector<lazy_token>& tokens, int offset, int type)
+	{
+		lazy_token t;
+		t.offset = offset;
+		t.next = 1;
+		t.header = 0;
+		t.type = type;
+		tokens.push_back(t);
+	}
+}
+
+namespace libtorrent
+{
+
+	void lazy_bdecode(char const* start, char const* end, lazy_entry& ret)
+	{
+		std::vector<lazy_token>& tokens = ret.m_tokens;
+		tokens.clear();
+		ret.m_root = 0;
+		ret.m_buffer = start;
+		ret.m_token = 0;
+		ret.m_last_index = -1;
+		ret.m_last_token = -1;
+
+		// the tokens of the lists and dictionaries we're in
+		int stack[max_depth];
+		int depth = 0;
+
+		char const* in = start;
+		do
+		{
+			if (in == end) throw invalid_encoding();
+
+			if (*in == 'e' && depth > 0)
+			{
+				int c = stack[--depth];
+				// a key without a value
+				if (tokens[c].type == entry::dictionary_t && (tokens[c].header & 1))
+					throw invalid_encoding();
+				push_token(tokens, int(in - start), lazy_token::end_t);
+				tokens[c].next = int(tokens.size()) - c;
+				++in;
+				continue;
+			}
+
+			if (depth > 0)
+			{
+				lazy_token& c = tokens[stack[depth - 1]];
+				// dictionary keys have to be strings
+				if (c.type == entry::dictionary_t && (c.header & 1) == 0
+					&& !std::isdigit((unsigned char)*in))
+					throw invalid_encoding();
+				++c.header;
+			}
+
+			int offset = int(in - start);
+			switch (*in)
+			{
+			case 'i':
+				{
+					++in; // 'i'
+					if (in != end && *in == '-') ++in;
+					char const* digits = in;
+					// the value is checked here, so that integer()
+					// can parse it without overflowing
+					entry::integer_type val = 0;
+					while (in != end && std::isdigit((unsigned char)*in))
+					{
+						int digit = *in - '0';
+						if (val > (std::numeric_limits<entry::integer_type>::max()
+							- digit) / 10)
+							throw invalid_encoding();
+						val = val * 10 + digit;
+						++in;
+					}
+					if (in == digits || in == end || *in != 'e')
+						throw invalid_encoding();
+					++in; // 'e'
+					push_token(tokens, offset, entry::int_t);
+				}
+				break;
+			case 'l':
+			case 'd':
+				if (depth == max_depth) throw invalid_encoding();
+				stack[depth++] = int(tokens.size());
+				push_token(tokens, offset, *in == 'l'
+					? entry::list_t : entry::dictionary_t);
+				++in;
+				break;
+			default:
+				{
+					if (!std::isdigit((unsigned char)*in)) throw invalid_encoding();
+					int len = 0;
+					while (in != end && std::isdigit((unsigned char)*in))
+					{
+						if (len > (std::numeric_limits<int>::max() - 9) / 10)
+							throw invalid_encoding();
+						len = len * 10 + *in - '0';
+						++in;
+					}
+					if (in == end || *in != ':') throw invalid_encoding();
+					++in; // ':'
+					if (len > end - in) throw invalid_encoding();
+					push_token(tokens, offset, entry::string_t);
+					tokens.back().header = int(in - start) - offset;
+					in += len;
+				}
+			}
+		}
+		while (depth > 0);
+
+		// marks the end of the last item, string_length()
+		// relies on every string being followed by a token
+		push_token(tokens, int(in - start), lazy_token::end_t);
+
+		ret.m_root = &tokens;
+	}
+
+	lazy_entry::lazy_entry(lazy_entry const& e)
+		: m_root(e.m_root)
+		, m_buffer(e.m_buffer)
+		, m_token(e.m_token)
+		, m_last_index(-1)
+		, m_last_token(-1)
+	{
+		if (e.m_root == &e.m_tokens)
+		{
+			m_tokens = e.m_tokens;
+			m_root = &m_tokens;
+		}
+	}
+
+	lazy_entry& lazy_entry::operator=(lazy_entry const& e)
+	{
+		if (&e == this) return *this;
+		m_root = e.m_root;
+		m_buffer = e.m_buffer;
+		m_token = e.m_token;
+		m_last_index = -1;
+		m_last_token = -1;
+		if (e.m_root == &e.m_tokens)
+		{
+			m_tokens = e.m_tokens;
+			m_root = &m_tokens;
+		}
+		return *this;
+	}
+
+	entry::integer_type lazy_entry::integer() const
+	{
+		check_type(entry::int_t);
+		char const* in = m_buffer + token(m_token).offset + 1;
+		bool negative = false;
+		if (*in == '-')
+		{
+			negative = true;
+			++in;
+		}
+		entry::integer_type val = 0;
+		for (; *in != 'e'; ++in) val = val * 10 + (*in - '0');
+		return negative ? -val : val;
+	}
+
+	bool lazy_entry::string_equal(char const* str) const
+	{
+		int len = string_length();
+		return int(std::strlen(str)) == len
+			&& std::memcmp(string_ptr(), str, len) == 0;
+	}
+
+	int lazy_entry::child_token(int i) const
+	{
+		if (i < 0 || i >= token(m_token).header)
+			throw type_error("index out of range");
+
+		int index = 0;
+		int t = m_token + 1;
+		if (m_last_index >= 0 && m_last_index <= i)
+		{
+			index = m_last_index;
+			t = m_last_token;
+		}
+		for (; index < i; ++index) t += token(t).next;
+
+		m_last_index = index;
+		m_last_token = t;
+		return t;
+	}
+
+	lazy_entry lazy_entry::list_at(int i) const
+	{
+		check_type(entry::list_t);
+		return lazy_entry(m_root, m_buffer, child_token(i));
+	}
+
+	std::pair<lazy_entry, lazy_entry> lazy_entry::dict_at(int i) const
+	{
+		check_type(entry::dictionary_t);
+		int key = child_token(i * 2);
+		return std::make_pair(lazy_entry(m_root, m_buffer, key)
+			, lazy_entry(m_root, m_buffer, key + 1));
+	}
+
+	lazy_entry lazy_entry::find_key(char const* key, int len) const
+	{
+		check_type(entry::dictionary_t);
+		// keys are strings, which are a single token
+		for (int t = m_token + 1; token(t).type != detail::lazy_token::end_t;)
+		{
+			detail::lazy_token const& k = token(t);
+			int value = t + 1;
+			char const* str = m_buffer + k.offset + k.header;
+			if (token(value).offset - k.offset - k.header == len
+				&& std::memcmp(str, key, len) == 0)
+				return lazy_entry(m_root, m_buffer, value);
+			t = value + token(value).next;
+		}
+		return lazy_entry();
+	}
+
+	lazy_entry lazy_entry::lookup(char const* key, int len) const
+	{
+		lazy_entry ret = find_key(key, len);
+		if (ret.type() == entry::undefined_t) throw type_error(
+			(std::string("key not found: ") + std::string(key, len)).c_str());
+		return ret;
+	}
+
+	lazy_entry lazy_entry::find_key(char const* key) const
+	{
+		return find_key(key, int(std::strlen(key)));
+	}
+
+	lazy_entry lazy_entry::find_key(std::string const& key) const
+	{
+		return find_key(key.c_str(), int(key.size()));
+	}
+
+	lazy_entry lazy_entry::operator[](char const* key) const
+	{
+		return lookup(key, int(std::strlen(key)));
+	}
+
+	lazy_entry lazy_entry::operator[](std::string const& key) const
+	{
+		return lookup(key.c_str(), int(key.size()));
+	}
+
+	std::pair<char const*, int> lazy_entry::data_section() const
+	{
+		assert(m_root);
+		detail::lazy_token const& t = token(m_token);
+		int next = m_token + t.next;
+		return std::make_pair(m_buffer + t.offset
+			, token(next).offset - t.offset);
+	}
+
+	entry lazy_entry::to_entry() const
+	{
+		switch (type())
+		{
+		case entry::int_t:
+			return entry(integer());
+		case entry::string_t:
+			return entry(string());
+		case entry::list_t:
+			{
+				entry ret(entry::list_t);
+				entry::list_type& l = ret.list();
+				int size = list_size();
+				for (int i = 0; i < size; ++i)
+					l.push_back(list_at(i).to_entry());
+				return ret;
+			}
+		case entry::dictionary_t:
+			{
+				entry ret(entry::dictionary_t);
+				int size = dict_size();
+				for (int i = 0; i < size; ++i)
+				{
+					std::pair<lazy_entry, lazy_entry> item = dict_at(i);
+					ret[item.first.string()] = item.second.to_entry();
+				}
+				return ret;
+			}
+		default:
+			return entry();
+		}
+	}
+
+}
+
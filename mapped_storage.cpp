@@ -0,0 +1,443 @@
+/*
+
+Copyright (c) 2007, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef _WIN32
+#define _FILE_OFFSET_BITS 64
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+#include <list>
+#include <vector>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+
+#ifdef _MSC_VER
+#pragma warning(push, 1)
+#endif
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/filesystem/operations.hpp>
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+#include "libtorrent/storage.hpp"
+#include "libtorrent/torrent_info.hpp"
+#include "libtorrent/file.hpp"
+
+// writing through a shared mapping is only safe when the blocks
+// can be allocated up front, otherwise a full disk raises SIGBUS
+// when the dirty pages are written back
+#if defined __linux__ || defined __FreeBSD__ || defined __NetBSD__
+#define TORRENT_USE_MAPPED_STORAGE 1
+#endif
+
+#ifndef TORRENT_USE_MAPPED_STORAGE
+
+namespace libtorrent
+{
+	// there's no mmap() on windows, and no posix_fallocate()
+	// on some other systems, fall back to the regular storage
+	storage_interface* mapped_storage_constructor(torrent_info const& ti
+		, boost::filesystem::path const& path)
+	{
+		return default_storage_constructor(ti, path);
+	}
+}
+
+#else
+
+namespace fs = boost::filesystem;
+
+namespace
+{
+	using namespace libtorrent;
+
+	// the files are mapped in windows of this size, so that
+	// files of any size can be mapped without running out of
+	// address space. It has to be a multiple of the page size.
+	// Mapping is lazy, only the pages that are touched cost
+	// any memory, so on 64 bit systems the windows are large
+	// enough for most files to fit in one
+	enum { window_size = sizeof(void*) >= 8
+		? 128 * 1024 * 1024 : 4 * 1024 * 1024 };
+
+	// the max number of windows each storage keeps mapped,
+	// that's 8 GiB of address space per torrent on 64 bit
+	// systems and 64 MiB on 32 bit systems. Randomly accessing
+	// more than this will keep remapping windows, which is
+	// a lot slower than pread(). Each writable view also
+	// keeps its file open
+	enum { max_views = sizeof(void*) >= 8 ? 64 : 16 };
+
+	std::string error_message(char const* op, fs::path const& p)
+	{
+		std::stringstream msg;
+		msg << op << " failed: '" << p.native_file_string() << "'. "
+			<< strerror(errno);
+		return msg.str();
+	}
+
+	// returns 0 if the file doesn't exist
+	size_type file_size_on_disk(fs::path const& p)
+	{
+		struct stat s;
+		if (::stat(p.native_file_string().c_str(), &s) == 0)
+			return s.st_size;
+		if (errno == ENOENT) return 0;
+		throw file_error(error_message("stat", p));
+	}
+
+	// one mapped window of a file. Read-only views close the
+	// file once it's mapped, the mapping stays valid after
+	// that. Writable views keep it open to allocate blocks
+	struct mapped_view : boost::noncopyable
+	{
+		mapped_view(fs::path const& p, int file_index_, size_type offset_
+			, bool writable_)
+			: file_index(file_index_)
+			, offset(offset_)
+			, writable(writable_)
+			, sequential(false)
+			, m_addr(0)
+			, m_fd(-1)
+		{
+			assert(offset % window_size == 0);
+
+			int fd = ::open(p.native_file_string().c_str()
+				, writable ? O_RDWR | O_CREAT : O_RDONLY
+				, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+			if (fd == -1) throw file_error(error_message("open", p));
+
+			// the window may extend past the end of the file. That's
+			// fine as long as those pages aren't touched, mapped_storage
+			// makes sure the file is large enough before accessing them
+			void* addr = ::mmap(0, window_size
+				, writable ? PROT_READ | PROT_WRITE : PROT_READ
+				, MAP_SHARED, fd, offset);
+			if (addr == MAP_FAILED)
+			{
+				std::string msg = error_message("mmap", p);
+				::close(fd);
+				throw file_error(msg);
+			}
+			if (writable) m_fd = fd;
+			else ::close(fd);
+			m_addr = static_cast<char*>(addr);
+
+			// peers request pieces in random order, so don't
+			// let the kernel read ahead until the access
+			// pattern turns out to be sequential
+			::madvise(m_addr, window_size, MADV_RANDOM);
+		}
+
+		~mapped_view()
+		{
+			::munmap(m_addr, window_size);
+			if (m_fd != -1) ::close(m_fd);
+		}
+
+		// allocates the blocks backing the given range of the
+		// file, growing the file if the range extends past its
+		// end. Holes in sparse files are filled in as well, so
+		// that a full disk is reported here, and not as a SIGBUS
+		// when the pages are written back
+		void reserve(fs::path const& p, size_type file_offset, int size)
+		{
+			assert(writable);
+			assert(m_fd != -1);
+			// posix_fallocate() doesn't set errno, it
+			// returns the error code
+			int ret = ::posix_fallocate(m_fd, file_offset, size);
+			if (ret == 0) return;
+			errno = ret;
+			throw file_error(error_message("fallocate", p));
+		}
+
+		void advise(bool seq)
+		{
+			if (seq == sequential) return;
+			::madvise(m_addr, window_size, seq ? MADV_SEQUENTIAL : MADV_RANDOM);
+			sequential = seq;
+		}
+
+		char* data() const { return m_addr; }
+
+		int file_index;
+		size_type offset;
+		bool writable;
+		// true if the view has been advised as sequential,
+		// false if it has been advised as random access
+		bool sequential;
+
+	private:
+		char* m_addr;
+		// the file descriptor of writable views,
+		// -1 for read-only views
+		int m_fd;
+	};
+
+	class mapped_storage : public storage_interface, boost::noncopyable
+	{
+	public:
+		mapped_storage(torrent_info const& info, fs::path const& save_path)
+			: m_info(info)
+			, m_save_path(fs::complete(save_path))
+			, m_files(info.num_files())
+		{
+			assert(info.begin_files() != info.end_files());
+		}
+
+		size_type read(char* buf, int slot, int offset, int size)
+		{
+			assert(buf != 0);
+			return readwrite(slot, offset, size, buf, 0);
+		}
+
+		void write(const char* buf, int slot, int offset, int size)
+		{
+			assert(buf != 0);
+			readwrite(slot, offset, size, 0, buf);
+		}
+
+		bool move_storage(fs::path save_path)
+		{
+			release_files();
+			if (!move_torrent_files(m_info, m_save_path, save_path))
+				return false;
+			m_save_path = fs::complete(save_path);
+			return true;
+		}
+
+		void release_files()
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+			// views that are being copied from right now are
+			// unmapped once the copy is done
+			m_views.clear();
+			std::fill(m_files.begin(), m_files.end(), file_state());
+		}
+
+	private:
+
+		// reads into read_buf, or writes from write_buf,
+		// whichever isn't 0
+		size_type readwrite(int slot, int offset, int size
+			, char* read_buf, char const* write_buf);
+
+		// copies size bytes at offset in the given file
+		void copy(int file, size_type offset, int size
+			, char* read_buf, char const* write_buf);
+
+		// returns the view of the window containing offset,
+		// mapping it if it isn't already. m_mutex must be held
+		boost::shared_ptr<mapped_view> view(int file, fs::path const& p
+			, size_type offset, bool writable, bool sequential);
+
+		struct file_state
+		{
+			file_state(): size(-1), last_end(-1) {}
+			// the size of the file on disk, or -1 if
+			// it hasn't been looked at yet
+			size_type size;
+			// where the last access to the file ended, used
+			// to tell sequential access from random access
+			size_type last_end;
+		};
+
+		torrent_info const& m_info;
+		fs::path m_save_path;
+
+		// protects m_files and m_views
+		boost::mutex m_mutex;
+
+		// one entry per file in the torrent
+		std::vector<file_state> m_files;
+
+		// the mapped windows, the most recently used first
+		typedef std::list<boost::shared_ptr<mapped_view> > views_t;
+		views_t m_views;
+	};
+
+	size_type mapped_storage::readwrite(int slot, int offset, int size
+		, char* read_buf, char const* write_buf)
+	{
+		assert(slot >= 0 && slot < m_info.num_pieces());
+		assert(offset >= 0);
+		assert(offset < m_info.piece_size(slot));
+		assert(size > 0);
+		assert((read_buf == 0) != (write_buf == 0));
+
+		size_type start = slot * (size_type)m_info.piece_length() + offset;
+		assert(start + size <= m_info.total_size());
+
+		torrent_info::file_iterator file_iter = m_info.file_at_offset(start);
+		size_type file_offset = start - file_iter->offset;
+
+		int left = size;
+		int slot_size = static_cast<int>(m_info.piece_size(slot));
+		if (offset + left > slot_size)
+			left = slot_size - offset;
+		assert(left >= 0);
+
+		size_type result = left;
+		int buf_pos = 0;
+
+		while (left > 0)
+		{
+			assert(file_iter != m_info.end_files());
+
+			int bytes = left;
+			if (file_offset + bytes > file_iter->size)
+				bytes = static_cast<int>(file_iter->size - file_offset);
+
+			// empty files don't take up any space in the slot
+			if (bytes > 0)
+			{
+				copy(static_cast<int>(file_iter - m_info.begin_files())
+					, file_offset, bytes
+					, read_buf ? read_buf + buf_pos : 0
+					, write_buf ? write_buf + buf_pos : 0);
+				left -= bytes;
+				buf_pos += bytes;
+			}
+
+			++file_iter;
+			file_offset = 0;
+		}
+		return result;
+	}
+
+	void mapped_storage::copy(int file, size_type offset, int size
+		, char* read_buf, char const* write_buf)
+	{
+		const bool writing = write_buf != 0;
+		fs::path p = m_save_path / m_info.file_at(file).path;
+
+		while (size > 0)
+		{
+			boost::shared_ptr<mapped_view> v;
+			int n;
+			{
+				boost::mutex::scoped_lock l(m_mutex);
+				file_state& st = m_files[file];
+				if (st.size < 0) st.size = file_size_on_disk(p);
+
+				// touching the pages past the end of
+				// the file would raise SIGBUS
+				if (!writing && offset + size > st.size)
+					throw file_error("slot has no storage");
+
+				v = view(file, p, offset, writing, offset == st.last_end);
+				n = (std::min)(size, int(v->offset + window_size - offset));
+				st.last_end = offset + n;
+
+				if (writing)
+				{
+					// the range may be past the end of the file or
+					// in a hole of a sparse file, either way the
+					// blocks have to exist before the pages are dirtied
+					v->reserve(p, offset, n);
+					if (offset + n > st.size) st.size = offset + n;
+				}
+			}
+
+			// the copy is done without holding the mutex, the
+			// view stays mapped as long as we hold on to it
+			char* addr = v->data() + (offset - v->offset);
+			if (writing)
+			{
+				std::memcpy(addr, write_buf, n);
+				write_buf += n;
+			}
+			else
+			{
+				std::memcpy(read_buf, addr, n);
+				read_buf += n;
+			}
+			offset += n;
+			size -= n;
+		}
+	}
+
+	boost::shared_ptr<mapped_view> mapped_storage::view(int file
+		, fs::path const& p, size_type offset, bool writable, bool sequential)
+	{
+		size_type window = offset - offset % window_size;
+
+		for (views_t::iterator i = m_views.begin(); i != m_views.end(); ++i)
+		{
+			mapped_view& v = **i;
+			if (v.file_index != file || v.offset != window) continue;
+
+			if (writable && !v.writable)
+			{
+				// it was mapped read-only, map it again
+				// with write access
+				m_views.erase(i);
+				break;
+			}
+
+			v.advise(sequential);
+			m_views.splice(m_views.begin(), m_views, i);
+			return m_views.front();
+		}
+
+		boost::shared_ptr<mapped_view> v(new mapped_view(p, file, window, writable));
+		v->advise(sequential);
+		m_views.push_front(v);
+		if ((int)m_views.size() > max_views) m_views.pop_back();
+		return v;
+	}
+}
+
+namespace libtorrent
+{
+	storage_interface* mapped_storage_constructor(torrent_info const& ti
+		, fs::path const& path)
+	{
+		return new mapped_storage(ti, path);
+	}
+}
+
+#endif
+
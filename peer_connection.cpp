@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <iostream>
 #include <iomanip>
 #include <limits>
+#include <cstring>
 #include <boost/bind.hpp>
 
 #include "libtorrent/peer_connection.hpp"
@@ -54,6 +55,12 @@ using libtorrent::aux::session_impl;
 
 namespace libtorrent
 {
+	namespace
+	{
+		// the smallest receive buffer. It's large enough to
+		// read a full block along with the messages around it
+		enum { min_recv_buffer_size = 32 * 1024 };
+	}
 
 	void intrusive_ptr_add_ref(peer_connection const* c)
 	{
@@ -83,12 +90,14 @@ namespace libtorrent
 #endif
 		  m_ses(ses)
 		, m_max_out_request_queue(m_ses.settings().max_out_request_queue)
+		, m_reading_bytes(0)
 		, m_timeout(m_ses.settings().peer_timeout)
 		, m_last_piece(second_clock::universal_time())
 		, m_packet_size(0)
 		, m_recv_pos(0)
-		, m_current_send_buffer(0)
-		, m_write_pos(0)
+		, m_recv_start(0)
+		, m_recv_end(0)
+		, m_recv_buffer_size(0)
 		, m_last_receive(second_clock::universal_time())
 		, m_last_sent(second_clock::universal_time())
 		, m_socket(s)
@@ -115,6 +124,11 @@ namespace libtorrent
 		, m_last_write_size(0)
 		, m_reading(false)
 		, m_last_read_size(0)
+		, m_ul_quota_waiting(false)
+		, m_dl_quota_waiting(false)
+		, m_last_refill(microsec_clock::universal_time())
+		, m_ul_refill_carry(0)
+		, m_dl_refill_carry(0)
 		, m_refs(0)
 #ifndef NDEBUG
 		, m_in_constructor(true)
@@ -174,12 +188,14 @@ namespace libtorrent
 #endif
 		  m_ses(ses)
 		, m_max_out_request_queue(m_ses.settings().max_out_request_queue)
+		, m_reading_bytes(0)
 		, m_timeout(m_ses.settings().peer_timeout)
 		, m_last_piece(second_clock::universal_time())
 		, m_packet_size(0)
 		, m_recv_pos(0)
-		, m_current_send_buffer(0)
-		, m_write_pos(0)
+		, m_recv_start(0)
+		, m_recv_end(0)
+		, m_recv_buffer_size(0)
 		, m_last_receive(second_clock::universal_time())
 		, m_last_sent(second_clock::universal_time())
 		, m_socket(s)
@@ -204,6 +220,11 @@ namespace libtorrent
 		, m_last_write_size(0)
 		, m_reading(false)
 		, m_last_read_size(0)
+		, m_ul_quota_waiting(false)
+		, m_dl_quota_waiting(false)
+		, m_last_refill(microsec_clock::universal_time())
+		, m_ul_refill_carry(0)
+		, m_dl_refill_carry(0)
 		, m_refs(0)
 #ifndef NDEBUG
 		, m_in_constructor(true)
@@ -270,32 +291,29 @@ namespace libtorrent
 		// now that we have a piece_picker,
 		// update it with this peers pieces
 
-		// build a vector of all pieces
-		m_num_pieces = 0;
-		std::vector<int> piece_list;
+		m_num_pieces = std::count(m_have_piece.begin()
+			, m_have_piece.end(), true);
+
+		bool interesting = false;
 		for (int i = 0; i < (int)m_have_piece.size(); ++i)
 		{
-			if (m_have_piece[i])
+			if (m_have_piece[i]
+				&& !t->have_piece(i)
+				&& !t->picker().is_filtered(i))
 			{
-				++m_num_pieces;
-				piece_list.push_back(i);
+				interesting = true;
+				break;
 			}
 		}
 
 		// let the torrent know which pieces the
-		// peer has, in a shuffled order
-		bool interesting = false;
-		for (std::vector<int>::reverse_iterator i = piece_list.rbegin();
-			i != piece_list.rend(); ++i)
-		{
-			int index = *i;
-			t->peer_has(index);
-			if (!t->have_piece(index)
-				&& !t->picker().is_filtered(index))
-				interesting = true;
-		}
+		// peer has, all in one go
+		if (m_num_pieces == (int)m_have_piece.size())
+			t->peer_has_all();
+		else
+			t->peer_has(m_have_piece);
 
-		if (piece_list.size() == m_have_piece.size())
+		if (m_num_pieces == (int)m_have_piece.size())
 		{
 #ifdef TORRENT_VERBOSE_LOGGING
 			(*m_logger) << " *** THIS IS A SEED ***\n";
@@ -419,14 +437,35 @@ namespace libtorrent
 
 	void peer_connection::reset_upload_quota()
 	{
-		m_ul_bandwidth_quota.used = 0;
-		m_dl_bandwidth_quota.used = 0;
+		// the new quota is handed out a slice at a time
+		// by the bandwidth manager
+		bandwidth_manager::reset(m_ul_bandwidth_quota, m_ul_refill_carry);
+		bandwidth_manager::reset(m_dl_bandwidth_quota, m_dl_refill_carry);
+		m_last_refill = microsec_clock::universal_time();
 		assert(m_ul_bandwidth_quota.left() >= 0);
 		assert(m_dl_bandwidth_quota.left() >= 0);
 		setup_send();
 		setup_receive();
 	}
 
+	void peer_connection::on_bandwidth(bandwidth_manager::channel_t channel)
+	{
+		if (channel == bandwidth_manager::upload_channel)
+		{
+			assert(m_ul_quota_waiting);
+			m_ul_quota_waiting = false;
+			if (m_disconnecting) return;
+			setup_send();
+		}
+		else
+		{
+			assert(m_dl_quota_waiting);
+			m_dl_quota_waiting = false;
+			if (m_disconnecting) return;
+			setup_receive();
+		}
+	}
+
 	// verifies a piece to see if it is valid (is within a valid range)
 	// and if it can correspond to a request generated by libtorrent.
 	bool peer_connection::verify_piece(const peer_request& p) const
@@ -722,8 +761,11 @@ namespace libtorrent
 			return;
 		}
 
-		// build a vector of all pieces
-		std::vector<int> piece_list;
+		// build a mask of the pieces the peer
+		// didn't have before
+		std::vector<bool> new_pieces(m_have_piece.size(), false);
+		int num_new_pieces = 0;
+		bool interesting = false;
 		for (int i = 0; i < (int)m_have_piece.size(); ++i)
 		{
 			bool have = bitfield[i];
@@ -731,7 +773,12 @@ namespace libtorrent
 			{
 				m_have_piece[i] = true;
 				++m_num_pieces;
-				piece_list.push_back(i);
+				new_pieces[i] = true;
+				++num_new_pieces;
+				if (!interesting
+					&& !t->have_piece(i)
+					&& !t->picker().is_filtered(i))
+					interesting = true;
 			}
 			else if (!have && m_have_piece[i])
 			{
@@ -743,19 +790,13 @@ namespace libtorrent
 		}
 
 		// let the torrent know which pieces the
-		// peer has, in a shuffled order
-		bool interesting = false;
-		for (std::vector<int>::reverse_iterator i = piece_list.rbegin();
-			i != piece_list.rend(); ++i)
-		{
-			int index = *i;
-			t->peer_has(index);
-			if (!t->have_piece(index)
-				&& !t->picker().is_filtered(index))
-				interesting = true;
-		}
+		// peer has, all in one go
+		if (num_new_pieces == (int)m_have_piece.size())
+			t->peer_has_all();
+		else if (num_new_pieces > 0)
+			t->peer_has(new_pieces);
 
-		if (piece_list.size() == m_have_piece.size())
+		if (num_new_pieces == (int)m_have_piece.size())
 		{
 #ifdef TORRENT_VERBOSE_LOGGING
 			(*m_logger) << " *** THIS IS A SEED ***\n";
@@ -991,51 +1032,25 @@ namespace libtorrent
 			return;
 		}
 
-		t->filesystem().write(data, p.piece, p.start, p.length);
+		// blocks that are still in the receive buffer are
+		// handed to the disk thread without copying them. The
+		// receive buffer is replaced rather than overwritten
+		// while the write is pending
+		if (data >= m_recv_buffer.get()
+			&& data + p.length <= m_recv_buffer.get() + m_recv_buffer_size)
+			t->async_write(p, m_recv_buffer, int(data - m_recv_buffer.get()));
+		else
+			t->async_write(p, data);
 
-		bool was_seed = t->is_seed();
-		bool was_finished = picker.num_filtered() + t->num_pieces()
-			== t->torrent_file().num_pieces();
-		
 		picker.mark_as_finished(block_finished, m_remote);
 
 		t->get_policy().block_finished(*this, block_finished);
 
-		// if the piece failed, this connection may be closed, and
-		// detached from the torrent. In that case m_torrent will
-		// be set to 0. So, we need to temporarily save it in this function
-
-		// did we just finish the piece?
+		// did we just finish the piece? The hash check is queued
+		// after the write of the block, and the torrent takes
+		// it from there
 		if (picker.is_piece_finished(p.piece))
-		{
-			bool verified = t->verify_piece(p.piece);
-			if (verified)
-			{
-				t->announce_piece(p.piece);
-				assert(t->valid_metadata());
-				if (!was_finished
-					&& picker.num_filtered() + t->num_pieces()
-						== t->torrent_file().num_pieces())  
-				{
-					// torrent finished
-					// i.e. all the pieces we're interested in have
-					// been downloaded. Release the files (they will open
-					// in read only mode if needed)
-					t->finished();
-				}
-			}
-			else
-			{
-				t->piece_failed(p.piece);
-			}
-			t->get_policy().piece_finished(p.piece, verified);
-
-			if (!was_seed && t->is_seed())
-			{
-				assert(verified);
-				t->completed();
-			}
-		}
+			t->async_verify_piece(p.piece);
 	}
 
 	// -----------------------------
@@ -1059,6 +1074,13 @@ namespace libtorrent
 		{
 			m_requests.erase(i);
 		}
+		else if ((i = std::find(m_reading_requests.begin()
+			, m_reading_requests.end(), r)) != m_reading_requests.end())
+		{
+			// the block is being read from disk, it
+			// will be dropped once the read completes
+			m_reading_requests.erase(i);
+		}
 		else
 		{
 #ifdef TORRENT_VERBOSE_LOGGING
@@ -1183,6 +1205,7 @@ namespace libtorrent
 #endif
 		m_num_invalid_requests = 0;
 		m_requests.clear();
+		m_reading_requests.clear();
 	}
 
 	void peer_connection::send_unchoke()
@@ -1303,7 +1326,9 @@ namespace libtorrent
 
 		if (m_disconnecting) return;
 		m_disconnecting = true;
-		m_ses.m_selector.post(boost::bind(&close_socket_ignore_error, m_socket));
+		// the socket may live on one of the peer demuxers, close
+		// it in the thread that runs it
+		m_socket->io_service().post(boost::bind(&close_socket_ignore_error, m_socket));
 
 		boost::shared_ptr<torrent> t = m_torrent.lock();
 
@@ -1379,19 +1404,15 @@ namespace libtorrent
 	{
 		INVARIANT_CHECK;
 
-		assert((int)m_recv_buffer.size() >= size);
-
-		std::copy(m_recv_buffer.begin() + size, m_recv_buffer.begin() + m_recv_pos, m_recv_buffer.begin());
-
+		assert(size >= 0);
 		assert(m_recv_pos >= size);
-		m_recv_pos -= size;
-
-#ifndef NDEBUG
-		std::fill(m_recv_buffer.begin() + m_recv_pos, m_recv_buffer.end(), 0);
-#endif
+		assert(packet_size > 0);
 
+		// the data stays where it is, the current packet
+		// just starts further into the buffer
+		m_recv_start += size;
+		m_recv_pos -= size;
 		m_packet_size = packet_size;
-		m_recv_buffer.resize(m_packet_size);
 	}
 
 	void peer_connection::second_tick(float tick_interval)
@@ -1470,6 +1491,11 @@ namespace libtorrent
 		m_ul_bandwidth_quota.used = std::min(
 			(int)ceil(statistics().upload_rate())
 			, m_ul_bandwidth_quota.given);
+		// the quota is refilled continuously, so what's left of
+		// it doesn't say how much was used. Use the rate instead
+		m_dl_bandwidth_quota.used = std::min(
+			(int)ceil(statistics().download_rate())
+			, m_dl_bandwidth_quota.given);
 
 		// If the client sends more data
 		// we send it data faster, otherwise, slower.
@@ -1570,7 +1596,7 @@ namespace libtorrent
 		// otherwise there will be no end to how large it will be!
 		// TODO: the buffer size should probably be dependent on the transfer speed
 		while (!m_requests.empty()
-			&& (send_buffer_size() < t->block_size() * 6)
+			&& (send_buffer_size() + m_reading_bytes < t->block_size() * 6)
 			&& !m_choked)
 		{
 			assert(t->valid_metadata());
@@ -1608,6 +1634,17 @@ namespace libtorrent
 		}
 	}
 
+	void peer_connection::refill_quota()
+	{
+		ptime now(microsec_clock::universal_time());
+		size_type interval = (now - m_last_refill).total_microseconds();
+		// the clock may have been set back
+		if (interval <= 0) return;
+		m_last_refill = now;
+		bandwidth_manager::refill(m_ul_bandwidth_quota, m_ul_refill_carry, interval);
+		bandwidth_manager::refill(m_dl_bandwidth_quota, m_dl_refill_carry, interval);
+	}
+
 	void peer_connection::setup_send()
 	{
 		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
@@ -1615,31 +1652,40 @@ namespace libtorrent
 		INVARIANT_CHECK;
 
 		if (m_writing) return;
-		if (!can_write()) return;
 
-		assert(!m_writing);
+		refill_quota();
 
-		int sending_buffer = (m_current_send_buffer + 1) & 1;
-		if (m_send_buffer[sending_buffer].empty())
+		if (!m_send_buffer.empty()
+			&& m_ul_bandwidth_quota.left() <= 0
+			&& !m_connecting)
 		{
-			// thise means we have to swap buffer, because there's no
-			// previous buffer we're still waiting for.
-			std::swap(m_current_send_buffer, sending_buffer);
-			m_write_pos = 0;
+			// we'll be woken up when the bandwidth
+			// manager refills our quota
+			if (!m_ul_quota_waiting)
+			{
+				m_ul_quota_waiting = true;
+				m_ses.m_bandwidth_manager.wait_for_quota(self()
+					, bandwidth_manager::upload_channel);
+			}
+			return;
 		}
 
+		if (!can_write()) return;
+
+		assert(!m_writing);
+
 		// send the actual buffer
-		if (!m_send_buffer[sending_buffer].empty())
+		if (!m_send_buffer.empty())
 		{
 			int amount_to_send
 				= std::min(m_ul_bandwidth_quota.left()
-				, (int)m_send_buffer[sending_buffer].size() - m_write_pos);
+				, m_send_buffer.size());
 
 			assert(amount_to_send > 0);
 
-			assert(m_write_pos < (int)m_send_buffer[sending_buffer].size());
-			m_socket->async_write_some(asio::buffer(
-				&m_send_buffer[sending_buffer][m_write_pos], amount_to_send)
+			// all the queued chunks are sent with a single
+			// scatter/gather write
+			m_socket->async_write_some(m_send_buffer.build_iovec(amount_to_send)
 				, bind(&peer_connection::on_send_data, self(), _1, _2));
 
 			m_writing = true;
@@ -1655,12 +1701,31 @@ namespace libtorrent
 		INVARIANT_CHECK;
 
 		if (m_reading) return;
+
+		refill_quota();
+
+		if (m_dl_bandwidth_quota.left() <= 0 && !m_connecting)
+		{
+			if (!m_dl_quota_waiting)
+			{
+				m_dl_quota_waiting = true;
+				m_ses.m_bandwidth_manager.wait_for_quota(self()
+					, bandwidth_manager::download_channel);
+			}
+			return;
+		}
+
 		if (!can_read()) return;
 
 		assert(m_packet_size > 0);
+		prepare_recv_buffer();
+
+		// read as much as fits in the buffer, not just the
+		// rest of the current packet. The messages that come
+		// along are parsed in place by on_receive_data()
 		int max_receive = std::min(
 			m_dl_bandwidth_quota.left()
-			, m_packet_size - m_recv_pos);
+			, m_recv_buffer_size - m_recv_end);
 
 		assert(m_recv_pos >= 0);
 		assert(m_packet_size > 0);
@@ -1668,7 +1733,7 @@ namespace libtorrent
 		assert(max_receive > 0);
 
 		assert(can_read());
-		m_socket->async_read_some(asio::buffer(&m_recv_buffer[m_recv_pos]
+		m_socket->async_read_some(asio::buffer(m_recv_buffer.get() + m_recv_end
 			, max_receive), bind(&peer_connection::on_receive_data, self(), _1, _2));
 		m_reading = true;
 		m_last_read_size = max_receive;
@@ -1679,40 +1744,75 @@ namespace libtorrent
 	void peer_connection::reset_recv_buffer(int packet_size)
 	{
 		assert(packet_size > 0);
+		// the current packet has been consumed, anything
+		// that was read past it belongs to the next one
+		m_recv_start += m_recv_pos;
 		m_recv_pos = 0;
 		m_packet_size = packet_size;
-		if (int(m_recv_buffer.size()) < m_packet_size)
-			m_recv_buffer.resize(m_packet_size);
+	}
+
+	void peer_connection::prepare_recv_buffer()
+	{
+		assert(!m_reading);
+		assert(m_recv_start + m_recv_pos <= m_recv_end);
+
+		int tail = m_recv_end - m_recv_start;
+		int needed = (std::max)(m_packet_size, tail);
+		// if a piece in the buffer is still waiting to be
+		// written to disk, the buffer must not be written
+		// over. It's fine to read into its free space though
+		bool shared = m_recv_buffer && !m_recv_buffer.unique();
+
+		if (tail == 0 && !shared && needed <= m_recv_buffer_size)
+		{
+			m_recv_start = 0;
+			m_recv_end = 0;
+			return;
+		}
+
+		// the rest of the current packet fits
+		if (m_recv_start + needed <= m_recv_buffer_size) return;
+
+		// move the partial packet to the front of the buffer.
+		// This is done once per buffer full, not per message
+		if (shared || needed > m_recv_buffer_size)
+		{
+			int size = (std::max)(needed, int(min_recv_buffer_size));
+			boost::shared_array<char> buf(new char[size]);
+			if (tail > 0)
+				std::memcpy(buf.get(), m_recv_buffer.get() + m_recv_start, tail);
+			m_recv_buffer.swap(buf);
+			m_recv_buffer_size = size;
+		}
+		else if (tail > 0)
+		{
+			std::memmove(m_recv_buffer.get()
+				, m_recv_buffer.get() + m_recv_start, tail);
+		}
+		m_recv_start = 0;
+		m_recv_end = tail;
 	}
 	
 	void peer_connection::send_buffer(char const* begin, char const* end)
 	{
-		std::vector<char>& buf = m_send_buffer[m_current_send_buffer];
-		buf.insert(buf.end(), begin, end);
+		m_send_buffer.append(begin, end);
 		setup_send();
 	}
 
+	void peer_connection::append_send_buffer(boost::shared_array<char> const& buf
+		, char* start, int size)
+	{
+		m_send_buffer.append_buffer(buf, start, size);
+	}
+
 // TODO: change this interface to automatically call setup_send() when the
 // return value is destructed
 	buffer::interval peer_connection::allocate_send_buffer(int size)
 	{
-		std::vector<char>& buf = m_send_buffer[m_current_send_buffer];
-		buf.resize(buf.size() + size);
-		buffer::interval ret(&buf[0] + buf.size() - size, &buf[0] + buf.size());
-		return ret;
+		char* p = m_send_buffer.allocate_appendix(size);
+		return buffer::interval(p, p + size);
 	}
 
-	template<class T>
-	struct set_to_zero
-	{
-		set_to_zero(T& v, bool cond): m_val(v), m_cond(cond) {}
-		void fire() { if (!m_cond) return; m_cond = false; m_val = 0; }
-		~set_to_zero() { if (m_cond) m_val = 0; }
-	private:
-		T& m_val;
-		bool m_cond;
-	};
-
 
 	// --------------------------
 	// RECEIVE DATA
@@ -1749,25 +1849,32 @@ namespace libtorrent
 		assert(bytes_transferred > 0);
 
 		m_last_receive = second_clock::universal_time();
-		m_recv_pos += bytes_transferred;
-
-		// this will reset the m_recv_pos to 0 if the
-		// entire packet was received
-		// it is important that this is done before
-		// setup_receive() is called. Therefore, fire() is
-		// called before setup_receive().
-		assert(m_recv_pos <= m_packet_size);
-		set_to_zero<int> reset(m_recv_pos, m_recv_pos == m_packet_size);
-		
+		m_recv_end += bytes_transferred;
+		assert(m_recv_end <= m_recv_buffer_size);
+
+		// the read may contain any number of messages. They
+		// are handed to on_receive() one packet at a time,
+		// in place in the receive buffer
+		for (;;)
 		{
-			INVARIANT_CHECK;
-			on_receive(error, bytes_transferred);
-		}
+			int received = std::min(m_recv_end - m_recv_start
+				, m_packet_size) - m_recv_pos;
+			if (received <= 0) break;
+			m_recv_pos += received;
 
-		assert(m_packet_size > 0);
+			{
+				INVARIANT_CHECK;
+				on_receive(error, received);
+			}
 
-		// do the reset immediately
-		reset.fire();
+			if (m_disconnecting) return;
+			assert(m_packet_size > 0);
+
+			// a finished packet that wasn't consumed is thrown
+			// away, and the next one has the same size
+			if (m_recv_pos == m_packet_size)
+				reset_recv_buffer(m_packet_size);
+		}
 
 		setup_receive();	
 	}
@@ -1809,8 +1916,7 @@ namespace libtorrent
 
 		// if we have requests or pending data to be sent or announcements to be made
 		// we want to send data
-		return (!m_send_buffer[m_current_send_buffer].empty()
-			|| !m_send_buffer[(m_current_send_buffer + 1) & 1].empty())
+		return !m_send_buffer.empty()
 			&& m_ul_bandwidth_quota.left() > 0
 			&& !m_connecting;
 	}
@@ -1907,7 +2013,6 @@ namespace libtorrent
 		// correct the ul quota usage, if not all of the buffer was sent
 		m_ul_bandwidth_quota.used -= m_last_write_size - bytes_transferred;
 		m_last_write_size = 0;
-		m_write_pos += bytes_transferred;
 
 		if (error)
 		{
@@ -1921,14 +2026,7 @@ namespace libtorrent
 		assert(!m_connecting);
 		assert(bytes_transferred > 0);
 
-		int sending_buffer = (m_current_send_buffer + 1) & 1;
-
-		assert(int(m_send_buffer[sending_buffer].size()) >= m_write_pos);
-		if (int(m_send_buffer[sending_buffer].size()) == m_write_pos)
-		{
-			m_send_buffer[sending_buffer].clear();
-			m_write_pos = 0;
-		}
+		m_send_buffer.pop_front(bytes_transferred);
 
 		m_last_sent = second_clock::universal_time();
 
@@ -1966,6 +2064,9 @@ namespace libtorrent
 			return;
 		}
 
+		assert(m_recv_start + m_recv_pos <= m_recv_end);
+		assert(m_recv_end <= m_recv_buffer_size);
+
 		if (!m_in_constructor && t->connection_for(remote()) != this)
 		{
 			assert(false);
@@ -1980,9 +2081,6 @@ namespace libtorrent
 				assert(false);
 			}
 		}
-		
-		assert(m_write_pos <= int(m_send_buffer[
-			(m_current_send_buffer + 1) & 1].size()));
 	}
 #endif
 
@@ -2039,6 +2137,43 @@ namespace libtorrent
 		write_keepalive();
 	}
 
+	int peer_connection::seconds_to_next_timeout() const
+	{
+		INVARIANT_CHECK;
+
+		using namespace boost::posix_time;
+
+		// the timeouts don't apply while connecting,
+		// look again in a second
+		if (m_connecting) return 1;
+
+		ptime now(second_clock::universal_time());
+
+		// the peer times out when it hasn't sent anything
+		// for m_timeout seconds, and we send a keep-alive
+		// when we haven't sent anything for half of that
+		time_duration d = m_last_receive + seconds(m_timeout) - now;
+		time_duration keep_alive = m_last_sent + seconds(m_timeout / 2) - now;
+		if (keep_alive < d) d = keep_alive;
+
+		if (!m_interesting && !m_peer_interested)
+		{
+			time_duration uninterested = std::max(m_became_uninterested
+				, m_became_uninteresting) + minutes(10) - now;
+			if (uninterested < d) d = uninterested;
+		}
+
+		// has_timed_out() only triggers once the time has
+		// passed, hence the extra second. Losing interest or
+		// a shorter timeout may bring the timeout closer
+		// without the session being told, so never wait for
+		// more than a minute
+		int ret = d.total_seconds() + 1;
+		if (ret < 1) ret = 1;
+		if (ret > 60) ret = 60;
+		return ret;
+	}
+
 	bool peer_connection::is_seed() const
 	{
 		INVARIANT_CHECK;
@@ -53,8 +53,7 @@ namespace libtorrent
 {
 
 	piece_picker::piece_picker(int blocks_per_piece, int total_num_blocks)
-		: m_piece_info(2)
-		, m_downloading_piece_info(2)
+		: m_dirty(false)
 		, m_piece_map((total_num_blocks + blocks_per_piece-1) / blocks_per_piece)
 		, m_num_filtered(0)
 		, m_num_have_filtered(0)
@@ -63,7 +62,7 @@ namespace libtorrent
 		assert(blocks_per_piece > 0);
 		assert(total_num_blocks >= 0);
 
-		// the piece index is stored in 20 bits, which limits the allowed
+		// the piece index is stored in 18 bits, which limits the allowed
 		// number of pieces somewhat
 		if (m_piece_map.size() >= piece_pos::we_have_index)
 			throw std::runtime_error("too many pieces in torrent");
@@ -85,49 +84,36 @@ namespace libtorrent
 	// pieces is a bitmask with the pieces we have
 	void piece_picker::files_checked(
 		const std::vector<bool>& pieces
-		, const std::vector<downloading_piece>& unfinished)
+		, const std::vector<unfinished_piece>& unfinished)
 	{
-		// build a vector of all the pieces we don't have
-		std::vector<int> piece_list;
-		piece_list.reserve(std::count(pieces.begin(), pieces.end(), false));
-
 		for (std::vector<bool>::const_iterator i = pieces.begin();
 			i != pieces.end(); ++i)
 		{
 			if (*i) continue;
 			int index = static_cast<int>(i - pieces.begin());
-			if (m_piece_map[index].filtered)
+			piece_pos& p = m_piece_map[index];
+			assert(p.have());
+			assert(p.peer_count == 0);
+			if (p.filtered())
 			{
 				++m_num_filtered;
 				--m_num_have_filtered;
-				m_piece_map[index].index = 0;
-			}
-			else
-			{
-				piece_list.push_back(index);
 			}
+			// clear the we_have_index to mark that we don't
+			// have the piece, rebuild_buckets() will set the
+			// real index
+			p.index = 0;
 		}
 
-		// add the pieces to the piece_picker
-		for (std::vector<int>::reverse_iterator i = piece_list.rbegin();
-			i != piece_list.rend(); ++i)
-		{
-			int index = *i;
-			assert(index >= 0);
-			assert(index < (int)m_piece_map.size());
-			assert(m_piece_map[index].index == piece_pos::we_have_index);
-			assert(m_piece_map[index].peer_count == 0);
-			assert(m_piece_info.size() == 2);
-
-			add(index);
-			assert(m_piece_map[index].index != piece_pos::we_have_index);
-		}
+		// add all the pieces we don't have to the buckets
+		// in one pass
+		rebuild_buckets();
 
 		// if we have fast resume info
 		// use it
 		if (!unfinished.empty())
 		{
-			for (std::vector<downloading_piece>::const_iterator i
+			for (std::vector<unfinished_piece>::const_iterator i
 				= unfinished.begin(); i != unfinished.end(); ++i)
 			{
 				tcp::endpoint peer;
@@ -145,58 +131,21 @@ namespace libtorrent
 	{
 		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
 
+		// the availability can never exceed what fits in
+		// piece_pos::peer_count, so there's no point in a
+		// higher threshold
+		if (sequenced_download_threshold < 1)
+			sequenced_download_threshold = 1;
+		if (sequenced_download_threshold > piece_pos::max_peer_count + 1)
+			sequenced_download_threshold = piece_pos::max_peer_count + 1;
+
 		if (sequenced_download_threshold == m_sequenced_download_threshold)
 			return;
-			
-		int old_limit = m_sequenced_download_threshold;
-		m_sequenced_download_threshold = sequenced_download_threshold;
 
-		for (std::vector<piece_pos>::iterator i = m_piece_map.begin()
-			, end(m_piece_map.end()); i != end; ++i)
-		{
-			if (i->priority(old_limit) != i->priority(m_sequenced_download_threshold))
-			{
-				piece_pos& p = *i;
-				if (p.index == piece_pos::we_have_index) continue;
-				int prev_priority = p.priority(old_limit);
-				move(p.downloading, p.filtered, prev_priority, p.index);
-			}
-		}
-		
-		typedef std::vector<int> info_t;
-
-		if (old_limit < sequenced_download_threshold)
-		{
-			// the threshold was incremented, in case
-			// the previous max availability was reached
-			// we need to shuffle that bucket, if not, we
-			// don't have to do anything
-			if (int(m_piece_info.size()) > old_limit)
-			{
-				info_t& in = m_piece_info[old_limit];
-				std::random_shuffle(in.begin(), in.end());
-				int c = 0;
-				for (info_t::iterator i = in.begin()
-					, end(in.end()); i != end; ++i)
-				{
-					m_piece_map[*i].index = c++;
-					assert(m_piece_map[*i].priority(old_limit) == old_limit);
-				}
-			}
-		}
-		else if (int(m_piece_info.size()) > sequenced_download_threshold)
-		{
-			info_t& in = m_piece_info[sequenced_download_threshold];
-			std::sort(in.begin(), in.end());
-			int c = 0;
-			for (info_t::iterator i = in.begin()
-				, end(in.end()); i != end; ++i)
-			{
-				m_piece_map[*i].index = c++;
-				assert(m_piece_map[*i].priority(
-					sequenced_download_threshold) == sequenced_download_threshold);
-			}
-		}
+		// the threshold is part of the bucket layout, so every
+		// piece may end up in a different bucket
+		m_sequenced_download_threshold = sequenced_download_threshold;
+		rebuild_buckets();
 	}
 
 #ifndef NDEBUG
@@ -208,15 +157,35 @@ namespace libtorrent
 		if (t != 0)
 			assert((int)m_piece_map.size() == t->torrent_file().num_pieces());
 
+		assert(m_priority_boundaries.empty()
+			|| m_priority_boundaries.back() == (int)m_pieces.size());
+		assert(!m_priority_boundaries.empty() || m_pieces.empty());
+
+		for (int b = 0; !m_dirty && b < (int)m_priority_boundaries.size(); ++b)
+		{
+			int begin = bucket_begin(b);
+			int end = m_priority_boundaries[b];
+			assert(begin <= end);
+			for (int i = begin; i < end; ++i)
+			{
+				piece_pos const& p = m_piece_map[m_pieces[i]];
+				assert(p.priority(m_sequenced_download_threshold) == b);
+				assert((int)p.index == i);
+				if (i > begin && is_ordered(b))
+					assert(m_pieces[i - 1] < m_pieces[i]);
+			}
+		}
+
 		int num_filtered = 0;
 		int num_have_filtered = 0;
+		int num_pickable = 0;
 		for (std::vector<piece_pos>::const_iterator i = m_piece_map.begin();
 			i != m_piece_map.end(); ++i)
 		{
 			int index = static_cast<int>(i - m_piece_map.begin());
-			if (i->filtered)
+			if (i->filtered())
 			{
-				if (i->index != piece_pos::we_have_index)
+				if (!i->have())
 					++num_filtered;
 				else
 					++num_have_filtered;
@@ -230,72 +199,29 @@ namespace libtorrent
 					if (peer->second->has_piece(index)) actual_peer_count++;
 				}
 
-				assert((int)i->peer_count == actual_peer_count);
-/*
-				int num_downloaders = 0;
-				for (std::vector<peer_connection*>::const_iterator peer = t->begin();
-					peer != t->end();
-					++peer)
-				{
-					const std::vector<piece_block>& queue = (*peer)->download_queue();
-					if (std::find_if(queue.begin(), queue.end(), has_index(index)) == queue.end()) continue;
-
-					++num_downloaders;
-				}
-
-				if (i->downloading)
-				{
-					assert(num_downloaders == 1);
-				}
-				else
-				{
-					assert(num_downloaders == 0);
-				}
-*/
+				std::map<int, int>::const_iterator o
+					= m_peer_count_overflow.find(index);
+				int overflow = o == m_peer_count_overflow.end() ? 0 : o->second;
+				assert(overflow == 0 || i->peer_count == piece_pos::max_peer_count);
+				assert((int)i->peer_count + overflow == actual_peer_count);
 			}
 
-			if (i->index == piece_pos::we_have_index)
+			if (i->have())
 			{
 				assert(t == 0 || t->have_piece(index));
 				assert(i->downloading == 0);
-
-				// make sure there's no entry
-				// with this index. (there shouldn't
-				// be since the piece_map is piece_pos::we_have_index)
-				for (std::vector<std::vector<int> >::const_iterator i = m_piece_info.begin();
-					i != m_piece_info.end(); ++i)
-				{
-					for (std::vector<int>::const_iterator j= i->begin();
-						j != i->end(); ++j)
-					{
-						assert(*j != index);
-					}
-				}
-
-				for (std::vector<std::vector<int> >::const_iterator i = m_downloading_piece_info.begin();
-					i != m_downloading_piece_info.end(); ++i)
-				{
-					for (std::vector<int>::const_iterator j = i->begin();
-						j != i->end(); ++j)
-					{
-						assert(*j != index);
-					}
-				}
-
 			}
-			else if (!i->filtered)
+			else if (!i->filtered())
 			{
 				if (t != 0)
 					assert(!t->have_piece(index));
 
-				const std::vector<std::vector<int> >& c_vec = pick_piece_info_vector(i->downloading, i->filtered);
-				assert(i->priority(m_sequenced_download_threshold) < (int)c_vec.size());
-				const std::vector<int>& vec = c_vec[i->priority(m_sequenced_download_threshold)];
-				if (i->index >= vec.size())
+				if (!m_dirty)
 				{
-					assert(false);
+					assert(i->index < m_pieces.size());
+					assert(m_pieces[i->index] == index);
 				}
-				assert(vec[i->index] == index);
+				++num_pickable;
 			}
 
 			std::vector<downloading_piece>::const_iterator down
@@ -311,6 +237,40 @@ namespace libtorrent
 				assert(down == m_downloads.end());
 			}
 		}
+
+		std::vector<int> peer_refs(m_peers.size(), 0);
+		int num_slots = m_blocks_per_piece == 0 ? 0
+			: int(m_block_info.size()) / m_blocks_per_piece;
+		assert(num_slots == int(m_downloads.size() + m_free_block_slots.size()));
+		for (std::vector<downloading_piece>::const_iterator i = m_downloads.begin();
+			i != m_downloads.end(); ++i)
+		{
+			assert(i->info >= &m_block_info[0]);
+			assert(i->info < &m_block_info[0] + m_block_info.size());
+			assert((i->info - &m_block_info[0]) % m_blocks_per_piece == 0);
+			int num_requested = 0;
+			int num_finished = 0;
+			for (int j = 0; j < blocks_in_piece(i->index); ++j)
+			{
+				block_info const& b = i->info[j];
+				if (b.state == block_info::state_requested) ++num_requested;
+				if (b.state == block_info::state_finished) ++num_finished;
+				if (b.peer != block_info::no_peer) ++peer_refs[b.peer];
+			}
+			assert(num_requested == i->requested);
+			assert(num_finished == i->finished);
+		}
+		for (int i = 0; i < int(m_peers.size()); ++i)
+		{
+			assert(m_peers[i].refcount == peer_refs[i]);
+			if (m_peers[i].refcount == 0) continue;
+			std::map<tcp::endpoint, int>::const_iterator j
+				= m_peer_index.find(m_peers[i].endpoint);
+			assert(j != m_peer_index.end());
+			assert(j->second == i);
+		}
+		assert(m_peer_index.size() + m_free_peers.size() == m_peers.size());
+		assert(m_dirty || num_pickable == (int)m_pieces.size());
 		assert(num_filtered == m_num_filtered);
 		assert(num_have_filtered == m_num_have_filtered);
 	}
@@ -320,260 +280,249 @@ namespace libtorrent
 	{
 		const float num_pieces = static_cast<float>(m_piece_map.size());
 
-		for (int i = 0; i < (int)m_piece_info.size(); ++i)
+		// find the availability of the rarest piece we still
+		// want, and how many pieces share it
+		int min_availability = piece_pos::max_peer_count + 1;
+		int num_rarest = 0;
+		for (std::vector<piece_pos>::const_iterator i = m_piece_map.begin()
+			, end(m_piece_map.end()); i != end; ++i)
 		{
-			int p = (int)m_piece_info[i].size();
-			assert(num_pieces == 0 || float(p) / num_pieces <= 1.f);
-			if (p > 0)
+			if (i->have() || i->filtered()) continue;
+			if ((int)i->peer_count < min_availability)
+			{
+				min_availability = i->peer_count;
+				num_rarest = 1;
+			}
+			else if ((int)i->peer_count == min_availability)
 			{
-				float fraction_above_count =
-					1.f - float(p) / num_pieces;
-				return i + fraction_above_count;
+				++num_rarest;
 			}
 		}
-		return 1.f;
-	}
+		if (num_rarest == 0) return 1.f;
 
-	std::vector<std::vector<int> >& piece_picker::pick_piece_info_vector(
-		bool downloading, bool filtered)
-	{
-		assert(!filtered);
-		return downloading?m_downloading_piece_info:m_piece_info;
+		assert(num_pieces == 0 || float(num_rarest) / num_pieces <= 1.f);
+		float fraction_above_count = 1.f - float(num_rarest) / num_pieces;
+		return min_availability + fraction_above_count;
 	}
 
-	std::vector<std::vector<int> > const& piece_picker::pick_piece_info_vector(
-		bool downloading, bool filtered) const
+	bool piece_picker::is_ordered(int bucket) const
 	{
-		assert(!filtered);
-		return downloading?m_downloading_piece_info:m_piece_info;
+		// bucket 0 holds the pieces no peer has
+		if (bucket == 0) return false;
+		// see piece_pos::priority()
+		int limit = m_sequenced_download_threshold;
+		return ((bucket - 1) / 2) % limit == limit - 1;
 	}
 
-	void piece_picker::add(int index)
+	void piece_picker::relocate(int bucket, int from, int to)
 	{
-		assert(index >= 0);
-		assert(index < (int)m_piece_map.size());
-		piece_pos& p = m_piece_map[index];
-		assert(!p.filtered);
-
-		std::vector<std::vector<int> >& dst_vec = pick_piece_info_vector(
-			p.downloading, p.filtered);
+		assert(from >= bucket_begin(bucket));
+		assert(from < m_priority_boundaries[bucket]);
+		assert(to >= bucket_begin(bucket));
+		assert(to < m_priority_boundaries[bucket]);
 
-		int priority = p.priority(m_sequenced_download_threshold);
-		if ((int)dst_vec.size() <= priority)
-			dst_vec.resize(priority + 1);
+		if (from == to) return;
 
-		assert((int)dst_vec.size() > priority);
-
-		if (p.ordered(m_sequenced_download_threshold))
+		if (is_ordered(bucket))
 		{
-			// the piece should be inserted ordered, not randomly
-			std::vector<int>& v = dst_vec[priority];
-//			assert(is_sorted(v.begin(), v.end()/*, std::greater<int>()*/));
-			std::vector<int>::iterator i = std::lower_bound(v.begin(), v.end()
-				, index/*, std::greater<int>()*/);
-			p.index = i - v.begin();
-			v.insert(i, index);
-			i = v.begin() + p.index + 1;
-			for (;i != v.end(); ++i)
+			// shift the entries in between one step to
+			// preserve their order
+			if (from < to)
+				std::rotate(m_pieces.begin() + from, m_pieces.begin() + from + 1
+					, m_pieces.begin() + to + 1);
+			else
+				std::rotate(m_pieces.begin() + to, m_pieces.begin() + from
+					, m_pieces.begin() + from + 1);
+			for (int i = (std::min)(from, to), end((std::max)(from, to));
+				i <= end; ++i)
 			{
-				++m_piece_map[*i].index;
-				assert(v[m_piece_map[*i].index] == *i);
+				m_piece_map[m_pieces[i]].index = i;
 			}
-//			assert(is_sorted(v.begin(), v.end()/*, std::greater<int>()*/));
-		}
-		else if (dst_vec[priority].size() < 2)
-		{
-			p.index = dst_vec[priority].size();
-			dst_vec[priority].push_back(index);
 		}
 		else
 		{
-			// find a random position in the destination vector where we will place
-			// this entry.
-			int dst_index = rand() % dst_vec[priority].size();
-			
-			// copy the entry at that position to the back
-			m_piece_map[dst_vec[priority][dst_index]].index
-				= dst_vec[priority].size();
-			dst_vec[priority].push_back(dst_vec[priority][dst_index]);
-
-			// and then replace the one at dst_index with the one we're moving.
-			// this procedure is to make sure there's no ordering when pieces
-			// are moved in sequenced order.
-			p.index = dst_index;
-			dst_vec[priority][p.index] = index;
+			std::swap(m_pieces[from], m_pieces[to]);
+			m_piece_map[m_pieces[from]].index = from;
+			m_piece_map[m_pieces[to]].index = to;
 		}
 	}
 
-	// will update the piece with the given properties (downloading, filtered,
-	// priority, elem_index) to place it at the correct position in the
-	// vectors.
-	void piece_picker::move(bool downloading, bool filtered, int priority
-		, int elem_index)
+	// moves the entry at elem_index, currently in the given bucket, to
+	// the bucket its piece_pos says it belongs in, and gives it its
+	// place within that bucket.
+	void piece_picker::move_to_bucket(int priority, int elem_index)
 	{
-		assert(!filtered);
 		assert(priority >= 0);
 		assert(elem_index >= 0);
-		assert(elem_index != piece_pos::we_have_index);
-		std::vector<std::vector<int> >& src_vec(pick_piece_info_vector(
-			downloading, filtered));
+		assert(elem_index < (int)m_pieces.size());
 
-		assert((int)src_vec.size() > priority);
-		assert((int)src_vec[priority].size() > elem_index);
+		int index = m_pieces[elem_index];
+		int new_priority = m_piece_map[index].priority(m_sequenced_download_threshold);
+		assert(new_priority >= 0);
 
-		int index = src_vec[priority][elem_index];
-		// update the piece_map
-		piece_pos& p = m_piece_map[index];
-		int new_priority = p.priority(m_sequenced_download_threshold);
+		if ((int)m_priority_boundaries.size() <= new_priority)
+			m_priority_boundaries.resize(new_priority + 1, m_pieces.size());
 
-		if (p.downloading == downloading
-			&& p.filtered == filtered
-			&& new_priority == priority)
+		// moving an entry to the last slot of its bucket and shrinking the
+		// bucket by one makes it the first slot of the next bucket (and the
+		// other way around). That way the entry is moved one bucket at a
+		// time with a single swap per bucket.
+		while (priority < new_priority)
 		{
-			assert(p.ordered(m_sequenced_download_threshold));
-			return;
+			int last = m_priority_boundaries[priority] - 1;
+			relocate(priority, elem_index, last);
+			elem_index = last;
+			--m_priority_boundaries[priority];
+			++priority;
 		}
-
-		std::vector<std::vector<int> >& dst_vec(pick_piece_info_vector(
-			p.downloading, p.filtered));
-
-		assert(&dst_vec != &src_vec || new_priority != priority);
-
-		if ((int)dst_vec.size() <= new_priority)
+		while (priority > new_priority)
 		{
-			dst_vec.resize(new_priority + 1);
-			assert((int)dst_vec.size() > new_priority);
+			int first = m_priority_boundaries[priority - 1];
+			relocate(priority, elem_index, first);
+			elem_index = first;
+			++m_priority_boundaries[priority - 1];
+			--priority;
 		}
 
-		if (p.ordered(m_sequenced_download_threshold))
-		{
-			// the piece should be inserted ordered, not randomly
-			std::vector<int>& v = dst_vec[new_priority];
-//			assert(is_sorted(v.begin(), v.end()/*, std::greater<int>()*/));
-			std::vector<int>::iterator i = std::lower_bound(v.begin(), v.end()
-				, index/*, std::greater<int>()*/);
-			p.index = i - v.begin();
-			v.insert(i, index);
-			i = v.begin() + p.index + 1;
-			for (;i != v.end(); ++i)
-			{
-				++m_piece_map[*i].index;
-				assert(v[m_piece_map[*i].index] == *i);
-			}
-//			assert(is_sorted(v.begin(), v.end()/*, std::greater<int>()*/));
-		}
-		else if (dst_vec[new_priority].size() < 2)
+		int begin = bucket_begin(priority);
+		int end = m_priority_boundaries[priority];
+		assert(elem_index >= begin && elem_index < end);
+
+		int dst_index;
+		if (is_ordered(priority))
 		{
-			p.index = dst_vec[new_priority].size();
-			dst_vec[new_priority].push_back(index);
+			// the piece should be inserted ordered, not randomly. The
+			// other entries in the bucket are still sorted, count the
+			// ones with lower index
+			std::vector<int>::iterator elem = m_pieces.begin() + elem_index;
+			dst_index = begin
+				+ (std::lower_bound(m_pieces.begin() + begin, elem, index)
+					- (m_pieces.begin() + begin))
+				+ (std::lower_bound(elem + 1, m_pieces.begin() + end, index)
+					- (elem + 1));
 		}
 		else
 		{
-			// find a random position in the destination vector where we will place
-			// this entry.
-			int dst_index = rand() % dst_vec[new_priority].size();
-			
-			// copy the entry at that position to the back
-			m_piece_map[dst_vec[new_priority][dst_index]].index
-				= dst_vec[new_priority].size();
-			dst_vec[new_priority].push_back(dst_vec[new_priority][dst_index]);
-
-			// and then replace the one at dst_index with the one we're moving.
-			// this procedure is to make sure there's no ordering when pieces
-			// are moved in sequenced order.
-			p.index = dst_index;
-			dst_vec[new_priority][p.index] = index;
+			// find a random position in the bucket where we will place
+			// this entry. This is to make sure there's no ordering when
+			// pieces are moved in sequenced order.
+			dst_index = begin + rand() % (end - begin);
 		}
-		assert(p.index < dst_vec[p.priority(m_sequenced_download_threshold)].size());
-		assert(dst_vec[p.priority(m_sequenced_download_threshold)][p.index] == index);
+		relocate(priority, elem_index, dst_index);
+	}
 
-		if (priority >= m_sequenced_download_threshold)
-		{
-			// remove the element from the source vector and preserve the order
-			std::vector<int>& v = src_vec[priority];
-			v.erase(v.begin() + elem_index);
-			for (std::vector<int>::iterator i = v.begin() + elem_index;
-				i != v.end(); ++i)
-			{
-				--m_piece_map[*i].index;
-				assert(v[m_piece_map[*i].index] == *i);
-			}
-		}
-		else
-		{
-			// this will remove elem from the source vector without
-			// preserving order, but the order is random anyway
-			int replace_index = src_vec[priority][elem_index] = src_vec[priority].back();
-			if (index != replace_index)
-			{
-				// update the entry we moved from the back
-				m_piece_map[replace_index].index = elem_index;
-
-				assert((int)src_vec[priority].size() > elem_index);
-				// this may not necessarily be the case. If we've just updated the threshold and are updating
-				// the piece map
-//				assert((int)m_piece_map[replace_index].priority(m_sequenced_download_threshold) == priority);
-				assert((int)m_piece_map[replace_index].index == elem_index);
-				assert(src_vec[priority][elem_index] == replace_index);
-			}
-			else
-			{
-				assert((int)src_vec[priority].size() == elem_index+1);
-			}
+	void piece_picker::add(int index)
+	{
+		assert(index >= 0);
+		assert(index < (int)m_piece_map.size());
+		piece_pos& p = m_piece_map[index];
+		int priority = p.priority(m_sequenced_download_threshold);
+		assert(priority >= 0);
 
-			src_vec[priority].pop_back();
-		}
+		// the piece will be put in place when the buckets are rebuilt
+		if (m_dirty) return;
+
+		if ((int)m_priority_boundaries.size() <= priority)
+			m_priority_boundaries.resize(priority + 1, m_pieces.size());
+
+		// append the piece to the last bucket and
+		// move it down from there
+		p.index = m_pieces.size();
+		m_pieces.push_back(index);
+		++m_priority_boundaries.back();
+		move_to_bucket(int(m_priority_boundaries.size()) - 1, p.index);
 	}
 
-	void piece_picker::remove(bool downloading, bool filtered, int priority
-		, int elem_index)
+	// will update the piece at elem_index, which was in the bucket
+	// 'priority', after its piece_pos has changed
+	void piece_picker::update(int priority, int elem_index)
 	{
-		assert(!filtered);
 		assert(priority >= 0);
 		assert(elem_index >= 0);
+		assert(elem_index != piece_pos::we_have_index);
 
-		std::vector<std::vector<int> >& src_vec(pick_piece_info_vector(downloading, filtered));
+		if (m_dirty) return;
+		assert(elem_index < (int)m_pieces.size());
 
-		assert((int)src_vec.size() > priority);
-		assert((int)src_vec[priority].size() > elem_index);
+		int new_priority = m_piece_map[m_pieces[elem_index]].priority(
+			m_sequenced_download_threshold);
+		if (new_priority == priority) return;
+		move_to_bucket(priority, elem_index);
+	}
 
-		int index = src_vec[priority][elem_index];
+	// removes the entry at elem_index, which is in the bucket 'priority',
+	// from m_pieces. The piece_pos index is left for the caller to set.
+	void piece_picker::remove(int priority, int elem_index)
+	{
+		assert(priority >= 0);
+		assert(elem_index >= 0);
 
-		if (downloading)
+		if (m_dirty) return;
+		assert(priority < (int)m_priority_boundaries.size());
+		assert(elem_index < (int)m_pieces.size());
+
+		// walk the entry past the end of the last bucket
+		for (int b = priority; b < (int)m_priority_boundaries.size(); ++b)
 		{
-			std::vector<downloading_piece>::iterator i
-				= std::find_if(m_downloads.begin(),
-				m_downloads.end(),
-				has_index(index));
-			assert(i != m_downloads.end());
-			m_downloads.erase(i);
+			int last = m_priority_boundaries[b] - 1;
+			relocate(b, elem_index, last);
+			elem_index = last;
+			--m_priority_boundaries[b];
 		}
-		piece_pos& p = m_piece_map[index];
-		p.downloading = 0;
-		if (p.ordered(m_sequenced_download_threshold))
+		assert(elem_index == (int)m_pieces.size() - 1);
+		m_pieces.pop_back();
+	}
+
+	// puts every piece we don't have and that isn't filtered in
+	// m_pieces, in linear time
+	void piece_picker::rebuild_buckets()
+	{
+		m_dirty = false;
+		m_pieces.clear();
+		m_priority_boundaries.clear();
+
+		// count the number of pieces in each bucket
+		for (std::vector<piece_pos>::const_iterator i = m_piece_map.begin()
+			, end(m_piece_map.end()); i != end; ++i)
 		{
-			std::vector<int>& v = src_vec[priority];
-//			assert(is_sorted(v.begin(), v.end()/*, std::greater<int>()*/));
-			std::vector<int>::iterator i = v.begin() + elem_index;
-			v.erase(i);
-			i = v.begin() + elem_index;
-			for (; i != v.end(); ++i)
-			{
-				--m_piece_map[*i].index;
-				assert(v[m_piece_map[*i].index] == *i);
-			}
-//			assert(is_sorted(v.begin(), v.end()/*, std::greater<int>()*/));
+			int priority = i->priority(m_sequenced_download_threshold);
+			if (priority < 0) continue;
+			if ((int)m_priority_boundaries.size() <= priority)
+				m_priority_boundaries.resize(priority + 1, 0);
+			++m_priority_boundaries[priority];
 		}
-		else
+
+		// and turn the counts into the end of each bucket
+		int num_pieces = 0;
+		for (std::vector<int>::iterator i = m_priority_boundaries.begin()
+			, end(m_priority_boundaries.end()); i != end; ++i)
+		{
+			num_pieces += *i;
+			*i = num_pieces;
+		}
+		m_pieces.resize(num_pieces);
+
+		// fill the buckets from the back, in reverse piece
+		// order, which leaves every bucket sorted
+		std::vector<int> fill(m_priority_boundaries);
+		for (int index = int(m_piece_map.size()) - 1; index >= 0; --index)
+		{
+			int priority = m_piece_map[index].priority(m_sequenced_download_threshold);
+			if (priority < 0) continue;
+			m_pieces[--fill[priority]] = index;
+		}
+
+		// the buckets that aren't downloaded in sequence
+		// are picked in random order
+		for (int b = 0; b < (int)m_priority_boundaries.size(); ++b)
 		{
-			// this will remove elem from the vector without
-			// preserving order
-			index = src_vec[priority][elem_index] = src_vec[priority].back();
-			// update the entry we moved from the back
-			if ((int)src_vec[priority].size() > elem_index+1)
-				m_piece_map[index].index = elem_index;
-			src_vec[priority].pop_back();
+			if (is_ordered(b)) continue;
+			std::random_shuffle(m_pieces.begin() + bucket_begin(b)
+				, m_pieces.begin() + m_priority_boundaries[b]);
 		}
+
+		for (int i = 0; i < num_pieces; ++i)
+			m_piece_map[m_pieces[i]].index = i;
 	}
 
 	void piece_picker::restore_piece(int index)
@@ -590,12 +539,43 @@ namespace libtorrent
 			m_downloads.end(),
 			has_index(index));
 		assert(i != m_downloads.end());
-		m_downloads.erase(i);
+		erase_download_piece(i);
+
+		piece_pos& p = m_piece_map[index];
+		int prev_priority = p.priority(m_sequenced_download_threshold);
+		p.downloading = 0;
+		if (prev_priority < 0) return;
+		update(prev_priority, p.index);
+	}
+
+	bool piece_picker::inc_peer_count(int index)
+	{
+		piece_pos& p = m_piece_map[index];
+		if (p.peer_count == piece_pos::max_peer_count)
+		{
+			++m_peer_count_overflow[index];
+			return false;
+		}
+		++p.peer_count;
+		return true;
+	}
 
-		m_piece_map[index].downloading = 0;
+	bool piece_picker::dec_peer_count(int index)
+	{
 		piece_pos& p = m_piece_map[index];
-		if (p.filtered) return;
-		move(true, p.filtered, p.priority(m_sequenced_download_threshold), p.index);
+		if (p.peer_count == piece_pos::max_peer_count)
+		{
+			std::map<int, int>::iterator o = m_peer_count_overflow.find(index);
+			if (o != m_peer_count_overflow.end())
+			{
+				if (--o->second == 0) m_peer_count_overflow.erase(o);
+				return false;
+			}
+		}
+		assert(p.peer_count > 0);
+		if (p.peer_count == 0) return false;
+		--p.peer_count;
+		return true;
 	}
 
 	void piece_picker::inc_refcount(int i)
@@ -604,26 +584,16 @@ namespace libtorrent
 		assert(i >= 0);
 		assert(i < (int)m_piece_map.size());
 
-		int index = m_piece_map[i].index;
-		int prev_priority = m_piece_map[i].priority(m_sequenced_download_threshold);
-
-		assert(m_piece_map[i].peer_count < 2048);
-		m_piece_map[i].peer_count++;
-		assert(m_piece_map[i].peer_count != 0);	
-
 		piece_pos& p = m_piece_map[i];
+		int prev_priority = p.priority(m_sequenced_download_threshold);
 
-		// if we have the piece or if it's filtered
-		// we don't have to move any entries in the piece_info vector
-		if (index == piece_pos::we_have_index || p.filtered
-			|| p.priority(m_sequenced_download_threshold) == prev_priority) return;
+		if (!inc_peer_count(i)) return;
 
-		move(p.downloading, p.filtered, prev_priority, index);
+		// if we have the piece or if it's filtered
+		// we don't have to move any entries in m_pieces
+		if (prev_priority < 0) return;
 
-#ifndef NDEBUG
-//		integrity_check();
-#endif
-		return;
+		update(prev_priority, p.index);
 	}
 
 	void piece_picker::dec_refcount(int i)
@@ -633,19 +603,91 @@ namespace libtorrent
 		assert(i >= 0);
 		assert(i < (int)m_piece_map.size());
 
-		int prev_priority = m_piece_map[i].priority(m_sequenced_download_threshold);
-		int index = m_piece_map[i].index;
-		assert(m_piece_map[i].peer_count > 0);
+		piece_pos& p = m_piece_map[i];
+		int prev_priority = p.priority(m_sequenced_download_threshold);
+
+		if (!dec_peer_count(i)) return;
 
-		if (m_piece_map[i].peer_count > 0)
-			m_piece_map[i].peer_count--;
+		if (prev_priority < 0) return;
 
-		piece_pos& p = m_piece_map[i];
+		update(prev_priority, p.index);
+	}
 
-		if (index == piece_pos::we_have_index || p.filtered
-			|| p.priority(m_sequenced_download_threshold) == prev_priority) return;
+	void piece_picker::inc_refcount(std::vector<bool> const& bitmask)
+	{
+		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
+		assert(bitmask.size() == m_piece_map.size());
 
-		move(p.downloading, p.filtered, prev_priority, index);
+		int num_pieces = std::count(bitmask.begin(), bitmask.end(), true);
+		if (num_pieces == 0) return;
+
+		// moving the pieces one at a time is only worth it if a
+		// few of them changed. Otherwise update all the peer counts
+		// and let the buckets be rebuilt in one pass
+		if (!m_dirty && num_pieces < int(m_piece_map.size()) / 4)
+		{
+			int index = 0;
+			for (std::vector<bool>::const_iterator i = bitmask.begin()
+				, end(bitmask.end()); i != end; ++i, ++index)
+			{
+				if (*i) inc_refcount(index);
+			}
+			return;
+		}
+
+		int index = 0;
+		for (std::vector<bool>::const_iterator i = bitmask.begin()
+			, end(bitmask.end()); i != end; ++i, ++index)
+		{
+			if (*i) inc_peer_count(index);
+		}
+		m_dirty = true;
+	}
+
+	void piece_picker::dec_refcount(std::vector<bool> const& bitmask)
+	{
+		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
+		assert(bitmask.size() == m_piece_map.size());
+
+		int num_pieces = std::count(bitmask.begin(), bitmask.end(), true);
+		if (num_pieces == 0) return;
+
+		if (!m_dirty && num_pieces < int(m_piece_map.size()) / 4)
+		{
+			int index = 0;
+			for (std::vector<bool>::const_iterator i = bitmask.begin()
+				, end(bitmask.end()); i != end; ++i, ++index)
+			{
+				if (*i) dec_refcount(index);
+			}
+			return;
+		}
+
+		int index = 0;
+		for (std::vector<bool>::const_iterator i = bitmask.begin()
+			, end(bitmask.end()); i != end; ++i, ++index)
+		{
+			if (*i) dec_peer_count(index);
+		}
+		m_dirty = true;
+	}
+
+	void piece_picker::inc_refcount_all()
+	{
+		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
+
+		for (int i = 0; i < int(m_piece_map.size()); ++i)
+			inc_peer_count(i);
+		if (!m_piece_map.empty()) m_dirty = true;
+	}
+
+	void piece_picker::dec_refcount_all()
+	{
+		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
+
+		for (int i = 0; i < int(m_piece_map.size()); ++i)
+			dec_peer_count(i);
+		if (!m_piece_map.empty()) m_dirty = true;
 	}
 
 	// this is used to indicate that we succesfully have
@@ -658,45 +700,122 @@ namespace libtorrent
 		assert(index >= 0);
 		assert(index < (int)m_piece_map.size());
 
-		int info_index = m_piece_map[index].index;
-		int priority = m_piece_map[index].priority(m_sequenced_download_threshold);
+		piece_pos& p = m_piece_map[index];
+		int info_index = p.index;
+		int priority = p.priority(m_sequenced_download_threshold);
 
-		assert(m_piece_map[index].downloading == 1);
+		assert(p.downloading == 1);
+		assert(!p.have());
+		if (p.have()) return;
 
-		assert(info_index != piece_pos::we_have_index);
-		piece_pos& p = m_piece_map[index];
-		if (p.filtered)
+		if (p.downloading)
+		{
+			std::vector<downloading_piece>::iterator i
+				= std::find_if(m_downloads.begin(),
+				m_downloads.end(),
+				has_index(index));
+			assert(i != m_downloads.end());
+			erase_download_piece(i);
+			p.downloading = 0;
+		}
+
+		if (p.filtered())
 		{
 			--m_num_filtered;
 			++m_num_have_filtered;
-			return;
 		}
-		if (info_index == piece_pos::we_have_index) return;
-		remove(p.downloading, p.filtered, priority, info_index);
+		else
+		{
+			remove(priority, info_index);
+		}
 		p.index = piece_pos::we_have_index;
 	}
 
-
-	void piece_picker::mark_as_filtered(int index)
+	void piece_picker::set_piece_priority(int index, int new_piece_priority)
 	{
 		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
+		assert(new_piece_priority >= 0);
+		assert(new_piece_priority < piece_pos::priority_levels);
 		assert(index >= 0);
 		assert(index < (int)m_piece_map.size());
-		
+
 		piece_pos& p = m_piece_map[index];
-		if (p.filtered == 1) return;	
-		p.filtered = 1;
-		if (p.index != piece_pos::we_have_index)
+		if (new_piece_priority == (int)p.piece_priority) return;
+
+		int prev_priority = p.priority(m_sequenced_download_threshold);
+
+		if (new_piece_priority == piece_pos::filter_priority)
+		{
+			// the piece just got filtered
+			if (p.have()) ++m_num_have_filtered;
+			else ++m_num_filtered;
+		}
+		else if (p.filtered())
+		{
+			// the piece just got unfiltered
+			if (p.have()) --m_num_have_filtered;
+			else --m_num_filtered;
+			assert(m_num_filtered >= 0);
+			assert(m_num_have_filtered >= 0);
+		}
+
+		p.piece_priority = new_piece_priority;
+
+		// if we have the piece, there's no entry to move
+		if (p.have()) return;
+
+		if (prev_priority < 0)
 		{
-			++m_num_filtered;
-			remove(p.downloading, false, p.priority(m_sequenced_download_threshold), p.index);
-			assert(p.filtered == 1);
+			// the piece was filtered
+			add(index);
+		}
+		else if (p.filtered())
+		{
+			remove(prev_priority, p.index);
+			p.index = 0;
+
+			// a filtered piece won't be downloaded,
+			// forget about the blocks we've requested
+			if (p.downloading)
+			{
+				std::vector<downloading_piece>::iterator i
+					= std::find_if(m_downloads.begin(),
+					m_downloads.end(),
+					has_index(index));
+				assert(i != m_downloads.end());
+				erase_download_piece(i);
+				p.downloading = 0;
+			}
 		}
 		else
 		{
-			++m_num_have_filtered;
+			update(prev_priority, p.index);
+		}
+	}
+
+	int piece_picker::piece_priority(int index) const
+	{
+		assert(index >= 0);
+		assert(index < (int)m_piece_map.size());
+
+		return m_piece_map[index].piece_priority;
+	}
+
+	void piece_picker::piece_priorities(std::vector<int>& pieces) const
+	{
+		pieces.resize(m_piece_map.size());
+		std::vector<int>::iterator j = pieces.begin();
+		for (std::vector<piece_pos>::const_iterator i = m_piece_map.begin(),
+			end(m_piece_map.end()); i != end; ++i, ++j)
+		{
+			*j = i->piece_priority;
 		}
 	}
+
+	void piece_picker::mark_as_filtered(int index)
+	{
+		set_piece_priority(index, piece_pos::filter_priority);
+	}
 	
 	// this function can be used for pieces that we don't
 	// have, but have marked as filtered (so we didn't
@@ -705,24 +824,11 @@ namespace libtorrent
 	// be inserted in the available piece list again
 	void piece_picker::mark_as_unfiltered(int index)
 	{
-		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
 		assert(index >= 0);
 		assert(index < (int)m_piece_map.size());
 
-		piece_pos& p = m_piece_map[index];
-		if (p.filtered == 0) return;	
-		p.filtered = 0;
-		if (p.index != piece_pos::we_have_index)
-		{
-			--m_num_filtered;
-			assert(m_num_filtered >= 0);
-			add(index);
-		}
-		else
-		{
-			--m_num_have_filtered;
-			assert(m_num_have_filtered >= 0);
-		}
+		if (!m_piece_map[index].filtered()) return;
+		set_piece_priority(index, 1);
 	}
 
 	bool piece_picker::is_filtered(int index) const
@@ -730,7 +836,7 @@ namespace libtorrent
 		assert(index >= 0);
 		assert(index < (int)m_piece_map.size());
 
-		return m_piece_map[index].filtered == 1;
+		return m_piece_map[index].filtered();
 	}
 
 	void piece_picker::filtered_pieces(std::vector<bool>& mask) const
@@ -740,42 +846,37 @@ namespace libtorrent
 		for (std::vector<piece_pos>::const_iterator i = m_piece_map.begin(),
 			end(m_piece_map.end()); i != end; ++i, ++j)
 		{
-			*j = i->filtered == 1;
+			*j = i->filtered();
 		}
 	}
 	
 	void piece_picker::pick_pieces(const std::vector<bool>& pieces
 		, std::vector<piece_block>& interesting_blocks
 		, int num_blocks, bool prefer_whole_pieces
-		, tcp::endpoint peer) const
+		, tcp::endpoint peer)
 	{
 		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
 		assert(num_blocks > 0);
 		assert(pieces.size() == m_piece_map.size());
 
-		// free refers to pieces that are free to download, no one else
-		// is downloading them.
-		// partial is pieces that are partially being downloaded, and
-		// parts of them may be free for download as well, the
-		// partially downloaded pieces will be prioritized
-		assert(m_piece_info.begin() != m_piece_info.end());
-		// +1 is to ignore pieces that no peer has. The bucket with index 0 contains
-		// pieces that 0 other peers has.
-		std::vector<std::vector<int> >::const_iterator free
-			= m_piece_info.begin() + 1;
-		assert(m_downloading_piece_info.begin()
-			!= m_downloading_piece_info.end());
-
-		std::vector<std::vector<int> >::const_iterator partial
-			= m_downloading_piece_info.begin() + 1;
+		if (m_dirty) rebuild_buckets();
 
 		std::vector<piece_block> backup_blocks;
-		
-		// this loop will loop from pieces with 1 peer and up
-		// until we either reach the end of the piece list or
-		// has filled the interesting_blocks with num_blocks
-		// blocks.
-	
+
+		// the blocks refer to peers by their index
+		// in the peer table
+		const int peer_index = find_peer(peer);
+
+		const int limit = m_sequenced_download_threshold;
+		const int num_buckets = int(m_priority_boundaries.size());
+
+		// pieces with higher priority are always picked first. Within
+		// each priority level, this loop will loop from pieces with 1
+		// peer and up until we either reach the end of the piece list
+		// or has filled the interesting_blocks with num_blocks blocks.
+		// Bucket 0 contains pieces that no other peer has, and is
+		// ignored.
+
 		// it iterates over two ranges simultaneously. The pieces that are
 		// partially downloaded or partially requested, and the pieces that
 		// hasn't been requested at all. The default is to prioritize pieces
@@ -789,30 +890,42 @@ namespace libtorrent
 		// fast peers) the partial pieces will not be prioritized, but actually
 		// ignored as long as possible.
 
-		while((free != m_piece_info.end())
-			|| (partial != m_downloading_piece_info.end()))
+		for (int prio = piece_pos::priority_levels - 1; prio > 0; --prio)
 		{
-			if (partial != m_downloading_piece_info.end())
+			// the buckets of this priority level alternate between
+			// free and partial pieces, one pair per availability
+			int first_bucket = 1 + (prio - 1) * limit * 2;
+			int end = (std::min)(first_bucket + limit * 2, num_buckets);
+			if (first_bucket >= end) continue;
+			if (bucket_begin(first_bucket) == m_priority_boundaries[end - 1]) continue;
+
+			// free refers to pieces that are free to download, no one else
+			// is downloading them.
+			// partial is pieces that are partially being downloaded, and
+			// parts of them may be free for download as well, the
+			// partially downloaded pieces will be prioritized
+			int free = first_bucket;
+			int partial = first_bucket + 1;
+
+			while (free < end || partial < end)
 			{
-				for (int i = 0; i < 2; ++i)
+				for (int i = 0; i < 2 && partial < end; ++i, partial += 2)
 				{
-					num_blocks = add_interesting_blocks_partial(*partial, pieces
+					num_blocks = add_interesting_blocks_partial(partial, pieces
 						, interesting_blocks, backup_blocks, num_blocks
-						, prefer_whole_pieces, peer);
+						, prefer_whole_pieces, peer_index);
 					assert(num_blocks >= 0);
 					if (num_blocks == 0) return;
-					++partial;
-					if (partial == m_downloading_piece_info.end()) break;
 				}
-			}
 
-			if (free != m_piece_info.end())
-			{
-				num_blocks = add_interesting_blocks_free(*free, pieces
-					, interesting_blocks, num_blocks, prefer_whole_pieces);
-				assert(num_blocks >= 0);
-				if (num_blocks == 0) return;
-				++free;
+				if (free < end)
+				{
+					num_blocks = add_interesting_blocks_free(free, pieces
+						, interesting_blocks, num_blocks, prefer_whole_pieces);
+					assert(num_blocks >= 0);
+					if (num_blocks == 0) return;
+					free += 2;
+				}
 			}
 		}
 
@@ -830,32 +943,30 @@ namespace libtorrent
 			+ (std::min)(num_blocks, (int)backup_blocks.size()));
 	}
 
-	namespace
+	bool piece_picker::exclusively_requested_from(downloading_piece const& p
+		, int peer) const
 	{
-		bool exclusively_requested_from(piece_picker::downloading_piece const& p
-			, int num_blocks_in_piece, tcp::endpoint peer)
+		for (int j = 0, end(blocks_in_piece(p.index)); j < end; ++j)
 		{
-			for (int j = 0; j < num_blocks_in_piece; ++j)
+			block_info const& b = p.info[j];
+			if (b.state != block_info::state_none
+				&& b.peer != peer
+				&& b.peer != block_info::no_peer)
 			{
-				if ((p.finished_blocks[j] == 1
-					|| p.requested_blocks[j] == 1)
-					&& p.info[j].peer != peer
-					&& p.info[j].peer != tcp::endpoint())
-				{
-					return false;
-				}
+				return false;
 			}
-			return true;
 		}
+		return true;
 	}
 
-	int piece_picker::add_interesting_blocks_free(std::vector<int> const& piece_list
+	int piece_picker::add_interesting_blocks_free(int bucket
 		, std::vector<bool> const& pieces
 		, std::vector<piece_block>& interesting_blocks
 		, int num_blocks, bool prefer_whole_pieces) const
 	{
-		for (std::vector<int>::const_iterator i = piece_list.begin();
-			i != piece_list.end(); ++i)
+		for (std::vector<int>::const_iterator i = m_pieces.begin()
+			+ bucket_begin(bucket), end(m_pieces.begin()
+			+ m_priority_boundaries[bucket]); i != end; ++i)
 		{
 			assert(*i >= 0);
 			assert(*i < (int)m_piece_map.size());
@@ -879,17 +990,18 @@ namespace libtorrent
 		return num_blocks;
 	}
 	
-	int piece_picker::add_interesting_blocks_partial(std::vector<int> const& piece_list
+	int piece_picker::add_interesting_blocks_partial(int bucket
 		, const std::vector<bool>& pieces
 		, std::vector<piece_block>& interesting_blocks
 		, std::vector<piece_block>& backup_blocks
 		, int num_blocks, bool prefer_whole_pieces
-		, tcp::endpoint peer) const
+		, int peer) const
 	{
 		assert(num_blocks > 0);
 
-		for (std::vector<int>::const_iterator i = piece_list.begin();
-			i != piece_list.end(); ++i)
+		for (std::vector<int>::const_iterator i = m_pieces.begin()
+			+ bucket_begin(bucket), end(m_pieces.begin()
+			+ m_priority_boundaries[bucket]); i != end; ++i)
 		{
 			assert(*i >= 0);
 			assert(*i < (int)m_piece_map.size());
@@ -916,14 +1028,15 @@ namespace libtorrent
 			// blocks aren't enough, blocks from this list
 			// will be picked.
 			if (prefer_whole_pieces
-				&& !exclusively_requested_from(*p, num_blocks_in_piece, peer))
+				&& !exclusively_requested_from(*p, peer))
 			{
 				if ((int)backup_blocks.size() >= num_blocks) continue;
 				for (int j = 0; j < num_blocks_in_piece; ++j)
 				{
-					if (p->finished_blocks[j] == 1) continue;
-					if (p->requested_blocks[j] == 1
-						&& p->info[j].peer == peer) continue;
+					block_info const& info = p->info[j];
+					if (info.state == block_info::state_finished) continue;
+					if (info.state == block_info::state_requested
+						&& info.peer == peer) continue;
 					backup_blocks.push_back(piece_block(*i, j));
 				}
 				continue;
@@ -931,9 +1044,10 @@ namespace libtorrent
 
 			for (int j = 0; j < num_blocks_in_piece; ++j)
 			{
-				if (p->finished_blocks[j] == 1) continue;
-				if (p->requested_blocks[j] == 1
-					&& p->info[j].peer == peer) continue;
+				block_info const& info = p->info[j];
+				if (info.state == block_info::state_finished) continue;
+				if (info.state == block_info::state_requested
+					&& info.peer == peer) continue;
 				// this block is interesting (we don't have it
 				// yet). But it may already have been requested
 				// from another peer. We have to add it anyway
@@ -944,7 +1058,7 @@ namespace libtorrent
 				// blocks that have not been requested from any
 				// other peer.
 				interesting_blocks.push_back(piece_block(*i, j));
-				if (p->requested_blocks[j] == 0)
+				if (info.state == block_info::state_none)
 				{
 					// we have found a block that's free to download
 					num_blocks--;
@@ -969,11 +1083,11 @@ namespace libtorrent
 		std::vector<downloading_piece>::const_iterator i
 			= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(index));
 		assert(i != m_downloads.end());
-		assert((int)i->finished_blocks.count() <= m_blocks_per_piece);
+		assert((int)i->finished <= m_blocks_per_piece);
 		int max_blocks = blocks_in_piece(index);
-		if ((int)i->finished_blocks.count() != max_blocks) return false;
+		if ((int)i->finished != max_blocks) return false;
 
-		assert((int)i->requested_blocks.count() == max_blocks);
+		assert((int)i->requested == 0);
 		return true;
 	}
 
@@ -992,7 +1106,7 @@ namespace libtorrent
 				, has_index(block.piece_index));
 
 		assert(i != m_downloads.end());
-		return i->requested_blocks[block.block_index];
+		return i->info[block.block_index].state != block_info::state_none;
 	}
 
 	bool piece_picker::is_finished(piece_block block) const
@@ -1002,14 +1116,113 @@ namespace libtorrent
 		assert(block.piece_index < (int)m_piece_map.size());
 		assert(block.block_index < (int)max_blocks_per_piece);
 
-		if (m_piece_map[block.piece_index].index == piece_pos::we_have_index) return true;
+		if (m_piece_map[block.piece_index].have()) return true;
 		if (m_piece_map[block.piece_index].downloading == 0) return false;
 		std::vector<downloading_piece>::const_iterator i
 			= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(block.piece_index));
 		assert(i != m_downloads.end());
-		return i->finished_blocks[block.block_index];
+		return i->info[block.block_index].state == block_info::state_finished;
 	}
 
+	piece_picker::downloading_piece& piece_picker::add_download_piece(int index)
+	{
+		int slot;
+		if (m_free_block_slots.empty())
+		{
+			// grow the pool by one slot. If the vector is
+			// reallocated, the pieces must be pointed to
+			// the new storage
+			slot = int(m_block_info.size()) / m_blocks_per_piece;
+			block_info const* old_base = m_block_info.empty() ? 0 : &m_block_info[0];
+			m_block_info.resize(m_block_info.size() + m_blocks_per_piece);
+			block_info* base = &m_block_info[0];
+			if (base != old_base)
+			{
+				for (std::vector<downloading_piece>::iterator i = m_downloads.begin()
+					, end(m_downloads.end()); i != end; ++i)
+				{
+					i->info = base + (i->info - old_base);
+				}
+			}
+		}
+		else
+		{
+			slot = m_free_block_slots.back();
+			m_free_block_slots.pop_back();
+		}
+
+		downloading_piece dp;
+		dp.index = index;
+		dp.info = &m_block_info[0] + slot * m_blocks_per_piece;
+		std::fill(dp.info, dp.info + m_blocks_per_piece, block_info());
+		m_downloads.push_back(dp);
+		return m_downloads.back();
+	}
+
+	void piece_picker::erase_download_piece(std::vector<downloading_piece>::iterator i)
+	{
+		for (int j = 0, end(blocks_in_piece(i->index)); j < end; ++j)
+		{
+			if (i->info[j].peer != block_info::no_peer)
+				release_peer(i->info[j].peer);
+		}
+		m_free_block_slots.push_back(int(i->info - &m_block_info[0])
+			/ m_blocks_per_piece);
+		m_downloads.erase(i);
+	}
+
+	int piece_picker::find_peer(tcp::endpoint const& peer) const
+	{
+		std::map<tcp::endpoint, int>::const_iterator i = m_peer_index.find(peer);
+		if (i == m_peer_index.end()) return -1;
+		return i->second;
+	}
+
+	void piece_picker::set_block_peer(block_info& b, tcp::endpoint const& peer)
+	{
+		int index = block_info::no_peer;
+		// a default endpoint means we don't know
+		// which peer the block came from
+		if (peer != tcp::endpoint())
+		{
+			std::map<tcp::endpoint, int>::iterator i = m_peer_index.find(peer);
+			if (i != m_peer_index.end())
+			{
+				index = i->second;
+			}
+			else if (!m_free_peers.empty())
+			{
+				index = m_free_peers.back();
+				m_free_peers.pop_back();
+				m_peers[index].endpoint = peer;
+				m_peer_index.insert(std::make_pair(peer, index));
+			}
+			else
+			{
+				index = int(m_peers.size());
+				// the peer index is stored in 16 bits
+				assert(index < block_info::no_peer);
+				peer_entry e;
+				e.endpoint = peer;
+				e.refcount = 0;
+				m_peers.push_back(e);
+				m_peer_index.insert(std::make_pair(peer, index));
+			}
+			++m_peers[index].refcount;
+		}
+		if (b.peer != block_info::no_peer) release_peer(b.peer);
+		b.peer = index;
+	}
+
+	void piece_picker::release_peer(int peer)
+	{
+		assert(peer >= 0 && peer < (int)m_peers.size());
+		peer_entry& e = m_peers[peer];
+		assert(e.refcount > 0);
+		if (--e.refcount > 0) return;
+		m_peer_index.erase(e.endpoint);
+		m_free_peers.push_back(peer);
+	}
 
 	void piece_picker::mark_as_downloading(piece_block block, const tcp::endpoint& peer)
 	{
@@ -1023,23 +1236,26 @@ namespace libtorrent
 		piece_pos& p = m_piece_map[block.piece_index];
 		if (p.downloading == 0)
 		{
+			int prev_priority = p.priority(m_sequenced_download_threshold);
 			p.downloading = 1;
-			move(false, p.filtered, p.priority(m_sequenced_download_threshold), p.index);
+			if (prev_priority >= 0) update(prev_priority, p.index);
 
-			downloading_piece dp;
-			dp.index = block.piece_index;
-			dp.requested_blocks[block.block_index] = 1;
-			dp.info[block.block_index].peer = peer;
-			m_downloads.push_back(dp);
+			downloading_piece& dp = add_download_piece(block.piece_index);
+			block_info& info = dp.info[block.block_index];
+			info.state = block_info::state_requested;
+			set_block_peer(info, peer);
+			++dp.requested;
 		}
 		else
 		{
 			std::vector<downloading_piece>::iterator i
 				= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(block.piece_index));
 			assert(i != m_downloads.end());
-			assert(i->requested_blocks[block.block_index] == 0);
-			i->info[block.block_index].peer = peer;
-			i->requested_blocks[block.block_index] = 1;
+			block_info& info = i->info[block.block_index];
+			assert(info.state == block_info::state_none);
+			info.state = block_info::state_requested;
+			set_block_peer(info, peer);
+			++i->requested;
 		}
 	}
 
@@ -1053,59 +1269,38 @@ namespace libtorrent
 		assert(block.block_index < blocks_in_piece(block.piece_index));
 
 		piece_pos& p = m_piece_map[block.piece_index];
-		if (p.index == piece_pos::we_have_index || p.filtered) return;
+		if (p.have() || p.filtered()) return;
 
 		if (p.downloading == 0)
 		{
+			int prev_priority = p.priority(m_sequenced_download_threshold);
 			p.downloading = 1;
-			move(false, p.filtered, p.priority(m_sequenced_download_threshold), p.index);
-
-			downloading_piece dp;
-			dp.index = block.piece_index;
-			dp.requested_blocks[block.block_index] = 1;
-			dp.finished_blocks[block.block_index] = 1;
-			dp.info[block.block_index].peer = peer;
-			m_downloads.push_back(dp);
+			update(prev_priority, p.index);
+
+			downloading_piece& dp = add_download_piece(block.piece_index);
+			block_info& info = dp.info[block.block_index];
+			info.state = block_info::state_finished;
+			set_block_peer(info, peer);
+			++dp.finished;
 		}
 		else
 		{
 			std::vector<downloading_piece>::iterator i
 				= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(block.piece_index));
 			assert(i != m_downloads.end());
-			i->info[block.block_index].peer = peer;
-			i->requested_blocks[block.block_index] = 1;
-			i->finished_blocks[block.block_index] = 1;
+			block_info& info = i->info[block.block_index];
+			set_block_peer(info, peer);
+			if (info.state == block_info::state_finished) return;
+			// the block may have been requested, then cancled
+			// and requested by a peer that disconnects
+			// that way we can actually receive the piece
+			// without the requested state being set.
+			if (info.state == block_info::state_requested) --i->requested;
+			info.state = block_info::state_finished;
+			++i->finished;
 		}
 	}
-/*
-	void piece_picker::mark_as_finished(piece_block block, const peer_id& peer)
-	{
-#ifndef NDEBUG
-		integrity_check();
-#endif
-		assert(block.piece_index >= 0);
-		assert(block.block_index >= 0);
-		assert(block.piece_index < m_piece_map.size());
-		assert(block.block_index < blocks_in_piece(block.piece_index));
-
-		assert(m_piece_map[block.piece_index].downloading == 1);
 
-		std::vector<downloading_piece>::iterator i
-			= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(block.piece_index));
-		assert(i != m_downloads.end());
-		i->finished_blocks[block.block_index] = 1;
-		// the block may have been requested, then cancled
-		// and requested by a peer that disconnects
-		// that way we can actually receive the piece
-		// without the requested bit is set.
-		i->requested_blocks[block.block_index] = 1;
-		i->info[block.block_index].num_downloads++;
-		i->info[block.block_index].peer = peer;
-#ifndef NDEBUG
-		integrity_check();
-#endif
-	}
-*/
 	void piece_picker::get_downloaders(std::vector<tcp::endpoint>& d, int index) const
 	{
 		assert(index >= 0 && index <= (int)m_piece_map.size());
@@ -1116,7 +1311,7 @@ namespace libtorrent
 		d.clear();
 		for (int j = 0; j < blocks_in_piece(index); ++j)
 		{
-			d.push_back(i->info[j].peer);
+			d.push_back(peer_endpoint(i->info[j].peer));
 		}
 	}
 
@@ -1133,11 +1328,11 @@ namespace libtorrent
 		assert(block.block_index < max_blocks_per_piece);
 		assert(block.block_index >= 0);
 
-		if (i->requested_blocks[block.block_index] == false
-			|| i->finished_blocks[block.block_index] == true)
+		if (i->info[block.block_index].state != block_info::state_requested)
 			return boost::optional<tcp::endpoint>();
 
-		return boost::optional<tcp::endpoint>(i->info[block.block_index].peer);
+		return boost::optional<tcp::endpoint>(
+			peer_endpoint(i->info[block.block_index].peer));
 	}
 
 	void piece_picker::abort_download(piece_block block)
@@ -1159,27 +1354,30 @@ namespace libtorrent
 			= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(block.piece_index));
 		assert(i != m_downloads.end());
 
-		if (i->finished_blocks[block.block_index]) return;
+		block_info& info = i->info[block.block_index];
+		if (info.state == block_info::state_finished) return;
 
 		assert(block.block_index < blocks_in_piece(block.piece_index));
 #ifndef NDEBUG
-		if (i->requested_blocks[block.block_index] != 1)
+		if (info.state != block_info::state_requested)
 		{
 			assert(false);
 		}
 #endif
 
 		// clear this block as being downloaded
-		i->requested_blocks[block.block_index] = 0;
+		info.state = block_info::state_none;
+		--i->requested;
 
 		// if there are no other blocks in this pieces
 		// that's being downloaded, remove it from the list
-		if (i->requested_blocks.count() == 0)
+		if (i->requested == 0 && i->finished == 0)
 		{
-			m_downloads.erase(i);
-			m_piece_map[block.piece_index].downloading = 0;
+			erase_download_piece(i);
 			piece_pos& p = m_piece_map[block.piece_index];
-			move(true, p.filtered, p.priority(m_sequenced_download_threshold), p.index);
+			int prev_priority = p.priority(m_sequenced_download_threshold);
+			p.downloading = 0;
+			if (prev_priority >= 0) update(prev_priority, p.index);
 		}
 	}
 
@@ -1189,7 +1387,7 @@ namespace libtorrent
 		for (std::vector<downloading_piece>::const_iterator i = m_downloads.begin();
 			i != m_downloads.end(); ++i)
 		{
-			counter += (int)i->finished_blocks.count();
+			counter += (int)i->finished;
 		}
 		return counter;
 	}
@@ -320,31 +320,110 @@ namespace
 		return free_upload;
 	}
 
-	struct match_peer_ip
+	// the orderings the choker ranks the connected peers by.
+	// The best candidate is the one that compares less than
+	// all the others.
+
+	// the peer to choke first is one that isn't interested
+	// in us, and after that the one that gives us the least
+	struct choke_order
 	{
-		match_peer_ip(const tcp::endpoint& ip)
-			: m_ip(ip)
-		{}
+		static size_type weight(policy::peer const* p)
+		{
+			peer_connection const& c = *p->connection;
+			if (!c.is_peer_interested())
+				return std::numeric_limits<size_type>::min();
 
-		bool operator()(const policy::peer& p) const
-		{ return p.ip.address() == m_ip.address(); }
+			size_type diff = p->total_download()
+				- p->total_upload();
+
+			return static_cast<int>(c.statistics().download_rate() * 10.f)
+				+ diff
+				+ ((c.is_interesting() && c.has_peer_choked())?-10:10)*1024;
+		}
 
-		tcp::endpoint m_ip;
+		bool operator()(policy::peer const* lhs, policy::peer const* rhs) const
+		{ return weight(lhs) < weight(rhs); }
 	};
 
-	struct match_peer_connection
+	// the peer to unchoke first is the one we download
+	// the fastest from
+	struct unchoke_order
 	{
-		match_peer_connection(const peer_connection& c)
-			: m_conn(c)
-		{}
+		bool operator()(policy::peer const* lhs, policy::peer const* rhs) const
+		{
+			return lhs->connection->statistics().download_rate()
+				> rhs->connection->statistics().download_rate();
+		}
+	};
 
-		bool operator()(const policy::peer& p) const
-		{ return p.connection == &m_conn; }
+	// when seeding, the peer to choke first is one we don't owe
+	// anything to and that has been unchoked the longest. If we
+	// owe something to everybody, it's the one we owe the least.
+	struct seed_choke_order
+	{
+		bool operator()(policy::peer const* lhs, policy::peer const* rhs) const
+		{
+			size_type lhs_diff = lhs->connection->share_diff();
+			size_type rhs_diff = rhs->connection->share_diff();
+			if ((lhs_diff <= 0) != (rhs_diff <= 0))
+				return lhs_diff <= 0;
+			if (lhs_diff <= 0)
+				return lhs->last_optimistically_unchoked
+					< rhs->last_optimistically_unchoked;
+			return lhs_diff < rhs_diff;
+		}
+	};
 
-		const peer_connection& m_conn;
+	// when seeding, the peer to unchoke first is the one
+	// that has been waiting for it the longest
+	struct seed_unchoke_order
+	{
+		bool operator()(policy::peer const* lhs, policy::peer const* rhs) const
+		{
+			return lhs->last_optimistically_unchoked
+				< rhs->last_optimistically_unchoked;
+		}
 	};
 
+	// the peer to disconnect first is the one with the lowest
+	// average download rate since it was connected
+	struct disconnect_order
+	{
+		disconnect_order(ptime const& now_)
+			: now(now_)
+		{}
+
+		double transfer_rate(policy::peer const* p) const
+		{
+			double transferred_amount
+				= (double)p->connection->statistics().total_payload_download();
+
+			time_duration connected_time = now - p->connected;
 
+			double connected_time_in_seconds
+				= connected_time.seconds()
+				+ connected_time.minutes()*60.0
+				+ connected_time.hours()*60.0*60.0;
+
+			return transferred_amount / (connected_time_in_seconds+1);
+		}
+
+		bool operator()(policy::peer const* lhs, policy::peer const* rhs) const
+		{ return transfer_rate(lhs) < transfer_rate(rhs); }
+
+		ptime now;
+	};
+
+	// moves the num best peers, according to the order, to
+	// the front of the vector, sorted.
+	template <class Order>
+	void rank_peers(std::vector<policy::peer*>& peers, int num, Order o)
+	{
+		if (num > int(peers.size())) num = int(peers.size());
+		if (num <= 0) return;
+		std::partial_sort(peers.begin(), peers.begin() + num, peers.end(), o);
+	}
 }
 
 namespace libtorrent
@@ -356,270 +435,273 @@ namespace libtorrent
 		, m_num_unchoked(0)
 		, m_available_free_upload(0)
 		, m_last_optimistic_disconnect(boost::gregorian::date(1970,boost::gregorian::Jan,1))
+		, m_last_peer_sweep(second_clock::universal_time())
 	{ assert(t); }
-	// finds the peer that has the worst download rate
-	// and returns it. May return 0 if all peers are
-	// choked.
-	policy::peer* policy::find_choke_candidate()
+
+	policy::iterator policy::find_connection(peer_connection const& c)
 	{
-		INVARIANT_CHECK;
+		iterator i = m_peers.find(c.remote().address());
+		if (i == m_peers.end() || i->second.connection != &c)
+			return m_peers.end();
+		return i;
+	}
 
-		peer* worst_peer = 0;
-		size_type min_weight = std::numeric_limits<int>::min();
+	void policy::add_connected(peer& p)
+	{
+		assert(p.connection);
+		if (std::find(m_connected.begin(), m_connected.end(), &p)
+			!= m_connected.end()) return;
+		m_connected.push_back(&p);
+	}
+
+	void policy::remove_connected(peer& p)
+	{
+		std::vector<peer*>::iterator i = std::find(
+			m_connected.begin(), m_connected.end(), &p);
+		if (i == m_connected.end()) return;
+		// the order of the connected peers doesn't matter
+		*i = m_connected.back();
+		m_connected.pop_back();
+	}
+
+	void policy::erase_old_peers()
+	{
+		old_disconnected_peer is_old;
+		for (iterator i = m_peers.begin(); i != m_peers.end();)
+		{
+			if (!is_old(i->second))
+			{
+				++i;
+				continue;
+			}
+			erase_connect_candidate(i->second);
+			m_peers.erase(i++);
+		}
+	}
+	void policy::choke_candidates(std::vector<peer*>& peers, int num)
+	{
+		peers.clear();
 
 #ifndef NDEBUG
 		int unchoked_counter = m_num_unchoked;
 #endif
-		
-		// TODO: make this selection better
 
-		for (std::vector<peer>::iterator i = m_peers.begin();
-			i != m_peers.end(); ++i)
+		for (std::vector<peer*>::iterator i = m_connected.begin();
+			i != m_connected.end(); ++i)
 		{
-			peer_connection* c = i->connection;
-
-			if (c == 0) continue;
+			peer_connection* c = (*i)->connection;
+			assert(c);
 			if (c->is_choked()) continue;
 #ifndef NDEBUG
 			unchoked_counter--;
 #endif
 			if (c->is_disconnecting()) continue;
-			// if the peer isn't interested, just choke it
-			if (!c->is_peer_interested())
-				return &(*i);
-
-			size_type diff = i->total_download()
-				- i->total_upload();
-
-			size_type weight = static_cast<int>(c->statistics().download_rate() * 10.f)
-				+ diff
-				+ ((c->is_interesting() && c->has_peer_choked())?-10:10)*1024;
-
-			if (weight >= min_weight && worst_peer) continue;
-
-			min_weight = weight;
-			worst_peer = &(*i);
-			continue;
+			peers.push_back(*i);
 		}
 		assert(unchoked_counter == 0);
-		return worst_peer;
+		rank_peers(peers, num, choke_order());
 	}
 
-	policy::peer* policy::find_unchoke_candidate()
+	void policy::unchoke_candidates(std::vector<peer*>& peers, int num)
 	{
-		INVARIANT_CHECK;
+		peers.clear();
 
 		// if all of our peers are unchoked, there's
 		// no left to unchoke
 		if (m_num_unchoked == m_torrent->num_peers())
-			return 0;
-
-		using namespace boost::posix_time;
-		using namespace boost::gregorian;
-
-		peer* unchoke_peer = 0;
-		ptime min_time(date(9999,Jan,1));
-		float max_down_speed = 0.f;
-
-		// TODO: make this selection better
+			return;
 
-		for (std::vector<peer>::iterator i = m_peers.begin();
-			i != m_peers.end(); ++i)
+		for (std::vector<peer*>::iterator i = m_connected.begin();
+			i != m_connected.end(); ++i)
 		{
-			peer_connection* c = i->connection;
-			if (c == 0) continue;
+			peer_connection* c = (*i)->connection;
+			assert(c);
 			if (c->is_disconnecting()) continue;
 			if (!c->is_choked()) continue;
 			if (!c->is_peer_interested()) continue;
 			if (c->share_diff() < -free_upload_amount
 				&& m_torrent->ratio() != 0) continue;
-			if (c->statistics().download_rate() < max_down_speed) continue;
-//			if (i->last_optimistically_unchoked > min_time) continue;
-
-			min_time = i->last_optimistically_unchoked;
-			max_down_speed = c->statistics().download_rate();
-			unchoke_peer = &(*i);
+			peers.push_back(*i);
 		}
-		return unchoke_peer;
+		rank_peers(peers, num, unchoke_order());
 	}
 
-	policy::peer* policy::find_disconnect_candidate()
+	void policy::seed_choke_candidates(std::vector<peer*>& peers, int num)
 	{
-		peer *disconnect_peer = 0;
-		double slowest_transfer_rate = std::numeric_limits<double>::max();
+		peers.clear();
 
-		boost::posix_time::ptime local_time
-			= second_clock::universal_time();
-
-		for (std::vector<peer>::iterator i = m_peers.begin();
-			i != m_peers.end(); ++i)
+		for (std::vector<peer*>::iterator i = m_connected.begin();
+			i != m_connected.end(); ++i)
 		{
-			peer_connection* c = i->connection;
-			if(c == 0)
-				continue;
-			if(c->is_disconnecting())
-				continue;
-
-			double transferred_amount
-				= (double)c->statistics().total_payload_download();
-
-			boost::posix_time::time_duration connected_time
-				= local_time - i->connected;
-
-			double connected_time_in_seconds
-				= connected_time.seconds()
-				+ connected_time.minutes()*60.0
-				+ connected_time.hours()*60.0*60.0;
-
-			double transfer_rate
-				= transferred_amount / (connected_time_in_seconds+1);
-
-			if (transfer_rate <= slowest_transfer_rate)
-			{
-				slowest_transfer_rate = transfer_rate;
-				disconnect_peer = &(*i);
-			}
+			peer_connection* c = (*i)->connection;
+			assert(c);
+			if (c->is_choked()) continue;
+			if (c->is_disconnecting()) continue;
+			peers.push_back(*i);
 		}
-		return disconnect_peer;
+		rank_peers(peers, num, seed_choke_order());
 	}
 
-	policy::peer *policy::find_connect_candidate()
+	void policy::seed_unchoke_candidates(std::vector<peer*>& peers, int num)
 	{
-		boost::posix_time::ptime local_time=second_clock::universal_time();
-		boost::posix_time::ptime ptime(local_time);
-		policy::peer* candidate  =0;
+		peers.clear();
 
-		for (std::vector<peer>::iterator i = m_peers.begin();
-			i != m_peers.end(); ++i)
+		for (std::vector<peer*>::iterator i = m_connected.begin();
+			i != m_connected.end(); ++i)
 		{
-			if(i->connection) continue;
-			if(i->banned) continue;
-			if(i->type == peer::not_connectable) continue;
-
-			assert(i->connected <= local_time);
+			peer_connection* c = (*i)->connection;
+			assert(c);
+			if (!c->is_choked()) continue;
+			if (!c->is_peer_interested()) continue;
+			if (c->is_disconnecting()) continue;
+			peers.push_back(*i);
+		}
+		rank_peers(peers, num, seed_unchoke_order());
+	}
 
-			boost::posix_time::ptime next_connect = i->connected;
+	void policy::disconnect_candidates(std::vector<peer*>& peers, int num)
+	{
+		peers.clear();
 
-			if (next_connect <= ptime)
-			{
-				ptime = next_connect;
-				candidate = &(*i);
-			}
+		for (std::vector<peer*>::iterator i = m_connected.begin();
+			i != m_connected.end(); ++i)
+		{
+			peer_connection* c = (*i)->connection;
+			assert(c);
+			if (c->is_disconnecting()) continue;
+			peers.push_back(*i);
 		}
-		
-		assert(ptime <= local_time);
-
-		return candidate;
+		rank_peers(peers, num
+			, disconnect_order(second_clock::universal_time()));
 	}
 
-	policy::peer* policy::find_seed_choke_candidate()
+	policy::peer* policy::find_unchoke_candidate()
 	{
 		INVARIANT_CHECK;
 
-		assert(m_num_unchoked > 0);
-		// first choice candidate.
-		// it is a candidate we owe nothing to and which has been unchoked
-		// the longest.
-		using namespace boost::posix_time;
-		using namespace boost::gregorian;
+		std::vector<peer*> peers;
+		unchoke_candidates(peers, 1);
+		return peers.empty() ? 0 : peers.front();
+	}
 
-		peer* candidate = 0;
+	policy::peer *policy::find_connect_candidate()
+	{
+		// the candidates are ordered by the time they were
+		// last connected, so the first one is the one we
+		// tried the longest time ago
+		if (m_connect_candidates.empty()) return 0;
+		peer* candidate = *m_connect_candidates.begin();
+		assert(candidate->connected <= second_clock::universal_time());
+		return candidate;
+	}
 
-		// not valid when candidate == 0
-		ptime last_unchoke = ptime(date(1970, Jan, 1));
+	policy::peer* policy::find_seed_unchoke_candidate()
+	{
+		INVARIANT_CHECK;
 
-		// second choice candidate.
-		// if there is no first choice candidate, this candidate will be chosen.
-		// it is the candidate that we owe the least to.
-		peer* second_candidate = 0;
-		size_type lowest_share_diff = 0; // not valid when secondCandidate==0
+		std::vector<peer*> peers;
+		seed_unchoke_candidates(peers, 1);
+		return peers.empty() ? 0 : peers.front();
+	}
 
-		for (std::vector<peer>::iterator i = m_peers.begin();
-			i != m_peers.end(); ++i)
+	int policy::choke_peers(int num)
+	{
+		std::vector<peer*> peers;
+		choke_candidates(peers, num);
+		num = std::min(num, int(peers.size()));
+		for (int i = 0; i < num; ++i)
 		{
-			peer_connection* c = i->connection;
-            // ignore peers that are choked or
-            // whose connection is closed
-			if (c == 0) continue;
+			peer_connection* c = peers[i]->connection;
+			assert(!c->is_choked());
+			c->send_choke();
+			--m_num_unchoked;
+		}
+		return num;
+	}
 
-			if (c->is_choked()) continue;
-			if (c->is_disconnecting()) continue;
+	int policy::unchoke_peers(int num)
+	{
+		std::vector<peer*> peers;
+		unchoke_candidates(peers, num);
+		num = std::min(num, int(peers.size()));
+		ptime now = second_clock::universal_time();
+		for (int i = 0; i < num; ++i)
+		{
+			peer_connection* c = peers[i]->connection;
+			assert(c->is_choked());
+			c->send_unchoke();
+			peers[i]->last_optimistically_unchoked = now;
+			++m_num_unchoked;
+		}
+		return num;
+	}
 
-			size_type share_diff = c->share_diff();
+	int policy::seed_choke_peers(int num)
+	{
+		assert(m_num_unchoked > 0);
 
-			// select as second candidate the one that we owe the least
-			// to
-			if (!second_candidate || share_diff <= lowest_share_diff)
-			{
-				lowest_share_diff = share_diff;
-				second_candidate = &(*i);
-			}
-			
-			// select as first candidate the one that we don't owe anything to
-			// and has been waiting for an unchoke the longest
-			if (share_diff > 0) continue;
-			if (!candidate || last_unchoke > i->last_optimistically_unchoked)
-			{
-				last_unchoke = i->last_optimistically_unchoked;
-				candidate = &(*i);
-			}
+		std::vector<peer*> peers;
+		seed_choke_candidates(peers, num);
+		num = std::min(num, int(peers.size()));
+		for (int i = 0; i < num; ++i)
+		{
+			peer_connection* c = peers[i]->connection;
+			assert(!c->is_choked());
+			c->send_choke();
+			--m_num_unchoked;
 		}
-		if (candidate) return candidate;
-		if (second_candidate) return second_candidate;
-		assert(false);
-		return 0;
+		return num;
 	}
 
-	policy::peer* policy::find_seed_unchoke_candidate()
+	int policy::seed_unchoke_peers(int num)
 	{
-		INVARIANT_CHECK;
-
-		peer* candidate = 0;
-		boost::posix_time::ptime last_unchoke
-			= second_clock::universal_time();
+		std::vector<peer*> peers;
+		seed_unchoke_candidates(peers, num);
+		num = std::min(num, int(peers.size()));
+		ptime now = second_clock::universal_time();
+		for (int i = 0; i < num; ++i)
+		{
+			peer_connection* c = peers[i]->connection;
+			assert(c->is_choked());
+			c->send_unchoke();
+			peers[i]->last_optimistically_unchoked = now;
+			++m_num_unchoked;
+		}
+		return num;
+	}
 
-		for (std::vector<peer>::iterator i = m_peers.begin();
-			i != m_peers.end(); ++i)
+	int policy::disconnect_peers(int num)
+	{
+		std::vector<peer*> peers;
+		disconnect_candidates(peers, num);
+		num = std::min(num, int(peers.size()));
+		for (int i = 0; i < num; ++i)
 		{
-			peer_connection* c = i->connection;
-			if (c == 0) continue;
-			if (!c->is_choked()) continue;
-			if (!c->is_peer_interested()) continue;
-			if (c->is_disconnecting()) continue;
-			if (last_unchoke < i->last_optimistically_unchoked) continue;
-			last_unchoke = i->last_optimistically_unchoked;
-			candidate = &(*i);
+			// disconnecting a peer ends up in connection_closed(),
+			// which may unchoke other peers, but it leaves their
+			// connections in place
+			peer_connection* c = peers[i]->connection;
+			assert(c);
+#if defined(TORRENT_VERBOSE_LOGGING)
+			(*c->m_logger) << "*** CLOSING CONNECTION 'too many connections'\n";
+#endif
+			c->disconnect();
 		}
-		return candidate;
+		return num;
 	}
 
 	bool policy::seed_unchoke_one_peer()
 	{
 		INVARIANT_CHECK;
 
-		peer* p = find_seed_unchoke_candidate();
-		if (p != 0)
-		{
-			assert(p->connection->is_choked());
-			p->connection->send_unchoke();
-			p->last_optimistically_unchoked
-				= second_clock::universal_time();
-			++m_num_unchoked;
-		}
-		return p != 0;
+		return seed_unchoke_peers(1) == 1;
 	}
 
 	void policy::seed_choke_one_peer()
 	{
 		INVARIANT_CHECK;
 
-		peer* p = find_seed_choke_candidate();
-		if (p != 0)
-		{
-			assert(!p->connection->is_choked());
-			p->connection->send_choke();
-			--m_num_unchoked;
-		}
+		seed_choke_peers(1);
 	}
 
 	void policy::pulse()
@@ -634,12 +716,16 @@ namespace libtorrent
 		// we failed to connect to from this list
 		// to avoid being part of a DDOS-attack
 
-		// remove old disconnected peers from the list
-		m_peers.erase(
-			std::remove_if(m_peers.begin()
-				, m_peers.end()
-				, old_disconnected_peer())
-			, m_peers.end());
+		// remove old disconnected peers from the list. They
+		// are only considered old after 30 minutes, so there's
+		// no need to look through all peers more often than
+		// once a minute
+		ptime now = second_clock::universal_time();
+		if (now - m_last_peer_sweep > minutes(1))
+		{
+			erase_old_peers();
+			m_last_peer_sweep = now;
+		}
 
 		// -------------------------------------
 		// maintain the number of connections
@@ -649,10 +735,10 @@ namespace libtorrent
 		// that are currently in the process of disconnecting
 		int num_connected_peers = 0;
 
-		for (std::vector<peer>::iterator i = m_peers.begin();
-					i != m_peers.end(); ++i)
+		for (std::vector<peer*>::iterator i = m_connected.begin();
+			i != m_connected.end(); ++i)
 		{
-			if (i->connection && !i->connection->is_disconnecting())
+			if (!(*i)->connection->is_disconnecting())
 				++num_connected_peers;
 		}
 
@@ -678,12 +764,12 @@ namespace libtorrent
 				m_last_optimistic_disconnect = second_clock::universal_time();
 			}
 
-			while (num_connected_peers > max_connections)
+			if (num_connected_peers > max_connections)
 			{
-				bool ret = disconnect_one_peer();
+				int num = num_connected_peers - max_connections;
+				int ret = disconnect_peers(num);
 				(void)ret;
-				assert(ret);
-				--num_connected_peers;
+				assert(ret == num);
 			}
 		}
 
@@ -725,6 +811,10 @@ namespace libtorrent
 				, m_available_free_upload);
 		}
 
+		// the choking rounds rank the peers once and
+		// (un)choke as many as needed from that ranking
+		ptime choke_start = microsec_clock::universal_time();
+
 		// ------------------------
 		// seed choking policy
 		// ------------------------
@@ -732,16 +822,10 @@ namespace libtorrent
 		{
 			if (m_num_unchoked > m_torrent->m_uploads_quota.given)
 			{
-				do
-				{
-					peer* p = find_seed_choke_candidate();
-					--m_num_unchoked;
-					assert(p != 0);
-					if (p == 0) break;
-
-					assert(!p->connection->is_choked());
-					p->connection->send_choke();
-				} while (m_num_unchoked > m_torrent->m_uploads_quota.given);
+				int num = m_num_unchoked - m_torrent->m_uploads_quota.given;
+				int ret = seed_choke_peers(num);
+				(void)ret;
+				assert(ret == num);
 			}
 			else if (m_num_unchoked > 0)
 			{
@@ -763,10 +847,8 @@ namespace libtorrent
 
 			// make sure we have enough
 			// unchoked peers
-			while (m_num_unchoked < m_torrent->m_uploads_quota.given)
-			{
-				if (!seed_unchoke_one_peer()) break;
-			}
+			if (m_num_unchoked < m_torrent->m_uploads_quota.given)
+				seed_unchoke_peers(m_torrent->m_uploads_quota.given - m_num_unchoked);
 #ifndef NDEBUG
 			check_invariant();
 #endif
@@ -780,13 +862,13 @@ namespace libtorrent
 			if (m_torrent->ratio() != 0)
 			{
 				// choke peers that have leeched too much without giving anything back
-				for (std::vector<peer>::iterator i = m_peers.begin();
-					i != m_peers.end(); ++i)
+				for (std::vector<peer*>::iterator i = m_connected.begin();
+					i != m_connected.end(); ++i)
 				{
-					peer_connection* c = i->connection;
-					if (c == 0) continue;
+					peer_connection* c = (*i)->connection;
+					assert(c);
 
-					size_type diff = i->connection->share_diff();
+					size_type diff = c->share_diff();
 					if (diff < -free_upload_amount
 						&& !c->is_choked())
 					{
@@ -805,17 +887,7 @@ namespace libtorrent
 				// make sure we don't have too many
 				// unchoked peers
 				if (m_num_unchoked > m_torrent->m_uploads_quota.given)
-				{
-					do
-					{
-						peer* p = find_choke_candidate();
-						if (!p) break;
-						assert(p);
-						assert(!p->connection->is_choked());
-						p->connection->send_choke();
-						--m_num_unchoked;
-					} while (m_num_unchoked > m_torrent->m_uploads_quota.given);
-				}
+					choke_peers(m_num_unchoked - m_torrent->m_uploads_quota.given);
 				else
 				{
 					// optimistic unchoke. trade the 'worst'
@@ -836,19 +908,24 @@ namespace libtorrent
 
 			// make sure we have enough
 			// unchoked peers
-			while (m_num_unchoked < m_torrent->m_uploads_quota.given
-				&& unchoke_one_peer());
+			if (m_num_unchoked < m_torrent->m_uploads_quota.given)
+				unchoke_peers(m_torrent->m_uploads_quota.given - m_num_unchoked);
 		}
+
+		m_last_choke_round = microsec_clock::universal_time() - choke_start;
+#if defined(TORRENT_VERBOSE_LOGGING)
+		m_torrent->debug_log("choke round: "
+			+ boost::lexical_cast<std::string>(m_last_choke_round.total_microseconds())
+			+ " us, " + boost::lexical_cast<std::string>(m_connected.size())
+			+ " connected peers");
+#endif
 	}
 
 	void policy::ban_peer(const peer_connection& c)
 	{
 		INVARIANT_CHECK;
 
-		std::vector<peer>::iterator i = std::find_if(
-			m_peers.begin()
-			, m_peers.end()
-			, match_peer_connection(c));
+		iterator i = find_connection(c);
 
 		if (i == m_peers.end())
 		{
@@ -860,9 +937,10 @@ namespace libtorrent
 			return;
 		}
 
-		i->type = peer::not_connectable;
-		i->ip.port(0);
-		i->banned = true;
+		erase_connect_candidate(i->second);
+		i->second.type = peer::not_connectable;
+		i->second.ip.port(0);
+		i->second.banned = true;
 	}
 
 	void policy::new_connection(peer_connection& c)
@@ -905,22 +983,18 @@ namespace libtorrent
 		}
 #endif
 
-		std::vector<peer>::iterator i = std::find_if(
-			m_peers.begin()
-			, m_peers.end()
-			, match_peer_ip(c.remote()));
-
+		iterator i = m_peers.find(c.remote().address());
 
 		if (i != m_peers.end())
 		{
-			if (i->banned)
+			if (i->second.banned)
 				throw protocol_error("ip address banned, closing");
 
-			if (i->connection != 0)
+			if (i->second.connection != 0)
 			{
 				// the new connection is a local (outgoing) connection
 				// or the current one is already connected
-				if (!i->connection->is_connecting() || c.is_local())
+				if (!i->second.connection->is_connecting() || c.is_local())
 				{
 					throw protocol_error("duplicate connection, closing");
 				}
@@ -931,8 +1005,15 @@ namespace libtorrent
 					" is connecting and this connection is incoming. closing existing "
 					"connection in favour of this one");
 #endif
-					i->connection->disconnect();
-					i->connection = 0;
+					// disconnect() will normally end up in
+					// connection_closed(), which detaches the
+					// connection from the peer entry
+					i->second.connection->disconnect();
+					if (i->second.connection)
+					{
+						remove_connected(i->second);
+						i->second.connection = 0;
+					}
 				}
 			}
 		}
@@ -947,17 +1028,18 @@ namespace libtorrent
 			assert(c.remote() == c.get_socket()->remote_endpoint());
 #endif
 			peer p(c.remote(), peer::not_connectable);
-			m_peers.push_back(p);
-			i = m_peers.end()-1;
+			i = m_peers.insert(std::make_pair(c.remote().address(), p)).first;
 		}
 		
-		assert(i->connection == 0);
-		c.add_stat(i->prev_amount_download, i->prev_amount_upload);
-		i->prev_amount_download = 0;
-		i->prev_amount_upload = 0;
-		i->connection = &c;
-		assert(i->connection);
-		i->connected = second_clock::universal_time();
+		assert(i->second.connection == 0);
+		erase_connect_candidate(i->second);
+		c.add_stat(i->second.prev_amount_download, i->second.prev_amount_upload);
+		i->second.prev_amount_download = 0;
+		i->second.prev_amount_upload = 0;
+		i->second.connection = &c;
+		assert(i->second.connection);
+		i->second.connected = second_clock::universal_time();
+		add_connected(i->second);
 		m_last_optimistic_disconnect = second_clock::universal_time();
 	}
 
@@ -971,10 +1053,7 @@ namespace libtorrent
 
 		try
 		{
-			std::vector<peer>::iterator i = std::find_if(
-				m_peers.begin()
-				, m_peers.end()
-				, match_peer_ip(remote));
+			iterator i = m_peers.find(remote.address());
 			
 			bool just_added = false;
 			
@@ -986,22 +1065,20 @@ namespace libtorrent
 				// we don't have any info about this peer.
 				// add a new entry
 				peer p(remote, peer::connectable);
-				m_peers.push_back(p);
-				// the iterator is invalid
-				// because of the push_back()
-				i = m_peers.end() - 1;
+				i = m_peers.insert(std::make_pair(remote.address(), p)).first;
 				just_added = true;
 			}
 			else
 			{
-				i->type = peer::connectable;
+				erase_connect_candidate(i->second);
+				i->second.type = peer::connectable;
 
 				// in case we got the ip from a remote connection, port is
 				// not known, so save it. Client may also have changed port
 				// for some reason.
-				i->ip = remote;
+				i->second.ip = remote;
 
-				if (i->connection)
+				if (i->second.connection)
 				{
 					// this means we're already connected
 					// to this peer. don't connect to
@@ -1012,22 +1089,23 @@ namespace libtorrent
 						+ boost::lexical_cast<std::string>(remote.port()));
 #endif
 
-					assert(i->connection->associated_torrent().lock().get() == m_torrent);
+					assert(i->second.connection->associated_torrent().lock().get() == m_torrent);
 					return;
 				}
 			}
+			update_connect_candidate(i->second);
 
-			if (i->banned) return;
+			if (i->second.banned) return;
 
 			if (m_torrent->num_peers() < m_torrent->m_connections_quota.given
 				&& !m_torrent->is_paused())
 			{
-				if (!connect_peer(&*i) && just_added)
+				if (!connect_peer(&i->second) && just_added)
 				{
 					// if this peer was just added, and it
 					// failed to connect. Remove it from the list
 					// (to keep it in sync with the session's list)
-					assert(i == m_peers.end() - 1);
+					erase_connect_candidate(i->second);
 					m_peers.erase(i);
 				}
 			}
@@ -1059,16 +1137,17 @@ namespace libtorrent
 		if (successfully_verified)
 		{
 			// have all peers update their interested-flag
-			for (std::vector<peer>::iterator i = m_peers.begin();
-				i != m_peers.end(); ++i)
+			for (std::vector<peer*>::iterator i = m_connected.begin();
+				i != m_connected.end(); ++i)
 			{
-				if (i->connection == 0) continue;
+				peer_connection* c = (*i)->connection;
+				assert(c);
 				// if we're not interested, we will not become interested
-				if (!i->connection->is_interesting()) continue;
-				if (!i->connection->has_piece(index)) continue;
+				if (!c->is_interesting()) continue;
+				if (!c->has_piece(index)) continue;
 
 				bool interested = false;
-				const std::vector<bool>& peer_has = i->connection->get_bitfield();
+				const std::vector<bool>& peer_has = c->get_bitfield();
 				const std::vector<bool>& we_have = m_torrent->pieces();
 				assert(we_have.size() == peer_has.size());
 				for (int j = 0; j != (int)we_have.size(); ++j)
@@ -1080,8 +1159,8 @@ namespace libtorrent
 					}
 				}
 				if (!interested)
-					i->connection->send_not_interested();
-				assert(i->connection->is_interesting() == interested);
+					c->send_not_interested();
+				assert(c->is_interesting() == interested);
 			}
 		}
 	}
@@ -1115,9 +1194,7 @@ namespace libtorrent
 	{
 		INVARIANT_CHECK;
 
-		assert(std::find_if(m_peers.begin(), m_peers.end()
-			, boost::bind<bool>(std::equal_to<peer_connection*>(), bind(&peer::connection, _1)
-			, &c)) != m_peers.end());
+		assert(find_connection(c) != m_peers.end());
 		
 		// if the peer is choked and we have upload slots left,
 		// then unchoke it. Another condition that has to be met
@@ -1170,27 +1247,12 @@ namespace libtorrent
 
 	bool policy::unchoke_one_peer()
 	{
-		peer* p = find_unchoke_candidate();
-		if (p == 0) return false;
-		assert(p->connection);
-		assert(!p->connection->is_disconnecting());
-
-		assert(p->connection->is_choked());
-		p->connection->send_unchoke();
-		p->last_optimistically_unchoked = second_clock::universal_time();
-		++m_num_unchoked;
-		return true;
+		return unchoke_peers(1) == 1;
 	}
 
 	void policy::choke_one_peer()
 	{
-		peer* p = find_choke_candidate();
-		if (p == 0) return;
-		assert(p->connection);
-		assert(!p->connection->is_disconnecting());
-		assert(!p->connection->is_choked());
-		p->connection->send_choke();
-		--m_num_unchoked;
+		choke_peers(1);
 	}
 
 	bool policy::connect_one_peer()
@@ -1212,7 +1274,12 @@ namespace libtorrent
 		try
 		{
 			assert(!p->connection);
-			p->connection = &m_torrent->connect_to_peer(p->ip);
+			peer_connection& c = m_torrent->connect_to_peer(p->ip);
+			// a peer with a connection, even one that is still
+			// being established, is not a connect candidate. If
+			// connect_to_peer() throws, the peer stays one
+			erase_connect_candidate(*p);
+			p->connection = &c;
 			assert(p->connection);
 			p->connection->add_stat(p->prev_amount_download, p->prev_amount_upload);
 			p->prev_amount_download = 0;
@@ -1220,6 +1287,7 @@ namespace libtorrent
 			p->connected =
 				m_last_optimistic_disconnect = 
 					second_clock::universal_time();
+			add_connected(*p);
 			return true;
 		}
 		catch (std::exception& e)
@@ -1229,15 +1297,7 @@ namespace libtorrent
 
 	bool policy::disconnect_one_peer()
 	{
-		peer *p = find_disconnect_candidate();
-		if(!p)
-			return false;
-#if defined(TORRENT_VERBOSE_LOGGING)
-		(*p->connection->m_logger) << "*** CLOSING CONNECTION 'too many connections'\n";
-#endif
-
-		p->connection->disconnect();
-		return true;
+		return disconnect_peers(1) == 1;
 	}
 
 	// this is called whenever a peer connection is closed
@@ -1248,13 +1308,11 @@ namespace libtorrent
 //		assert(c.is_disconnecting());
 		bool unchoked = false;
 
-		std::vector<peer>::iterator i = std::find_if(
-			m_peers.begin()
-			, m_peers.end()
-			, match_peer_connection(c));
+		iterator j = find_connection(c);
 
 		// if we couldn't find the connection in our list, just ignore it.
-		if (i == m_peers.end()) return;
+		if (j == m_peers.end()) return;
+		peer* i = &j->second;
 		assert(i->connection == &c);
 
 		i->connected = second_clock::universal_time();
@@ -1281,6 +1339,8 @@ namespace libtorrent
 		i->prev_amount_download += c.statistics().total_payload_download();
 		i->prev_amount_upload += c.statistics().total_payload_upload();
 		i->connection = 0;
+		remove_connected(*i);
+		update_connect_candidate(*i);
 
 		if (unchoked)
 		{
@@ -1316,10 +1376,7 @@ namespace libtorrent
 #ifndef NDEBUG
 		assert(c->remote() == c->get_socket()->remote_endpoint());
 #endif
-		return std::find_if(
-			m_peers.begin()
-			, m_peers.end()
-			, match_peer_ip(c->remote())) != m_peers.end();
+		return m_peers.find(c->remote().address()) != m_peers.end();
 	}
 
 	void policy::check_invariant() const
@@ -1332,18 +1389,27 @@ namespace libtorrent
 		int nonempty_connections = 0;
 		
 		
-		for (std::vector<peer>::const_iterator i = m_peers.begin();
+		for (peers_t::const_iterator i = m_peers.begin();
 			i != m_peers.end(); ++i)
 		{
+			peer const& p = i->second;
+			assert(p.ip.address() == i->first);
+			peer* pp = const_cast<peer*>(&p);
+			assert(is_connect_candidate(p)
+				== (m_connect_candidates.find(pp) != m_connect_candidates.end()));
+			assert((p.connection != 0) == (std::find(m_connected.begin()
+				, m_connected.end(), pp) != m_connected.end()));
 			++total_connections;
-			if (!i->connection) continue;
+			if (!p.connection) continue;
 			++nonempty_connections;
-			if (!i->connection->is_disconnecting())
+			if (!p.connection->is_disconnecting())
 				++connected_peers;
-			if (!i->connection->is_choked()) ++actual_unchoked;
+			if (!p.connection->is_choked()) ++actual_unchoked;
 		}
 //		assert(actual_unchoked <= m_torrent->m_uploads_quota.given);
 		assert(actual_unchoked == m_num_unchoked);
+		assert(int(m_connected.size()) == nonempty_connections);
+		assert(m_connect_candidates.size() <= m_peers.size());
 
 		int num_torrent_peers = 0;
 		for (torrent::const_peer_iterator i = m_torrent->begin();
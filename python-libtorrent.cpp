@@ -22,7 +22,11 @@
 
 #include <Python.h>
 
+#include <deque>
+
 #include <boost/filesystem/exception.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/bind.hpp>
 
 #include "libtorrent/entry.hpp"
 #include "libtorrent/bencode.hpp"
@@ -32,6 +36,7 @@
 #include "libtorrent/storage.hpp"
 #include "libtorrent/hasher.hpp"
 #include "libtorrent/ip_filter.hpp"
+#include "libtorrent/create_torrent.hpp"
 
 #include <boost/filesystem/operations.hpp>
 
@@ -67,6 +72,7 @@ using boost::filesystem::path;
 #define EVENT_FASTRESUME_REJECTED_ERROR	8
 #define EVENT_TRACKER							9
 #define EVENT_OTHER				           	10
+#define EVENT_CREATE_TORRENT_PROGRESS		11
 
 #define STATE_QUEUED           0
 #define STATE_CHECKING         1
@@ -107,8 +113,57 @@ long					uniqueCounter	= 0;
 torrentNames_t   *torrentNames   = NULL;
 ip_filter		  *theFilter		= NULL;
 
+// Progress of createTorrent(). The pieces are hashed without
+// holding the GIL, so the events are queued here and handed
+// out by popEvent().
+struct create_progress_t
+{
+	std::string torrent;
+	long piecesDone;
+	long numPieces;
+};
+
+std::deque<create_progress_t> createProgress;
+boost::mutex                  createProgressMutex;
+
+// Protects ses and the global torrent lists above. Every call
+// into the session can block on the session's mutex, the disk
+// or the network, so the GIL is released around them and this
+// lock is what keeps concurrent python threads apart. It must
+// only be taken after the GIL has been released, never the
+// other way around.
+boost::mutex bindingMutex;
+
+// releases the GIL for as long as it's in scope
+class release_gil
+{
+public:
+	release_gil(): m_state(PyEval_SaveThread()) {}
+	~release_gil() { PyEval_RestoreThread(m_state); }
+private:
+	release_gil(release_gil const&);
+	release_gil& operator=(release_gil const&);
+	PyThreadState* m_state;
+};
+
 // Internal functions
 
+// called from the hashing threads. Only queues an event when
+// the percentage changes, to not flood the event queue
+void post_create_progress(std::string const& torrent, int* lastPercent
+	, int done, int total)
+{
+	boost::mutex::scoped_lock l(createProgressMutex);
+	int percent = total > 0 ? int(done * 100.0 / total) : 100;
+	if (percent == *lastPercent && done != total) return;
+	*lastPercent = percent;
+	create_progress_t p;
+	p.torrent = torrent;
+	p.piecesDone = done;
+	p.numPieces = total;
+	createProgress.push_back(p);
+}
+
 bool empty_name_check(const std::string & name)
 {
 	return 1;
@@ -224,6 +279,30 @@ long internal_add_torrent(std::string const& torrent
 	return (uniqueCounter - 1);
 }
 
+// writes the resume data of the torrent at index next to its
+// .torrent file. It's first written to a temporary file and then
+// renamed over the old one, so that a crash while writing never
+// leaves a truncated .fastresume behind
+void save_fastresume(long index, std::vector<char> const& data)
+{
+	if (data.empty()) return;
+
+	std::string path = torrentNames->at(index) + ".fastresume";
+	std::string tmp_path = path + ".tmp";
+	{
+		boost::filesystem::ofstream out(tmp_path, std::ios_base::binary);
+		out.write(&data[0], data.size());
+		if (!out) return;
+	}
+
+	if (rename(tmp_path.c_str(), path.c_str()) != 0)
+	{
+		// on windows rename() won't replace an existing file
+		remove(path.c_str());
+		rename(tmp_path.c_str(), path.c_str());
+	}
+}
+
 void internal_remove_torrent(long index)
 {
 	assert(index < handles->size());
@@ -235,16 +314,9 @@ void internal_remove_torrent(long index)
 	{
 		h.pause();
 
-		entry data = h.write_resume_data();
-
-		std::stringstream s;
-		s << torrentNames->at(index) << ".fastresume";
-//		printf("Saving fastresume to: %s\r\n", s.str().c_str());
-		boost::filesystem::ofstream out(s.str(), std::ios_base::binary);
-
-		out.unsetf(std::ios_base::skipws);
-
-		bencode(std::ostream_iterator<char>(out), data);
+		std::vector<char> data;
+		h.write_resume_data(data);
+		save_fastresume(index, data);
 	}
 
 	ses->remove_torrent(h);
@@ -266,6 +338,36 @@ void internal_remove_torrent(long index)
 	assert(handles->size() == torrentNames->size());
 }
 
+template <class T>
+bool get_alert_handle(alert* a, torrent_handle& h)
+{
+	T* ta = dynamic_cast<T*>(a);
+	if (!ta) return false;
+	h = ta->handle;
+	return true;
+}
+
+// returns the uniqueID of the torrent the alert refers to, or
+// -1 if it doesn't refer to a torrent we know about
+long get_alert_unique_id(alert* a)
+{
+	torrent_handle h;
+	if (get_alert_handle<torrent_finished_alert>(a, h)
+		|| get_alert_handle<file_error_alert>(a, h)
+		|| get_alert_handle<hash_failed_alert>(a, h)
+		|| get_alert_handle<peer_ban_alert>(a, h)
+		|| get_alert_handle<fastresume_rejected_alert>(a, h)
+		|| get_alert_handle<tracker_announce_alert>(a, h)
+		|| get_alert_handle<tracker_alert>(a, h)
+		|| get_alert_handle<tracker_reply_alert>(a, h)
+		|| get_alert_handle<tracker_warning_alert>(a, h))
+	{
+		if (handle_exists(h))
+			return uniqueIDs->at(get_torrent_index(h));
+	}
+	return -1;
+}
+
 long get_peer_index(libtorrent::tcp::endpoint addr, std::vector<peer_info> const& peers)
 {
 	long index = -1;
@@ -308,8 +410,15 @@ static PyObject *torrent_init(PyObject *self, PyObject *args)
 
 	PyArg_ParseTuple(args, "siiiis", &clientID, &v1, &v2, &v3, &v4, &userAgent);
 
+	std::string stdClientID(clientID);
+	std::string stdUserAgent(userAgent);
+
+	{
+	release_gil g;
+	boost::mutex::scoped_lock l(bindingMutex);
+
 	settings   		= new session_settings;
-	ses        		= new session(libtorrent::fingerprint(clientID, v1, v2, v3, v4));
+	ses        		= new session(libtorrent::fingerprint(stdClientID.c_str(), v1, v2, v3, v4));
 	handles    		= new handles_t;
 	uniqueIDs  		= new uniqueIDs_t;
 	filterOuts 		= new filterOuts_t;
@@ -322,7 +431,7 @@ static PyObject *torrent_init(PyObject *self, PyObject *args)
 	filterOuts->reserve(10);
 	torrentNames->reserve(10);
 
-	settings->user_agent = std::string(userAgent);// + " (libtorrent " LIBTORRENT_VERSION ")";
+	settings->user_agent = stdUserAgent;// + " (libtorrent " LIBTORRENT_VERSION ")";
 
 //	printf("ID: %s\r\n", clientID);
 //	printf("User Agent: %s\r\n", settings->user_agent.c_str());
@@ -338,6 +447,7 @@ static PyObject *torrent_init(PyObject *self, PyObject *args)
 //			ses.set_severity_level(alert::warning);
 //			ses.set_severity_level(alert::fatal);
 //			ses.set_severity_level(alert::info);
+	}
 
 /*	// Load old DHT data
 	std::ifstream dht_file;
@@ -358,7 +468,7 @@ static PyObject *torrent_init(PyObject *self, PyObject *args)
 	} else
 		printf("No DHT file found.\r\n");
 */
-	constants = Py_BuildValue("{s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i}",
+	constants = Py_BuildValue("{s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i}",
 										"EVENT_NULL",					EVENT_NULL,
 										"EVENT_FINISHED",				EVENT_FINISHED,
 										"EVENT_PEER_ERROR",			EVENT_PEER_ERROR,
@@ -369,6 +479,7 @@ static PyObject *torrent_init(PyObject *self, PyObject *args)
 										"EVENT_FASTRESUME_REJECTED_ERROR", EVENT_FASTRESUME_REJECTED_ERROR,
 										"EVENT_TRACKER",				EVENT_TRACKER,
 										"EVENT_OTHER",					EVENT_OTHER,
+										"EVENT_CREATE_TORRENT_PROGRESS", EVENT_CREATE_TORRENT_PROGRESS,
 										"STATE_QUEUED",				STATE_QUEUED,
 										"STATE_CHECKING",				STATE_CHECKING,
 										"STATE_CONNECTING",			STATE_CONNECTING,
@@ -387,6 +498,10 @@ static PyObject *torrent_init(PyObject *self, PyObject *args)
 
 static PyObject *torrent_quit(PyObject *self, PyObject *args)
 {
+	{
+	release_gil g;
+	boost::mutex::scoped_lock l(bindingMutex);
+
 	long Num = handles->size();
 
 	// Shut down torrents gracefully
@@ -409,6 +524,7 @@ static PyObject *torrent_quit(PyObject *self, PyObject *args)
 	delete settings;
 	delete handles;
 	delete uniqueIDs;
+	}
 
 	Py_DECREF(constants);
 
@@ -420,7 +536,11 @@ static PyObject *torrent_setMaxHalfOpenConnections(PyObject *self, PyObject *arg
 	pythonLong arg;
 	PyArg_ParseTuple(args, "i", &arg);
 
-	ses->set_max_half_open_connections(arg);
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		ses->set_max_half_open_connections(arg);
+	}
 
 	Py_INCREF(Py_None); return Py_None;
 }
@@ -430,7 +550,11 @@ static PyObject *torrent_setDownloadRateLimit(PyObject *self, PyObject *args)
 	pythonLong arg;
 	PyArg_ParseTuple(args, "i", &arg);
 printf("Capping download to %d bytes per second\r\n", (int)arg);
-	ses->set_download_rate_limit(arg);
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		ses->set_download_rate_limit(arg);
+	}
 
 	Py_INCREF(Py_None); return Py_None;
 }
@@ -440,7 +564,11 @@ static PyObject *torrent_setUploadRateLimit(PyObject *self, PyObject *args)
 	pythonLong arg;
 	PyArg_ParseTuple(args, "i", &arg);
 printf("Capping upload to %d bytes per second\r\n", (int)arg);
-	ses->set_upload_rate_limit(arg);
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		ses->set_upload_rate_limit(arg);
+	}
 
 	Py_INCREF(Py_None); return Py_None;
 }
@@ -450,21 +578,36 @@ static PyObject *torrent_setListenOn(PyObject *self, PyObject *args)
 	pythonLong portStart, portEnd;
 	PyArg_ParseTuple(args, "ii", &portStart, &portEnd);
 
-	ses->listen_on(std::make_pair(portStart, portEnd), "");
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		ses->listen_on(std::make_pair(portStart, portEnd), "");
+	}
 
 	Py_INCREF(Py_None); return Py_None;
 }
 
 static PyObject *torrent_isListening(PyObject *self, PyObject *args)
 {
-	long ret = (ses->is_listening() != 0);
+	long ret;
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		ret = (ses->is_listening() != 0);
+	}
 
 	return Py_BuildValue("i", ret);
 }
 
 static PyObject *torrent_listeningPort(PyObject *self, PyObject *args)
 {
-	return Py_BuildValue("i", (pythonLong)ses->listen_port());
+	pythonLong port;
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		port = ses->listen_port();
+	}
+	return Py_BuildValue("i", port);
 }
 
 static PyObject *torrent_setMaxUploads(PyObject *self, PyObject *args)
@@ -472,7 +615,11 @@ static PyObject *torrent_setMaxUploads(PyObject *self, PyObject *args)
 	pythonLong max_up;
 	PyArg_ParseTuple(args, "i", &max_up);
 
-	ses->set_max_uploads(max_up);
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		ses->set_max_uploads(max_up);
+	}
 
 	Py_INCREF(Py_None); return Py_None;
 }
@@ -483,7 +630,11 @@ static PyObject *torrent_setMaxConnections(PyObject *self, PyObject *args)
 	PyArg_ParseTuple(args, "i", &max_conn);
 
 //	printf("Setting max connections: %d\r\n", max_conn);
-	ses->set_max_connections(max_conn);
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		ses->set_max_connections(max_conn);
+	}
 
 	Py_INCREF(Py_None); return Py_None;
 }
@@ -494,53 +645,100 @@ static PyObject *torrent_addTorrent(PyObject *self, PyObject *args)
 	pythonLong compact;
 	PyArg_ParseTuple(args, "ssi", &name, &saveDir, &compact);
 
+	std::string stdName(name);
 	path saveDir_2	(saveDir, empty_name_check);
 
+	long ret;
+	{
+	release_gil g;
+	boost::mutex::scoped_lock l(bindingMutex);
+
 	try
 	{
-		return Py_BuildValue("i", internal_add_torrent(name, 0, compact, saveDir_2));
+		ret = internal_add_torrent(stdName, 0, compact, saveDir_2);
 	}
 	catch (invalid_encoding&)
 	{
-		return Py_BuildValue("i", ERROR_INVALID_ENCODING);
+		ret = ERROR_INVALID_ENCODING;
 	}
 	catch (invalid_torrent_file&)
 	{
-		return Py_BuildValue("i", ERROR_INVALID_TORRENT);
+		ret = ERROR_INVALID_TORRENT;
 	}
 	catch (boost::filesystem::filesystem_error&)
 	{
-		return Py_BuildValue("i", ERROR_FILESYSTEM);
+		ret = ERROR_FILESYSTEM;
 	}
 	catch (duplicate_torrent&)
 	{
-		return Py_BuildValue("i", ERROR_DUPLICATE_TORRENT);
+		ret = ERROR_DUPLICATE_TORRENT;
+	}
 	}
+
+	return Py_BuildValue("i", ret);
 }
 
 static PyObject *torrent_removeTorrent(PyObject *self, PyObject *args)
 {
 	pythonLong uniqueID;
 	PyArg_ParseTuple(args, "i", &uniqueID);
-	long index = get_index_from_unique(uniqueID);
-
-	internal_remove_torrent(index);
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		long index = get_index_from_unique(uniqueID);
+		internal_remove_torrent(index);
+	}
 
 	Py_INCREF(Py_None); return Py_None;
 }
 
+// saves the resume data of every torrent that has made progress
+// since it was last saved. Meant to be called periodically, so
+// that a crash doesn't lose everything downloaded since the
+// torrent was added. Returns the number of files written
+static PyObject *torrent_saveFastResumeCheckpoints(PyObject *self, PyObject *args)
+{
+	long num = 0;
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+
+		std::vector<char> data;
+		for (unsigned long i = 0; i < handles->size(); i++)
+		{
+			torrent_handle& h = handles->at(i);
+			if (!h.is_valid() || !h.has_metadata()) continue;
+
+			data.clear();
+			if (!h.write_resume_checkpoint(data)) continue;
+			save_fastresume(i, data);
+			++num;
+		}
+	}
+	return Py_BuildValue("i", num);
+}
+
 static PyObject *torrent_getNumTorrents(PyObject *self, PyObject *args)
 {
-	return Py_BuildValue("i", handles->size());
+	long num;
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		num = handles->size();
+	}
+	return Py_BuildValue("i", num);
 }
 
 static PyObject *torrent_reannounce(PyObject *self, PyObject *args)
 {
 	pythonLong uniqueID;
 	PyArg_ParseTuple(args, "i", &uniqueID);
-	long index = get_index_from_unique(uniqueID);
-
-	handles->at(index).force_reannounce();
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		long index = get_index_from_unique(uniqueID);
+		handles->at(index).force_reannounce();
+	}
 
 	Py_INCREF(Py_None); return Py_None;
 }
@@ -549,9 +747,12 @@ static PyObject *torrent_pause(PyObject *self, PyObject *args)
 {
 	pythonLong uniqueID;
 	PyArg_ParseTuple(args, "i", &uniqueID);
-	long index = get_index_from_unique(uniqueID);
-
-	handles->at(index).pause();
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		long index = get_index_from_unique(uniqueID);
+		handles->at(index).pause();
+	}
 
 	Py_INCREF(Py_None); return Py_None;
 }
@@ -560,9 +761,12 @@ static PyObject *torrent_resume(PyObject *self, PyObject *args)
 {
 	pythonLong uniqueID;
 	PyArg_ParseTuple(args, "i", &uniqueID);
-	long index = get_index_from_unique(uniqueID);
-
-	handles->at(index).resume();
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		long index = get_index_from_unique(uniqueID);
+		handles->at(index).resume();
+	}
 
 	Py_INCREF(Py_None); return Py_None;
 }
@@ -571,33 +775,58 @@ static PyObject *torrent_getName(PyObject *self, PyObject *args)
 {
 	pythonLong uniqueID;
 	PyArg_ParseTuple(args, "i", &uniqueID);
-	long index = get_index_from_unique(uniqueID);
+	std::string name;
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		long index = get_index_from_unique(uniqueID);
+		name = handles->at(index).get_torrent_info().name();
+	}
 
-	return Py_BuildValue("s", handles->at(index).get_torrent_info().name().c_str());
+	return Py_BuildValue("s", name.c_str());
 }
 
 static PyObject *torrent_getState(PyObject *self, PyObject *args)
 {
 	pythonLong uniqueID;
 	PyArg_ParseTuple(args, "i", &uniqueID);
-	long index = get_index_from_unique(uniqueID);
-
-	torrent_status			 s = handles->at(index).status();
-	const torrent_info	&i = handles->at(index).get_torrent_info();
-
-	std::vector<peer_info> peers;
-	handles->at(index).get_peer_info(peers);
+	torrent_status	s;
+	size_type		total_size;
+	long				piece_length;
+	long				num_pieces;
+	long				is_paused;
+	long				is_seed;
 
 	long total_seeds = 0;
 	long total_peers = 0;
 
-	for (unsigned long i = 0; i < peers.size(); i++)
-		if (peers[i].seed)
-			total_seeds++;
-		else
-			total_peers++;
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		long index = get_index_from_unique(uniqueID);
+		torrent_handle& h = handles->at(index);
+
+		s = h.status();
+		const torrent_info	&i = h.get_torrent_info();
+		total_size = i.total_size();
+		piece_length = long(i.piece_length());
+		num_pieces = i.num_pieces();
+		// take these from the status, asking the handle would
+		// lock the session twice more for every torrent
+		is_paused = s.paused;
+		is_seed = s.num_pieces == num_pieces;
+
+		std::vector<peer_info> peers;
+		h.get_peer_info(peers);
+
+		for (unsigned long i = 0; i < peers.size(); i++)
+			if (peers[i].seed)
+				total_seeds++;
+			else
+				total_peers++;
+	}
 
-	return Py_BuildValue("{s:l,s:l,s:l,s:f,s:f,s:d,s:f,s:l,s:f,s:l,s:s,s:s,s:f,s:d,s:l,s:l,s:l,s:d,s:l,s:l,s:l,s:l,s:l,s:l,s:d,s:d,s:l,s:l}",
+	return Py_BuildValue("{s:l,s:l,s:l,s:f,s:f,s:d,s:f,s:l,s:f,s:l,s:s,s:s,s:f,s:d,s:l,s:l,s:l,s:d,s:l,s:l,s:l,s:l,s:l,s:l,s:d,s:d,s:l,s:l,s:l}",
 								"state",					s.state,
 								"numPeers", 			s.num_peers,
 								"numSeeds", 			s.num_seeds,
@@ -615,24 +844,45 @@ static PyObject *torrent_getState(PyObject *self, PyObject *args)
 								"totalPieces",			long(s.pieces),
 								"piecesDone",			long(s.num_pieces),
 								"blockSize",			long(s.block_size),
-								"totalSize",			double(i.total_size()),
-								"pieceLength",			long(i.piece_length()),
-								"numPieces",			long(i.num_pieces()),
+								"totalSize",			double(total_size),
+								"pieceLength",			piece_length,
+								"numPieces",			num_pieces,
 								"totalSeeds",			total_seeds,
 								"totalPeers",			total_peers,
-								"isPaused",				long(handles->at(index).is_paused()),
-								"isSeed",				long(handles->at(index).is_seed()),
+								"isPaused",				is_paused,
+								"isSeed",				is_seed,
 								"totalWanted",			double(s.total_wanted),
 								"totalWantedDone",	double(s.total_wanted_done),
 								"numComplete",			long(s.num_complete),
-								"numIncomplete",		long(s.num_incomplete));
+								"numIncomplete",		long(s.num_incomplete),
+								"chokeRoundDuration",	long(s.choke_round_duration));
 };
 
 static PyObject *torrent_popEvent(PyObject *self, PyObject *args)
 {
+	{
+		boost::mutex::scoped_lock l(createProgressMutex);
+		if (!createProgress.empty())
+		{
+			create_progress_t p = createProgress.front();
+			createProgress.pop_front();
+			l.unlock();
+			return Py_BuildValue("{s:i,s:s,s:l,s:l}", "eventType", EVENT_CREATE_TORRENT_PROGRESS,
+													"torrent",    p.torrent.c_str(),
+													"piecesDone", p.piecesDone,
+													"numPieces",  p.numPieces);
+		}
+	}
+
 	std::auto_ptr<alert> a;
+	long uniqueID;
 
-	a = ses->pop_alert();
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		a = ses->pop_alert();
+		uniqueID = a.get() ? get_alert_unique_id(a.get()) : -1;
+	}
 
 	alert *poppedAlert = a.get();
 
@@ -641,11 +891,9 @@ static PyObject *torrent_popEvent(PyObject *self, PyObject *args)
 		Py_INCREF(Py_None); return Py_None;
 	} else if (dynamic_cast<torrent_finished_alert*>(poppedAlert))
 	{
-		torrent_handle handle = (dynamic_cast<torrent_finished_alert*>(poppedAlert))->handle;
-
-		if (handle_exists(handle))
+		if (uniqueID != -1)
 			return Py_BuildValue("{s:i,s:i}", "eventType", EVENT_FINISHED,
-														 "uniqueID",  uniqueIDs->at(get_torrent_index(handle)));
+														 "uniqueID",  uniqueID);
 		else
 		{ Py_INCREF(Py_None); return Py_None; }
 	} else if (dynamic_cast<peer_error_alert*>(poppedAlert))
@@ -666,87 +914,72 @@ static PyObject *torrent_popEvent(PyObject *self, PyObject *args)
 													 		"message",   a->msg().c_str()                 );
 	} else if (dynamic_cast<file_error_alert*>(poppedAlert))
 	{
-		torrent_handle handle = (dynamic_cast<file_error_alert*>(poppedAlert))->handle;
-
-		if (handle_exists(handle))
+		if (uniqueID != -1)
 			return Py_BuildValue("{s:i,s:i,s:s}",  "eventType", EVENT_FILE_ERROR,
-																"uniqueID",  uniqueIDs->at(get_torrent_index(handle)),
+																"uniqueID",  uniqueID,
 														 		"message",   a->msg().c_str()                 );
 		else
 		{ Py_INCREF(Py_None); return Py_None; }
 	} else if (dynamic_cast<hash_failed_alert*>(poppedAlert))
 	{
-		torrent_handle handle = (dynamic_cast<hash_failed_alert*>(poppedAlert))->handle;
-
-		if (handle_exists(handle))
+		if (uniqueID != -1)
 			return Py_BuildValue("{s:i,s:i,s:i,s:s}",  "eventType",  EVENT_HASH_FAILED_ERROR,
-																"uniqueID",   uniqueIDs->at(get_torrent_index(handle)),
+																"uniqueID",   uniqueID,
 																"pieceIndex", long((dynamic_cast<hash_failed_alert*>(poppedAlert))->piece_index),
 														 		"message",    a->msg().c_str()                 );
 		else
 		{ Py_INCREF(Py_None); return Py_None; }
 	} else if (dynamic_cast<peer_ban_alert*>(poppedAlert))
 	{
-		torrent_handle handle = (dynamic_cast<peer_ban_alert*>(poppedAlert))->handle;
 		std::string peerIP = (dynamic_cast<peer_ban_alert*>(poppedAlert))->ip.address().to_string();
 
-		if (handle_exists(handle))
+		if (uniqueID != -1)
 			return Py_BuildValue("{s:i,s:i,s:s,s:s}",  "eventType",  EVENT_PEER_BAN_ERROR,
-																"uniqueID",   uniqueIDs->at(get_torrent_index(handle)),
+																"uniqueID",   uniqueID,
 																"ip",			  peerIP.c_str(),
 														 		"message",    a->msg().c_str()                 );
 		else
 		{ Py_INCREF(Py_None); return Py_None; }
 	} else if (dynamic_cast<fastresume_rejected_alert*>(poppedAlert))
 	{
-		torrent_handle handle = (dynamic_cast<fastresume_rejected_alert*>(poppedAlert))->handle;
-
-		if (handle_exists(handle))
+		if (uniqueID != -1)
 			return Py_BuildValue("{s:i,s:i,s:s}",  "eventType",  EVENT_FASTRESUME_REJECTED_ERROR,
-																"uniqueID",   uniqueIDs->at(get_torrent_index(handle)),
+																"uniqueID",   uniqueID,
 														 		"message",    a->msg().c_str()                 );
 		else
 		{ Py_INCREF(Py_None); return Py_None; }
 	} else if (dynamic_cast<tracker_announce_alert*>(poppedAlert))
 	{
-		torrent_handle handle = (dynamic_cast<tracker_announce_alert*>(poppedAlert))->handle;
-
-		if (handle_exists(handle))
+		if (uniqueID != -1)
 			return Py_BuildValue("{s:i,s:i,s:s,s:s}", "eventType",  		EVENT_TRACKER,
-																	"uniqueID",   		uniqueIDs->at(get_torrent_index(handle)),
+																	"uniqueID",   		uniqueID,
 																	"trackerStatus",	"Announce sent",
 														 			"message",    		a->msg().c_str()                 );
 		else
 		{ Py_INCREF(Py_None); return Py_None; }
 	} else if (dynamic_cast<tracker_alert*>(poppedAlert))
 	{
-		torrent_handle handle = (dynamic_cast<tracker_alert*>(poppedAlert))->handle;
-
-		if (handle_exists(handle))
+		if (uniqueID != -1)
 			return Py_BuildValue("{s:i,s:i,s:s,s:s}", "eventType",  		EVENT_TRACKER,
-																	"uniqueID",   		uniqueIDs->at(get_torrent_index(handle)),
+																	"uniqueID",   		uniqueID,
 																	"trackerStatus",	"Bad response (status code=?)",
 														 			"message",    		a->msg().c_str()                 );
 		else
 		{ Py_INCREF(Py_None); return Py_None; }
 	} else if (dynamic_cast<tracker_reply_alert*>(poppedAlert))
 	{
-		torrent_handle handle = (dynamic_cast<tracker_reply_alert*>(poppedAlert))->handle;
-
-		if (handle_exists(handle))
+		if (uniqueID != -1)
 			return Py_BuildValue("{s:i,s:i,s:s,s:s}", "eventType",  		EVENT_TRACKER,
-																	"uniqueID",   		uniqueIDs->at(get_torrent_index(handle)),
+																	"uniqueID",   		uniqueID,
 																	"trackerStatus",	"Announce succeeded",
 														 			"message",    		a->msg().c_str()                 );
 		else
 		{ Py_INCREF(Py_None); return Py_None; }
 	} else if (dynamic_cast<tracker_warning_alert*>(poppedAlert))
 	{
-		torrent_handle handle = (dynamic_cast<tracker_warning_alert*>(poppedAlert))->handle;
-
-		if (handle_exists(handle))
+		if (uniqueID != -1)
 			return Py_BuildValue("{s:i,s:i,s:s,s:s}", "eventType",  		EVENT_TRACKER,
-																	"uniqueID",   		uniqueIDs->at(get_torrent_index(handle)),
+																	"uniqueID",   		uniqueID,
 																	"trackerStatus",	"Warning in response",
 														 			"message",    		a->msg().c_str()                 );
 		else
@@ -759,25 +992,48 @@ static PyObject *torrent_popEvent(PyObject *self, PyObject *args)
 
 static PyObject *torrent_getSessionInfo(PyObject *self, PyObject *args)
 {
-	session_status s = ses->status();
+	session_status s;
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		s = ses->status();
+	}
 
-	return Py_BuildValue("{s:l,s:f,s:f,s:f,s:f,s:l}",
+	return Py_BuildValue("{s:l,s:f,s:f,s:f,s:f,s:l,s:l,s:l,s:l,s:L,s:L,s:l,s:l,s:L,s:L,s:L,s:L,s:L,s:l,s:l,s:l}",
 								"hasIncomingConnections",		long(s.has_incoming_connections),
 								"uploadRate",						float(s.upload_rate),
 								"downloadRate",					float(s.download_rate),
 								"payloadUploadRate",				float(s.payload_upload_rate),
 								"payloadDownloadRate",			float(s.payload_download_rate),
-								"numPeers",							long(s.num_peers));
+								"numPeers",							long(s.num_peers),
+								"diskQueueDepth",					long(s.disk_queue_depth),
+								"diskAverageLatency",			long(s.disk_average_latency),
+								"diskMaxLatency",					long(s.disk_max_latency),
+								"readCacheHits",					(long long)(s.read_cache_hits),
+								"readCacheMisses",				(long long)(s.read_cache_misses),
+								"readCacheSize",					long(s.read_cache_size),
+								"writeCacheSize",					long(s.write_cache_size),
+								"blocksWritten",					(long long)(s.blocks_written),
+								"diskWrites",						(long long)(s.disk_writes),
+								"forcedWriteFlushes",			(long long)(s.forced_write_flushes),
+								"bytesHashedFromMemory",		(long long)(s.bytes_hashed_from_memory),
+								"bytesHashedFromDisk",			(long long)(s.bytes_hashed_from_disk),
+								"tickDuration",					long(s.tick_duration),
+								"maxTickDuration",				long(s.max_tick_duration),
+								"tickExpiredTimers",				long(s.tick_expired_timers));
 }
 
 static PyObject *torrent_getPeerInfo(PyObject *self, PyObject *args)
 {
 	pythonLong uniqueID;
 	PyArg_ParseTuple(args, "i", &uniqueID);
-	long index = get_index_from_unique(uniqueID);
-
 	std::vector<peer_info> peers;
-	handles->at(index).get_peer_info(peers);
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		long index = get_index_from_unique(uniqueID);
+		handles->at(index).get_peer_info(peers);
+	}
 
 	PyObject *peerInfo;
 
@@ -825,24 +1081,33 @@ static PyObject *torrent_getFileInfo(PyObject *self, PyObject *args)
 {
 	pythonLong uniqueID;
 	PyArg_ParseTuple(args, "i", &uniqueID);
-	long index = get_index_from_unique(uniqueID);
-
 	std::vector<PyObject *> tempFiles;
 
 	PyObject *fileInfo;
 
 	std::vector<float> progresses;
+	std::vector<file_entry> files;
+	filterOut_t filterOut;
 
-	handles->at(index).file_progress(progresses);
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		long index = get_index_from_unique(uniqueID);
 
-	torrent_info::file_iterator start = handles->at(index).get_torrent_info().begin_files();
-	torrent_info::file_iterator end   = handles->at(index).get_torrent_info().end_files();
+		handles->at(index).file_progress(progresses);
 
-	long fileIndex = 0;
+		torrent_info const& info = handles->at(index).get_torrent_info();
+		files.assign(info.begin_files(), info.end_files());
+
+		filterOut = filterOuts->at(index);
+	}
+
+	std::vector<file_entry>::iterator start = files.begin();
+	std::vector<file_entry>::iterator end   = files.end();
 
-	filterOut_t &filterOut = filterOuts->at(index);
+	long fileIndex = 0;
 
-	for(torrent_info::file_iterator i = start; i != end; ++i)
+	for(std::vector<file_entry>::iterator i = start; i != end; ++i)
 	{
 		file_entry const &currFile = (*i);
 
@@ -873,17 +1138,24 @@ static PyObject *torrent_setFilterOut(PyObject *self, PyObject *args)
 	pythonLong uniqueID;
 	PyObject *filterOutObject;
 	PyArg_ParseTuple(args, "iO", &uniqueID, &filterOutObject);
-	long index = get_index_from_unique(uniqueID);
-
-	long numFiles = handles->at(index).get_torrent_info().num_files();
-	assert(PyList_Size(filterOutObject) ==  numFiles);
+	filterOut_t filterOut(PyList_Size(filterOutObject));
 
-	for (long i = 0; i < numFiles; i++)
+	for (long i = 0; i < long(filterOut.size()); i++)
 	{
-		filterOuts->at(index).at(i) = PyInt_AsLong(PyList_GetItem(filterOutObject, i));
+		filterOut.at(i) = PyInt_AsLong(PyList_GetItem(filterOutObject, i));
 	};
 
-	handles->at(index).filter_files(filterOuts->at(index));
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		long index = get_index_from_unique(uniqueID);
+
+		long numFiles = handles->at(index).get_torrent_info().num_files();
+		assert(long(filterOut.size()) ==  numFiles);
+
+		filterOuts->at(index) = filterOut;
+		handles->at(index).filter_files(filterOuts->at(index));
+	}
 
 	Py_INCREF(Py_None); return Py_None;
 }
@@ -901,6 +1173,11 @@ static PyObject *torrent_startDHT(PyObject *self, PyObject *args)
 	printf("Loading DHT state from %s\r\n", DHTpath);
 
 	path tempPath(DHTpath, empty_name_check);
+
+	{
+	release_gil g;
+	boost::mutex::scoped_lock l(bindingMutex);
+
 	boost::filesystem::ifstream dht_state_file(tempPath, std::ios_base::binary);
 	dht_state_file.unsetf(std::ios_base::skipws);
 	entry dht_state;
@@ -916,6 +1193,7 @@ static PyObject *torrent_startDHT(PyObject *self, PyObject *args)
 	ses->add_dht_router(std::make_pair(std::string("router.bittorrent.com"), DHT_ROUTER_PORT));
 	ses->add_dht_router(std::make_pair(std::string("router.utorrent.com"), DHT_ROUTER_PORT));
 	ses->add_dht_router(std::make_pair(std::string("router.bitcomet.com"), DHT_ROUTER_PORT));
+	}
 
 	Py_INCREF(Py_None); return Py_None;
 }
@@ -929,6 +1207,10 @@ static PyObject *torrent_stopDHT(PyObject *self, PyObject *args)
 
 	path tempPath = path(DHTpath, empty_name_check);
 
+	{
+	release_gil g;
+	boost::mutex::scoped_lock l(bindingMutex);
+
 	try {
 		entry dht_state = ses->dht_state();
 		boost::filesystem::ofstream out(tempPath, std::ios_base::binary);
@@ -938,6 +1220,7 @@ static PyObject *torrent_stopDHT(PyObject *self, PyObject *args)
 		printf("An error occured in saving DHT\r\n");
       std::cerr << e.what() << "\n";
 	}
+	}
 
 	Py_INCREF(Py_None); return Py_None;
 }
@@ -945,7 +1228,12 @@ static PyObject *torrent_stopDHT(PyObject *self, PyObject *args)
 static PyObject *torrent_getDHTinfo(PyObject *self, PyObject *args)
 {
 //	printf("Pouring out DHT state:\r\n");
-	entry DHTstate = ses->dht_state();
+	entry DHTstate;
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+		DHTstate = ses->dht_state();
+	}
 //	DHTstate.print(cout);
 
 	entry *nodes = DHTstate.find_key("nodes");
@@ -973,28 +1261,48 @@ static PyObject *torrent_getDHTinfo(PyObject *self, PyObject *args)
 // createTorrent("mytorrent.torrent", "directory or file to make a torrent out of",
 //               "tracker1\ntracker2\ntracker3", "no comment", 256, "Deluge");
 // That makes a torrent with pieces of 256K, with "Deluge" as the creator string.
+// An optional 7th argument sets the number of hashing threads (default 2).
+// The GIL is released while hashing, and the progress is reported through
+// popEvent() as EVENT_CREATE_TORRENT_PROGRESS events.
 //
 // The following function contains code by Christophe Dumez and Arvid Norberg
 static PyObject *torrent_createTorrent(PyObject *self, PyObject *args)
 {
 	char *destination, *comment, *creator_str, *input, *trackers;
 	pythonLong piece_size;
-	PyArg_ParseTuple(args, "ssssis", &destination, &input, &trackers, &comment, &piece_size, 													&creator_str);
+	pythonLong num_threads = 2;
+	if (!PyArg_ParseTuple(args, "ssssis|i", &destination, &input, &trackers, &comment, &piece_size,
+									&creator_str, &num_threads))
+		return NULL;
 
 	piece_size = piece_size * 1024;
 
+	// copy the arguments, the python strings can't be touched
+	// once the GIL is released
+	std::string stdDestination(destination);
+	std::string stdInput(input);
+	std::string stdTrackers(trackers);
+	std::string stdComment(comment);
+	std::string stdCreator(creator_str);
+
+	bool ok = true;
+	std::string error;
+	int lastPercent = -1;
+
+	{
+	// this doesn't touch the session, so it doesn't need the
+	// binding lock
+	release_gil g;
+
 	try
 	{
 		torrent_info t;
-		path full_path = complete(path(input));
-		boost::filesystem::ofstream out(complete(path(destination)), std::ios_base::binary);
+		path full_path = complete(path(stdInput));
+		boost::filesystem::ofstream out(complete(path(stdDestination)), std::ios_base::binary);
 
 		internal_add_files(t, full_path.branch_path(), full_path.leaf());
 		t.set_piece_size(piece_size);
 
-		storage st(t, full_path.branch_path());
-
-		std::string stdTrackers(trackers);
 		unsigned long index = 0, next = stdTrackers.find("\n");
 		while (1 == 1)
 		{
@@ -1007,26 +1315,28 @@ static PyObject *torrent_createTorrent(PyObject *self, PyObject *args)
 				break;
 		}
 
-		int num = t.num_pieces();
-		std::vector<char> buf(piece_size);
-		for (int i = 0; i < num; ++i)
-		{
-			st.read(&buf[0], i, 0, t.piece_size(i));
-			hasher h(&buf[0], t.piece_size(i));
-			t.set_hash(i, h.final());
-		}
+		set_piece_hashes(t, full_path.branch_path(), num_threads
+			, boost::bind(&post_create_progress, stdDestination, &lastPercent, _1, _2));
 
-		t.set_creator(creator_str);
-		t.set_comment(comment);
+		t.set_creator(stdCreator.c_str());
+		t.set_comment(stdComment.c_str());
 
-		entry e = t.create_torrent();
-		libtorrent::bencode(std::ostream_iterator<char>(out), e);
-		return Py_BuildValue("l", 1);
+		std::vector<char> buf;
+		t.create_torrent(buf);
+		if (!buf.empty()) out.write(&buf[0], buf.size());
 	} catch (std::exception& e)
 	{
-		std::cerr << e.what() << "\n";
+		ok = false;
+		error = e.what();
+	}
+	}
+
+	if (!ok)
+	{
+		std::cerr << error << "\n";
 		return Py_BuildValue("l", 0);
 	}
+	return Py_BuildValue("l", 1);
 }
 
 static PyObject *torrent_applyIPFilter(PyObject *self, PyObject *args)
@@ -1039,11 +1349,7 @@ static PyObject *torrent_applyIPFilter(PyObject *self, PyObject *args)
 //	printf("Number of ranges: %ld\r\n", numRanges);
 //	Py_INCREF(Py_None); return Py_None;
 
-	// Remove existing filter, if there is one
-	if (theFilter != NULL)
-		delete theFilter;
-
-	theFilter = new ip_filter();
+	ip_filter* newFilter = new ip_filter();
 
 	address_v4 from, to;
 	PyObject *curr;
@@ -1057,12 +1363,23 @@ static PyObject *torrent_applyIPFilter(PyObject *self, PyObject *args)
 		from = address_v4::from_string(PyString_AsString(PyList_GetItem(curr, 0)));
 		to   = address_v4::from_string(PyString_AsString(PyList_GetItem(curr, 1)));
 //		printf("Filtering: %s - %s\r\n", from.to_string().c_str(), to.to_string().c_str());
-		theFilter->add_rule(from, to, ip_filter::blocked);
+		newFilter->add_rule(from, to, ip_filter::blocked);
 	};
 
 //	printf("Can I 10.10.10.10? %d\r\n", theFilter->access(address_v4::from_string("10.10.10.10")));
 
-	ses->set_ip_filter(*theFilter);
+	{
+		release_gil g;
+		boost::mutex::scoped_lock l(bindingMutex);
+
+		// Remove existing filter, if there is one
+		if (theFilter != NULL)
+			delete theFilter;
+
+		theFilter = newFilter;
+
+		ses->set_ip_filter(*theFilter);
+	}
 
 //	printf("Can I 10.10.10.10? %d\r\n", theFilter->access(address_v4::from_string("10.10.10.10")));
 
@@ -1088,6 +1405,7 @@ static PyMethodDef TorrentMethods[] = {
 	{"addTorrent",                torrent_addTorrent,           METH_VARARGS,		 "."},
 	{"removeTorrent",             torrent_removeTorrent,        METH_VARARGS,		 "."},
 	{"getNumTorrents",            torrent_getNumTorrents,       METH_VARARGS,		 "."},
+	{"saveFastResumeCheckpoints", torrent_saveFastResumeCheckpoints, METH_VARARGS, "."},
 	{"reannounce",                torrent_reannounce,           METH_VARARGS, 		 "."},
 	{"pause",                     torrent_pause,                METH_VARARGS, 		 "."},
 	{"resume",                    torrent_resume,               METH_VARARGS,		 "."},
@@ -159,10 +159,11 @@ namespace libtorrent
 		, boost::filesystem::path const& save_path
 		, entry const& resume_data
 		, bool compact_mode
-		, int block_size)
+		, int block_size
+		, storage_constructor_type sc)
 	{
 		return m_impl->add_torrent(ti, save_path, resume_data
-			, compact_mode, block_size);
+			, compact_mode, block_size, sc);
 	}
 
 	torrent_handle session::add_torrent(
@@ -171,10 +172,11 @@ namespace libtorrent
 		, boost::filesystem::path const& save_path
 		, entry const& e
 		, bool compact_mode
-		, int block_size)
+		, int block_size
+		, storage_constructor_type sc)
 	{
 		return m_impl->add_torrent(tracker_url, info_hash, save_path, e
-			, compact_mode, block_size);
+			, compact_mode, block_size, sc);
 	}
 
 	void session::remove_torrent(const torrent_handle& h)
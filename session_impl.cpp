@@ -70,6 +70,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/bt_peer_connection.hpp"
 #include "libtorrent/ip_filter.hpp"
 #include "libtorrent/socket.hpp"
+#include "libtorrent/io.hpp"
 #include "libtorrent/aux_/session_impl.hpp"
 #include "libtorrent/kademlia/dht_tracker.hpp"
 
@@ -92,16 +93,82 @@ namespace libtorrent { namespace detail
 	
 
 	} namespace aux {
-	// This is the checker thread
-	// it is looping in an infinite loop
-	// until the session is aborted. It will
+
+	namespace
+	{
+		typedef std::deque<boost::shared_ptr<piece_checker_data> > check_queue;
+
+		void erase_entry(check_queue& q
+			, boost::shared_ptr<piece_checker_data> const& t)
+		{
+			check_queue::iterator i = std::find(q.begin(), q.end(), t);
+			assert(i != q.end());
+			q.erase(i);
+		}
+
+		// returns the first torrent in the queue that isn't
+		// already being processed by another checker thread
+		boost::shared_ptr<piece_checker_data> first_unclaimed(check_queue& q)
+		{
+			for (check_queue::iterator i = q.begin(); i != q.end(); ++i)
+				if (!(*i)->claimed) return *i;
+			return boost::shared_ptr<piece_checker_data>();
+		}
+
+		// a partially downloaded piece, as stored in the
+		// resume data
+		struct stored_piece
+		{
+			int index;
+			char const* bitmask;
+			int bitmask_size;
+			size_type adler;
+		};
+
+		// decodes the run-length encoded slot map of version 2
+		// resume data, see write_slot_map() in torrent_handle.cpp.
+		// Returns false if it's malformed or has more slots than
+		// the torrent has pieces
+		bool read_slot_map(std::string const& runs, int num_pieces
+			, std::vector<int>& slots)
+		{
+			if (runs.size() % 8 != 0) return false;
+			char const* in = runs.c_str();
+			char const* end = in + runs.size();
+			while (in != end)
+			{
+				int first = detail::read_int32(in);
+				boost::uint32_t count = detail::read_uint32(in);
+				// this also keeps first + i from overflowing
+				if (first < -2 || first >= num_pieces) return false;
+				if (count > boost::uint32_t(num_pieces) - slots.size()) return false;
+				for (int i = 0; i < int(count); ++i)
+					slots.push_back(first >= 0 ? first + i : first);
+			}
+			return true;
+		}
+	}
+
+	// These are the checker threads
+	// they are looping in an infinite loop
+	// until the session is aborted. They will
 	// normally just block in a wait() call,
 	// waiting for a signal from session that
-	// there's a new torrent to check.
+	// there's a new torrent to check. Each thread
+	// checks one torrent at a time, so there are
+	// as many torrents being checked in parallel
+	// as there are threads.
 
 	void checker_impl::operator()()
 	{
 		eh_initializer();
+
+		int thread_index;
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+			thread_index = m_next_thread++;
+		}
+
 		// if we're currently performing a full file check,
 		// this is the torrent being processed
 		boost::shared_ptr<piece_checker_data> processing;
@@ -117,18 +184,49 @@ namespace libtorrent { namespace detail
 
 					INVARIANT_CHECK;
 
+					// threads beyond the configured limit don't
+					// pick up any new work
+					bool idle = thread_index >= m_max_threads;
+
+					// if we're not checking any files, pick up
+					// a torrent that is waiting for its full check
+					if (!processing && !idle)
+					{
+						processing = first_unclaimed(m_processing);
+						if (processing)
+						{
+							processing->claimed = true;
+							processing->processing = true;
+						}
+					}
+
+					if (!idle) t = first_unclaimed(m_torrents);
+
 					// if the job queue is empty and
 					// we shouldn't abort
 					// wait for a signal
-					if (m_torrents.empty() && !m_abort && !processing)
+					if (!t && !m_abort && !processing)
+					{
 						m_cond.wait(l);
+						continue;
+					}
 
 					if (m_abort)
 					{
+						t.reset();
+						if (processing)
+						{
+							processing->torrent_ptr->abort();
+							erase_entry(m_processing, processing);
+							processing.reset();
+						}
+
+						// the last thread to exit aborts the torrents
+						// that are still waiting in the queues.
 						// no lock is needed here, because the main thread
 						// has already been shut down by now
-						processing.reset();
-						t.reset();
+						if (--m_num_threads > 0) return;
+
 						std::for_each(m_torrents.begin(), m_torrents.end()
 							, boost::bind(&torrent::abort
 							, boost::bind(&shared_ptr<torrent>::get
@@ -142,9 +240,12 @@ namespace libtorrent { namespace detail
 						return;
 					}
 
-					if (!m_torrents.empty())
+					if (t)
 					{
-						t = m_torrents.front();
+						// claim the torrent so that no other thread picks
+						// it up. While it's claimed, removing it will set
+						// the abort flag instead of removing it from the queue
+						t->claimed = true;
 						if (t->abort)
 						{
 							// make sure the locking order is
@@ -156,7 +257,7 @@ namespace libtorrent { namespace detail
 							l.lock();
 
 							t->torrent_ptr->abort();
-							m_torrents.pop_front();
+							erase_entry(m_torrents, t);
 							continue;
 						}
 					}
@@ -193,15 +294,14 @@ namespace libtorrent { namespace detail
 						mutex::scoped_lock l2(m_mutex);
 						INVARIANT_CHECK;
 
-						assert(m_torrents.front() == t);
-
 						t->torrent_ptr->files_checked(t->unfinished_pieces);
-						m_torrents.pop_front();
+						erase_entry(m_torrents, t);
 
 						// we cannot add the torrent if the session is aborted.
-						if (!m_ses.is_aborted())
+						if (!m_ses.is_aborted() && !t->abort)
 						{
 							m_ses.m_torrents.insert(std::make_pair(t->info_hash, t->torrent_ptr));
+							m_ses.schedule_announce(*t->torrent_ptr);
 							if (t->torrent_ptr->is_seed() && m_ses.m_alerts.should_post(alert::info))
 							{
 								m_ses.m_alerts.post_alert(torrent_finished_alert(
@@ -229,16 +329,29 @@ namespace libtorrent { namespace detail
 					// m_torrents to m_processing
 					{
 						mutex::scoped_lock l(m_mutex);
-						assert(m_torrents.front() == t);
 
-						m_torrents.pop_front();
+						erase_entry(m_torrents, t);
+						if (t->abort)
+						{
+							t->torrent_ptr->abort();
+							t.reset();
+							continue;
+						}
+
 						m_processing.push_back(t);
 						if (!processing)
 						{
 							processing = t;
 							processing->processing = true;
-							t.reset();
 						}
+						else
+						{
+							// leave it for the next thread
+							// that becomes available
+							t->claimed = false;
+							m_cond.notify_all();
+						}
+						t.reset();
 					}
 				}
 			}
@@ -257,8 +370,7 @@ namespace libtorrent { namespace detail
 				}
 				t->torrent_ptr->abort();
 
-				assert(!m_torrents.empty());
-				m_torrents.pop_front();
+				erase_entry(m_torrents, t);
 			}
 			catch(...)
 			{
@@ -266,8 +378,7 @@ namespace libtorrent { namespace detail
 				std::cerr << "error while checking resume data\n";
 #endif
 				mutex::scoped_lock l(m_mutex);
-				assert(!m_torrents.empty());
-				m_torrents.pop_front();
+				erase_entry(m_torrents, t);
 				assert(false);
 			}
 
@@ -289,18 +400,10 @@ namespace libtorrent { namespace detail
 					processing->progress = progress;
 					if (processing->abort)
 					{
-						assert(!m_processing.empty());
-						assert(m_processing.front() == processing);
-
 						processing->torrent_ptr->abort();
 
+						erase_entry(m_processing, processing);
 						processing.reset();
-						m_processing.pop_front();
-						if (!m_processing.empty())
-						{
-							processing = m_processing.front();
-							processing->processing = true;
-						}
 						continue;
 					}
 				}
@@ -312,9 +415,6 @@ namespace libtorrent { namespace detail
 
 					INVARIANT_CHECK;
 
-					assert(!m_processing.empty());
-					assert(m_processing.front() == processing);
-
 					// TODO: factor out the adding of torrents to the session
 					// and to the checker thread to avoid duplicating the
 					// check for abortion.
@@ -323,6 +423,7 @@ namespace libtorrent { namespace detail
 						processing->torrent_ptr->files_checked(processing->unfinished_pieces);
 						m_ses.m_torrents.insert(std::make_pair(
 							processing->info_hash, processing->torrent_ptr));
+						m_ses.schedule_announce(*processing->torrent_ptr);
 						if (processing->torrent_ptr->is_seed()
 							&& m_ses.m_alerts.should_post(alert::info))
 						{
@@ -343,13 +444,8 @@ namespace libtorrent { namespace detail
 					{
 						processing->torrent_ptr->abort();
 					}
+					erase_entry(m_processing, processing);
 					processing.reset();
-					m_processing.pop_front();
-					if (!m_processing.empty())
-					{
-						processing = m_processing.front();
-						processing->processing = true;
-					}
 				}
 			}
 			catch(std::exception const& e)
@@ -365,17 +461,11 @@ namespace libtorrent { namespace detail
 							processing->torrent_ptr->get_handle()
 							, e.what()));
 				}
-				assert(!m_processing.empty());
 
 				processing->torrent_ptr->abort();
 
+				erase_entry(m_processing, processing);
 				processing.reset();
-				m_processing.pop_front();
-				if (!m_processing.empty())
-				{
-					processing = m_processing.front();
-					processing->processing = true;
-				}
 			}
 			catch(...)
 			{
@@ -383,15 +473,9 @@ namespace libtorrent { namespace detail
 				std::cerr << "error while checking files\n";
 #endif
 				mutex::scoped_lock l(m_mutex);
-				assert(!m_processing.empty());
 
+				erase_entry(m_processing, processing);
 				processing.reset();
-				m_processing.pop_front();
-				if (!m_processing.empty())
-				{
-					processing = m_processing.front();
-					processing->processing = true;
-				}
 
 				assert(false);
 			}
@@ -424,7 +508,7 @@ namespace libtorrent { namespace detail
 		{
 			if ((*i)->info_hash == info_hash)
 			{
-				assert((*i)->processing == false);
+				assert((*i)->claimed == false);
 				m_torrents.erase(i);
 				return;
 			}
@@ -434,7 +518,7 @@ namespace libtorrent { namespace detail
 		{
 			if ((*i)->info_hash == info_hash)
 			{
-				assert((*i)->processing == false);
+				assert((*i)->claimed == false);
 				m_processing.erase(i);
 				return;
 			}
@@ -465,7 +549,9 @@ namespace libtorrent { namespace detail
 		std::pair<int, int> listen_port_range
 		, fingerprint const& cl_fprint
 		, char const* listen_interface)
-		: m_tracker_manager(m_settings)
+		: m_next_incoming_demuxer(0)
+		, m_disk_thread(m_selector)
+		, m_tracker_manager(m_settings)
 		, m_listen_port_range(listen_port_range)
 		, m_listen_interface(address::from_string(listen_interface), listen_port_range.first)
 		, m_abort(false)
@@ -476,7 +562,9 @@ namespace libtorrent { namespace detail
 		, m_half_open_limit(-1)
 		, m_incoming_connection(false)
 		, m_last_tick(microsec_clock::universal_time())
+		, m_last_tick_timers(0)
 		, m_timer(m_selector)
+		, m_bandwidth_timer(m_selector)
 		, m_checker_impl(*this)
 	{
 
@@ -488,6 +576,8 @@ namespace libtorrent { namespace detail
 #endif
 		std::fill(m_extension_enabled, m_extension_enabled
 			+ num_supported_extensions, true);
+		m_disk_thread.set_cache_size(m_settings.read_cache_size
+			, m_settings.write_cache_size);
 		// ---- generate a peer id ----
 
 		std::srand((unsigned int)std::time(0));
@@ -516,8 +606,13 @@ namespace libtorrent { namespace detail
 		m_timer.expires_from_now(seconds(1));
 		m_timer.async_wait(bind(&session_impl::second_tick, this, _1));
 
+		m_bandwidth_timer.expires_from_now(
+			milliseconds(int(bandwidth_manager::refill_interval)));
+		m_bandwidth_timer.async_wait(bind(&session_impl::bandwidth_tick, this, _1));
+
 		m_thread.reset(new boost::thread(boost::ref(*this)));
-		m_checker_thread.reset(new boost::thread(boost::ref(m_checker_impl)));
+		m_checker_impl.m_num_threads = 1;
+		m_checker_threads.create_thread(boost::ref(m_checker_impl));
 	}
 
 #ifndef TORRENT_DISABLE_DHT	
@@ -581,6 +676,75 @@ namespace libtorrent { namespace detail
 		while ((i = std::find(i, m_settings.user_agent.end(), '\n'))
 			!= m_settings.user_agent.end())
 			*i = ' ';
+
+		m_disk_thread.set_cache_size(m_settings.read_cache_size
+			, m_settings.write_cache_size);
+
+		// checker threads are started on demand, but never
+		// stopped. The ones beyond the limit are just kept idle
+		mutex::scoped_lock l2(m_checker_impl.m_mutex);
+		m_checker_impl.m_max_threads = (std::max)(m_settings.file_checks_threads, 1);
+		while (m_checker_impl.m_num_threads < m_checker_impl.m_max_threads
+			&& !m_checker_impl.m_abort)
+		{
+			++m_checker_impl.m_num_threads;
+			m_checker_threads.create_thread(boost::ref(m_checker_impl));
+		}
+		m_checker_impl.m_cond.notify_all();
+	}
+
+	demuxer& session_impl::peer_demuxer(sha1_hash const& ih)
+	{
+		return network_demuxer(ih[0]);
+	}
+
+	demuxer& session_impl::incoming_demuxer()
+	{
+		return network_demuxer(m_next_incoming_demuxer++);
+	}
+
+	// index 0 is m_selector, the rest are the peer demuxers,
+	// which are created when they are first needed
+	demuxer& session_impl::network_demuxer(int index)
+	{
+		int threads = m_settings.network_threads;
+		if (threads <= 1 || m_abort) return m_selector;
+
+		while (int(m_peer_demuxers.size()) < threads - 1)
+		{
+			boost::shared_ptr<demuxer> d(new demuxer);
+			m_peer_demuxer_work.push_back(boost::shared_ptr<demuxer::work>(
+				new demuxer::work(*d)));
+			m_peer_demuxers.push_back(d);
+			m_peer_threads.create_thread(bind(&session_impl::run_peer_demuxer
+				, this, boost::ref(*d)));
+		}
+
+		index = (index & 0x7fffffff) % threads;
+		if (index == 0) return m_selector;
+		return *m_peer_demuxers[index - 1];
+	}
+
+	void session_impl::run_peer_demuxer(demuxer& d)
+	{
+		eh_initializer();
+
+		for (;;)
+		{
+			try
+			{
+				d.run();
+				return;
+			}
+			catch (std::exception& e)
+			{
+	#ifndef NDEBUG
+				std::cerr << e.what() << "\n";
+				std::string err = e.what();
+	#endif
+				assert(false);
+			}
+		}
 	}
 
 	void session_impl::open_listen_port()
@@ -686,7 +850,7 @@ namespace libtorrent { namespace detail
 
 	void session_impl::async_accept()
 	{
-		shared_ptr<stream_socket> c(new stream_socket(m_selector));
+		shared_ptr<stream_socket> c(new stream_socket(incoming_demuxer()));
 		m_listen_socket->async_accept(*c
 			, bind(&session_impl::on_incoming_connection, this, c
 			, weak_ptr<socket_acceptor>(m_listen_socket), _1));
@@ -741,6 +905,7 @@ namespace libtorrent { namespace detail
 #endif
 
 		m_connections.insert(std::make_pair(s, c));
+		m_connection_timers.schedule(s, c->seconds_to_next_timeout());
 	}
 	catch (std::exception& exc)
 	{
@@ -848,7 +1013,10 @@ namespace libtorrent { namespace detail
 			connection_map::iterator i = m_connections.find(p->get_socket());
 //			assert (i != m_connections.end());
 			if (i != m_connections.end())
+			{
+				m_connection_timers.cancel(i->first);
 				m_connections.erase(i);
+			}
 		}
 	}
 
@@ -879,27 +1047,32 @@ namespace libtorrent { namespace detail
 		}
 
 		if (m_abort) return;
-		float tick_interval = (microsec_clock::universal_time()
-			- m_last_tick).total_milliseconds() / 1000.f;
-		m_last_tick = microsec_clock::universal_time();
+		ptime tick_start = microsec_clock::universal_time();
+		float tick_interval = (tick_start - m_last_tick)
+			.total_milliseconds() / 1000.f;
+		m_last_tick = tick_start;
 
 		m_timer.expires_from_now(seconds(1));
 		m_timer.async_wait(bind(&session_impl::second_tick, this, _1));
 		
-		// do the second_tick() on each connection
-		// this will update their statistics (download and upload speeds)
-		// also purge sockets that have timed out
-		// and keep sockets open by keeping them alive.
-		for (connection_map::iterator i = m_connections.begin();
-			i != m_connections.end();)
+		// purge sockets that have timed out and keep sockets
+		// open by keeping them alive. Only the connections
+		// whose timers expired are looked at. The statistics
+		// of all connections are updated by their torrent's
+		// second_tick() further down
+		std::vector<boost::shared_ptr<stream_socket> > expired_connections;
+		m_connection_timers.tick(expired_connections);
+		for (std::vector<boost::shared_ptr<stream_socket> >::iterator i
+			= expired_connections.begin(), end(expired_connections.end());
+			i != end; ++i)
 		{
-			// we need to do like this because j->second->disconnect() will
-			// erase the connection from the map we're iterating
-			connection_map::iterator j = i;
-			++i;
-			// if this socket has timed out
-			// close it.
-			peer_connection& c = *j->second;
+			connection_map::iterator j = m_connections.find(*i);
+			// the connection has been closed
+			if (j == m_connections.end()) continue;
+			// keep a reference, c.disconnect() will erase
+			// the connection from the map
+			boost::intrusive_ptr<peer_connection> cp = j->second;
+			peer_connection& c = *cp;
 			if (c.has_timed_out())
 			{
 				if (m_alerts.should_post(alert::debug))
@@ -920,14 +1093,20 @@ namespace libtorrent { namespace detail
 			}
 
 			c.keep_alive();
+			m_connection_timers.schedule(*i, c.seconds_to_next_timeout());
 		}
 
-		// check each torrent for tracker updates
-		// TODO: do this in a timer-event in each torrent instead
-		for (std::map<sha1_hash, boost::shared_ptr<torrent> >::iterator i
-			= m_torrents.begin(); i != m_torrents.end();)
+		// check the torrents whose timers expired for
+		// tracker updates
+		std::vector<sha1_hash> expired_torrents;
+		m_announce_timers.tick(expired_torrents);
+		for (std::vector<sha1_hash>::iterator i = expired_torrents.begin()
+			, end(expired_torrents.end()); i != end; ++i)
 		{
-			torrent& t = *i->second;
+			torrent_map::iterator j = m_torrents.find(*i);
+			// the torrent has been removed
+			if (j == m_torrents.end()) continue;
+			torrent& t = *j->second;
 			assert(!t.is_aborted());
 			if (t.should_request())
 			{
@@ -935,7 +1114,7 @@ namespace libtorrent { namespace detail
 				req.listen_port = m_listen_interface.port();
 				req.key = m_key;
 				m_tracker_manager.queue_request(m_selector, req, t.tracker_login()
-					, i->second);
+					, j->second);
 
 				if (m_alerts.should_post(alert::info))
 				{
@@ -944,10 +1123,14 @@ namespace libtorrent { namespace detail
 							t.get_handle(), "tracker announce"));
 				}
 			}
+			schedule_announce(t);
+		}
 
+		for (torrent_map::iterator i = m_torrents.begin();
+			i != m_torrents.end(); ++i)
+		{
 			// second_tick() will set the used upload quota
-			t.second_tick(m_stat, tick_interval);
-			++i;
+			i->second->second_tick(m_stat, tick_interval);
 		}
 
 		m_stat.second_tick(tick_interval);
@@ -991,6 +1174,108 @@ namespace libtorrent { namespace detail
 #endif
 			i->second->distribute_resources();
 		}
+
+		refresh_status();
+
+		m_last_tick_timers = int(expired_connections.size()
+			+ expired_torrents.size());
+		m_last_tick_duration = microsec_clock::universal_time() - tick_start;
+		if (m_last_tick_duration > m_max_tick_duration)
+			m_max_tick_duration = m_last_tick_duration;
+	}
+	catch (std::exception& exc)
+	{
+#ifndef NDEBUG
+		std::string err = exc.what();
+#endif
+	}; // msvc 7.1 seems to require this
+
+	void session_impl::schedule_announce(torrent& t)
+	{
+		mutex_t::scoped_lock l(m_mutex);
+		m_announce_timers.schedule(t.torrent_file().info_hash()
+			, t.seconds_to_next_announce());
+	}
+
+	void session_impl::refresh_status()
+	{
+		std::vector<sha1_hash> requested;
+		{
+			boost::mutex::scoped_lock l(m_status_mutex);
+			for (status_map::iterator i = m_status.begin();
+				i != m_status.end();)
+			{
+				// nobody has looked at this torrent's status
+				// since the last tick, stop refreshing it
+				if (!i->second.requested)
+				{
+					m_status.erase(i++);
+					continue;
+				}
+				i->second.requested = false;
+				requested.push_back(i->first);
+				++i;
+			}
+		}
+
+		for (std::vector<sha1_hash>::iterator i = requested.begin()
+			, end(requested.end()); i != end; ++i)
+		{
+			torrent_map::iterator t = m_torrents.find(*i);
+			if (t == m_torrents.end())
+			{
+				invalidate_status(*i);
+				continue;
+			}
+			torrent_status st = t->second->status();
+
+			boost::mutex::scoped_lock l(m_status_mutex);
+			status_map::iterator s = m_status.find(*i);
+			// the snapshot may have been invalidated
+			// while we computed the status
+			if (s == m_status.end()) continue;
+			s->second.status = st;
+		}
+	}
+
+	bool session_impl::published_status(sha1_hash const& ih, torrent_status& st)
+	{
+		boost::mutex::scoped_lock l(m_status_mutex);
+		status_map::iterator i = m_status.find(ih);
+		if (i == m_status.end()) return false;
+		i->second.requested = true;
+		st = i->second.status;
+		return true;
+	}
+
+	void session_impl::publish_status(sha1_hash const& ih, torrent_status const& st)
+	{
+		boost::mutex::scoped_lock l(m_status_mutex);
+		status_snapshot& s = m_status[ih];
+		s.status = st;
+		s.requested = true;
+	}
+
+	void session_impl::invalidate_status(sha1_hash const& ih)
+	{
+		boost::mutex::scoped_lock l(m_status_mutex);
+		m_status.erase(ih);
+	}
+
+	void session_impl::bandwidth_tick(asio::error const& e) try
+	{
+		session_impl::mutex_t::scoped_lock l(m_mutex);
+
+		if (e || m_abort) return;
+
+		m_bandwidth_timer.expires_from_now(
+			milliseconds(int(bandwidth_manager::refill_interval)));
+		m_bandwidth_timer.async_wait(bind(&session_impl::bandwidth_tick, this, _1));
+
+		// the connections refill their quota themselves when they're
+		// about to send or receive, only the ones that ran out and
+		// are waiting for more need to be woken up
+		m_bandwidth_manager.wake_up();
 	}
 	catch (std::exception& exc)
 	{
@@ -1012,6 +1297,7 @@ namespace libtorrent { namespace detail
 		connection_map::iterator i = m_half_open.find(p->get_socket());
 
 		m_connections.insert(std::make_pair(p->get_socket(), p));
+		m_connection_timers.schedule(p->get_socket(), p->seconds_to_next_timeout());
 		if (i != m_half_open.end()) m_half_open.erase(i);
 		process_connection_queue();
 	}
@@ -1096,6 +1382,35 @@ namespace libtorrent { namespace detail
 			m_half_open.begin()->second->disconnect();
 
 		m_connection_queue.clear();
+		m_bandwidth_manager.clear();
+
+		// the pending accept holds a socket that may belong to
+		// one of the peer demuxers. Closing the listen socket
+		// aborts it, and its handler is run (and the socket
+		// destructed) when m_selector is drained below
+		if (m_listen_socket)
+		{
+			m_listen_socket->close();
+			m_listen_socket.reset();
+		}
+
+		// let the disk io thread finish the jobs that are still
+		// queued and run their handlers before the torrents
+		// (and their storage) go away. The handlers lock the
+		// session themselves.
+		l.unlock();
+
+		// all the sockets on the peer demuxers have been closed,
+		// once their aborted operations have been handled the
+		// threads run out of work and return
+		m_peer_demuxer_work.clear();
+		m_peer_threads.join_all();
+
+		m_disk_thread.stop();
+		m_selector.reset();
+		m_selector.post(bind(&demuxer::interrupt, &m_selector));
+		m_selector.run();
+		l.lock();
 
 #ifndef NDEBUG
 		for (torrent_map::iterator i = m_torrents.begin();
@@ -1106,6 +1421,10 @@ namespace libtorrent { namespace detail
 #endif
 
 		m_torrents.clear();
+		{
+			boost::mutex::scoped_lock l2(m_status_mutex);
+			m_status.clear();
+		}
 
 		assert(m_torrents.empty());
 		assert(m_connections.empty());
@@ -1183,7 +1502,8 @@ namespace libtorrent { namespace detail
 		, boost::filesystem::path const& save_path
 		, entry const& resume_data
 		, bool compact_mode
-		, int block_size)
+		, int block_size
+		, storage_constructor_type sc)
 	{
 		// make sure the block_size is an even power of 2
 #ifndef NDEBUG
@@ -1223,7 +1543,7 @@ namespace libtorrent { namespace detail
 		boost::shared_ptr<torrent> torrent_ptr(
 			new torrent(*this, m_checker_impl, ti, save_path
 				, m_listen_interface, compact_mode, block_size
-				, settings()));
+				, sc, settings()));
 
 		boost::shared_ptr<aux::piece_checker_data> d(
 			new aux::piece_checker_data);
@@ -1258,7 +1578,8 @@ namespace libtorrent { namespace detail
 		, boost::filesystem::path const& save_path
 		, entry const&
 		, bool compact_mode
-		, int block_size)
+		, int block_size
+		, storage_constructor_type sc)
 	{
 		// make sure the block_size is an even power of 2
 #ifndef NDEBUG
@@ -1303,10 +1624,11 @@ namespace libtorrent { namespace detail
 		boost::shared_ptr<torrent> torrent_ptr(
 			new torrent(*this, m_checker_impl, tracker_url, info_hash, save_path
 			, m_listen_interface, compact_mode, block_size
-			, settings()));
+			, sc, settings()));
 
 		m_torrents.insert(
 			std::make_pair(info_hash, torrent_ptr)).first;
+		schedule_announce(*torrent_ptr);
 
 		return torrent_handle(this, &m_checker_impl, info_hash);
 	}
@@ -1344,6 +1666,8 @@ namespace libtorrent { namespace detail
 #ifndef NDEBUG
 			sha1_hash i_hash = t.torrent_file().info_hash();
 #endif
+			invalidate_status(i->first);
+			m_announce_timers.cancel(i->first);
 			m_torrents.erase(i);
 			assert(m_torrents.find(i_hash) == m_torrents.end());
 			return;
@@ -1357,7 +1681,7 @@ namespace libtorrent { namespace detail
 			aux::piece_checker_data* d = m_checker_impl.find_torrent(h.m_info_hash);
 			if (d != 0)
 			{
-				if (d->processing) d->abort = true;
+				if (d->claimed) d->abort = true;
 				else m_checker_impl.remove_torrent(h.m_info_hash);
 				return;
 			}
@@ -1431,6 +1755,25 @@ namespace libtorrent { namespace detail
 		s.total_payload_download = m_stat.total_payload_download();
 		s.total_payload_upload = m_stat.total_payload_upload();
 
+		disk_io_status ds = m_disk_thread.status();
+		s.disk_queue_depth = ds.queue_depth;
+		s.disk_average_latency = ds.average_latency;
+		s.disk_max_latency = ds.max_latency;
+		s.disk_total_jobs = ds.total_jobs;
+		s.read_cache_hits = ds.cache_hits;
+		s.read_cache_misses = ds.cache_misses;
+		s.read_cache_size = ds.read_cache_size;
+		s.write_cache_size = ds.write_cache_size;
+		s.blocks_written = ds.blocks_written;
+		s.disk_writes = ds.writes;
+		s.forced_write_flushes = ds.forced_flushes;
+		s.bytes_hashed_from_memory = ds.hashed_from_memory;
+		s.bytes_hashed_from_disk = ds.hashed_from_disk;
+
+		s.tick_duration = int(m_last_tick_duration.total_microseconds());
+		s.max_tick_duration = int(m_max_tick_duration.total_microseconds());
+		s.tick_expired_timers = m_last_tick_timers;
+
 #ifndef TORRENT_DISABLE_DHT
 		if (m_dht)
 		{
@@ -1538,10 +1881,10 @@ namespace libtorrent { namespace detail
 			{
 				m_checker_impl.m_torrents.front()->abort = true;
 			}
-			m_checker_impl.m_cond.notify_one();
+			m_checker_impl.m_cond.notify_all();
 		}
 
-		m_checker_thread->join();
+		m_checker_threads.join_all();
 
 		assert(m_torrents.empty());
 		assert(m_connections.empty());
@@ -1649,10 +1992,11 @@ namespace libtorrent { namespace detail
 				return;
 			}
 
-			if (rd["file-version"].integer() > 1)
+			int version = (int)rd["file-version"].integer();
+			if (version > 2)
 			{
 				error = "incompatible file version "
-					+ boost::lexical_cast<std::string>(rd["file-version"].integer());
+					+ boost::lexical_cast<std::string>(version);
 				return;
 			}
 
@@ -1667,7 +2011,7 @@ namespace libtorrent { namespace detail
 
 			// the peers
 
-			if (rd.find_key("peers"))
+			if (version == 1 && rd.find_key("peers"))
 			{
 				entry::list_type& peer_list = rd["peers"].list();
 
@@ -1684,23 +2028,56 @@ namespace libtorrent { namespace detail
 
 				peers.swap(tmp_peers);
 			}
+			else if (version == 2)
+			{
+				// 6 bytes per IPv4 peer and 18 per IPv6 peer
+				std::string empty;
+				entry const* e4 = rd.find_key("peers");
+				entry const* e6 = rd.find_key("peers6");
+				const std::string& v4 = e4 ? e4->string() : empty;
+				const std::string& v6 = e6 ? e6->string() : empty;
+
+				std::vector<tcp::endpoint> tmp_peers;
+				tmp_peers.reserve(v4.size() / 6 + v6.size() / 18);
+				for (std::string::const_iterator i = v4.begin();
+					v4.end() - i >= 6;)
+					tmp_peers.push_back(detail::read_v4_endpoint<tcp::endpoint>(i));
+				for (std::string::const_iterator i = v6.begin();
+					v6.end() - i >= 18;)
+					tmp_peers.push_back(detail::read_v6_endpoint<tcp::endpoint>(i));
+
+				peers.swap(tmp_peers);
+			}
 
 			// read piece map
-			const entry::list_type& slots = rd["slots"].list();
-			if ((int)slots.size() > info.num_pieces())
+			std::vector<int> tmp_pieces;
+			if (version == 1)
 			{
-				error = "file has more slots than torrent (slots: "
-					+ boost::lexical_cast<std::string>(slots.size()) + " size: "
-					+ boost::lexical_cast<std::string>(info.num_pieces()) + " )";
+				const entry::list_type& slots = rd["slots"].list();
+				if ((int)slots.size() > info.num_pieces())
+				{
+					error = "file has more slots than torrent (slots: "
+						+ boost::lexical_cast<std::string>(slots.size()) + " size: "
+						+ boost::lexical_cast<std::string>(info.num_pieces()) + " )";
+					return;
+				}
+
+				tmp_pieces.reserve(slots.size());
+				for (entry::list_type::const_iterator i = slots.begin();
+					i != slots.end(); ++i)
+					tmp_pieces.push_back((int)i->integer());
+			}
+			else if (!read_slot_map(rd["slots"].string(), info.num_pieces()
+				, tmp_pieces))
+			{
+				error = "invalid slot map, or more slots than the torrent has pieces";
 				return;
 			}
 
-			std::vector<int> tmp_pieces;
-			tmp_pieces.reserve(slots.size());
-			for (entry::list_type::const_iterator i = slots.begin();
-				i != slots.end(); ++i)
+			for (std::vector<int>::iterator i = tmp_pieces.begin();
+				i != tmp_pieces.end(); ++i)
 			{
-				int index = (int)i->integer();
+				int index = *i;
 				if (index >= info.num_pieces() || index < -2)
 				{
 					error = "too high index number in slot map (index: "
@@ -1708,27 +2085,69 @@ namespace libtorrent { namespace detail
 						+ boost::lexical_cast<std::string>(info.num_pieces()) + ")";
 					return;
 				}
-				tmp_pieces.push_back(index);
 			}
 
 			// only bother to check the partial pieces if we have the same block size
 			// as in the fast resume data. If the blocksize has changed, then throw
 			// away all partial pieces.
-			std::vector<piece_picker::downloading_piece> tmp_unfinished;
+			std::vector<piece_picker::unfinished_piece> tmp_unfinished;
 			int num_blocks_per_piece = (int)rd["blocks per piece"].integer();
 			if (num_blocks_per_piece == info.piece_length() / torrent_ptr->block_size())
 			{
+				const int num_bitmask_bytes = std::max(num_blocks_per_piece / 8, 1);
+
 				// the unfinished pieces
 
-				entry::list_type& unfinished = rd["unfinished"].list();
+				std::vector<stored_piece> stored;
+				if (version == 1)
+				{
+					entry::list_type& unfinished = rd["unfinished"].list();
+					stored.reserve(unfinished.size());
+					for (entry::list_type::iterator i = unfinished.begin();
+						i != unfinished.end(); ++i)
+					{
+						const std::string& bitmask = (*i)["bitmask"].string();
+						stored_piece p;
+						p.index = (int)(*i)["piece"].integer();
+						p.bitmask = bitmask.c_str();
+						p.bitmask_size = (int)bitmask.size();
+						p.adler = (*i)["adler32"].integer();
+						stored.push_back(p);
+					}
+				}
+				else
+				{
+					// records of the piece index and adler32 checksum,
+					// 4 bytes each, followed by the bitmask
+					const std::string& unfinished = rd["unfinished"].string();
+					const int record_size = 8 + num_bitmask_bytes;
+					if (unfinished.size() % record_size != 0)
+					{
+						error = "invalid size of unfinished piece list ("
+							+ boost::lexical_cast<std::string>(unfinished.size()) + ")";
+						return;
+					}
+					stored.reserve(unfinished.size() / record_size);
+					for (char const* i = unfinished.c_str()
+						, *end = i + unfinished.size(); i != end;)
+					{
+						stored_piece p;
+						p.index = detail::read_int32(i);
+						p.adler = detail::read_uint32(i);
+						p.bitmask = i;
+						p.bitmask_size = num_bitmask_bytes;
+						i += num_bitmask_bytes;
+						stored.push_back(p);
+					}
+				}
 
-				tmp_unfinished.reserve(unfinished.size());
-				for (entry::list_type::iterator i = unfinished.begin();
-					i != unfinished.end(); ++i)
+				tmp_unfinished.reserve(stored.size());
+				for (std::vector<stored_piece>::iterator i = stored.begin();
+					i != stored.end(); ++i)
 				{
-					piece_picker::downloading_piece p;
+					piece_picker::unfinished_piece p;
 	
-					p.index = (int)(*i)["piece"].integer();
+					p.index = i->index;
 					if (p.index < 0 || p.index >= info.num_pieces())
 					{
 						error = "invalid piece index in unfinished piece list (index: "
@@ -1737,17 +2156,14 @@ namespace libtorrent { namespace detail
 						return;
 					}
 
-					const std::string& bitmask = (*i)["bitmask"].string();
-
-					const int num_bitmask_bytes = std::max(num_blocks_per_piece / 8, 1);
-					if ((int)bitmask.size() != num_bitmask_bytes)
+					if (i->bitmask_size != num_bitmask_bytes)
 					{
-						error = "invalid size of bitmask (" + boost::lexical_cast<std::string>(bitmask.size()) + ")";
+						error = "invalid size of bitmask (" + boost::lexical_cast<std::string>(i->bitmask_size) + ")";
 						return;
 					}
 					for (int j = 0; j < num_bitmask_bytes; ++j)
 					{
-						unsigned char bits = bitmask[j];
+						unsigned char bits = i->bitmask[j];
 						for (int k = 0; k < 8; ++k)
 						{
 							const int bit = j * 8 + k;
@@ -1777,14 +2193,13 @@ namespace libtorrent { namespace detail
 							, torrent_ptr->block_size()
 							, p.finished_blocks);
 
-					const entry& ad = (*i)["adler32"];
-	
-					// crc's didn't match, don't use the resume data
-					if (ad.integer() != adler)
-					{
-						error = "checksum mismatch on piece " + boost::lexical_cast<std::string>(p.index);
-						return;
-					}
+					// if the crc doesn't match, the blocks on disk aren't
+					// the ones that were saved (the client may have crashed
+					// before they were written). Only this piece is
+					// downloaded again, it's still listed as unfinished
+					// so that it isn't mistaken for a piece we have
+					if (i->adler != size_type(adler))
+						p.finished_blocks.reset();
 
 					tmp_unfinished.push_back(p);
 				}
@@ -26,13 +26,19 @@ module1 = Extension('torrent',
 											'boost_serialization', 'boost_thread', 'z', 'pthread'],
                     sources = ['alert.cpp',
 										 'allocate_resources.cpp',
+										 'bandwidth_manager.cpp',
+										 'bencode_writer.cpp',
 										 'bt_peer_connection.cpp',
+										 'create_torrent.cpp',
+										 'disk_io_thread.cpp',
 										 'entry.cpp',
 										 'escape_string.cpp',
 										 'file.cpp',
 										 'http_tracker_connection.cpp',
 					                'identify_client.cpp',
 										 'ip_filter.cpp',
+										 'lazy_bdecode.cpp',
+										 'mapped_storage.cpp',
  										 'peer_connection.cpp',
 						             'piece_picker.cpp',     
 										 'policy.cpp',           
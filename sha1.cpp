@@ -20,9 +20,27 @@ changelog at the end of the file.
 #include <boost/cstdint.hpp>
 using boost::uint32_t;
 using boost::uint8_t;
+using boost::uint64_t;
 
 #include "libtorrent/config.hpp"
 
+// the x86 backends need the sha and avx2 intrinsics, and a
+// way to enable them for single functions
+#if defined __GNUC__ && __GNUC__ >= 5 \
+	&& (defined __x86_64__ || defined __i386__)
+#define TORRENT_SHA1_X86
+#define TORRENT_SHA1_MULTI_BUFFER
+#define TORRENT_TARGET(x) __attribute__((target(x)))
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined _MSC_VER && _MSC_VER >= 1900 \
+	&& (defined _M_X64 || defined _M_IX86)
+#define TORRENT_SHA1_X86
+#define TORRENT_TARGET(x)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
 struct TORRENT_EXPORT SHA1_CTX
 {
 	uint32_t state[5];
@@ -33,6 +51,9 @@ struct TORRENT_EXPORT SHA1_CTX
 TORRENT_EXPORT void SHA1Init(SHA1_CTX* context);
 TORRENT_EXPORT void SHA1Update(SHA1_CTX* context, uint8_t const* data, uint32_t len);
 TORRENT_EXPORT void SHA1Final(SHA1_CTX* context, uint8_t* digest);
+TORRENT_EXPORT void SHA1Multi(uint8_t const* const* data, int num
+	, uint32_t len, uint8_t* digests);
+TORRENT_EXPORT char const* SHA1Backend();
 
 namespace
 {
@@ -123,6 +144,243 @@ namespace
 		a = b = c = d = e = 0;
 	}
 
+	// all backends hash a number of consecutive 64 byte blocks
+	typedef void (*transform_fun)(uint32_t state[5]
+		, uint8_t const* data, uint32_t blocks);
+
+	template <class BlkFun>
+	void generic_transform(uint32_t state[5], uint8_t const* data
+		, uint32_t blocks)
+	{
+		for (; blocks > 0; --blocks, data += 64)
+			SHA1Transform<BlkFun>(state, data);
+	}
+
+#ifdef TORRENT_SHA1_X86
+
+	// uses the SHA extensions (SHA-NI). Each instruction
+	// performs four rounds, or a step of the message schedule
+	TORRENT_TARGET("sha,sse4.1")
+	void shani_transform(uint32_t state[5], uint8_t const* data
+		, uint32_t blocks)
+	{
+		__m128i abcd, abcd_save, e0, e0_save, e1;
+		__m128i msg0, msg1, msg2, msg3;
+		__m128i const mask = _mm_set_epi64x(0x0001020304050607LL
+			, 0x08090a0b0c0d0e0fLL);
+
+		abcd = _mm_loadu_si128((__m128i const*)state);
+		e0 = _mm_set_epi32(state[4], 0, 0, 0);
+		abcd = _mm_shuffle_epi32(abcd, 0x1b);
+
+// four rounds, using message vector m, with function f. The
+// e values alternate between e0 and e1
+#define SHANI_ROUNDS(ex, ey, m, f) \
+		ex = _mm_sha1nexte_epu32(ex, m); \
+		ey = abcd; \
+		abcd = _mm_sha1rnds4_epu32(abcd, ex, f);
+
+		for (; blocks > 0; --blocks, data += 64)
+		{
+			abcd_save = abcd;
+			e0_save = e0;
+
+			// rounds 0-3
+			msg0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)data), mask);
+			e0 = _mm_add_epi32(e0, msg0);
+			e1 = abcd;
+			abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+			// rounds 4-7
+			msg1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(data + 16)), mask);
+			SHANI_ROUNDS(e1, e0, msg1, 0)
+			msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+			// rounds 8-11
+			msg2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(data + 32)), mask);
+			SHANI_ROUNDS(e0, e1, msg2, 0)
+			msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+			msg0 = _mm_xor_si128(msg0, msg2);
+
+			// rounds 12-15
+			msg3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(data + 48)), mask);
+			e1 = _mm_sha1nexte_epu32(e1, msg3);
+			e0 = abcd;
+			msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+			abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+			msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+			msg1 = _mm_xor_si128(msg1, msg3);
+
+// rounds 16-67 all follow the same pattern, with the message
+// vectors rotating
+#define SHANI_SCHEDULE(ex, ey, m0, m1, m2, m3, f) \
+			ex = _mm_sha1nexte_epu32(ex, m0); \
+			ey = abcd; \
+			m1 = _mm_sha1msg2_epu32(m1, m0); \
+			abcd = _mm_sha1rnds4_epu32(abcd, ex, f); \
+			m3 = _mm_sha1msg1_epu32(m3, m0); \
+			m2 = _mm_xor_si128(m2, m0);
+
+			SHANI_SCHEDULE(e0, e1, msg0, msg1, msg2, msg3, 0) // 16-19
+			SHANI_SCHEDULE(e1, e0, msg1, msg2, msg3, msg0, 1) // 20-23
+			SHANI_SCHEDULE(e0, e1, msg2, msg3, msg0, msg1, 1) // 24-27
+			SHANI_SCHEDULE(e1, e0, msg3, msg0, msg1, msg2, 1) // 28-31
+			SHANI_SCHEDULE(e0, e1, msg0, msg1, msg2, msg3, 1) // 32-35
+			SHANI_SCHEDULE(e1, e0, msg1, msg2, msg3, msg0, 1) // 36-39
+			SHANI_SCHEDULE(e0, e1, msg2, msg3, msg0, msg1, 2) // 40-43
+			SHANI_SCHEDULE(e1, e0, msg3, msg0, msg1, msg2, 2) // 44-47
+			SHANI_SCHEDULE(e0, e1, msg0, msg1, msg2, msg3, 2) // 48-51
+			SHANI_SCHEDULE(e1, e0, msg1, msg2, msg3, msg0, 2) // 52-55
+			SHANI_SCHEDULE(e0, e1, msg2, msg3, msg0, msg1, 2) // 56-59
+			SHANI_SCHEDULE(e1, e0, msg3, msg0, msg1, msg2, 3) // 60-63
+			SHANI_SCHEDULE(e0, e1, msg0, msg1, msg2, msg3, 3) // 64-67
+
+			// rounds 68-71
+			e1 = _mm_sha1nexte_epu32(e1, msg1);
+			e0 = abcd;
+			msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+			abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+			msg3 = _mm_xor_si128(msg3, msg1);
+
+			// rounds 72-75
+			e0 = _mm_sha1nexte_epu32(e0, msg2);
+			e1 = abcd;
+			msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+			abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+			// rounds 76-79
+			SHANI_ROUNDS(e1, e0, msg3, 3)
+
+			e0 = _mm_sha1nexte_epu32(e0, e0_save);
+			abcd = _mm_add_epi32(abcd, abcd_save);
+		}
+#undef SHANI_ROUNDS
+#undef SHANI_SCHEDULE
+
+		abcd = _mm_shuffle_epi32(abcd, 0x1b);
+		_mm_storeu_si128((__m128i*)state, abcd);
+		state[4] = _mm_extract_epi32(e0, 3);
+	}
+
+	bool has_sha_ni()
+	{
+		unsigned int a, b, c, d;
+#ifdef _MSC_VER
+		int regs[4];
+		__cpuid(regs, 0);
+		if (regs[0] < 7) return false;
+		__cpuid(regs, 1);
+		c = regs[2];
+		__cpuidex(regs, 7, 0);
+		b = regs[1];
+#else
+		if (__get_cpuid_max(0, 0) < 7) return false;
+		__cpuid(1, a, b, c, d);
+		unsigned int c1 = c;
+		__cpuid_count(7, 0, a, b, c, d);
+		c = c1;
+#endif
+		// SSSE3, SSE4.1 and SHA
+		return (c & (1 << 9)) && (c & (1 << 19)) && (b & (1 << 29));
+	}
+
+#endif // TORRENT_SHA1_X86
+
+#ifdef TORRENT_SHA1_MULTI_BUFFER
+
+	// the multi-buffer backends hash one message per 32 bit lane
+	// of a vector register. They only pay off when there are
+	// several independent messages of the same length to hash.
+	typedef uint32_t v4u __attribute__((vector_size(16)));
+	typedef uint32_t v8u __attribute__((vector_size(32)));
+
+#define vrol(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+	inline uint32_t load_be32(uint8_t const* p)
+	{
+		return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16)
+			| (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+	}
+
+	// hashes the first blocks * 64 bytes of every message
+	template <class V>
+	inline __attribute__((always_inline)) void multi_transform(
+		uint32_t (*state)[5], uint8_t const* const* data, uint32_t blocks)
+	{
+		int const lanes = sizeof(V) / 4;
+		V h[5];
+		for (int i = 0; i < 5; ++i)
+			for (int l = 0; l < lanes; ++l) h[i][l] = state[l][i];
+
+		for (uint32_t offset = 0; offset < blocks * 64; offset += 64)
+		{
+			V w[16];
+			for (int t = 0; t < 16; ++t)
+				for (int l = 0; l < lanes; ++l)
+					w[t][l] = load_be32(data[l] + offset + t * 4);
+
+			V a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+			for (int t = 0; t < 80; ++t)
+			{
+				if (t >= 16)
+				{
+					w[t & 15] = vrol(w[(t + 13) & 15] ^ w[(t + 8) & 15]
+						^ w[(t + 2) & 15] ^ w[t & 15], 1);
+				}
+				V f;
+				uint32_t k;
+				if (t < 20) { f = (b & (c ^ d)) ^ d; k = 0x5A827999; }
+				else if (t < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+				else if (t < 60) { f = ((b | c) & d) | (b & c); k = 0x8F1BBCDC; }
+				else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+				V temp = vrol(a, 5) + f + e + w[t & 15] + k;
+				e = d;
+				d = c;
+				c = vrol(b, 30);
+				b = a;
+				a = temp;
+			}
+			h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+		}
+
+		for (int i = 0; i < 5; ++i)
+			for (int l = 0; l < lanes; ++l) state[l][i] = h[i][l];
+	}
+#undef vrol
+
+	TORRENT_TARGET("sse2")
+	void multi_transform_sse2(uint32_t (*state)[5]
+		, uint8_t const* const* data, uint32_t blocks)
+	{ multi_transform<v4u>(state, data, blocks); }
+
+	TORRENT_TARGET("avx2")
+	void multi_transform_avx2(uint32_t (*state)[5]
+		, uint8_t const* const* data, uint32_t blocks)
+	{ multi_transform<v8u>(state, data, blocks); }
+
+	bool has_sse2()
+	{
+		unsigned int a, b, c, d;
+		if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+		return d & (1 << 26);
+	}
+
+	bool has_avx2()
+	{
+		unsigned int a, b, c, d;
+		if (__get_cpuid_max(0, 0) < 7) return false;
+		__cpuid(1, a, b, c, d);
+		// the OS has to save the ymm registers
+		if (!(c & (1 << 27))) return false;
+		unsigned int xcr0_lo, xcr0_hi;
+		__asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+		if ((xcr0_lo & 6) != 6) return false;
+		__cpuid_count(7, 0, a, b, c, d);
+		return b & (1 << 5);
+	}
+
+#endif // TORRENT_SHA1_MULTI_BUFFER
+
 	void SHAPrintContext(SHA1_CTX *context, char *msg)
 	{
 		using namespace std;
@@ -133,8 +391,8 @@ namespace
 			, context->state[4]);
 	}
 
-	template <class BlkFun>
-	void internal_update(SHA1_CTX* context, uint8_t const* data, uint32_t len)
+	void internal_update(transform_fun transform, SHA1_CTX* context
+		, uint8_t const* data, uint32_t len)
 	{
 		using namespace std;
 		uint32_t i, j;	// JHB
@@ -148,10 +406,12 @@ namespace
 		if ((j + len) > 63)
 		{
 			memcpy(&context->buffer[j], data, (i = 64-j));
-			SHA1Transform<BlkFun>(context->state, context->buffer);
-			for ( ; i + 63 < len; i += 64)
+			transform(context->state, context->buffer, 1);
+			uint32_t blocks = (len - i) / 64;
+			if (blocks > 0)
 			{
-				SHA1Transform<BlkFun>(context->state, &data[i]);
+				transform(context->state, &data[i], blocks);
+				i += blocks * 64;
 			}
 			j = 0;
 		}
@@ -170,6 +430,82 @@ namespace
 		uint32_t test = 1;
 		return *reinterpret_cast<uint8_t*>(&test) == 0;
 	}
+
+	// the FIPS 180-1 test vector for "abc"
+	bool known_answer_test(transform_fun transform)
+	{
+		// the message padded to a single block
+		uint8_t block[64] = {'a', 'b', 'c', 0x80};
+		block[63] = 24;
+		uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE
+			, 0x10325476, 0xC3D2E1F0};
+		transform(state, block, 1);
+		static uint32_t const expected[5] = {0xA9993E36, 0x4706816A
+			, 0xBA3E2571, 0x7850C26C, 0x9CD0D89D};
+		return std::memcmp(state, expected, sizeof(state)) == 0;
+	}
+
+	struct backend
+	{
+		char const* name;
+		transform_fun transform;
+#ifdef TORRENT_SHA1_MULTI_BUFFER
+		// the widest multi-buffer transform the CPU
+		// supports, and the number of lanes it hashes
+		void (*multi)(uint32_t (*state)[5], uint8_t const* const* data
+			, uint32_t blocks);
+		int lanes;
+#endif
+	};
+
+	// picks the fastest transform the CPU supports. A backend
+	// is only used if it produces the right digest for the
+	// known answer test.
+	backend select_backend()
+	{
+		backend ret;
+		ret.name = "generic";
+#if defined __BIG_ENDIAN__
+		ret.transform = &generic_transform<big_endian_blk0>;
+#elif defined LITTLE_ENDIAN
+		ret.transform = &generic_transform<little_endian_blk0>;
+#else
+		if (is_big_endian())
+			ret.transform = &generic_transform<big_endian_blk0>;
+		else
+			ret.transform = &generic_transform<little_endian_blk0>;
+#endif
+
+#ifdef TORRENT_SHA1_X86
+		if (has_sha_ni() && known_answer_test(&shani_transform))
+		{
+			ret.name = "sha-ni";
+			ret.transform = &shani_transform;
+		}
+#endif
+
+#ifdef TORRENT_SHA1_MULTI_BUFFER
+		ret.multi = 0;
+		ret.lanes = 1;
+		// eight lanes of AVX2 outrun the SHA extensions, but
+		// four lanes of SSE2 don't
+		if (has_avx2())
+		{
+			ret.multi = &multi_transform_avx2;
+			ret.lanes = 8;
+		}
+		else if (has_sse2() && ret.transform != &shani_transform)
+		{
+			ret.multi = &multi_transform_sse2;
+			ret.lanes = 4;
+		}
+#endif
+		return ret;
+	}
+
+	// this is initialized before main() is entered, and
+	// before any other thread is started
+	backend const sha1_backend = select_backend();
 }
 
 // SHA1Init - Initialize new context
@@ -190,18 +526,7 @@ void SHA1Init(SHA1_CTX* context)
 
 void SHA1Update(SHA1_CTX* context, uint8_t const* data, uint32_t len)
 {
-#if defined __BIG_ENDIAN__
-	internal_update<big_endian_blk0>(context, data, len);
-#elif defined LITTLE_ENDIAN
-	internal_update<little_endian_blk0>(context, data, len);
-#else
-	// select different functions depending on endianess
-	// and figure out the endianess runtime
-	if (is_big_endian())
-		internal_update<big_endian_blk0>(context, data, len);
-	else
-		internal_update<little_endian_blk0>(context, data, len);
-#endif
+	internal_update(sha1_backend.transform, context, data, len);
 }
 
 
@@ -230,6 +555,57 @@ void SHA1Final(SHA1_CTX* context, uint8_t* digest)
 			(context->state[i>>2] >> ((3-(i & 3)) * 8) ) & 255);
 	}
 }
+
+// Hashes num messages of len bytes each, and stores the 20
+// byte digests one after another. When the CPU allows it,
+// several messages are hashed at once.
+
+void SHA1Multi(uint8_t const* const* data, int num, uint32_t len
+	, uint8_t* digests)
+{
+	int i = 0;
+#ifdef TORRENT_SHA1_MULTI_BUFFER
+	int const lanes = sha1_backend.lanes;
+	uint32_t const blocks = len / 64;
+	for (; sha1_backend.multi && blocks > 0 && num - i >= lanes; i += lanes)
+	{
+		uint32_t state[8][5];
+		SHA1_CTX ctx;
+		SHA1Init(&ctx);
+		for (int l = 0; l < lanes; ++l)
+			std::memcpy(state[l], ctx.state, sizeof(ctx.state));
+
+		sha1_backend.multi(state, data + i, blocks);
+
+		// the tail of each message is hashed one at a time
+		uint64_t bits = uint64_t(blocks) * 64 * 8;
+		for (int l = 0; l < lanes; ++l)
+		{
+			std::memcpy(ctx.state, state[l], sizeof(ctx.state));
+			ctx.count[0] = uint32_t(bits);
+			ctx.count[1] = uint32_t(bits >> 32);
+			if (len > blocks * 64)
+				SHA1Update(&ctx, data[i + l] + blocks * 64, len - blocks * 64);
+			SHA1Final(&ctx, digests + (i + l) * 20);
+		}
+	}
+#endif
+	for (; i < num; ++i)
+	{
+		SHA1_CTX ctx;
+		SHA1Init(&ctx);
+		SHA1Update(&ctx, data[i], len);
+		SHA1Final(&ctx, digests + i * 20);
+	}
+}
+
+// Returns the name of the transform that was selected
+// for this CPU
+
+char const* SHA1Backend()
+{
+	return sha1_backend.name;
+}
   
 /************************************************************
 
@@ -0,0 +1,297 @@
+/*
+
+Copyright (c) 2007, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+// Checks every SHA-1 backend sha1.cpp can select against the FIPS
+// 180-1 test vectors and against the generic transform, and measures
+// how fast each of them is. Backends the CPU doesn't support are
+// skipped. Build and run it with testsha1.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <ctime>
+#include <vector>
+#include <string>
+
+// the backends live in an anonymous namespace in
+// sha1.cpp, this is the only way to reach them
+#include "sha1.cpp"
+
+namespace
+{
+	int failures = 0;
+
+	void check(bool ok, std::string const& what)
+	{
+		if (ok) return;
+		std::printf("FAILED: %s\n", what.c_str());
+		++failures;
+	}
+
+	std::string to_hex(uint8_t const* digest)
+	{
+		char buf[41];
+		for (int i = 0; i < 20; ++i)
+			std::sprintf(buf + i * 2, "%02x", digest[i]);
+		return buf;
+	}
+
+	std::string to_hex(uint32_t const* state)
+	{
+		uint8_t digest[20];
+		for (int i = 0; i < 20; ++i)
+			digest[i] = uint8_t(state[i >> 2] >> ((3 - (i & 3)) * 8));
+		return to_hex(digest);
+	}
+
+	// hashes len bytes with the given transform. The message is padded
+	// here, so that SHA1Final() (which uses the selected backend)
+	// doesn't get involved
+	std::string hash(transform_fun transform, uint8_t const* data
+		, uint32_t len, int repeat = 1)
+	{
+		SHA1_CTX ctx;
+		SHA1Init(&ctx);
+		for (int i = 0; i < repeat; ++i)
+			internal_update(transform, &ctx, data, len);
+
+		uint64_t bits = (uint64_t(ctx.count[1]) << 32) | ctx.count[0];
+		uint8_t pad[128] = {0x80};
+		uint32_t pad_len = ((ctx.count[0] >> 3) & 63) < 56
+			? 56 - ((ctx.count[0] >> 3) & 63)
+			: 120 - ((ctx.count[0] >> 3) & 63);
+		for (int i = 0; i < 8; ++i)
+			pad[pad_len + i] = uint8_t(bits >> ((7 - i) * 8));
+		internal_update(transform, &ctx, pad, pad_len + 8);
+		assert((ctx.count[0] & 511) == 0);
+		return to_hex(ctx.state);
+	}
+
+	struct test_vector
+	{
+		char const* message;
+		int repeat;
+		char const* digest;
+	};
+
+	// FIPS PUB 180-1, appendix A, B and C
+	test_vector const vectors[] =
+	{
+		{ "abc", 1, "a9993e364706816aba3e25717850c26c9cd0d89d" },
+		{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1
+			, "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+		{ "a", 1000000, "34aa973cd4c4daa4f61eeb2bdbad27316534016f" },
+		{ "", 1, "da39a3ee5e6b4b0d3255bfef95601890afd80709" }
+	};
+
+	void test_transform(char const* name, transform_fun transform
+		, std::vector<uint8_t> const& data)
+	{
+		for (int i = 0; i < int(sizeof(vectors) / sizeof(vectors[0])); ++i)
+		{
+			test_vector const& v = vectors[i];
+			std::string d = hash(transform, (uint8_t const*)v.message
+				, uint32_t(std::strlen(v.message)), v.repeat);
+			check(d == v.digest, std::string(name) + " known answer "
+				+ v.digest + " got " + d);
+		}
+
+		// every length up to a few blocks, and every
+		// alignment of the start of the message
+		transform_fun ref = &generic_transform<little_endian_blk0>;
+		if (is_big_endian()) ref = &generic_transform<big_endian_blk0>;
+		for (uint32_t len = 0; len < 300; ++len)
+		{
+			for (int align = 0; align < 8; ++align)
+			{
+				char msg[100];
+				std::sprintf(msg, "%s length %u offset %d", name, len, align);
+				check(hash(transform, &data[align], len)
+					== hash(ref, &data[align], len), msg);
+			}
+		}
+	}
+
+	double seconds(std::clock_t start)
+	{
+		return double(std::clock() - start) / CLOCKS_PER_SEC;
+	}
+
+	void bench_transform(char const* name, transform_fun transform
+		, std::vector<uint8_t> const& data)
+	{
+		uint32_t state[5] = {0};
+		uint32_t blocks = uint32_t(data.size() / 64);
+		int rounds = 0;
+		std::clock_t start = std::clock();
+		do
+		{
+			transform(state, &data[0], blocks);
+			++rounds;
+		} while (seconds(start) < 1.0);
+		std::printf("%-16s %6.2f GB/s\n", name
+			, double(blocks) * 64 * rounds / seconds(start) / 1e9);
+	}
+
+#ifdef TORRENT_SHA1_MULTI_BUFFER
+
+	typedef void (*multi_fun)(uint32_t (*state)[5]
+		, uint8_t const* const* data, uint32_t blocks);
+
+	void test_multi(char const* name, multi_fun multi, int lanes
+		, std::vector<uint8_t> const& data)
+	{
+		transform_fun ref = &generic_transform<little_endian_blk0>;
+		for (uint32_t blocks = 1; blocks < 20; ++blocks)
+		{
+			uint32_t state[8][5];
+			uint8_t const* lane_data[8];
+			for (int l = 0; l < lanes; ++l)
+			{
+				SHA1_CTX ctx;
+				SHA1Init(&ctx);
+				std::memcpy(state[l], ctx.state, sizeof(ctx.state));
+				// each lane hashes a different message
+				lane_data[l] = &data[l * 1031];
+			}
+			multi(state, lane_data, blocks);
+			for (int l = 0; l < lanes; ++l)
+			{
+				SHA1_CTX ctx;
+				SHA1Init(&ctx);
+				ref(ctx.state, lane_data[l], blocks);
+				char msg[100];
+				std::sprintf(msg, "%s lane %d blocks %u", name, l, blocks);
+				check(to_hex(state[l]) == to_hex(ctx.state), msg);
+			}
+		}
+	}
+
+	void bench_multi(char const* name, multi_fun multi, int lanes
+		, std::vector<uint8_t> const& data)
+	{
+		uint32_t state[8][5] = {{0}};
+		uint32_t blocks = uint32_t(data.size() / 64 / lanes);
+		uint8_t const* lane_data[8];
+		for (int l = 0; l < lanes; ++l)
+			lane_data[l] = &data[l * blocks * 64];
+		int rounds = 0;
+		std::clock_t start = std::clock();
+		do
+		{
+			multi(state, lane_data, blocks);
+			++rounds;
+		} while (seconds(start) < 1.0);
+		std::printf("%-16s %6.2f GB/s\n", name
+			, double(blocks) * 64 * lanes * rounds / seconds(start) / 1e9);
+	}
+
+#endif
+
+	// SHA1Multi() has to agree with hashing the messages one
+	// at a time, whatever the number and length of messages
+	void test_sha1_multi(std::vector<uint8_t> const& data)
+	{
+		for (int num = 0; num < 20; ++num)
+		{
+			for (uint32_t len = 0; len < 300; ++len)
+			{
+				std::vector<uint8_t const*> bufs(num + 1);
+				for (int i = 0; i < num; ++i) bufs[i] = &data[i * 311];
+				std::vector<uint8_t> digests(num * 20 + 1);
+				SHA1Multi(&bufs[0], num, len, &digests[0]);
+				for (int i = 0; i < num; ++i)
+				{
+					SHA1_CTX ctx;
+					uint8_t digest[20];
+					SHA1Init(&ctx);
+					SHA1Update(&ctx, bufs[i], len);
+					SHA1Final(&ctx, digest);
+					char msg[100];
+					std::sprintf(msg, "SHA1Multi %d messages length %u"
+						", message %d", num, len, i);
+					check(std::memcmp(digest, &digests[i * 20], 20) == 0, msg);
+				}
+			}
+		}
+	}
+}
+
+int main()
+{
+	std::vector<uint8_t> data(16 * 1024 * 1024);
+	std::srand(0);
+	for (std::size_t i = 0; i < data.size(); ++i)
+		data[i] = uint8_t(std::rand());
+
+	std::printf("selected backend: %s\n", SHA1Backend());
+
+	std::vector<std::pair<char const*, transform_fun> > transforms;
+	if (is_big_endian())
+		transforms.push_back(std::make_pair("generic", &generic_transform<big_endian_blk0>));
+	else
+		transforms.push_back(std::make_pair("generic", &generic_transform<little_endian_blk0>));
+#ifdef TORRENT_SHA1_X86
+	if (has_sha_ni())
+		transforms.push_back(std::make_pair("sha-ni", &shani_transform));
+	else
+		std::printf("sha-ni: not supported by this CPU, skipped\n");
+#endif
+
+	for (std::size_t i = 0; i < transforms.size(); ++i)
+		test_transform(transforms[i].first, transforms[i].second, data);
+
+#ifdef TORRENT_SHA1_MULTI_BUFFER
+	if (has_sse2()) test_multi("sse2 x4", &multi_transform_sse2, 4, data);
+	else std::printf("sse2: not supported by this CPU, skipped\n");
+	if (has_avx2()) test_multi("avx2 x8", &multi_transform_avx2, 8, data);
+	else std::printf("avx2: not supported by this CPU, skipped\n");
+#endif
+
+	test_sha1_multi(data);
+
+	if (failures > 0)
+	{
+		std::printf("%d tests FAILED\n", failures);
+		return 1;
+	}
+	std::printf("all tests passed\n\n");
+
+	for (std::size_t i = 0; i < transforms.size(); ++i)
+		bench_transform(transforms[i].first, transforms[i].second, data);
+#ifdef TORRENT_SHA1_MULTI_BUFFER
+	if (has_sse2()) bench_multi("sse2 x4", &multi_transform_sse2, 4, data);
+	if (has_avx2()) bench_multi("avx2 x8", &multi_transform_avx2, 8, data);
+#endif
+	return 0;
+}
+
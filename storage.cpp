@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <iterator>
 #include <algorithm>
 #include <set>
+#include <deque>
 #include <functional>
 
 #ifdef _MSC_VER
@@ -46,6 +47,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/filesystem/fstream.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/ref.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/bind.hpp>
 #include <boost/version.hpp>
@@ -253,6 +255,7 @@ namespace
 		{
 			assert(st != 0);
 			assert(p.is_complete());
+			boost::mutex::scoped_lock l(m_mutex);
 			typedef nth_index<file_set, 0>::type path_view;
 			path_view& pt = get<0>(m_files);
 			path_view::iterator i = pt.find(p);
@@ -307,6 +310,7 @@ namespace
 		{
 			assert(st != 0);
 			using boost::tie;
+			boost::mutex::scoped_lock l(m_mutex);
 
 			typedef nth_index<file_set, 2>::type key_view;
 			key_view& kt = get<2>(m_files);
@@ -334,6 +338,10 @@ namespace
 	private:
 		int m_size;
 
+		// the pool is shared by all storages and used both
+		// by the disk io thread and the checker threads
+		boost::mutex m_mutex;
+
 		typedef multi_index_container<
 			lru_file_entry, indexed_by<
 				ordered_unique<member<lru_file_entry, path
@@ -347,6 +355,116 @@ namespace
 		
 		file_set m_files;
 	};
+
+	// hashes one slot's worth of data read by the file check.
+	// The small hash covers the size of the last piece and the
+	// large hash covers a full piece, see identify_data()
+	struct hash_slot_job
+	{
+		hash_slot_job(char const* data, int small_size, int large_size
+			, sha1_hash* small_hash, sha1_hash* large_hash)
+			: m_data(data)
+			, m_small_size(small_size)
+			, m_large_size(large_size)
+			, m_small_hash(small_hash)
+			, m_large_hash(large_hash)
+		{}
+
+		void operator()() const
+		{
+			hasher small_digest;
+			small_digest.update(m_data, m_small_size);
+			hasher large_digest(small_digest);
+			assert(m_large_size - m_small_size >= 0);
+			if (m_large_size - m_small_size > 0)
+			{
+				large_digest.update(m_data + m_small_size
+					, m_large_size - m_small_size);
+			}
+			*m_large_hash = large_digest.final();
+			*m_small_hash = small_digest.final();
+		}
+
+		char const* m_data;
+		int m_small_size;
+		int m_large_size;
+		sha1_hash* m_small_hash;
+		sha1_hash* m_large_hash;
+	};
+
+	// a fixed set of threads that hash the slots read by
+	// the file check. The threads are started once and fed
+	// from a queue, rather than started once per slot
+	class hash_thread_pool : boost::noncopyable
+	{
+	public:
+		hash_thread_pool(int num_threads)
+			: m_outstanding(0)
+			, m_abort(false)
+		{
+			assert(num_threads > 0);
+			for (int i = 0; i < num_threads; ++i)
+				m_threads.create_thread(boost::bind(&hash_thread_pool::run, this));
+		}
+
+		~hash_thread_pool()
+		{
+			{
+				boost::mutex::scoped_lock l(m_mutex);
+				m_abort = true;
+				m_job_cond.notify_all();
+			}
+			m_threads.join_all();
+		}
+
+		int num_threads() const { return int(m_threads.size()); }
+
+		void post(hash_slot_job const& j)
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+			m_jobs.push_back(j);
+			++m_outstanding;
+			m_job_cond.notify_one();
+		}
+
+		// blocks until every posted job has been hashed
+		void wait()
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+			while (m_outstanding > 0) m_done_cond.wait(l);
+		}
+
+	private:
+
+		void run()
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+			for (;;)
+			{
+				while (m_jobs.empty() && !m_abort) m_job_cond.wait(l);
+				if (m_jobs.empty()) return;
+
+				hash_slot_job j = m_jobs.front();
+				m_jobs.pop_front();
+				l.unlock();
+				j();
+				l.lock();
+				if (--m_outstanding == 0) m_done_cond.notify_all();
+			}
+		}
+
+		boost::mutex m_mutex;
+		// signalled when a job is posted or the pool is
+		// being destructed
+		boost::condition m_job_cond;
+		// signalled when the last outstanding job is done
+		boost::condition m_done_cond;
+		std::deque<hash_slot_job> m_jobs;
+		// the number of jobs posted but not yet hashed
+		int m_outstanding;
+		bool m_abort;
+		boost::thread_group m_threads;
+	};
 }
 
 namespace libtorrent
@@ -511,13 +629,30 @@ namespace libtorrent
 		m_pimpl.swap(other.m_pimpl);
 	}
 
+	void storage_interface::writev(file::iovec_t const* bufs, int num_bufs
+		, int slot, int offset)
+	{
+		for (int i = 0; i < num_bufs; ++i)
+		{
+			write(bufs[i].buf, slot, offset, bufs[i].size);
+			offset += bufs[i].size;
+		}
+	}
+
+	storage_interface* default_storage_constructor(torrent_info const& ti
+		, path const& path)
+	{
+		return new storage(ti, path);
+	}
+
 	// returns true on success
-	bool storage::move_storage(path save_path)
+	bool move_torrent_files(torrent_info const& info
+		, path const& old_save_path, path const& new_save_path)
 	{
 		path old_path;
 		path new_path;
 
-		save_path = complete(save_path);
+		path save_path = complete(new_save_path);
 
 #if defined(_WIN32) && defined(UNICODE)
 		std::wstring wsave_path(safe_convert(save_path.native_file_string()));
@@ -536,11 +671,9 @@ namespace libtorrent
 			return false;
 #endif
 
-		m_pimpl->files.release(m_pimpl.get());
-
-		if (m_pimpl->info.num_files() == 1)
+		if (info.num_files() == 1)
 		{
-			path single_file = m_pimpl->info.begin_files()->path;
+			path single_file = info.begin_files()->path;
 			if (single_file.has_branch_path())
 			{
 #if defined(_WIN32) && defined(UNICODE)
@@ -552,14 +685,14 @@ namespace libtorrent
 #endif
 			}
 
-			old_path = m_pimpl->save_path / single_file;
-			new_path = save_path / m_pimpl->info.begin_files()->path;
+			old_path = old_save_path / single_file;
+			new_path = save_path / info.begin_files()->path;
 		}
 		else
 		{
-			assert(m_pimpl->info.num_files() > 1);
-			old_path = m_pimpl->save_path / m_pimpl->info.name();
-			new_path = save_path / m_pimpl->info.name();
+			assert(info.num_files() > 1);
+			old_path = old_save_path / info.name();
+			new_path = save_path / info.name();
 		}
 
 		try
@@ -569,13 +702,22 @@ namespace libtorrent
 #else
 			rename(old_path, new_path);
 #endif
-			m_pimpl->save_path = save_path;
 			return true;
 		}
 		catch (std::exception&) {}
 		return false;
 	}
 
+	bool storage::move_storage(path save_path)
+	{
+		m_pimpl->files.release(m_pimpl.get());
+
+		if (!move_torrent_files(m_pimpl->info, m_pimpl->save_path, save_path))
+			return false;
+		m_pimpl->save_path = complete(save_path);
+		return true;
+	}
+
 #ifndef NDEBUG
 
 	void storage::shuffle()
@@ -631,17 +773,8 @@ namespace libtorrent
 		assert(start + size <= m_pimpl->info.total_size());
 
 		// find the file iterator and file offset
-		size_type file_offset = start;
-		std::vector<file_entry>::const_iterator file_iter;
-
-		for (file_iter = m_pimpl->info.begin_files();;)
-		{
-			if (file_offset < file_iter->size)
-				break;
-
-			file_offset -= file_iter->size;
-			++file_iter;
-		}
+		torrent_info::file_iterator file_iter = m_pimpl->info.file_at_offset(start);
+		size_type file_offset = start - file_iter->offset;
 
 		boost::shared_ptr<file> in(m_pimpl->files.open_file(
 			m_pimpl.get()
@@ -652,18 +785,6 @@ namespace libtorrent
 
 		assert(slices[0].offset == file_offset);
 
-		size_type new_pos = in->seek(file_offset);
-		if (new_pos != file_offset)
-		{
-			// the file was not big enough
-			throw file_error("slot has no storage");
-		}
-
-#ifndef NDEBUG
-		size_type in_tell = in->tell();
-		assert(in_tell == file_offset);
-#endif
-
 		int left_to_read = size;
 		int slot_size = static_cast<int>(m_pimpl->info.piece_size(slot));
 
@@ -695,7 +816,8 @@ namespace libtorrent
 					== file_iter->path);
 #endif
 
-				size_type actual_read = in->read(buf + buf_pos, read_bytes);
+				size_type actual_read = in->read_at(buf + buf_pos
+					, file_offset, read_bytes);
 
 				if (read_bytes != actual_read)
 				{
@@ -723,7 +845,6 @@ namespace libtorrent
 				in = m_pimpl->files.open_file(
 					m_pimpl.get()
 					, path, file::in);
-				in->seek(0);
 			}
 		}
 
@@ -754,18 +875,8 @@ namespace libtorrent
 		size_type start = slot * (size_type)m_pimpl->info.piece_length() + offset;
 
 		// find the file iterator and file offset
-		size_type file_offset = start;
-		std::vector<file_entry>::const_iterator file_iter;
-
-		for (file_iter = m_pimpl->info.begin_files();;)
-		{
-			if (file_offset < file_iter->size)
-				break;
-
-			file_offset -= file_iter->size;
-			++file_iter;
-			assert(file_iter != m_pimpl->info.end_files());
-		}
+		torrent_info::file_iterator file_iter = m_pimpl->info.file_at_offset(start);
+		size_type file_offset = start - file_iter->offset;
 
 		path p(m_pimpl->save_path / file_iter->path);
 		boost::shared_ptr<file> out = m_pimpl->files.open_file(
@@ -775,15 +886,6 @@ namespace libtorrent
 		assert(file_offset < file_iter->size);
 		assert(slices[0].offset == file_offset);
 
-		size_type pos = out->seek(file_offset);
-
-		if (pos != file_offset)
-		{
-			std::stringstream s;
-			s << "no storage for slot " << slot;
-			throw file_error(s.str());
-		}
-
 		int left_to_write = size;
 		int slot_size = static_cast<int>(m_pimpl->info.piece_size(slot));
 
@@ -814,7 +916,8 @@ namespace libtorrent
 
 				assert(buf_pos >= 0);
 				assert(write_bytes >= 0);
-				size_type written = out->write(buf + buf_pos, write_bytes);
+				size_type written = out->write_at(buf + buf_pos
+					, file_offset, write_bytes);
 
 				if (written != write_bytes)
 				{
@@ -843,8 +946,99 @@ namespace libtorrent
 				out = m_pimpl->files.open_file(
 					m_pimpl.get()
 					, p, file::out | file::in);
+			}
+		}
+	}
 
-				out->seek(0);
+	// the buffers are split at the file boundaries, and the
+	// ones (or the parts of them) that go to the same file
+	// are written with a single writev_at()
+	void storage::writev(
+		file::iovec_t const* bufs
+		, int num_bufs
+		, int slot
+		, int offset)
+	{
+		assert(bufs != 0);
+		assert(num_bufs > 0);
+		assert(slot >= 0);
+		assert(slot < m_pimpl->info.num_pieces());
+		assert(offset >= 0);
+
+		int left_to_write = 0;
+		for (int i = 0; i < num_bufs; ++i)
+		{
+			assert(bufs[i].size > 0);
+			left_to_write += bufs[i].size;
+		}
+		assert(offset + left_to_write <= m_pimpl->info.piece_size(slot));
+
+		slot_lock lock(*m_pimpl, slot);
+
+		size_type start = slot * (size_type)m_pimpl->info.piece_length() + offset;
+
+		// find the file iterator and file offset
+		torrent_info::file_iterator file_iter = m_pimpl->info.file_at_offset(start);
+		size_type file_offset = start - file_iter->offset;
+		assert(file_offset < file_iter->size);
+
+		// the part of the current buffer that hasn't been written
+		file::iovec_t cur = bufs[0];
+		int next_buf = 1;
+		std::vector<file::iovec_t> vec;
+
+		while (left_to_write > 0)
+		{
+			int write_bytes = left_to_write;
+			if (file_offset + write_bytes > file_iter->size)
+			{
+				assert(file_iter->size >= file_offset);
+				write_bytes = static_cast<int>(file_iter->size - file_offset);
+			}
+
+			if (write_bytes > 0)
+			{
+				vec.clear();
+				for (int left = write_bytes; left > 0;)
+				{
+					if (cur.size == 0)
+					{
+						assert(next_buf < num_bufs);
+						cur = bufs[next_buf++];
+					}
+					file::iovec_t v;
+					v.buf = cur.buf;
+					v.size = (std::min)(cur.size, left);
+					vec.push_back(v);
+					cur.buf += v.size;
+					cur.size -= v.size;
+					left -= v.size;
+				}
+
+				boost::shared_ptr<file> out = m_pimpl->files.open_file(
+					m_pimpl.get()
+					, m_pimpl->save_path / file_iter->path
+					, file::out | file::in);
+
+				size_type written = out->writev_at(&vec[0]
+					, int(vec.size()), file_offset);
+
+				if (written != write_bytes)
+				{
+					std::stringstream s;
+					s << "no storage for slot " << slot;
+					throw file_error(s.str());
+				}
+
+				left_to_write -= write_bytes;
+				file_offset += write_bytes;
+			}
+
+			if (left_to_write > 0)
+			{
+				++file_iter;
+				assert(file_iter != m_pimpl->info.end_files());
+				file_offset = 0;
 			}
 		}
 	}
@@ -862,7 +1056,8 @@ namespace libtorrent
 
 		impl(
 			torrent_info const& info
-			, path const& path);
+			, path const& path
+			, storage_constructor_type sc);
 
 		bool check_fastresume(
 			aux::piece_checker_data& d
@@ -872,7 +1067,8 @@ namespace libtorrent
 
 		std::pair<bool, float> check_files(
 			std::vector<bool>& pieces
-			, int& num_pieces);
+			, int& num_pieces
+			, int hash_threads);
 
 		void release_files();
 
@@ -897,12 +1093,18 @@ namespace libtorrent
 			, int offset
 			, int size);
 
+		void writev(
+			file::iovec_t const* bufs
+			, int num_bufs
+			, int piece_index
+			, int offset);
+
 		path const& save_path() const
 		{ return m_save_path; }
 
 		bool move_storage(path save_path)
 		{
-			if (m_storage.move_storage(save_path))
+			if (m_storage->move_storage(save_path))
 			{
 				m_save_path = complete(save_path);
 				return true;
@@ -916,12 +1118,17 @@ namespace libtorrent
 		// piece or assigns the given piece_index to a free slot
 		
 		int identify_data(
-			const std::vector<char>& piece_data
+			sha1_hash const& large_hash
+			, sha1_hash const& small_hash
 			, int current_slot
 			, std::vector<bool>& have_pieces
 			, int& num_pieces
 			, const std::multimap<sha1_hash, int>& hash_to_piece);
 
+		// reads the slots following m_current_slot into
+		// m_piece_data and hashes them into m_hashed_slots
+		void read_ahead(int hash_threads);
+
 		int allocate_slot_for_piece(int piece_index);
 #ifndef NDEBUG
 		void check_invariant() const;
@@ -929,7 +1136,7 @@ namespace libtorrent
 		void debug_log() const;
 #endif
 #endif
-		storage m_storage;
+		boost::scoped_ptr<storage_interface> m_storage;
 
 		// if this is true, pieces are always allocated at the
 		// lowest possible slot index. If it is false, pieces
@@ -996,6 +1203,26 @@ namespace libtorrent
 		int m_current_slot;
 		
 		std::vector<char> m_piece_data;
+
+		// the result of hashing a slot during the full check
+		struct hashed_slot
+		{
+			int slot;
+			// true if the slot could not be read
+			bool failed;
+			sha1_hash small_hash;
+			sha1_hash large_hash;
+		};
+
+		// the slots, starting at m_current_slot, that have
+		// been read and hashed ahead of time. These are thrown
+		// away whenever the check moves data between slots,
+		// since that may have invalidated them
+		std::deque<hashed_slot> m_hashed_slots;
+
+		// the threads hashing the slots read by read_ahead(),
+		// only used while checking with more than one thread
+		boost::scoped_ptr<hash_thread_pool> m_hash_pool;
 		
 		// this maps a piece hash to piece index. It will be
 		// build the first time it is used (to save time if it
@@ -1011,8 +1238,9 @@ namespace libtorrent
 
 	piece_manager::impl::impl(
 		torrent_info const& info
-		, path const& save_path)
-		: m_storage(info, save_path)
+		, path const& save_path
+		, storage_constructor_type sc)
+		: m_storage(sc(info, save_path))
 		, m_compact_mode(false)
 		, m_fill_mode(true)
 		, m_info(info)
@@ -1024,8 +1252,9 @@ namespace libtorrent
 
 	piece_manager::piece_manager(
 		torrent_info const& info
-		, path const& save_path)
-		: m_pimpl(new impl(info, save_path))
+		, path const& save_path
+		, storage_constructor_type sc)
+		: m_pimpl(new impl(info, save_path, sc))
 	{
 	}
 
@@ -1040,7 +1269,7 @@ namespace libtorrent
 
 	void piece_manager::impl::release_files()
 	{
-		m_storage.release_files();
+		m_storage->release_files();
 	}
 
 	void piece_manager::impl::export_piece_map(
@@ -1110,6 +1339,11 @@ namespace libtorrent
 		return m_pimpl->slot_for_piece(piece_index);
 	}
 
+	int piece_manager::piece_size(int piece_index) const
+	{
+		return static_cast<int>(m_pimpl->m_info.piece_size(piece_index));
+	}
+
 	int piece_manager::impl::slot_for_piece(int piece_index) const
 	{
 		assert(piece_index >= 0 && piece_index < m_info.num_pieces());
@@ -1142,7 +1376,7 @@ namespace libtorrent
 		for (int i = 0; i < num_blocks-1; ++i)
 		{
 			if (!bitmask[i]) continue;
-			m_storage.read(
+			m_storage->read(
 				&buf[0]
 				, slot_index
 				, i * block_size
@@ -1151,7 +1385,7 @@ namespace libtorrent
 		}
 		if (bitmask[num_blocks - 1])
 		{
-			m_storage.read(
+			m_storage->read(
 				&buf[0]
 				, slot_index
 				, block_size * (num_blocks - 1)
@@ -1167,6 +1401,10 @@ namespace libtorrent
 	  , int offset
 	  , int size)
 	{
+		// synchronization ------------------------------------------------------
+		boost::recursive_mutex::scoped_lock lock(m_mutex);
+		// ----------------------------------------------------------------------
+
 		assert(buf);
 		assert(offset >= 0);
 		assert(size > 0);
@@ -1174,7 +1412,7 @@ namespace libtorrent
 		assert(m_piece_to_slot[piece_index] >= 0 && m_piece_to_slot[piece_index] < (int)m_slot_to_piece.size());
 		int slot = m_piece_to_slot[piece_index];
 		assert(slot >= 0 && slot < (int)m_slot_to_piece.size());
-		return m_storage.read(buf, slot, offset, size);
+		return m_storage->read(buf, slot, offset, size);
 	}
 
 	size_type piece_manager::read(
@@ -1192,13 +1430,17 @@ namespace libtorrent
 	  , int offset
 	  , int size)
 	{
+		// synchronization ------------------------------------------------------
+		boost::recursive_mutex::scoped_lock lock(m_mutex);
+		// ----------------------------------------------------------------------
+
 		assert(buf);
 		assert(offset >= 0);
 		assert(size > 0);
 		assert(piece_index >= 0 && piece_index < (int)m_piece_to_slot.size());
 		int slot = allocate_slot_for_piece(piece_index);
 		assert(slot >= 0 && slot < (int)m_slot_to_piece.size());
-		m_storage.write(buf, slot, offset, size);
+		m_storage->write(buf, slot, offset, size);
 	}
 
 	void piece_manager::write(
@@ -1210,8 +1452,40 @@ namespace libtorrent
 		m_pimpl->write(buf, piece_index, offset, size);
 	}
 
+	void piece_manager::impl::writev(
+		file::iovec_t const* bufs
+	  , int num_bufs
+	  , int piece_index
+	  , int offset)
+	{
+		// synchronization ------------------------------------------------------
+		boost::recursive_mutex::scoped_lock lock(m_mutex);
+		// ----------------------------------------------------------------------
+
+		assert(bufs);
+		assert(num_bufs > 0);
+		assert(offset >= 0);
+		assert(piece_index >= 0 && piece_index < (int)m_piece_to_slot.size());
+		int slot = allocate_slot_for_piece(piece_index);
+		assert(slot >= 0 && slot < (int)m_slot_to_piece.size());
+		m_storage->writev(bufs, num_bufs, slot, offset);
+	}
+
+	void piece_manager::writev(
+		file::iovec_t const* bufs
+	  , int num_bufs
+	  , int piece_index
+	  , int offset)
+	{
+		m_pimpl->writev(bufs, num_bufs, piece_index, offset);
+	}
+
+	// the small hash is the digest of the slot with the
+	// same size as the last piece, and the large hash is
+	// the digest with the same size as a normal piece
 	int piece_manager::impl::identify_data(
-		const std::vector<char>& piece_data
+		sha1_hash const& large_hash
+		, sha1_hash const& small_hash
 		, int current_slot
 		, std::vector<bool>& have_pieces
 		, int& num_pieces
@@ -1221,28 +1495,6 @@ namespace libtorrent
 
 		assert((int)have_pieces.size() == m_info.num_pieces());
 
-		const int piece_size = static_cast<int>(m_info.piece_length());
-		const int last_piece_size = static_cast<int>(m_info.piece_size(
-			m_info.num_pieces() - 1));
-
-		assert((int)piece_data.size() >= last_piece_size);
-
-		// calculate a small digest, with the same
-		// size as the last piece. And a large digest
-		// which has the same size as a normal piece
-		hasher small_digest;
-		small_digest.update(&piece_data[0], last_piece_size);
-		hasher large_digest(small_digest);
-		assert(piece_size - last_piece_size >= 0);
-		if (piece_size - last_piece_size > 0)
-		{
-			large_digest.update(
-				&piece_data[last_piece_size]
-				, piece_size - last_piece_size);
-		}
-		sha1_hash large_hash = large_digest.final();
-		sha1_hash small_hash = small_digest.final();
-
 		typedef std::multimap<sha1_hash, int>::const_iterator map_iter;
 		map_iter begin1;
 		map_iter end1;
@@ -1380,7 +1632,7 @@ namespace libtorrent
 		// use while debugging to find
 		// states that cannot be scanned
 		// by check_pieces.
-//		m_storage.shuffle();
+//		m_storage->shuffle();
 
 		m_piece_to_slot.resize(m_info.num_pieces(), has_no_slot);
 		m_slot_to_piece.resize(m_info.num_pieces(), unallocated);
@@ -1449,6 +1701,75 @@ namespace libtorrent
 		return false;
 	}
 
+	void piece_manager::impl::read_ahead(int hash_threads)
+	{
+		assert(m_hashed_slots.empty());
+		assert(m_current_slot < m_info.num_pieces());
+
+		if (hash_threads < 1) hash_threads = 1;
+
+		const int piece_size = static_cast<int>(m_info.piece_length());
+		const int last_piece_size = static_cast<int>(m_info.piece_size(
+			m_info.num_pieces() - 1));
+
+		// read twice as many slots as there are hash threads, to
+		// keep them busy while the next slot is being read. With
+		// a single thread this degenerates to one slot at a time
+		int num_slots = (std::min)(hash_threads == 1 ? 1 : hash_threads * 2
+			, m_info.num_pieces() - m_current_slot);
+
+		m_piece_data.resize(num_slots * piece_size);
+		m_hashed_slots.resize(num_slots);
+
+		if (hash_threads > 1 && (!m_hash_pool
+			|| m_hash_pool->num_threads() != hash_threads))
+		{
+			m_hash_pool.reset();
+			m_hash_pool.reset(new hash_thread_pool(hash_threads));
+		}
+
+		int num_read = 0;
+		for (; num_read < num_slots; ++num_read)
+		{
+			hashed_slot& hs = m_hashed_slots[num_read];
+			hs.slot = m_current_slot + num_read;
+			hs.failed = false;
+			char* buf = &m_piece_data[num_read * piece_size];
+			try
+			{
+				m_storage->read(buf, hs.slot, 0
+					, static_cast<int>(m_info.piece_size(hs.slot)));
+			}
+			catch (file_error&)
+			{
+				// the check will skip the rest of this
+				// file, so there's no point in reading further
+				hs.failed = true;
+				++num_read;
+				break;
+			}
+
+			hash_slot_job job(buf, last_piece_size, piece_size
+				, &hs.small_hash, &hs.large_hash);
+
+			// the pool hashes this slot while the next
+			// one is being read
+			if (hash_threads == 1) job();
+			else m_hash_pool->post(job);
+		}
+
+		if (hash_threads > 1)
+		{
+			m_hash_pool->wait();
+
+			// the threads aren't needed once the
+			// last slot has been hashed
+			if (m_current_slot + num_read == m_info.num_pieces())
+				m_hash_pool.reset();
+		}
+		m_hashed_slots.resize(num_read);
+	}
+
 	// performs the full check and full allocation
 	// (if necessary). returns true if finished and
 	// false if it should be called again
@@ -1456,7 +1777,7 @@ namespace libtorrent
 	// file check is at. 0 is nothing done, and 1
 	// is finished
 	std::pair<bool, float> piece_manager::impl::check_files(
-		std::vector<bool>& pieces, int& num_pieces)
+		std::vector<bool>& pieces, int& num_pieces, int hash_threads)
 	{
 		assert(num_pieces == std::count(pieces.begin(), pieces.end(), true));
 
@@ -1515,7 +1836,7 @@ namespace libtorrent
 			}
 			m_current_slot = 0;
 			m_state = state_full_check;
-			m_piece_data.resize(int(m_info.piece_length()));
+			m_hashed_slots.clear();
 			return std::make_pair(false, 0.f);
 		}
 
@@ -1527,12 +1848,14 @@ namespace libtorrent
 
 		try
 		{
+			if (m_hashed_slots.empty()) read_ahead(hash_threads);
 
-			m_storage.read(
-				&m_piece_data[0]
-				, m_current_slot
-				, 0
-				, int(m_info.piece_size(m_current_slot)));
+			assert(!m_hashed_slots.empty());
+			hashed_slot hs = m_hashed_slots.front();
+			m_hashed_slots.pop_front();
+			assert(hs.slot == m_current_slot);
+
+			if (hs.failed) throw file_error("slot has no storage");
 
 			if (m_hash_to_piece.empty())
 			{
@@ -1543,7 +1866,8 @@ namespace libtorrent
 			}
 
 			int piece_index = identify_data(
-				m_piece_data
+				hs.large_hash
+				, hs.small_hash
 				, m_current_slot
 				, pieces
 				, num_pieces
@@ -1555,6 +1879,11 @@ namespace libtorrent
 			const bool this_should_move = piece_index >= 0 && m_slot_to_piece[piece_index] != unallocated;
 			const bool other_should_move = m_piece_to_slot[m_current_slot] != has_no_slot;
 
+			// moving pieces around will overwrite slots we
+			// may already have read ahead
+			if (this_should_move || other_should_move)
+				m_hashed_slots.clear();
+
 			// check if this piece should be swapped with any other slot
 			// this section will ensure that the storage is correctly sorted
 			// libtorrent will never leave the storage in a state that
@@ -1607,14 +1936,14 @@ namespace libtorrent
 				const int slot1_size = static_cast<int>(m_info.piece_size(piece_index));
 				const int slot2_size = other_piece >= 0 ? static_cast<int>(m_info.piece_size(other_piece)) : 0;
 				std::vector<char> buf1(slot1_size);
-				m_storage.read(&buf1[0], m_current_slot, 0, slot1_size);
+				m_storage->read(&buf1[0], m_current_slot, 0, slot1_size);
 				if (slot2_size > 0)
 				{
 					std::vector<char> buf2(slot2_size);
-					m_storage.read(&buf2[0], piece_index, 0, slot2_size);
-					m_storage.write(&buf2[0], m_current_slot, 0, slot2_size);
+					m_storage->read(&buf2[0], piece_index, 0, slot2_size);
+					m_storage->write(&buf2[0], m_current_slot, 0, slot2_size);
 				}
-				m_storage.write(&buf1[0], piece_index, 0, slot1_size);
+				m_storage->write(&buf1[0], piece_index, 0, slot1_size);
 				assert(m_slot_to_piece[m_current_slot] == unassigned
 						|| m_piece_to_slot[m_slot_to_piece[m_current_slot]] == m_current_slot);
 			}
@@ -1640,14 +1969,14 @@ namespace libtorrent
 				const int slot1_size = static_cast<int>(m_info.piece_size(other_piece));
 				const int slot2_size = piece_index >= 0 ? static_cast<int>(m_info.piece_size(piece_index)) : 0;
 				std::vector<char> buf1(slot1_size);
-				m_storage.read(&buf1[0], other_slot, 0, slot1_size);
+				m_storage->read(&buf1[0], other_slot, 0, slot1_size);
 				if (slot2_size > 0)
 				{
 					std::vector<char> buf2(slot2_size);
-					m_storage.read(&buf2[0], m_current_slot, 0, slot2_size);
-					m_storage.write(&buf2[0], other_slot, 0, slot2_size);
+					m_storage->read(&buf2[0], m_current_slot, 0, slot2_size);
+					m_storage->write(&buf2[0], other_slot, 0, slot2_size);
 				}
-				m_storage.write(&buf1[0], m_current_slot, 0, slot1_size);
+				m_storage->write(&buf1[0], m_current_slot, 0, slot1_size);
 				assert(m_slot_to_piece[m_current_slot] == unassigned
 						|| m_piece_to_slot[m_slot_to_piece[m_current_slot]] == m_current_slot);
 			}
@@ -1689,10 +2018,10 @@ namespace libtorrent
 					std::vector<char> buf1(static_cast<int>(slot1_size));
 					std::vector<char> buf2(static_cast<int>(slot3_size));
 
-					m_storage.read(&buf2[0], m_current_slot, 0, slot3_size);
-					m_storage.read(&buf1[0], slot1, 0, slot1_size);
-					m_storage.write(&buf1[0], m_current_slot, 0, slot1_size);
-					m_storage.write(&buf2[0], slot1, 0, slot3_size);
+					m_storage->read(&buf2[0], m_current_slot, 0, slot3_size);
+					m_storage->read(&buf1[0], slot1, 0, slot1_size);
+					m_storage->write(&buf1[0], m_current_slot, 0, slot1_size);
+					m_storage->write(&buf2[0], slot1, 0, slot3_size);
 
 					assert(m_slot_to_piece[m_current_slot] == unassigned
 							|| m_piece_to_slot[m_slot_to_piece[m_current_slot]] == m_current_slot);
@@ -1731,15 +2060,15 @@ namespace libtorrent
 					std::vector<char> buf1(static_cast<int>(m_info.piece_length()));
 					std::vector<char> buf2(static_cast<int>(m_info.piece_length()));
 
-					m_storage.read(&buf2[0], m_current_slot, 0, slot3_size);
-					m_storage.read(&buf1[0], slot2, 0, slot2_size);
-					m_storage.write(&buf1[0], m_current_slot, 0, slot2_size);
+					m_storage->read(&buf2[0], m_current_slot, 0, slot3_size);
+					m_storage->read(&buf1[0], slot2, 0, slot2_size);
+					m_storage->write(&buf1[0], m_current_slot, 0, slot2_size);
 					if (slot1_size > 0)
 					{
-						m_storage.read(&buf1[0], slot1, 0, slot1_size);
-						m_storage.write(&buf1[0], slot2, 0, slot1_size);
+						m_storage->read(&buf1[0], slot1, 0, slot1_size);
+						m_storage->write(&buf1[0], slot2, 0, slot1_size);
 					}
-					m_storage.write(&buf2[0], slot1, 0, slot3_size);
+					m_storage->write(&buf2[0], slot1, 0, slot3_size);
 					assert(m_slot_to_piece[m_current_slot] == unassigned
 						|| m_piece_to_slot[m_slot_to_piece[m_current_slot]] == m_current_slot);
 				}
@@ -1764,15 +2093,12 @@ namespace libtorrent
 		}
 		catch (file_error&)
 		{
+			m_hashed_slots.clear();
+
 			// find the file that failed, and skip all the blocks in that file
-			size_type file_offset = 0;
 			size_type current_offset = m_current_slot * m_info.piece_length();
-			for (torrent_info::file_iterator i = m_info.begin_files();
-					i != m_info.end_files(); ++i)
-			{
-				file_offset += i->size;
-				if (file_offset > current_offset) break;
-			}
+			torrent_info::file_iterator i = m_info.file_at_offset(current_offset);
+			size_type file_offset = i->offset + i->size;
 
 			assert(file_offset > current_offset);
 			int skip_blocks = static_cast<int>(
@@ -1796,6 +2122,7 @@ namespace libtorrent
 
 			// clear the memory we've been using
 			std::vector<char>().swap(m_piece_data);
+			std::deque<hashed_slot>().swap(m_hashed_slots);
 			std::multimap<sha1_hash, int>().swap(m_hash_to_piece);
 			m_state = state_allocating;
 			assert(num_pieces == std::count(pieces.begin(), pieces.end(), true));
@@ -1816,9 +2143,10 @@ namespace libtorrent
 
 	std::pair<bool, float> piece_manager::check_files(
 		std::vector<bool>& pieces
-		, int& num_pieces)
+		, int& num_pieces
+		, int hash_threads)
 	{
-		return m_pimpl->check_files(pieces, num_pieces);
+		return m_pimpl->check_files(pieces, num_pieces, hash_threads);
 	}
 
 	int piece_manager::impl::allocate_slot_for_piece(int piece_index)
@@ -1917,8 +2245,8 @@ namespace libtorrent
 
 			const int slot_size = static_cast<int>(m_info.piece_size(slot_index));
 			std::vector<char> buf(slot_size);
-			m_storage.read(&buf[0], piece_index, 0, slot_size);
-			m_storage.write(&buf[0], slot_index, 0, slot_size);
+			m_storage->read(&buf[0], piece_index, 0, slot_size);
+			m_storage->write(&buf[0], slot_index, 0, slot_size);
 
 			assert(m_slot_to_piece[piece_index] == piece_index);
 			assert(m_piece_to_slot[piece_index] == piece_index);
@@ -2005,7 +2333,7 @@ namespace libtorrent
 			if (m_piece_to_slot[pos] != has_no_slot)
 			{
 				assert(m_piece_to_slot[pos] >= 0);
-				m_storage.read(&buffer[0], m_piece_to_slot[pos], 0, static_cast<int>(m_info.piece_size(pos)));
+				m_storage->read(&buffer[0], m_piece_to_slot[pos], 0, static_cast<int>(m_info.piece_size(pos)));
 				new_free_slot = m_piece_to_slot[pos];
 				m_slot_to_piece[pos] = pos;
 				m_piece_to_slot[pos] = pos;
@@ -2016,7 +2344,7 @@ namespace libtorrent
 			m_free_slots.push_back(new_free_slot);
 
 			if (write_back || m_fill_mode)
-				m_storage.write(&buffer[0], pos, 0, static_cast<int>(m_info.piece_size(pos)));
+				m_storage->write(&buffer[0], pos, 0, static_cast<int>(m_info.piece_size(pos)));
 		}
 
 		assert(m_free_slots.size() > 0);
@@ -0,0 +1,186 @@
+#/*
+#Copyright: A. Zakai ('Kripken') <kripkensteiner@gmail.com> http://6thsenseless.blogspot.com
+#
+#2006-15-9
+#
+#This code is licensed under the terms of the GNU General Public License (GPL),
+#version 2 or above; See /usr/share/common-licenses/GPL , or see
+#http://www.fsf.org/licensing/licenses/gpl.html
+#*/
+
+# Calls the blocking functions of the torrent module from several
+# threads at once, to make sure they release the GIL and don't deadlock
+# or crash each other. A pure python thread ticks along meanwhile, if it
+# gets stuck for long the GIL wasn't released around some call.
+#
+# usage: python stress.py [seconds] [threads]
+
+import torrent
+import os
+import sys
+import random
+import shutil
+import tempfile
+import threading
+import time
+
+duration = 30
+numThreads = 8
+if len(sys.argv) > 1: duration = int(sys.argv[1])
+if len(sys.argv) > 2: numThreads = int(sys.argv[2])
+
+# the longest the ticker thread may go without running
+maxStall = 2.0
+
+numTorrents = 4
+
+workDir = tempfile.mkdtemp(prefix="stress")
+
+errors = []
+errorsLock = threading.Lock()
+
+def fail(msg):
+	errorsLock.acquire()
+	errors.append(msg)
+	errorsLock.release()
+	print("FAILED: " + msg)
+
+def makePayload(index):
+	payloadDir = os.path.join(workDir, "payload%d" % index)
+	os.mkdir(payloadDir)
+	for f in range(3):
+		out = open(os.path.join(payloadDir, "file%d" % f), "wb")
+		out.write(os.urandom(4 * 1024 * 1024))
+		out.close()
+	return payloadDir
+
+def createTorrent(index, payloadDir):
+	torrentFile = os.path.join(workDir, "stress%d.torrent" % index)
+	torrent.createTorrent(torrentFile, payloadDir
+		, "http://127.0.0.1:1/announce", "stress test", 64, "stress.py")
+	return torrentFile
+
+class Ticker(threading.Thread):
+	def __init__(self):
+		threading.Thread.__init__(self)
+		self.done = False
+		self.worst = 0.0
+
+	def run(self):
+		last = time.time()
+		while not self.done:
+			time.sleep(0.01)
+			now = time.time()
+			self.worst = max(self.worst, now - last)
+			last = now
+
+# every call a worker makes, picked at random. They all
+# block on the session, the disk or both
+def randomCall(ids, payloadDir, scratch):
+	uniqueID = random.choice(ids)
+	call = random.randint(0, 13)
+	if call == 0:
+		state = torrent.getState(uniqueID)
+		if state["numPeers"] < 0: fail("negative numPeers")
+	elif call == 1:
+		torrent.getPeerInfo(uniqueID)
+	elif call == 2:
+		torrent.getFileInfo(uniqueID)
+	elif call == 3:
+		torrent.getSessionInfo()
+	elif call == 4:
+		torrent.pause(uniqueID)
+	elif call == 5:
+		torrent.resume(uniqueID)
+	elif call == 6:
+		torrent.reannounce(uniqueID)
+	elif call == 7:
+		torrent.popEvent()
+	elif call == 8:
+		torrent.setUploadRateLimit(random.choice([-1, 10 * 1024, 100 * 1024]))
+		torrent.setDownloadRateLimit(random.choice([-1, 10 * 1024, 100 * 1024]))
+	elif call == 9:
+		torrent.saveFastResumeCheckpoints()
+	elif call == 10:
+		if torrent.getNumTorrents() != numTorrents:
+			fail("getNumTorrents() returned %d" % torrent.getNumTorrents())
+	elif call == 11:
+		files = len(torrent.getFileInfo(uniqueID))
+		torrent.setFilterOut(uniqueID, [random.randint(0, 1) for f in range(files)])
+	elif call == 12:
+		torrent.applyIPFilter([["10.0.0.0", "10.255.255.255"]])
+	else:
+		# hashes while the others keep going
+		torrent.createTorrent(scratch, payloadDir
+			, "http://127.0.0.1:1/announce", "stress test", 16, "stress.py")
+
+class Worker(threading.Thread):
+	def __init__(self, index, ids, payloadDir, endTime):
+		threading.Thread.__init__(self)
+		self.ids = ids
+		self.payloadDir = payloadDir
+		self.endTime = endTime
+		self.scratch = os.path.join(workDir, "scratch%d.torrent" % index)
+		self.calls = 0
+
+	def run(self):
+		try:
+			while time.time() < self.endTime:
+				randomCall(self.ids, self.payloadDir, self.scratch)
+				self.calls += 1
+		except Exception, e:
+			fail("%s: %s" % (self.getName(), e))
+
+def runThreads(threads):
+	for t in threads: t.start()
+	for t in threads: t.join()
+
+torrent.init("DE", 0, 5, 0, 0, "stress.py")
+torrent.setListenOn(6881, 6889)
+
+ticker = Ticker()
+ticker.start()
+
+try:
+	print("Creating %d torrents in parallel" % numTorrents)
+	payloads = [makePayload(i) for i in range(numTorrents)]
+	torrentFiles = [None] * numTorrents
+	def create(i):
+		torrentFiles[i] = createTorrent(i, payloads[i])
+	runThreads([threading.Thread(target=create, args=(i,)) for i in range(numTorrents)])
+
+	# the payload is already where the torrent will be
+	# saved, so adding them checks the files
+	print("Adding them in parallel")
+	ids = [None] * numTorrents
+	def add(i):
+		ids[i] = torrent.addTorrent(torrentFiles[i], workDir, 0)
+	runThreads([threading.Thread(target=add, args=(i,)) for i in range(numTorrents)])
+	# addTorrent() returns a negative error code if it fails
+	for i in ids:
+		if i < 0: raise Exception("addTorrent() failed: %d" % i)
+
+	print("Running %d threads for %d seconds" % (numThreads, duration))
+	endTime = time.time() + duration
+	workers = [Worker(i, ids, payloads[0], endTime) for i in range(numThreads)]
+	runThreads(workers)
+	print("%d calls made" % sum([w.calls for w in workers]))
+
+	print("Removing the torrents in parallel")
+	runThreads([threading.Thread(target=torrent.removeTorrent, args=(i,)) for i in ids])
+	if torrent.getNumTorrents() != 0:
+		fail("%d torrents left after removing them all" % torrent.getNumTorrents())
+finally:
+	ticker.done = True
+	ticker.join()
+	torrent.quit()
+	shutil.rmtree(workDir)
+
+print("The python thread stalled for at most %.2f seconds" % ticker.worst)
+if ticker.worst > maxStall:
+	fail("a call held the GIL for more than %.1f seconds" % maxStall)
+
+if len(errors) > 0:
+	print("%d errors" % len(errors))
+	sys.exit(1)
+print("OK")
@@ -38,6 +38,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <set>
 #include <cctype>
 #include <numeric>
+#include <cstring>
 
 #ifdef _MSC_VER
 #pragma warning(push, 1)
@@ -57,6 +58,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/torrent_info.hpp"
 #include "libtorrent/tracker_manager.hpp"
 #include "libtorrent/bencode.hpp"
+#include "libtorrent/bencode_writer.hpp"
 #include "libtorrent/hasher.hpp"
 #include "libtorrent/entry.hpp"
 #include "libtorrent/peer.hpp"
@@ -198,14 +200,16 @@ namespace libtorrent
 		, tcp::endpoint const& net_interface
 		, bool compact_mode
 		, int block_size
+		, storage_constructor_type sc
 		, session_settings const& s)
 		: m_torrent_file(tf)
 		, m_abort(false)
 		, m_paused(false)
 		, m_just_paused(false)
+		, m_need_save_resume_data(false)
 		, m_event(tracker_request::started)
 		, m_block_size(0)
-		, m_storage(0)
+		, m_storage()
 		, m_next_request(second_clock::universal_time())
 		, m_duration(1800)
 		, m_complete(-1)
@@ -237,6 +241,7 @@ namespace libtorrent
 		, m_metadata_progress(0)
 		, m_metadata_size(0)
 		, m_default_block_size(block_size)
+		, m_storage_constructor(sc)
 		, m_connections_initialized(true)
 		, m_settings(s)
 	{
@@ -298,14 +303,16 @@ namespace libtorrent
 		, tcp::endpoint const& net_interface
 		, bool compact_mode
 		, int block_size
+		, storage_constructor_type sc
 		, session_settings const& s)
 		: m_torrent_file(info_hash)
 		, m_abort(false)
 		, m_paused(false)
 		, m_just_paused(false)
+		, m_need_save_resume_data(false)
 		, m_event(tracker_request::started)
 		, m_block_size(0)
-		, m_storage(0)
+		, m_storage()
 		, m_next_request(second_clock::universal_time())
 		, m_duration(1800)
 		, m_complete(-1)
@@ -336,6 +343,7 @@ namespace libtorrent
 		, m_metadata_progress(0)
 		, m_metadata_size(0)
 		, m_default_block_size(block_size)
+		, m_storage_constructor(sc)
 		, m_connections_initialized(false)
 		, m_settings(s)
 	{
@@ -418,7 +426,8 @@ namespace libtorrent
 		assert(m_torrent_file.total_size() >= 0);
 
 		m_have_pieces.resize(m_torrent_file.num_pieces(), false);
-		m_storage.reset(new piece_manager(m_torrent_file, m_save_path));
+		m_storage.reset(new piece_manager(m_torrent_file, m_save_path
+			, m_storage_constructor));
 		m_block_size = calculate_block_size(m_torrent_file, m_default_block_size);
 		m_picker.reset(new piece_picker(
 			static_cast<int>(m_torrent_file.piece_length() / m_block_size)
@@ -485,6 +494,35 @@ namespace libtorrent
 			m_next_request < second_clock::universal_time();
 	}
 
+	int torrent::seconds_to_next_announce() const
+	{
+		// without trackers, or while paused, there's nothing
+		// to announce. Look again in a minute, in case trackers
+		// are added. resume() forces a tracker request, which
+		// reschedules the torrent
+		if (m_torrent_file.trackers().empty()) return 60;
+		if (m_just_paused) return 1;
+		if (m_paused) return 60;
+
+		// should_request() only returns true once
+		// m_next_request has passed, hence the extra second
+		int ret = (m_next_request - second_clock::universal_time())
+			.total_seconds() + 1;
+		return ret < 1 ? 1 : ret;
+	}
+
+	void torrent::force_tracker_request()
+	{
+		m_next_request = second_clock::universal_time();
+		m_ses.schedule_announce(*this);
+	}
+
+	void torrent::force_tracker_request(boost::posix_time::ptime t)
+	{
+		m_next_request = t;
+		m_ses.schedule_announce(*this);
+	}
+
 	void torrent::tracker_warning(std::string const& msg)
 	{
 		INVARIANT_CHECK;
@@ -652,15 +690,13 @@ namespace libtorrent
 			int corr = 0;
 			assert(!m_have_pieces[i->index]);
 
-			for (int j = 0; j < blocks_per_piece; ++j)
-			{
-				corr += (i->finished_blocks[j]) * m_block_size;
-			}
+			corr += i->finished * m_block_size;
 
 			// correction if this was the last piece
 			// and if we have the last block
 			if (i->index == last_piece
-				&& i->finished_blocks[m_picker->blocks_in_last_piece()-1])
+				&& i->info[m_picker->blocks_in_last_piece()-1].state
+					== piece_picker::block_info::state_finished)
 			{
 				corr -= m_block_size;
 				corr += m_torrent_file.piece_size(last_piece) % m_block_size;
@@ -793,7 +829,7 @@ namespace libtorrent
 		// disconnect all peers and close all
 		// files belonging to the torrents
 		disconnect_all();
-		if (m_storage.get()) m_storage->release_files();
+		async_release_files();
 	}
 
 	void torrent::announce_piece(int index)
@@ -831,6 +867,59 @@ namespace libtorrent
 		return m_username + ":" + m_password;
 	}
 
+	void torrent::set_piece_priority(int index, int priority)
+	{
+		INVARIANT_CHECK;
+
+		// this call is only valid on torrents with metadata
+		assert(m_picker.get());
+		assert(index >= 0);
+		assert(index < m_torrent_file.num_pieces());
+		assert(priority >= 0 && priority <= 7);
+
+		// TODO: update peer's interesting-bit
+		
+		m_picker->set_piece_priority(index, priority);
+	}
+
+	int torrent::piece_priority(int index) const
+	{
+		// this call is only valid on torrents with metadata
+		assert(m_picker.get());
+		assert(index >= 0);
+		assert(index < m_torrent_file.num_pieces());
+
+		return m_picker->piece_priority(index);
+	}
+
+	void torrent::prioritize_pieces(std::vector<int> const& pieces)
+	{
+		INVARIANT_CHECK;
+
+		// this call is only valid on torrents with metadata
+		assert(m_picker.get());
+		assert((int)pieces.size() == m_torrent_file.num_pieces());
+
+		// TODO: update peer's interesting-bit
+
+		int index = 0;
+		for (std::vector<int>::const_iterator i = pieces.begin()
+			, end(pieces.end()); i != end; ++i, ++index)
+		{
+			assert(*i >= 0 && *i <= 7);
+			m_picker->set_piece_priority(index, *i);
+		}
+	}
+
+	void torrent::piece_priorities(std::vector<int>& pieces) const
+	{
+		INVARIANT_CHECK;
+
+		// this call is only valid on torrents with metadata
+		assert(m_picker.get());
+		m_picker->piece_priorities(pieces);
+	}
+
 	void torrent::filter_piece(int index, bool filter)
 	{
 		INVARIANT_CHECK;
@@ -991,20 +1080,10 @@ namespace libtorrent
 		{
 			assert(p->associated_torrent().lock().get() == this);
 
-			std::vector<int> piece_list;
-			const std::vector<bool>& pieces = p->get_bitfield();
-
-			for (std::vector<bool>::const_iterator i = pieces.begin();
-				i != pieces.end(); ++i)
-			{
-				if (*i) piece_list.push_back(static_cast<int>(i - pieces.begin()));
-			}
-
-			for (std::vector<int>::reverse_iterator i = piece_list.rbegin();
-				i != piece_list.rend(); ++i)
-			{
-				peer_lost(*i);
-			}
+			if (p->is_seed())
+				peer_lost_all();
+			else
+				peer_lost(p->get_bitfield());
 		}
 
 		m_policy->connection_closed(*p);
@@ -1093,7 +1172,8 @@ namespace libtorrent
 
 		tcp::endpoint a(host->endpoint());
 
-		boost::shared_ptr<stream_socket> s(new stream_socket(m_ses.m_selector));
+		boost::shared_ptr<stream_socket> s(new stream_socket(
+			m_ses.peer_demuxer(m_torrent_file.info_hash())));
 		boost::intrusive_ptr<peer_connection> c(new web_peer_connection(
 			m_ses, shared_from_this(), s, a, url));
 #ifndef NDEBUG
@@ -1144,7 +1224,8 @@ namespace libtorrent
 		if (m_connections.find(a) != m_connections.end())
 			throw protocol_error("already connected to peer");
 
-		boost::shared_ptr<stream_socket> s(new stream_socket(m_ses.m_selector));
+		boost::shared_ptr<stream_socket> s(new stream_socket(
+			m_ses.peer_demuxer(m_torrent_file.info_hash())));
 		boost::intrusive_ptr<peer_connection> c(new bt_peer_connection(
 			m_ses, shared_from_this(), s, a));
 #ifndef NDEBUG
@@ -1295,7 +1376,7 @@ namespace libtorrent
 		std::for_each(seeds.begin(), seeds.end()
 			, bind(&peer_connection::disconnect, _1));
 
-		m_storage->release_files();
+		async_release_files();
 	}
 	
 	// called when torrent is complete (all pieces downloaded)
@@ -1359,7 +1440,7 @@ namespace libtorrent
 			// don't delay before trying the next tracker
 			m_next_request = second_clock::universal_time();
 		}
-
+		m_ses.schedule_announce(*this);
 	}
 
 	bool torrent::check_fastresume(aux::piece_checker_data& data)
@@ -1387,7 +1468,8 @@ namespace libtorrent
 		INVARIANT_CHECK;
 
 		assert(m_storage.get());
-		std::pair<bool, float> progress = m_storage->check_files(m_have_pieces, m_num_pieces);
+		std::pair<bool, float> progress = m_storage->check_files(m_have_pieces
+			, m_num_pieces, m_ses.settings().hashing_threads);
 
 #ifndef NDEBUG
 		m_initial_done = boost::get<0>(bytes_done());
@@ -1395,7 +1477,7 @@ namespace libtorrent
 		return progress;
 	}
 
-	void torrent::files_checked(std::vector<piece_picker::downloading_piece> const&
+	void torrent::files_checked(std::vector<piece_picker::unfinished_piece> const&
 		unfinished_pieces)
 	{
 		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
@@ -1403,6 +1485,8 @@ namespace libtorrent
 		INVARIANT_CHECK;
 
 		m_picker->files_checked(m_have_pieces, unfinished_pieces);
+		// the first checkpoint records the result of the check
+		m_need_save_resume_data = true;
 		if (!m_connections_initialized)
 		{
 			m_connections_initialized = true;
@@ -1443,17 +1527,40 @@ namespace libtorrent
 	{
 		INVARIANT_CHECK;
 
-		bool ret = true;
 		if (m_storage.get())
 		{
-			ret = m_storage->move_storage(save_path);
-			m_save_path = m_storage->save_path();
+			// the save path is updated once the disk io
+			// thread has moved the files
+			disk_io_job j;
+			j.action = disk_io_job::move_storage;
+			j.storage = m_storage;
+			j.save_path = save_path;
+			m_ses.m_disk_thread.add_job(j
+				, bind(&torrent::on_storage_moved, shared_from_this(), _1, _2));
 		}
 		else
 		{
 			m_save_path = save_path;
 		}
-		return ret;
+		return true;
+	}
+
+	void torrent::on_storage_moved(int ret, disk_io_job const& j)
+	{
+		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
+
+		m_save_path = j.save_path;
+		if (ret < 0)
+		{
+			if (alerts().should_post(alert::fatal))
+				alerts().post_alert(file_error_alert(get_handle(), j.str));
+			return;
+		}
+		if (alerts().should_post(alert::warning))
+		{
+			alerts().post_alert(storage_moved_alert(get_handle()
+				, j.save_path.native_file_string()));
+		}
 	}
 
 	piece_manager& torrent::filesystem()
@@ -1565,9 +1672,10 @@ namespace libtorrent
 		// tell the tracker that we stopped
 		m_event = tracker_request::stopped;
 		m_just_paused = true;
+		m_ses.schedule_announce(*this);
 		// this will make the storage close all
 		// files and flush all cached data
-		if (m_storage.get()) m_storage->release_files();
+		async_release_files();
 	}
 
 	void torrent::resume()
@@ -1716,7 +1824,107 @@ namespace libtorrent
 		}
 	}
 
-	bool torrent::verify_piece(int piece_index)
+	void torrent::async_read(peer_request const& r
+		, disk_io_thread::handler_t const& handler)
+	{
+		assert(m_storage.get());
+		assert(r.length > 0);
+
+		disk_io_job j;
+		j.action = disk_io_job::read;
+		j.storage = m_storage;
+		j.buffer_size = r.length;
+		j.piece = r.piece;
+		j.offset = r.start;
+		m_ses.m_disk_thread.add_job(j, bind(&torrent::on_disk_read_complete
+			, shared_from_this(), _1, _2, handler));
+	}
+
+	void torrent::on_disk_read_complete(int ret, disk_io_job const& j
+		, disk_io_thread::handler_t handler)
+	{
+		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
+		handler(ret, j);
+	}
+
+	void torrent::async_write(peer_request const& p, char const* data)
+	{
+		assert(m_storage.get());
+		assert(p.length > 0);
+
+		// the data may be reused before the job is
+		// executed, so the block has to be copied
+		boost::shared_array<char> buf(new char[p.length]);
+		std::memcpy(buf.get(), data, p.length);
+		async_write(p, buf, 0);
+	}
+
+	void torrent::async_write(peer_request const& p
+		, boost::shared_array<char> const& buf, int offset)
+	{
+		assert(m_storage.get());
+		assert(p.length > 0);
+		assert(offset >= 0);
+
+		m_need_save_resume_data = true;
+
+		disk_io_job j;
+		j.action = disk_io_job::write;
+		j.storage = m_storage;
+		j.buffer = buf;
+		j.buffer_offset = offset;
+		j.buffer_size = p.length;
+		j.piece = p.piece;
+		j.offset = p.start;
+		m_ses.m_disk_thread.add_job(j, bind(&torrent::on_disk_write_complete
+			, shared_from_this(), _1, _2));
+	}
+
+	void torrent::on_disk_write_complete(int ret, disk_io_job const& j)
+	{
+		if (ret >= 0) return;
+
+		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
+
+		INVARIANT_CHECK;
+
+		if (m_abort || m_paused) return;
+
+		// there's no point in downloading more data
+		// if we can't write it to disk
+		if (alerts().should_post(alert::fatal))
+			alerts().post_alert(file_error_alert(get_handle(), j.str));
+		pause();
+	}
+
+	void torrent::flush_disk_writes()
+	{
+		if (!m_storage.get()) return;
+
+		m_ses.m_disk_thread.flush(m_storage
+			, bind(&torrent::on_disk_write_complete
+			, shared_from_this(), _1, _2));
+	}
+
+	void torrent::async_release_files()
+	{
+		if (!m_storage.get()) return;
+
+		disk_io_job j;
+		j.action = disk_io_job::release_files;
+		j.storage = m_storage;
+		m_ses.m_disk_thread.add_job(j, bind(&torrent::on_files_released
+			, shared_from_this(), _1, _2));
+	}
+
+	void torrent::on_files_released(int ret, disk_io_job const& j)
+	{
+		// the handler only keeps the torrent (and with it, the
+		// torrent_info the storage refers to) alive until the
+		// files are closed
+	}
+
+	void torrent::async_verify_piece(int piece_index)
 	{
 		INVARIANT_CHECK;
 
@@ -1725,25 +1933,86 @@ namespace libtorrent
 		assert(piece_index < m_torrent_file.num_pieces());
 		assert(piece_index < (int)m_have_pieces.size());
 
-		int size = static_cast<int>(m_torrent_file.piece_size(piece_index));
-		std::vector<char> buffer(size);
-		assert(size > 0);
-		m_storage->read(&buffer[0], piece_index, 0, size);
+		// since the disk io thread executes the jobs in order,
+		// all the blocks of this piece have been written by
+		// the time it is hashed
+		disk_io_job j;
+		j.action = disk_io_job::hash;
+		j.storage = m_storage;
+		j.piece = piece_index;
+		j.buffer_size = static_cast<int>(m_torrent_file.piece_size(piece_index));
+		assert(j.buffer_size > 0);
+		m_ses.m_disk_thread.add_job(j, bind(&torrent::on_piece_verified
+			, shared_from_this(), _1, _2));
+	}
 
-		hasher h;
-		h.update(&buffer[0], size);
-		sha1_hash digest = h.final();
+	void torrent::on_piece_verified(int ret, disk_io_job const& j)
+	{
+		session_impl::mutex_t::scoped_lock l(m_ses.m_mutex);
 
-		if (m_torrent_file.hash_for_piece(piece_index) != digest)
-			return false;
+		// the torrent may have been removed while the
+		// piece was being hashed
+		if (m_abort) return;
 
-		if (!m_have_pieces[piece_index])
-			m_num_pieces++;
-		m_have_pieces[piece_index] = true;
+		INVARIANT_CHECK;
 
-		assert(std::accumulate(m_have_pieces.begin(), m_have_pieces.end(), 0)
-			== m_num_pieces);
-		return true;
+		bool passed_hash_check = false;
+		if (ret >= 0)
+		{
+			assert(j.str.size() == sha1_hash::size);
+			sha1_hash digest;
+			std::copy(j.str.begin(), j.str.end(), digest.begin());
+			passed_hash_check = digest == m_torrent_file.hash_for_piece(j.piece);
+		}
+		piece_finished(j.piece, passed_hash_check);
+	}
+
+	void torrent::piece_finished(int index, bool passed_hash_check)
+	{
+		INVARIANT_CHECK;
+
+		assert(m_picker.get());
+		assert(index >= 0);
+		assert(index < m_torrent_file.num_pieces());
+
+		bool was_seed = is_seed();
+		bool was_finished = m_picker->num_filtered() + num_pieces()
+			== m_torrent_file.num_pieces();
+
+		m_need_save_resume_data = true;
+
+		if (passed_hash_check)
+		{
+			if (!m_have_pieces[index])
+				m_num_pieces++;
+			m_have_pieces[index] = true;
+
+			assert(std::accumulate(m_have_pieces.begin(), m_have_pieces.end(), 0)
+				== m_num_pieces);
+
+			announce_piece(index);
+			if (!was_finished
+				&& m_picker->num_filtered() + num_pieces()
+					== m_torrent_file.num_pieces())
+			{
+				// torrent finished
+				// i.e. all the pieces we're interested in have
+				// been downloaded. Release the files (they will open
+				// in read only mode if needed)
+				finished();
+			}
+		}
+		else
+		{
+			piece_failed(index);
+		}
+		m_policy->piece_finished(index, passed_hash_check);
+
+		if (!was_seed && is_seed())
+		{
+			assert(passed_hash_check);
+			completed();
+		}
 	}
 
 	const tcp::endpoint& torrent::current_tracker() const
@@ -1760,8 +2029,8 @@ namespace libtorrent
 
 		if (m_metadata.empty())
 		{
-			bencode(std::back_inserter(m_metadata)
-				, m_torrent_file.create_info_metadata());
+			bencode_writer w(m_metadata);
+			m_torrent_file.write_info_section(w);
 
 			assert(hasher(&m_metadata[0], m_metadata.size()).final()
 				== m_torrent_file.info_hash());
@@ -1824,6 +2093,11 @@ namespace libtorrent
 		st.num_complete = m_complete;
 		st.num_incomplete = m_incomplete;
 		st.paused = m_paused;
+		if (m_policy)
+		{
+			st.choke_round_duration = int(
+				m_policy->last_choke_round().total_microseconds());
+		}
 		boost::tie(st.total_done, st.total_wanted_done) = bytes_done();
 
 		// payload transfer
@@ -2037,6 +2311,7 @@ namespace libtorrent
 			torrent_map::iterator i = m_ses.m_torrents.find(
 				m_torrent_file.info_hash());
 			assert(i != m_ses.m_torrents.end());
+			m_ses.invalidate_status(i->first);
 			m_ses.m_torrents.erase(i);
 			// and notify the thread that it got another
 			// job in its queue
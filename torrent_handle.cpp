@@ -37,6 +37,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <iterator>
 #include <algorithm>
 #include <set>
+#include <map>
+#include <bitset>
 #include <cctype>
 #include <algorithm>
 
@@ -58,6 +60,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/torrent_info.hpp"
 #include "libtorrent/tracker_manager.hpp"
 #include "libtorrent/bencode.hpp"
+#include "libtorrent/bencode_writer.hpp"
+#include "libtorrent/io.hpp"
+#include "libtorrent/socket.hpp"
 #include "libtorrent/hasher.hpp"
 #include "libtorrent/entry.hpp"
 #include "libtorrent/session.hpp"
@@ -84,6 +89,36 @@ namespace libtorrent
 		{
 			throw invalid_handle();
 		}
+
+		void write_buffer(bencode_writer& w, std::vector<char> const& buf)
+		{
+			w.string(buf.empty() ? "" : &buf[0], int(buf.size()));
+		}
+
+		// the slot map is stored as runs of 8 bytes, the first
+		// value and the number of slots in the run. Slots with
+		// pieces in them count up from the first value, the
+		// unassigned and unallocated ones (negative values)
+		// repeat it. A torrent that is complete, or allocated
+		// in full mode, is a single run
+		void write_slot_map(std::vector<int> const& slots
+			, std::vector<char>& buf)
+		{
+			std::back_insert_iterator<std::vector<char> > out(buf);
+			for (std::vector<int>::const_iterator i = slots.begin()
+				, end(slots.end()); i != end;)
+			{
+				int first = *i;
+				int count = 1;
+				for (++i; i != end; ++i, ++count)
+				{
+					if (first >= 0 ? *i != first + count : *i != first)
+						break;
+				}
+				detail::write_int32(first, out);
+				detail::write_uint32(count, out);
+			}
+		}
 			  
 		template<class Ret, class F>
 		Ret call_member(
@@ -225,6 +260,7 @@ namespace libtorrent
 
 		call_member<void>(m_ses, m_chk, m_info_hash
 			, bind(&torrent::pause, _1));
+		m_ses->invalidate_status(m_info_hash);
 	}
 
 	void torrent_handle::resume() const
@@ -233,6 +269,7 @@ namespace libtorrent
 
 		call_member<void>(m_ses, m_chk, m_info_hash
 			, bind(&torrent::resume, _1));
+		m_ses->invalidate_status(m_info_hash);
 	}
 
 	void torrent_handle::set_tracker_login(std::string const& name
@@ -284,6 +321,12 @@ namespace libtorrent
 
 		if (m_ses == 0) throw_invalid_handle();
 
+		// the network thread publishes the status of the torrents
+		// that are being polled once a second. Reading it doesn't
+		// require the session lock
+		torrent_status st;
+		if (m_ses->published_status(m_info_hash, st)) return st;
+
 		if (m_chk)
 		{
 			mutex::scoped_lock l(m_chk->m_mutex);
@@ -291,8 +334,6 @@ namespace libtorrent
 			aux::piece_checker_data* d = m_chk->find_torrent(m_info_hash);
 			if (d != 0)
 			{
-				torrent_status st;
-
 				if (d->processing)
 				{
 					if (d->torrent_ptr->is_allocating())
@@ -311,7 +352,12 @@ namespace libtorrent
 		{
 			session_impl::mutex_t::scoped_lock l(m_ses->m_mutex);
 			boost::shared_ptr<torrent> t = m_ses->find_torrent(m_info_hash).lock();
-			if (t) return t->status();
+			if (t)
+			{
+				st = t->status();
+				m_ses->publish_status(m_info_hash, st);
+				return st;
+			}
 		}
 
 		throw_invalid_handle();
@@ -325,11 +371,44 @@ namespace libtorrent
 			, bind(&torrent::set_sequenced_download_threshold, _1, threshold));
 	}
 
+	void torrent_handle::piece_priority(int index, int priority) const
+	{
+		INVARIANT_CHECK;
+		call_member<void>(m_ses, m_chk, m_info_hash
+			, bind(&torrent::set_piece_priority, _1, index, priority));
+		m_ses->invalidate_status(m_info_hash);
+	}
+
+	int torrent_handle::piece_priority(int index) const
+	{
+		INVARIANT_CHECK;
+		return call_member<int>(m_ses, m_chk, m_info_hash
+			, bind(&torrent::piece_priority, _1, index));
+	}
+
+	void torrent_handle::prioritize_pieces(std::vector<int> const& pieces) const
+	{
+		INVARIANT_CHECK;
+		call_member<void>(m_ses, m_chk, m_info_hash
+			, bind(&torrent::prioritize_pieces, _1, pieces));
+		m_ses->invalidate_status(m_info_hash);
+	}
+
+	std::vector<int> torrent_handle::piece_priorities() const
+	{
+		INVARIANT_CHECK;
+		std::vector<int> ret;
+		call_member<void>(m_ses, m_chk, m_info_hash
+			, bind(&torrent::piece_priorities, _1, boost::ref(ret)));
+		return ret;
+	}
+
 	void torrent_handle::filter_piece(int index, bool filter) const
 	{
 		INVARIANT_CHECK;
 		call_member<void>(m_ses, m_chk, m_info_hash
 			, bind(&torrent::filter_piece, _1, index, filter));
+		m_ses->invalidate_status(m_info_hash);
 	}
 
 	void torrent_handle::filter_pieces(std::vector<bool> const& pieces) const
@@ -337,6 +416,7 @@ namespace libtorrent
 		INVARIANT_CHECK;
 		call_member<void>(m_ses, m_chk, m_info_hash
 			, bind(&torrent::filter_pieces, _1, pieces));
+		m_ses->invalidate_status(m_info_hash);
 	}
 
 	bool torrent_handle::is_piece_filtered(int index) const
@@ -360,6 +440,7 @@ namespace libtorrent
 		INVARIANT_CHECK;
 		call_member<void>(m_ses, m_chk, m_info_hash
 			, bind(&torrent::filter_files, _1, files));
+		m_ses->invalidate_status(m_info_hash);
 	}
 
 	std::vector<announce_entry> const& torrent_handle::trackers() const
@@ -385,6 +466,7 @@ namespace libtorrent
 
 		call_member<void>(m_ses, m_chk, m_info_hash
 			, bind(&torrent::replace_trackers, _1, urls));
+		m_ses->invalidate_status(m_info_hash);
 	}
 
 	const torrent_info& torrent_handle::get_torrent_info() const
@@ -419,125 +501,212 @@ namespace libtorrent
 	}
 
 	entry torrent_handle::write_resume_data() const
+	{
+		std::vector<char> buf;
+		write_resume_data(buf);
+		if (buf.empty()) return entry();
+		return bdecode(buf.begin(), buf.end());
+	}
+
+	void torrent_handle::write_resume_data(std::vector<char>& buf) const
 	{
 		INVARIANT_CHECK;
 
 		std::vector<int> piece_index;
-		if (m_ses == 0) return entry();
+		if (m_ses == 0) return;
+
+		// the checksums of the unfinished pieces are calculated
+		// from disk, so the blocks the picker considers finished
+		// have to be written first. The session mutex is released
+		// while waiting for that, so only the blocks that were
+		// finished before the flush are saved
+		typedef std::bitset<piece_picker::max_blocks_per_piece> bitmask_t;
+		std::map<int, bitmask_t> flushed_blocks;
+		boost::shared_ptr<torrent> t;
+		{
+			session_impl::mutex_t::scoped_lock l(m_ses->m_mutex);
+			t = m_ses->find_torrent(m_info_hash).lock();
+			if (!t) return;
 
-		session_impl::mutex_t::scoped_lock l(m_ses->m_mutex);
-		boost::shared_ptr<torrent> t = m_ses->find_torrent(m_info_hash).lock();
-		if (!t) return entry();
+			if (!t->valid_metadata()) return;
 
-		if (!t->valid_metadata()) return entry();
+			const piece_picker& p = t->picker();
+			const std::vector<piece_picker::downloading_piece>& q
+				= p.get_download_queue();
+			for (std::vector<piece_picker::downloading_piece>::const_iterator i
+				= q.begin(); i != q.end(); ++i)
+			{
+				if (i->finished == 0) continue;
+				bitmask_t& finished_blocks = flushed_blocks[i->index];
+				for (int j = 0; j < p.blocks_in_piece(i->index); ++j)
+				{
+					finished_blocks[j] = i->info[j].state
+						== piece_picker::block_info::state_finished;
+				}
+			}
+		}
+
+		t->flush_disk_writes();
+
+		session_impl::mutex_t::scoped_lock l(m_ses->m_mutex);
+		if (t->is_aborted()) return;
 
 		t->filesystem().export_piece_map(piece_index);
 
-		entry ret(entry::dictionary_t);
+		std::vector<std::pair<size_type, std::time_t> > file_sizes
+			= get_filesizes(t->torrent_file(), t->save_path());
 
-		ret["file-format"] = "libtorrent resume file";
-		ret["file-version"] = 1;
+		// blocks per piece
+		int num_blocks_per_piece =
+			static_cast<int>(t->torrent_file().piece_length()) / t->block_size();
+
+		// the keys are written in sorted order
+		bencode_writer w(buf);
+		w.begin_dict();
+
+		w.key("blocks per piece");
+		w.integer(num_blocks_per_piece);
+
+		w.key("file sizes");
+		w.begin_list();
+		for (std::vector<std::pair<size_type, std::time_t> >::iterator i
+			= file_sizes.begin(), end(file_sizes.end()); i != end; ++i)
+		{
+			w.begin_list();
+			w.integer(i->first);
+			w.integer(i->second);
+			w.end();
+		}
+		w.end();
+
+		w.key("file-format");
+		w.string("libtorrent resume file");
+		w.key("file-version");
+		w.integer(2);
 
 		const sha1_hash& info_hash = t->torrent_file().info_hash();
-		ret["info-hash"] = std::string((char*)info_hash.begin(), (char*)info_hash.end());
+		w.key("info-hash");
+		w.string((char const*)info_hash.begin(), sha1_hash::size);
+
+		// write local peers, 6 bytes per IPv4 peer and 18
+		// bytes per IPv6 peer
+
+		std::vector<char> peers;
+		std::vector<char> peers6;
+		std::back_insert_iterator<std::vector<char> > peers_out(peers);
+		std::back_insert_iterator<std::vector<char> > peers6_out(peers6);
+
+		policy& pol = t->get_policy();
 
-		ret["slots"] = entry(entry::list_t);
-		entry::list_type& slots = ret["slots"].list();
-		std::copy(piece_index.begin(), piece_index.end(), std::back_inserter(slots));
+		for (policy::iterator i = pol.begin_peer()
+			, end(pol.end_peer()); i != end; ++i)
+		{
+			// we cannot save remote connection
+			// since we don't know their listen port
+			// unless they gave us their listen port
+			// through the extension handshake
+			// so, if the peer is not connectable (i.e. we
+			// don't know its listen port) or if it has
+			// been banned, don't save it.
+			if (i->second.type == policy::peer::not_connectable
+				|| i->second.banned) continue;
+
+			tcp::endpoint const& ip = i->second.ip;
+			if (ip.address().is_v4())
+				detail::write_endpoint(ip, peers_out);
+			else
+				detail::write_endpoint(ip, peers6_out);
+		}
+
+		w.key("peers");
+		write_buffer(w, peers);
+		w.key("peers6");
+		write_buffer(w, peers6);
+
+		std::vector<char> slots;
+		write_slot_map(piece_index, slots);
+		w.key("slots");
+		write_buffer(w, slots);
 
 		const piece_picker& p = t->picker();
 
 		const std::vector<piece_picker::downloading_piece>& q
 			= p.get_download_queue();
 
-		// blocks per piece
-		int num_blocks_per_piece =
-			static_cast<int>(t->torrent_file().piece_length()) / t->block_size();
-		ret["blocks per piece"] = num_blocks_per_piece;
+		const int num_bitmask_bytes
+			= std::max(num_blocks_per_piece / 8, 1);
 
-		// unfinished pieces
-		ret["unfinished"] = entry::list_type();
-		entry::list_type& up = ret["unfinished"].list();
+		// unfinished pieces, one record per piece: its index
+		// and adler32 checksum as 4 bytes each, followed by
+		// the bitmask of its finished blocks
+		std::vector<char> unfinished;
+		std::back_insert_iterator<std::vector<char> > out(unfinished);
 
-		// info for each unfinished piece
 		for (std::vector<piece_picker::downloading_piece>::const_iterator i
 			= q.begin(); i != q.end(); ++i)
 		{
-			if (i->finished_blocks.count() == 0) continue;
-
-			entry piece_struct(entry::dictionary_t);
-
-			// the unfinished piece's index
-			piece_struct["piece"] = i->index;
-
-			std::string bitmask;
-			const int num_bitmask_bytes
-				= std::max(num_blocks_per_piece / 8, 1);
-
-			for (int j = 0; j < num_bitmask_bytes; ++j)
+			if (i->finished == 0) continue;
+			// if writing the piece failed it may not have
+			// any storage, there's nothing to save then
+			if (t->filesystem().slot_for_piece(i->index) < 0) continue;
+
+			std::map<int, bitmask_t>::const_iterator flushed
+				= flushed_blocks.find(i->index);
+			if (flushed == flushed_blocks.end()) continue;
+
+			// the blocks that were finished after the flush
+			// may not be on disk yet
+			bitmask_t finished_blocks;
+			for (int j = 0; j < p.blocks_in_piece(i->index); ++j)
 			{
-				unsigned char v = 0;
-				for (int k = 0; k < 8; ++k)
-					v |= i->finished_blocks[j*8+k]?(1 << k):0;
-				bitmask.insert(bitmask.end(), v);
+				finished_blocks[j] = flushed->second[j]
+					&& i->info[j].state == piece_picker::block_info::state_finished;
 			}
-			piece_struct["bitmask"] = bitmask;
+			if (finished_blocks.none()) continue;
 
-			assert(t->filesystem().slot_for_piece(i->index) >= 0);
 			unsigned long adler
 				= t->filesystem().piece_crc(
 					t->filesystem().slot_for_piece(i->index)
 					, t->block_size()
-					, i->finished_blocks);
+					, finished_blocks);
 
-			piece_struct["adler32"] = adler;
-
-			// push the struct onto the unfinished-piece list
-			up.push_back(piece_struct);
+			detail::write_int32(i->index, out);
+			detail::write_uint32(adler, out);
+			for (int j = 0; j < num_bitmask_bytes; ++j)
+			{
+				unsigned char v = 0;
+				for (int k = 0; k < 8; ++k)
+					v |= finished_blocks[j*8+k]?(1 << k):0;
+				detail::write_uint8(v, out);
+			}
 		}
 
-		// write local peers
+		w.key("unfinished");
+		write_buffer(w, unfinished);
 
-		ret["peers"] = entry::list_type();
-		entry::list_type& peer_list = ret["peers"].list();
-		
-		policy& pol = t->get_policy();
+		w.end();
+		assert(w.done());
 
-		for (policy::iterator i = pol.begin_peer()
-			, end(pol.end_peer()); i != end; ++i)
-		{
-			// we cannot save remote connection
-			// since we don't know their listen port
-			// unless they gave us their listen port
-			// through the extension handshake
-			// so, if the peer is not connectable (i.e. we
-			// don't know its listen port) or if it has
-			// been banned, don't save it.
-			if (i->type == policy::peer::not_connectable
-				|| i->banned) continue;
-
-			tcp::endpoint ip = i->ip;
-			entry peer(entry::dictionary_t);
-			peer["ip"] = ip.address().to_string();
-			peer["port"] = ip.port();
-			peer_list.push_back(peer);
-		}
+		t->resume_data_saved();
+	}
 
-		std::vector<std::pair<size_type, std::time_t> > file_sizes
-			= get_filesizes(t->torrent_file(), t->save_path());
+	bool torrent_handle::write_resume_checkpoint(std::vector<char>& buf) const
+	{
+		INVARIANT_CHECK;
+
+		if (m_ses == 0) return false;
 
-		ret["file sizes"] = entry::list_type();
-		entry::list_type& fl = ret["file sizes"].list();
-		for (std::vector<std::pair<size_type, std::time_t> >::iterator i
-			= file_sizes.begin(), end(file_sizes.end()); i != end; ++i)
 		{
-			entry::list_type p;
-			p.push_back(entry(i->first));
-			p.push_back(entry(i->second));
-			fl.push_back(entry(p));
+			session_impl::mutex_t::scoped_lock l(m_ses->m_mutex);
+			boost::shared_ptr<torrent> t = m_ses->find_torrent(m_info_hash).lock();
+			if (!t || !t->need_save_resume_data()) return false;
 		}
 
-		return ret;
+		// write_resume_data() must be called without the
+		// session mutex held, since it waits for the disk
+		std::vector<char>::size_type size = buf.size();
+		write_resume_data(buf);
+		return buf.size() != size;
 	}
 
 
@@ -598,6 +767,7 @@ namespace libtorrent
 		using boost::posix_time::second_clock;
 		t->force_tracker_request(second_clock::universal_time()
 			+ duration);
+		m_ses->invalidate_status(m_info_hash);
 	}
 
 	void torrent_handle::force_reannounce() const
@@ -611,6 +781,7 @@ namespace libtorrent
 		if (!t) throw_invalid_handle();
 
 		t->force_tracker_request();
+		m_ses->invalidate_status(m_info_hash);
 	}
 
 	void torrent_handle::set_ratio(float ratio) const
@@ -712,15 +883,18 @@ namespace libtorrent
 			= q.begin(); i != q.end(); ++i)
 		{
 			partial_piece_info pi;
-			pi.finished_blocks = i->finished_blocks;
-			pi.requested_blocks = i->requested_blocks;
-			for (int j = 0; j < partial_piece_info::max_blocks_per_piece; ++j)
+			pi.blocks_in_piece = p.blocks_in_piece(i->index);
+			for (int j = 0; j < pi.blocks_in_piece; ++j)
 			{
-				pi.peer[j] = i->info[j].peer;
-				pi.num_downloads[j] = i->info[j].num_downloads;
+				piece_picker::block_info const& info = i->info[j];
+				pi.finished_blocks[j] = info.state
+					== piece_picker::block_info::state_finished;
+				pi.requested_blocks[j] = info.state
+					!= piece_picker::block_info::state_none;
+				pi.peer[j] = p.peer_endpoint(info.peer);
+				pi.num_downloads[j] = info.num_downloads;
 			}
 			pi.piece_index = i->index;
-			pi.blocks_in_piece = p.blocks_in_piece(i->index);
 			queue.push_back(pi);
 		}
 	}
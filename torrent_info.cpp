@@ -54,6 +54,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "libtorrent/torrent_info.hpp"
 #include "libtorrent/bencode.hpp"
+#include "libtorrent/bencode_writer.hpp"
 #include "libtorrent/hasher.hpp"
 #include "libtorrent/entry.hpp"
 
@@ -200,6 +201,13 @@ namespace
 		}
 	}
 
+	// used for binary searching the file list by torrent offset
+	struct file_offset_less
+	{
+		bool operator()(size_type offset, file_entry const& f) const
+		{ return offset < f.offset; }
+	};
+
 	void remove_dir(path& p)
 	{
 		assert(p.begin() != p.end());
@@ -293,7 +301,7 @@ namespace libtorrent
 	{
 		// encode the info-field in order to calculate it's sha1-hash
 		std::vector<char> buf;
-		bencode(std::back_inserter(buf), info);
+		bencode_writer(buf).value(info);
 		hasher h;
 		h.update(&buf[0], (int)buf.size());
 		m_info_hash = h.final();
@@ -377,8 +385,8 @@ namespace libtorrent
 
 #ifndef NDEBUG
 		std::vector<char> info_section_buf;
-		entry gen_info_section = create_info_metadata();
-		bencode(std::back_inserter(info_section_buf), gen_info_section);
+		bencode_writer w(info_section_buf);
+		write_info_section(w);
 		assert(hasher(&info_section_buf[0], info_section_buf.size()).final()
 			== m_info_hash);
 #endif
@@ -538,6 +546,7 @@ namespace libtorrent
 		file_entry e;
 		e.path = file;
 		e.size = size;
+		e.offset = m_total_size;
 		m_files.push_back(e);
 
 		m_total_size += size;
@@ -571,36 +580,62 @@ namespace libtorrent
 	}
 
 	entry torrent_info::create_info_metadata() const
+	{
+		std::vector<char> buf;
+		bencode_writer w(buf);
+		write_info_section(w);
+		return bdecode(buf.begin(), buf.end());
+	}
+
+	void torrent_info::write_info_section(bencode_writer& w) const
 	{
 		namespace fs = boost::filesystem;
 
 		// you have to add files to the torrent first
 		assert(!m_files.empty());
-	
-		entry info(m_extra_info);
 
-		if (!info.find_key("name"))
-			info["name"] = m_name;
+		// the keys generated from this torrent_info, in sorted
+		// order. They are merged with the other keys of the
+		// info section the torrent was loaded from. Those may
+		// replace the name and the file list
+		enum { files_key, length_key, name_key, piece_length_key
+			, pieces_key, num_keys };
+		char const* keys[] = { "files", "length", "name", "piece length"
+			, "pieces" };
 
-		if (!m_multifile)
-		{
-			info["length"] = m_files.front().size;
-		}
-		else
+		entry::dictionary_type const& extra = m_extra_info.dict();
+		bool extra_name = m_extra_info.find_key("name") != 0;
+		bool extra_files = m_extra_info.find_key("files") != 0;
+
+		w.begin_dict();
+		entry::dictionary_type::const_iterator e = extra.begin();
+		for (int k = 0; k < num_keys; ++k)
 		{
-			if (!info.find_key("files"))
+			if (k == files_key && (!m_multifile || extra_files)) continue;
+			if (k == length_key && m_multifile) continue;
+			if (k == name_key && extra_name) continue;
+
+			for (; e != extra.end() && e->first < keys[k]; ++e)
 			{
-				entry& files = info["files"];
-				files = entry(entry::list_t);
+				if (e->second.type() == entry::undefined_t) continue;
+				w.key(e->first);
+				w.value(e->second);
+			}
+			if (e != extra.end() && e->first == keys[k]) ++e;
 
+			w.key(keys[k]);
+			switch (k)
+			{
+			case files_key:
+				w.begin_list();
 				for (std::vector<file_entry>::const_iterator i = m_files.begin();
 					i != m_files.end(); ++i)
 				{
-					files.list().push_back(entry(entry::dictionary_t));
-					entry& file_e = files.list().back();
-					file_e["length"] = i->size;
-					entry& path_e = file_e["path"];
-					path_e = entry(entry::list_t);
+					w.begin_dict();
+					w.key("length");
+					w.integer(i->size);
+					w.key("path");
+					w.begin_list();
 
 					fs::path const* file_path;
 					if (i->orig_path) file_path = &(*i->orig_path);
@@ -610,70 +645,77 @@ namespace libtorrent
 
 					for (fs::path::iterator j = boost::next(file_path->begin());
 						j != file_path->end(); ++j)
-					{
-						path_e.list().push_back(entry(*j));
-					}
+						w.string(*j);
+					w.end();
+					w.end();
 				}
+				w.end();
+				break;
+			case length_key:
+				w.integer(m_files.front().size);
+				break;
+			case name_key:
+				w.string(m_name);
+				break;
+			case piece_length_key:
+				w.integer(piece_length());
+				break;
+			case pieces_key:
+				{
+					char* p = w.string_buffer(int(m_piece_hash.size()) * 20);
+					for (std::vector<sha1_hash>::const_iterator i = m_piece_hash.begin();
+						i != m_piece_hash.end(); ++i)
+						p = std::copy(i->begin(), i->end(), p);
+				}
+				break;
 			}
 		}
-
-		info["piece length"] = piece_length();
-		entry& pieces = info["pieces"];
-		pieces = entry(entry::string_t);
-
-		std::string& p = pieces.string();
-
-		for (std::vector<sha1_hash>::const_iterator i = m_piece_hash.begin();
-			i != m_piece_hash.end(); ++i)
+		for (; e != extra.end(); ++e)
 		{
-			p.append((char*)i->begin(), (char*)i->end());
+			if (e->second.type() == entry::undefined_t) continue;
+			w.key(e->first);
+			w.value(e->second);
 		}
-
-		return info;
+		w.end();
 	}
 
 	entry torrent_info::create_torrent() const
+	{
+		std::vector<char> buf;
+		create_torrent(buf);
+		if (buf.empty()) return entry();
+		return bdecode(buf.begin(), buf.end());
+	}
+
+	void torrent_info::create_torrent(std::vector<char>& buf) const
 	{
 		assert(m_piece_length > 0);
 
 		using namespace boost::gregorian;
 		using namespace boost::posix_time;
 
-		namespace fs = boost::filesystem;
-
-		entry dict(entry::dictionary_t);
-
 		if ((m_urls.empty() && m_nodes.empty()) || m_files.empty())
 		{
 			// TODO: throw something here
 			// throw
-			return entry();
+			return;
 		}
 
-		if (m_private) dict["private"] = 1;
+		// the keys are written in sorted order
+		bencode_writer w(buf);
+		w.begin_dict();
 
 		if (!m_urls.empty())
-			dict["announce"] = m_urls.front().url;
-		
-		if (!m_nodes.empty())
 		{
-			entry& nodes = dict["nodes"];
-			nodes = entry(entry::list_t);
-			entry::list_type& nodes_list = nodes.list();
-			for (nodes_t::const_iterator i = m_nodes.begin()
-				, end(m_nodes.end()); i != end; ++i)
-			{
-				entry::list_type node;
-				node.push_back(entry(i->first));
-				node.push_back(entry(i->second));
-				nodes_list.push_back(entry(node));
-			}
+			w.key("announce");
+			w.string(m_urls.front().url);
 		}
 
 		if (m_urls.size() > 1)
 		{
-			entry trackers(entry::list_t);
-			entry tier(entry::list_t);
+			w.key("announce-list");
+			w.begin_list();
+			w.begin_list();
 			int current_tier = m_urls.front().tier;
 			for (std::vector<announce_entry>::const_iterator i = m_urls.begin();
 				i != m_urls.end(); ++i)
@@ -681,50 +723,77 @@ namespace libtorrent
 				if (i->tier != current_tier)
 				{
 					current_tier = i->tier;
-					trackers.list().push_back(tier);
-					tier.list().clear();
+					w.end();
+					w.begin_list();
 				}
-				tier.list().push_back(entry(i->url));
+				w.string(i->url);
 			}
-			trackers.list().push_back(tier);
-			dict["announce-list"] = trackers;
+			w.end();
+			w.end();
 		}
 
 		if (!m_comment.empty())
-			dict["comment"] = m_comment;
-
-		dict["creation date"] =
-			(m_creation_date - ptime(date(1970, Jan, 1))).total_seconds();
+		{
+			w.key("comment");
+			w.string(m_comment);
+		}
 
 		if (!m_created_by.empty())
-			dict["created by"] = m_created_by;
-			
+		{
+			w.key("created by");
+			w.string(m_created_by);
+		}
+
+		w.key("creation date");
+		w.integer((m_creation_date - ptime(date(1970, Jan, 1))).total_seconds());
+
+		w.key("info");
+		int info_start = int(buf.size());
+		write_info_section(w);
+		m_info_hash = hasher(&buf[info_start], int(buf.size()) - info_start).final();
+
+		if (!m_nodes.empty())
+		{
+			w.key("nodes");
+			w.begin_list();
+			for (nodes_t::const_iterator i = m_nodes.begin()
+				, end(m_nodes.end()); i != end; ++i)
+			{
+				w.begin_list();
+				w.string(i->first);
+				w.integer(i->second);
+				w.end();
+			}
+			w.end();
+		}
+
+		if (m_private)
+		{
+			w.key("private");
+			w.integer(1);
+		}
+
 		if (!m_url_seeds.empty())
 		{
+			w.key("url-list");
 			if (m_url_seeds.size() == 1)
 			{
-				dict["url-list"] = m_url_seeds.front();
+				w.string(m_url_seeds.front());
 			}
 			else
 			{
-				entry& list = dict["url-list"];
-				list = entry(entry::list_t);
+				w.begin_list();
 				for (std::vector<std::string>::const_iterator i
 					= m_url_seeds.begin(); i != m_url_seeds.end(); ++i)
 				{
-					list.list().push_back(entry(*i));
+					w.string(*i);
 				}
+				w.end();
 			}
 		}
 
-		dict["info"] = create_info_metadata();
-
-		entry const& info_section = dict["info"];
-		std::vector<char> buf;
-		bencode(std::back_inserter(buf), info_section);
-		m_info_hash = hasher(&buf[0], buf.size()).final();
-
-		return dict;
+		w.end();
+		assert(w.done());
 	}
 
 	void torrent_info::set_hash(int index, const sha1_hash& h)
@@ -779,6 +848,23 @@ namespace libtorrent
 		m_nodes.push_back(node);
 	}
 
+	torrent_info::file_iterator torrent_info::file_at_offset(size_type offset) const
+	{
+		assert(!m_files.empty());
+		assert(offset >= 0 && offset < m_total_size);
+
+		// find the first file that starts after the offset, the
+		// file we're looking for is the one right before it. Empty
+		// files share their offset with the next file, which means
+		// the one we end up with is always the non-empty one
+		file_iterator i = std::upper_bound(m_files.begin(), m_files.end()
+			, offset, file_offset_less());
+		assert(i != m_files.begin());
+		--i;
+		assert(offset >= i->offset && offset < i->offset + i->size);
+		return i;
+	}
+
 	std::vector<file_slice> torrent_info::map_block(int piece, size_type offset
 		, int size) const
 	{
@@ -789,12 +875,11 @@ namespace libtorrent
 		assert(start + size <= m_total_size);
 
 		// find the file iterator and file offset
-		// TODO: make a vector that can map piece -> file index in O(1)
-		size_type file_offset = start;
-		std::vector<file_entry>::const_iterator file_iter;
+		file_iterator file_iter = file_at_offset(start);
+		size_type file_offset = start - file_iter->offset;
 
-		int counter = 0;
-		for (file_iter = begin_files();; ++counter, ++file_iter)
+		int counter = static_cast<int>(file_iter - begin_files());
+		for (;; ++counter, ++file_iter)
 		{
 			assert(file_iter != end_files());
 			if (file_offset < file_iter->size)